@@ -4,122 +4,664 @@
  * SPDX-License-Identifier: Unlicense OR CC0-1.0
  */
 
+#pragma once
+
 #include "stdlib.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/semphr.h"
+#include "freertos/task.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "usb/usb_host.h"
+#include "usb_hid_report_parser.hpp"
+#include "usb_report_ring.hpp"
+#include "usb_hid_log.hpp"
+#include "usb_latency_hist.hpp"
+#include "usb_hid_cache.hpp"
+#include "usb_transfer_pool.hpp"
+#include "usb_desc_index.hpp"
+#include "usb_report_filter.hpp"
+#include "usb_hid_class.hpp"
+#include "usb_state_snapshot.hpp"
+#include "usb_output_queue.hpp"
+#include "usb_report_dispatch.hpp"
+#include "usb_hid_capture.hpp"
+#include "usb_hid_static_decoders.hpp"
+#include "usb_ep_recovery.hpp"
+#include "usb_report_sink.hpp"
 
 #define CLIENT_NUM_EVENT_MSG        5
 
-#define ACTION_OPEN_DEV             0x01
-#define ACTION_GET_DEV_INFO         0x02
-#define ACTION_GET_DEV_DESC         0x04
-#define ACTION_GET_CONFIG_DESC      0x08
-#define ACTION_GET_STR_DESC         0x10
-#define ACTION_CLOSE_DEV            0x20
-#define ACTION_EXIT                 0x40
-#define ACTION_CLAIM_INTF           0x0100
-#define ACTION_TRANSFER_CONTROL     0x0200
-#define ACTION_TRANSFER             0x0400
+#define CLASS_MAX_DEVICES           4       //Devices serviced at once, e.g. behind a hub
+#define CLASS_MAX_INTERFACES        3       //HID interfaces claimed per device
+
+#define TRANSFER_IN_FLIGHT_NUM      4       //Interrupt-IN transfers kept submitted per endpoint while streaming
+#define STREAM_STATS_PERIOD_MS      1000    //Interval between stream stats printouts
+#define REPORT_DRAIN_BATCH          8       //Reports taken from one endpoint's ring before moving to the next
+#define CONTROL_TRANSFER_SIZE       1024    //Data stage for report descriptors without a wDescriptorLength
+
+static_assert(TRANSFER_POOL_MAX_ENTRIES >= CLASS_MAX_DEVICES * CLASS_MAX_INTERFACES * (TRANSFER_IN_FLIGHT_NUM + 2),
+              "transfer pool too small for every device at once");
+static_assert(CLASS_MAX_INTERFACES <= HID_STATE_MAX_INTFS, "state snapshots too small for every interface");
+static_assert(sizeof(hid_capture_rec_t) + USB_SETUP_PACKET_SIZE + CONTROL_TRANSFER_SIZE <= HID_CAPTURE_MAX_RECORD_BYTES &&
+              sizeof(hid_capture_rec_t) + sizeof(hid_report_layout_t) <= HID_CAPTURE_MAX_RECORD_BYTES,
+              "capture records too small for report descriptors and layouts");
+
+#define POLL_POLICY                 POLL_POLICY_DEVICE_RATE
+#define POLL_CAP_HZ                 250     //Upper bound on the poll rate under POLL_POLICY_CAPPED
+
+#define ENUM_CACHE_ENABLED          1       //Reuse endpoints and report layouts of known devices from NVS
+#define CLASS_EXIT_WHEN_IDLE        0       //Deregister once the last device is gone instead of waiting for the next one
+
+#define STATIC_DECODERS_ENABLED     1       //Decode s_hid_static_decoders devices with their compile-time decoder
+
+#define REPORT_FILTER_ENABLED       1       //Drop IN reports identical to the last one forwarded
+#define REPORT_FILTER_FIELDS        REPORT_FILTER_ALL_FIELDS    //Layout fields that count as a change
+#define REPORT_FILTER_DEADBAND      0       //Absolute axis change, in logical units, still treated as unchanged
+
+//Class requests sent to devices s_hid_class_policies does not list
+#define HID_POLICY_BOOT_PROTOCOL    false   //Switch boot keyboards and mice to the boot protocol
+#define HID_POLICY_IDLE_RATE        HID_IDLE_ONLY_ON_CHANGE
+#define HID_POLICY_READ_BACK        false   //Log GET_PROTOCOL/GET_IDLE after setting them
+#define CLASS_MAX_REQUESTS          (CLASS_MAX_INTERFACES * 4)
+
+#define OUTPUT_REPORTS_ENABLED      1       //Send usb_class_driver_write_output() reports, over interrupt OUT or SET_REPORT
+#define REPORT_SINKS_ENABLED        1       //Lend IN transfer buffers to usb_class_driver_add_sink() sinks
+
+typedef enum {
+    POLL_POLICY_DEVICE_RATE,    //Resubmit on completion, as fast as the endpoint's bInterval allows
+    POLL_POLICY_CAPPED,         //Resubmit on completion, but never faster than poll_cap_hz
+} poll_policy_t;
+
+#define CLASS_EVENT_QUEUE_LEN       16      //Must be a power of two
+
+#define REPORT_WORKERS_MAX          CLASS_MAX_DEVICES   //Each device is decoded by exactly one worker
+
+//Device lifecycle, see s_dev_states for what runs in each state
+typedef enum {
+    DEV_STATE_FREE,             //Slot unused
+    DEV_STATE_OPEN,
+    DEV_STATE_GET_DEV_INFO,
+    DEV_STATE_GET_DEV_DESC,
+    DEV_STATE_GET_CONFIG_DESC,
+    DEV_STATE_GET_STR_DESC,
+    DEV_STATE_CLAIM_INTF,
+    DEV_STATE_TRANSFER_CONTROL,
+    DEV_STATE_CONTROL_WAIT,     //Control requests queued, ctrl_transfer_cb() steps on the last answer
+    DEV_STATE_CLASS_REQUESTS,
+    DEV_STATE_CLASS_WAIT,       //Class requests running one at a time, class_req_cb() steps after the last
+    DEV_STATE_TRANSFER,
+    DEV_STATE_STREAMING,        //Waiting, completions are handled in stream_transfer_cb()
+    DEV_STATE_IDLE,             //Open with nothing to stream, waiting for removal
+    DEV_STATE_CLOSE,
+    DEV_STATE_CLOSE_WAIT,       //Endpoints flushed, waiting for every transfer to come back and the report worker to let go
+    DEV_STATE_NUM,
+    DEV_STATE_NONE = DEV_STATE_NUM, //No transition
+} dev_state_t;
+
+typedef enum {
+    DEV_EVENT_ATTACH,           //NEW_DEV claimed a free slot
+    DEV_EVENT_STEP,             //Run the action of the current state
+    DEV_EVENT_GONE,             //DEV_GONE for an opened device
+} dev_event_type_t;
 
 typedef struct {
-    usb_host_client_handle_t client_hdl;
-    uint8_t dev_addr;
+    uint8_t dev_index;
+    uint8_t type;               //dev_event_type_t
+    uint8_t state;              //dev_state_t a step was queued for, stale steps are dropped
+} dev_event_t;
+
+typedef struct {
+    uint32_t reports;           //Completed IN transfers carrying data
+    uint32_t bytes;             //Sum of actual_num_bytes over all reports
+    uint32_t errors;            //Completions with a status other than COMPLETED
+    uint32_t missed;            //Poll slots that passed with no IN transfer submitted
+    uint32_t unsubscribed;      //Reports dropped before the ring, no subscriber for their report ID
+    uint32_t unlent;            //Reports the sinks missed, lending would have left the endpoint without a transfer
+    int64_t start_us;           //Time the stream was started
+    int64_t idle_since_us;      //Time the last in-flight transfer returned, 0 while any is pending
+    uint32_t configured_hz;     //Poll rate the scheduler was set up for
+} stream_stats_t;
+
+typedef enum {
+    LATENCY_SUBMIT_TO_COMPLETE, //usb_host_transfer_submit() to stream_transfer_cb()
+    LATENCY_COMPLETE_TO_DEQUEUE,//stream_transfer_cb() to usb_report_consumer_task() picking the report up
+    LATENCY_JITTER,             //Distance of each completion interval from the configured poll interval
+    LATENCY_NUM_STAGES,
+} latency_stage_t;
+
+static const char *s_latency_stage_names[LATENCY_NUM_STAGES] = { "submit->cb", "cb->dequeue", "jitter" };
+
+struct hid_device_s;
+
+//One usb_report_consumer_task(), decoding and dispatching the reports of every device d with d % num_workers == index
+typedef struct {
+    TaskHandle_t task;
+    std::atomic<uint32_t> busy_us;              //Time spent draining since the last stats printout
+    std::atomic<uint32_t> reports;              //Reports drained since the last stats printout
+} report_worker_t;
+
+//Leases of one interface's IN transfers, outside hid_intf_t since the sink task releases them
+typedef struct {
+    report_lease_t leases[TRANSFER_IN_FLIGHT_NUM];
+    std::atomic<uint32_t> returned;             //Leases every sink let go of
+} sink_leases_t;
+
+/**
+ * Streaming handshake of one interface slot with its report worker,
+ * outside hid_intf_t since claim and close memset that. The class driver
+ * bumps generation when streaming starts (odd) and stops (even); the
+ * worker only touches the interface while the generation it acked is odd,
+ * and acks a stop once it is out of it. The interface is not modified
+ * between a start and its ack, nor reused before the stop is acked.
+ */
+typedef struct {
+    std::atomic<uint32_t> generation;           //Written by the class driver
+    std::atomic<uint32_t> acked;                //Written by the report worker
+} intf_sync_t;
+
+/**
+ * Where usb_class_driver_write_output() may queue for one interface slot,
+ * outside hid_intf_t like intf_sync_t. The class driver opens key once
+ * the slot streams with an OUT path and clears it on close; writers only
+ * queue while counted in writers and key still matches, and the slot is
+ * not freed, nor its queue reset, before writers is back to 0.
+ */
+typedef struct {
+    std::atomic<uint32_t> key;                  //OUTPUT_ROUTE_KEY() while open, 0 closed
+    std::atomic<uint32_t> writers;              //usb_class_driver_write_output() calls inside
+} output_route_t;
+
+#define OUTPUT_ROUTE_KEY(dev_addr, bInterfaceNumber) (0x10000u | ((uint32_t)(dev_addr) << 8) | (bInterfaceNumber))
+
+//One claimed HID interface, with at most one interrupt IN and one interrupt OUT endpoint
+typedef struct {
+    struct hid_device_s *dev;
+    uint8_t bInterfaceNumber;
+    uint8_t bInterfaceSubClass;
+    uint8_t bInterfaceProtocol;
+    uint8_t boot_protocol;                      //HID_BOOT_PROTOCOL_* once SET_PROTOCOL(boot) succeeded, else 0
+    bool has_ep_in;
+    bool has_ep_out;
+    usb_ep_desc_t ep_in;
+    usb_ep_desc_t ep_out;
+    uint16_t report_desc_len;                   //wDescriptorLength from the HID class descriptor, 0 if absent
+    usb_transfer_t *ctrl_transfer;              //From the transfer pool until streaming starts
+    usb_transfer_t *in_transfers[TRANSFER_IN_FLIGHT_NUM];
+    int in_flight;
+    bool streaming;
+    bool capped;
+    uint32_t poll_interval_us;                  //Effective period between IN submits
+    int64_t next_submit_us;                     //Earliest time the next capped submit may go out
+    usb_transfer_t *parked[TRANSFER_IN_FLIGHT_NUM]; //Completed transfers waiting for their capped slot
+    int num_parked;
+    stream_stats_t stream_stats;
+    int64_t submit_us[TRANSFER_IN_FLIGHT_NUM];  //Submit time of in_transfers[i]
+    int64_t last_complete_us;
+    latency_hist_t latency[LATENCY_NUM_STAGES];
+    report_ring_t *ring;                        //stream_transfer_cb -> usb_report_consumer_task
+    report_worker_t *worker;                    //Task draining ring
+    hid_report_layout_t report_layout;          //Compiled from the interface's report descriptor
+    hid_static_decode_t static_decode;          //Specialized decoder of a known device, NULL for hid_decode_report()
+    hid_report_values_t report_values;          //Latest decoded state of ep_in
+    report_filter_t filter;                     //Owned by usb_report_consumer_task()
+    report_dispatch_t *dispatch;                //Subscribers by report ID, built by the class driver task
+    output_queue_t *out_queue;                  //Filled by any task through usb_class_driver_write_output()
+    usb_transfer_t *out_transfer;               //Interrupt OUT, or SET_REPORT when there is no OUT endpoint
+    bool out_busy;
+    bool out_flushed;                           //Interrupt OUT taken back past its deadline, the pipe needs a clear
+    int64_t out_submit_us;                      //Submit time of the interrupt OUT in flight
+    int64_t next_out_us;                        //Earliest time the next interrupt OUT may go out
+    uint32_t out_sent;
+    uint32_t out_errors;
+    ep_recovery_t recovery;                     //Error state of ep_in, stream_recover() performs its steps
+    sink_leases_t *leases;                      //in_transfers[] lent to the sinks
+    intf_sync_t *sync;                          //Streaming handshake with worker
+    uint32_t lent_mask;                         //in_transfers[] off the endpoint until the sinks let go
+} hid_intf_t;
+
+//One class request, run on the control transfer of the interface it addresses
+typedef struct {
+    uint8_t intf;                               //Into hid_device_t::intfs
+    uint8_t setup[USB_SETUP_PACKET_SIZE];
+    usb_transfer_status_t status;
+    uint8_t value;                              //First data byte of a GET answer
+} class_req_t;
+
+typedef struct hid_device_s {
+    uint8_t dev_addr;                           //0 while the slot is free
     usb_device_handle_t dev_hdl;
-    uint32_t actions;
+    dev_state_t state;
     uint16_t bMaxPacketSize0;
-    usb_ep_desc_t *ep_in;
-    usb_ep_desc_t *ep_out;
-    SemaphoreHandle_t transfer_done;
-    usb_transfer_status_t transfer_status;
+    uint16_t idVendor;
+    uint16_t idProduct;
+    usb_device_info_t dev_info;
+    int ctrl_pending;                           //Control transfers submitted and not yet called back, EP0 users wait for 0
+    int64_t ctrl_submit_us;                     //Submit time of the last serial EP0 request
+    uint32_t ctrl_srtt_us;                      //Smoothed EP0 round trip, sets the interrupt OUT deadline
+    int out_pending;                            //Interrupt OUT transfers submitted and not yet called back
+    const usb_config_desc_t *config_desc;       //Active configuration, owned by the host library while open
+    desc_index_t desc_index;                    //Built from config_desc once per attach
+    hid_intf_t intfs[CLASS_MAX_INTERFACES];
+    uint8_t num_intfs;
+    char cache_key[HID_CACHE_KEY_LEN];          //idVendor/idProduct/bcdDevice
+    uint32_t config_hash;
+    bool cached;                                //Claimed from the enumeration cache
+    const hid_class_policy_t *policy;           //Which class requests to send, by idVendor/idProduct
+    class_req_t class_reqs[CLASS_MAX_REQUESTS];
+    uint8_t num_class_reqs;
+    uint8_t next_class_req;
+    int64_t attach_us;                          //Time the NEW_DEV event arrived
+    int64_t first_report_us;                    //Time the first IN report completed, 0 until then
+    bool first_report_logged;
+} hid_device_t;
+
+//Everything claim and decode need, as stored in the enumeration cache
+typedef struct {
+    uint8_t bInterfaceNumber;
+    bool has_ep_in;
+    bool has_ep_out;
+    usb_ep_desc_t ep_in;
+    usb_ep_desc_t ep_out;
+    hid_report_layout_t report_layout;
+} enum_cache_intf_t;
+
+typedef struct {
+    hid_cache_header_t header;
+    uint8_t num_intfs;
+    enum_cache_intf_t intfs[CLASS_MAX_INTERFACES];
+} enum_cache_entry_t;
+
+typedef enum {
+    TTFR_UNCACHED,
+    TTFR_CACHED,
+    TTFR_NUM,
+} ttfr_kind_t;
+
+//A device that was closed recently, to tell a replug from a first attach
+typedef struct {
+    char cache_key[HID_CACHE_KEY_LEN];
+    int64_t gone_us;                            //0 once a replug was matched to it
+} recent_gone_t;
+
+typedef struct {
+    uint32_t records;                           //Capture records read
+    uint32_t reports;                           //IN reports fed through the report path
+    uint32_t skipped;                           //IN records of unknown endpoints or with an error status
+    int64_t captured_us;                        //Time the capture spans
+    int64_t elapsed_us;                         //Time the replay took
+} replay_stats_t;
+
+typedef struct {
+    usb_host_client_handle_t client_hdl;
+    poll_policy_t poll_policy;
+    uint32_t poll_cap_hz;
+    hid_device_t devices[CLASS_MAX_DEVICES];
+    uint8_t rr_next;                            //Endpoint the fair scheduler serves first next round
+    int64_t print_us;                           //Time of the last stats printout
+    bool cache_ready;                           //NVS is up and ENUM_CACHE_ENABLED is set
+    latency_hist_t ttfr[TTFR_NUM];              //Attach to first report, by cache outcome
+    latency_hist_t reconnect;                   //Attach to first report, replugs only
+    latency_hist_t recover;                     //First transfer error to the next good report, all endpoints
+    recent_gone_t recent_gone[CLASS_MAX_DEVICES];
+    uint8_t recent_gone_next;
+    transfer_pool_t transfer_pool;
+    dev_event_t events[CLASS_EVENT_QUEUE_LEN];  //Only touched by the class driver task
+    uint8_t events_head;
+    uint8_t events_tail;
+    uint32_t wakeups;                           //Returns from usb_host_client_handle_events()
+    int64_t busy_us;                            //Time spent dispatching, in timers and in IN callbacks
+    uint32_t reports;                           //IN reports completed, for busy_us and wakeups per report
 } class_driver_t;
 
 static const char *TAG_CLASS = "CLASS";
 
+static class_driver_t s_driver_obj;
+static report_ring_t s_report_rings[CLASS_MAX_DEVICES][CLASS_MAX_INTERFACES];
+static state_snapshot_t s_state_snapshots[CLASS_MAX_DEVICES];  //Written by usb_report_consumer_task() only
+static output_queue_t s_output_queues[CLASS_MAX_DEVICES][CLASS_MAX_INTERFACES];
+static output_route_t s_output_routes[CLASS_MAX_DEVICES][CLASS_MAX_INTERFACES];
+static report_sub_table_t s_report_subs;
+static report_sink_table_t s_report_sinks;
+static sink_leases_t s_sink_leases[CLASS_MAX_DEVICES][CLASS_MAX_INTERFACES];
+static intf_sync_t s_intf_syncs[CLASS_MAX_DEVICES][CLASS_MAX_INTERFACES];
+static report_dispatch_t s_report_dispatches[CLASS_MAX_DEVICES][CLASS_MAX_INTERFACES];
+static TaskHandle_t s_report_sink_task;
+static report_worker_t s_report_workers[REPORT_WORKERS_MAX];
+static uint8_t s_num_report_workers = 1;
+static enum_cache_entry_t s_enum_cache_entry;  //Class driver task only, too large for its stack
+static const hid_class_policy_t s_hid_class_default_policy = {
+    HID_POLICY_BOOT_PROTOCOL, HID_POLICY_IDLE_RATE, HID_POLICY_READ_BACK
+};
+
+/**
+ * Clock of the busy_us counters. The native build's virtual clock stands
+ * still while a task runs, so there they count the thread's CPU time.
+ */
+static inline int64_t busy_clock_us(void)
+{
+#ifdef MOCK_USB_HOST
+    return mock_rtos_cpu_ns() / 1000;
+#else
+    return esp_timer_get_time();
+#endif
+}
+
+static hid_device_t *find_device(class_driver_t *driver_obj, usb_device_handle_t dev_hdl)
+{
+    for (int d = 0; d < CLASS_MAX_DEVICES; d++) {
+        if (driver_obj->devices[d].dev_addr != 0 && driver_obj->devices[d].dev_hdl == dev_hdl) {
+            return &driver_obj->devices[d];
+        }
+    }
+    return NULL;
+}
+
+//Returns false, with the event dropped, if the queue is full
+static bool event_post(class_driver_t *driver_obj, hid_device_t *dev, dev_event_type_t type)
+{
+    if ((uint8_t)(driver_obj->events_head - driver_obj->events_tail) >= CLASS_EVENT_QUEUE_LEN) {
+        //Cannot happen with fewer devices than slots, each has at most a step and a removal queued
+        ESP_LOGE(TAG_CLASS, "event queue full, dropping event %d", type);
+        return false;
+    }
+    dev_event_t *event = &driver_obj->events[driver_obj->events_head++ & (CLASS_EVENT_QUEUE_LEN - 1)];
+    event->dev_index = dev - driver_obj->devices;
+    event->type = type;
+    event->state = dev->state;
+    return true;
+}
+
+static bool event_pop(class_driver_t *driver_obj, dev_event_t *event)
+{
+    if (driver_obj->events_head == driver_obj->events_tail) {
+        return false;
+    }
+    *event = driver_obj->events[driver_obj->events_tail++ & (CLASS_EVENT_QUEUE_LEN - 1)];
+    return true;
+}
+
 static void client_event_cb(const usb_host_client_event_msg_t *event_msg, void *arg)
 {
     class_driver_t *driver_obj = (class_driver_t *)arg;
     switch (event_msg->event) {
-        case USB_HOST_CLIENT_EVENT_NEW_DEV:
-            if (driver_obj->dev_addr == 0) {
-                driver_obj->dev_addr = event_msg->new_dev.address;
-                //Open the device next
-                driver_obj->actions |= ACTION_OPEN_DEV;
+        case USB_HOST_CLIENT_EVENT_NEW_DEV: {
+            hid_device_t *dev = NULL;
+            for (int d = 0; d < CLASS_MAX_DEVICES && dev == NULL; d++) {
+                if (driver_obj->devices[d].dev_addr == 0) {
+                    dev = &driver_obj->devices[d];
+                }
+            }
+            if (dev == NULL) {
+                ESP_LOGW(TAG_CLASS, "No free device slot for address %d", event_msg->new_dev.address);
+                break;
+            }
+            //Open the device next; the slot is only taken once the attach is queued, or it would stay taken unopened
+            if (event_post(driver_obj, dev, DEV_EVENT_ATTACH)) {
+                dev->dev_addr = event_msg->new_dev.address;
+                dev->attach_us = esp_timer_get_time();
             }
             break;
-        case USB_HOST_CLIENT_EVENT_DEV_GONE:
-            if (driver_obj->dev_hdl != NULL) {
+        }
+        case USB_HOST_CLIENT_EVENT_DEV_GONE: {
+            hid_device_t *dev = find_device(driver_obj, event_msg->dev_gone.dev_hdl);
+            if (dev != NULL) {
                 //Cancel any other actions and close the device next
-                driver_obj->actions = ACTION_CLOSE_DEV;
+                event_post(driver_obj, dev, DEV_EVENT_GONE);
             }
             break;
+        }
         default:
             //Should never occur
             abort();
     }
 }
 
-static void action_open_dev(class_driver_t *driver_obj)
+/**
+ * Key the device for the enumeration cache and load its entry into
+ * s_enum_cache_entry. Returns true on a hit.
+ */
+static bool enum_cache_lookup(class_driver_t *driver_obj, hid_device_t *dev, const usb_device_desc_t *dev_desc)
+{
+    const usb_config_desc_t *config_desc = dev->config_desc;
+    hid_cache_key(dev->cache_key, dev_desc->idVendor, dev_desc->idProduct, dev_desc->bcdDevice);
+    dev->config_hash = hid_cache_hash((const uint8_t *)config_desc, config_desc->wTotalLength);
+    dev->cached = driver_obj->cache_ready &&
+                  hid_cache_load(dev->cache_key, dev->config_hash, &s_enum_cache_entry.header, sizeof(enum_cache_entry_t)) &&
+                  s_enum_cache_entry.num_intfs > 0 && s_enum_cache_entry.num_intfs <= CLASS_MAX_INTERFACES;
+    return dev->cached;
+}
+
+static void enum_cache_save(class_driver_t *driver_obj, const hid_device_t *dev)
+{
+    if (!driver_obj->cache_ready) {
+        return;
+    }
+    enum_cache_entry_t *entry = &s_enum_cache_entry;
+    memset(entry, 0, sizeof(enum_cache_entry_t));
+    entry->num_intfs = dev->num_intfs;
+    for (int n = 0; n < dev->num_intfs; n++) {
+        const hid_intf_t *hid_intf = &dev->intfs[n];
+        enum_cache_intf_t *cached = &entry->intfs[n];
+        cached->bInterfaceNumber = hid_intf->bInterfaceNumber;
+        cached->has_ep_in = hid_intf->has_ep_in;
+        cached->has_ep_out = hid_intf->has_ep_out;
+        cached->ep_in = hid_intf->ep_in;
+        cached->ep_out = hid_intf->ep_out;
+        cached->report_layout = hid_intf->report_layout;
+    }
+    if (hid_cache_store(dev->cache_key, dev->config_hash, &entry->header, sizeof(enum_cache_entry_t))) {
+        ESP_LOGI(TAG_CLASS, "Enumeration cached for %s", dev->cache_key);
+    }
+}
+
+/**
+ * Claim the interfaces recorded in s_enum_cache_entry, filled by
+ * enum_cache_lookup(). Returns false, with nothing claimed, if any claim
+ * fails, so the caller can fall back to a full enumeration.
+ */
+static bool claim_from_cache(class_driver_t *driver_obj, hid_device_t *dev)
+{
+    const enum_cache_entry_t *entry = &s_enum_cache_entry;
+    int d = dev - driver_obj->devices;
+    dev->num_intfs = 0;
+    for (int n = 0; n < entry->num_intfs; n++) {
+        const enum_cache_intf_t *cached = &entry->intfs[n];
+        esp_err_t err = usb_host_interface_claim(driver_obj->client_hdl, dev->dev_hdl, cached->bInterfaceNumber, 0);
+        if (err) {
+            ESP_LOGW(TAG_CLASS, "cached interface 0x%02x claim status: %d", cached->bInterfaceNumber, err);
+            for (int k = 0; k < dev->num_intfs; k++) {
+                usb_host_interface_release(driver_obj->client_hdl, dev->dev_hdl, dev->intfs[k].bInterfaceNumber);
+            }
+            dev->num_intfs = 0;
+            return false;
+        }
+        hid_intf_t *hid_intf = &dev->intfs[n];
+        memset(hid_intf, 0, sizeof(hid_intf_t));
+        hid_intf->dev = dev;
+        hid_intf->bInterfaceNumber = cached->bInterfaceNumber;
+        const desc_index_intf_t *intf = desc_index_find_intf(&dev->desc_index, cached->bInterfaceNumber, 0);
+        if (intf) {
+            hid_intf->bInterfaceSubClass = intf->bInterfaceSubClass;
+            hid_intf->bInterfaceProtocol = intf->bInterfaceProtocol;
+            hid_intf->report_desc_len = intf->report_desc_len;
+        }
+        hid_intf->has_ep_in = cached->has_ep_in;
+        hid_intf->has_ep_out = cached->has_ep_out;
+        hid_intf->ep_in = cached->ep_in;
+        hid_intf->ep_out = cached->ep_out;
+        hid_intf->report_layout = cached->report_layout;
+        hid_intf->ring = &s_report_rings[d][n];
+        hid_intf->leases = &s_sink_leases[d][n];
+        hid_intf->sync = &s_intf_syncs[d][n];
+        hid_intf->dispatch = &s_report_dispatches[d][n];
+        hid_intf->worker = &s_report_workers[d % s_num_report_workers];
+        hid_intf->out_queue = &s_output_queues[d][n];
+        dev->num_intfs++;
+    }
+    return true;
+}
+
+//Data stage of the report descriptor request, exactly wDescriptorLength when the device gave one
+static uint16_t ctrl_data_len(const hid_intf_t *hid_intf)
+{
+    return hid_intf->report_desc_len ? hid_intf->report_desc_len : CONTROL_TRANSFER_SIZE;
+}
+
+/**
+ * Take every transfer the device will need from the pool: a control
+ * transfer per interface, only large enough for class requests if the
+ * enumeration cache made the report descriptor unnecessary, one for output
+ * reports, and
+ * TRANSFER_IN_FLIGHT_NUM per interrupt IN endpoint, each sized to the
+ * endpoint. Slots the pool cannot serve stay NULL and are skipped.
+ */
+static void reserve_transfers(class_driver_t *driver_obj, hid_device_t *dev)
+{
+    transfer_pool_t *pool = &driver_obj->transfer_pool;
+    for (int n = 0; n < dev->num_intfs; n++) {
+        hid_intf_t *hid_intf = &dev->intfs[n];
+        size_t data_len = dev->cached ? 1 : ctrl_data_len(hid_intf);
+        size_t tps = usb_round_up_to_mps(USB_SETUP_PACKET_SIZE + data_len, dev->bMaxPacketSize0);
+        if (transfer_pool_get(pool, tps, &hid_intf->ctrl_transfer) != ESP_OK) {
+            ESP_LOGW(TAG_CLASS, "device %d: no control transfer for intf 0x%02x, pool exhausted",
+                     dev->dev_addr, hid_intf->bInterfaceNumber);
+        }
+        if (OUTPUT_REPORTS_ENABLED) {
+            //SET_REPORT needs room for the setup packet on EP0
+            size_t out_size = hid_intf->has_ep_out ? OUTPUT_REPORT_MAX_BYTES :
+                              usb_round_up_to_mps(USB_SETUP_PACKET_SIZE + OUTPUT_REPORT_MAX_BYTES, dev->bMaxPacketSize0);
+            if (transfer_pool_get(pool, out_size, &hid_intf->out_transfer) != ESP_OK) {
+                ESP_LOGW(TAG_CLASS, "device %d: no output transfer for intf 0x%02x, pool exhausted",
+                         dev->dev_addr, hid_intf->bInterfaceNumber);
+            }
+        }
+        for (int i = 0; hid_intf->has_ep_in && i < TRANSFER_IN_FLIGHT_NUM; i++) {
+            if (transfer_pool_get(pool, hid_intf->ep_in.wMaxPacketSize, &hid_intf->in_transfers[i]) != ESP_OK) {
+                ESP_LOGW(TAG_CLASS, "%d/%02x: %d of %d IN transfers, pool exhausted",
+                         dev->dev_addr, hid_intf->ep_in.bEndpointAddress, i, TRANSFER_IN_FLIGHT_NUM);
+                break;
+            }
+        }
+    }
+}
+
+static void sink_reclaim(hid_intf_t *hid_intf);
+
+/**
+ * Put a closing device's transfers back in the pool, none may be left with
+ * the host library. IN transfers a sink still holds become orphans the
+ * main loop reclaims once they are released.
+ */
+static void return_transfers(class_driver_t *driver_obj, hid_device_t *dev)
+{
+    transfer_pool_t *pool = &driver_obj->transfer_pool;
+    assert(dev->ctrl_pending == 0 && dev->out_pending == 0);
+    for (int n = 0; n < dev->num_intfs; n++) {
+        hid_intf_t *hid_intf = &dev->intfs[n];
+        assert(hid_intf->in_flight == 0);
+        if (hid_intf->ctrl_transfer) {
+            transfer_pool_put(pool, hid_intf->ctrl_transfer);
+            hid_intf->ctrl_transfer = NULL;
+        }
+        if (hid_intf->out_transfer) {
+            transfer_pool_put(pool, hid_intf->out_transfer);
+            hid_intf->out_transfer = NULL;
+        }
+        if (hid_intf->lent_mask) {
+            sink_reclaim(hid_intf);
+        }
+        for (int i = 0; i < TRANSFER_IN_FLIGHT_NUM; i++) {
+            usb_transfer_t *transfer = hid_intf->in_transfers[i];
+            if (!transfer) {
+                continue;
+            }
+            if (hid_intf->lent_mask & (1u << i)) {
+                //A sink still reads the buffer, the pool takes it back once the sink lets go
+                transfer_pool_orphan(pool, transfer, &hid_intf->leases->returned, 1u << i);
+            } else {
+                transfer_pool_put(pool, transfer);
+            }
+            hid_intf->in_transfers[i] = NULL;
+        }
+        hid_intf->lent_mask = 0;
+    }
+}
+
+static dev_state_t action_open_dev(class_driver_t *driver_obj, hid_device_t *dev)
 {
-    assert(driver_obj->dev_addr != 0);
-    ESP_LOGI(TAG_CLASS, "Opening device at address %d", driver_obj->dev_addr);
-    ESP_ERROR_CHECK(usb_host_device_open(driver_obj->client_hdl, driver_obj->dev_addr, &driver_obj->dev_hdl));
-    
+    assert(dev->dev_addr != 0);
+    ESP_LOGI(TAG_CLASS, "Opening device at address %d", dev->dev_addr);
+    ESP_ERROR_CHECK(usb_host_device_open(driver_obj->client_hdl, dev->dev_addr, &dev->dev_hdl));
+
     //Get the device's information next
-    driver_obj->actions &= ~ACTION_OPEN_DEV;
-    driver_obj->actions |= ACTION_GET_DEV_INFO;
+    return DEV_STATE_GET_DEV_INFO;
 }
 
-static void action_get_info(class_driver_t *driver_obj)
+static dev_state_t action_get_info(class_driver_t *, hid_device_t *dev)
 {
-    assert(driver_obj->dev_hdl != NULL);
+    assert(dev->dev_hdl != NULL);
     ESP_LOGI(TAG_CLASS, "Getting device information");
-    usb_device_info_t dev_info;
-    ESP_ERROR_CHECK(usb_host_device_info(driver_obj->dev_hdl, &dev_info));
-    ESP_LOGI(TAG_CLASS, "\t%s speed", (dev_info.speed == USB_SPEED_LOW) ? "Low" : "Full");
-    ESP_LOGI(TAG_CLASS, "\tbConfigurationValue %d", dev_info.bConfigurationValue);
+    ESP_ERROR_CHECK(usb_host_device_info(dev->dev_hdl, &dev->dev_info));
+    ESP_LOGI(TAG_CLASS, "\t%s speed", (dev->dev_info.speed == USB_SPEED_LOW) ? "Low" : "Full");
+    ESP_LOGI(TAG_CLASS, "\tbConfigurationValue %d", dev->dev_info.bConfigurationValue);
 
     //Get the device descriptor next
-    driver_obj->actions &= ~ACTION_GET_DEV_INFO;
-    driver_obj->actions |= ACTION_GET_DEV_DESC;
+    return DEV_STATE_GET_DEV_DESC;
 }
 
-static void action_get_dev_desc(class_driver_t *driver_obj)
+static dev_state_t action_get_dev_desc(class_driver_t *driver_obj, hid_device_t *dev)
 {
-    assert(driver_obj->dev_hdl != NULL);
+    assert(dev->dev_hdl != NULL);
     ESP_LOGI(TAG_CLASS, "Getting device descriptor");
     const usb_device_desc_t *dev_desc;
-    ESP_ERROR_CHECK(usb_host_get_device_descriptor(driver_obj->dev_hdl, &dev_desc));
+    ESP_ERROR_CHECK(usb_host_get_device_descriptor(dev->dev_hdl, &dev_desc));
     ESP_LOGI(TAG_CLASS, "\tidVendor 0x%04x", dev_desc->idVendor);
     ESP_LOGI(TAG_CLASS, "\tidProduct 0x%04x", dev_desc->idProduct);
-    usb_print_device_descriptor(dev_desc);
 
-    driver_obj->bMaxPacketSize0 = dev_desc->bMaxPacketSize0;
+    dev->bMaxPacketSize0 = dev_desc->bMaxPacketSize0;
+    dev->idVendor = dev_desc->idVendor;
+    dev->idProduct = dev_desc->idProduct;
+    dev->policy = hid_class_policy_find(dev_desc->idVendor, dev_desc->idProduct, &s_hid_class_default_policy);
+
+    //Index the configuration once, claim and close read the index from here on
+    ESP_ERROR_CHECK(usb_host_get_active_config_descriptor(dev->dev_hdl, &dev->config_desc));
+    int64_t now = esp_timer_get_time();
+    HID_CAPTURE(HID_CAPTURE_REC_ATTACH, dev->dev_addr, 0x00, USB_TRANSFER_STATUS_COMPLETED, dev_desc, sizeof(usb_device_desc_t), now);
+    HID_CAPTURE(HID_CAPTURE_REC_CONFIG_DESC, dev->dev_addr, 0x00, USB_TRANSFER_STATUS_COMPLETED, dev->config_desc,
+                dev->config_desc->wTotalLength, now);
+    if (!desc_index_build((const uint8_t *)dev->config_desc, dev->config_desc->wTotalLength, &dev->desc_index) ||
+        dev->desc_index.truncated) {
+        ESP_LOGW(TAG_CLASS, "config descriptor only partly indexed, %d interfaces, %d endpoints",
+                 dev->desc_index.num_intfs, dev->desc_index.num_eps);
+    }
+
+    if (enum_cache_lookup(driver_obj, dev, dev_desc)) {
+        //Known device, skip the descriptor dumps and claim straight from the cached entry
+        ESP_LOGI(TAG_CLASS, "Enumeration cache hit for %s", dev->cache_key);
+        return DEV_STATE_CLAIM_INTF;
+    }
+    usb_print_device_descriptor(dev_desc);
 
     //Get the device's config descriptor next
-    driver_obj->actions &= ~ACTION_GET_DEV_DESC;
-    driver_obj->actions |= ACTION_GET_CONFIG_DESC;
+    return DEV_STATE_GET_CONFIG_DESC;
 }
 
-static void action_get_config_desc(class_driver_t *driver_obj)
+static dev_state_t action_get_config_desc(class_driver_t *, hid_device_t *dev)
 {
-    assert(driver_obj->dev_hdl != NULL);
+    assert(dev->dev_hdl != NULL);
     ESP_LOGI(TAG_CLASS, "Getting config descriptor");
-    const usb_config_desc_t *config_desc;
-    ESP_ERROR_CHECK(usb_host_get_active_config_descriptor(driver_obj->dev_hdl, &config_desc));
-    usb_print_config_descriptor(config_desc, NULL);
+    usb_print_config_descriptor(dev->config_desc, NULL);
 
     //Get the device's string descriptors next
-    driver_obj->actions &= ~ACTION_GET_CONFIG_DESC;
-    driver_obj->actions |= ACTION_GET_STR_DESC;
+    return DEV_STATE_GET_STR_DESC;
 }
 
-static void action_get_str_desc(class_driver_t *driver_obj)
+static dev_state_t action_get_str_desc(class_driver_t *, hid_device_t *dev)
 {
-    assert(driver_obj->dev_hdl != NULL);
-    usb_device_info_t dev_info;
-    ESP_ERROR_CHECK(usb_host_device_info(driver_obj->dev_hdl, &dev_info));
+    assert(dev->dev_hdl != NULL);
+    //String descriptors were read during enumeration, action_get_info() kept the pointers
+    const usb_device_info_t &dev_info = dev->dev_info;
     if (dev_info.str_desc_manufacturer) {
         ESP_LOGI(TAG_CLASS, "Getting Manufacturer string descriptor");
         usb_print_string_descriptor(dev_info.str_desc_manufacturer);
@@ -134,120 +676,154 @@ static void action_get_str_desc(class_driver_t *driver_obj)
     }
 
     //Claim the interface next
-    driver_obj->actions &= ~ACTION_GET_STR_DESC;
-    driver_obj->actions |= ACTION_CLAIM_INTF;
+    return DEV_STATE_CLAIM_INTF;
 }
 
-static void action_claim_interface(class_driver_t *driver_obj)
+//Route interfaces of known devices to their specialized decoder, everything else stays on the generic one
+static void static_decoders_attach(hid_device_t *dev)
 {
-    assert(driver_obj->dev_hdl != NULL);
-    ESP_LOGI(TAG_CLASS, "Getting config descriptor");
-    const usb_config_desc_t *config_desc;
-    ESP_ERROR_CHECK(usb_host_get_active_config_descriptor(driver_obj->dev_hdl, &config_desc));
+    for (int n = 0; n < dev->num_intfs; n++) {
+        hid_intf_t *hid_intf = &dev->intfs[n];
+        const hid_static_decoder_t *decoder = STATIC_DECODERS_ENABLED ?
+            hid_static_decoder_find(dev->idVendor, dev->idProduct, hid_intf->bInterfaceNumber, hid_intf->report_desc_len) : NULL;
+        hid_intf->static_decode = decoder ? decoder->decode : NULL;
+        if (decoder) {
+            ESP_LOGI(TAG_CLASS, "device %d intf 0x%02x: %s decoder", dev->dev_addr, hid_intf->bInterfaceNumber, decoder->name);
+        }
+    }
+}
 
-    bool hidIntfClaimed = false;
-    int offset = 0;
-    for (size_t n = 0; n < config_desc->bNumInterfaces; n++)
+static dev_state_t action_claim_interface(class_driver_t *driver_obj, hid_device_t *dev)
+{
+    assert(dev->dev_hdl != NULL);
+    if (dev->cached) {
+        if (claim_from_cache(driver_obj, dev)) {
+            static_decoders_attach(dev);
+            //No report descriptor goes over the bus, capture what it compiled to instead
+            for (int n = 0; n < dev->num_intfs; n++) {
+                HID_CAPTURE(HID_CAPTURE_REC_LAYOUT, dev->dev_addr, dev->intfs[n].bInterfaceNumber, USB_TRANSFER_STATUS_COMPLETED,
+                            &dev->intfs[n].report_layout, sizeof(hid_report_layout_t), esp_timer_get_time());
+            }
+            reserve_transfers(driver_obj, dev);
+            //Layouts came from the cache, only the class requests are left
+            return DEV_STATE_CLASS_REQUESTS;
+        }
+        ESP_LOGW(TAG_CLASS, "Enumeration cache entry for %s unusable, enumerating", dev->cache_key);
+        hid_cache_erase(dev->cache_key);
+        dev->cached = false;
+    }
+    const desc_index_t *index = &dev->desc_index;
+    const uint8_t *config = (const uint8_t *)dev->config_desc;
+    int d = dev - driver_obj->devices;
+    dev->num_intfs = 0;
+    for (int n = 0; n < index->num_intfs; n++)
     {
-        const usb_intf_desc_t *intf = usb_parse_interface_descriptor(config_desc, n, 0, &offset);
+        const desc_index_intf_t *intf = &index->intfs[n];
+        if (intf->bAlternateSetting != 0) {
+            continue;
+        }
         printf("Parsed intf->bInterfaceNumber: 0x%02x \n", intf->bInterfaceNumber);
-        
+
         if (intf->bInterfaceClass == 0x03) // HID - https://www.usb.org/defined-class-codes
         {
             printf("Detected HID intf->bInterfaceClass: 0x%02x \n", intf->bInterfaceClass);
+            if (dev->num_intfs >= CLASS_MAX_INTERFACES) {
+                ESP_LOGW("", "skipping HID intf 0x%02x, CLASS_MAX_INTERFACES reached", intf->bInterfaceNumber);
+                continue;
+            }
 
-            const usb_ep_desc_t *ep_in = nullptr;
-            const usb_ep_desc_t *ep_out = nullptr;
-            const usb_ep_desc_t *ep = nullptr;
-            for (size_t i = 0; i < intf->bNumEndpoints; i++) {
-                int _offset = 0;
-                ep = usb_parse_endpoint_descriptor_by_index(intf, i, config_desc->wTotalLength, &_offset);
-                printf("\t > Detected EP num: %d/%d, len: %d, ", i + 1, intf->bNumEndpoints, config_desc->wTotalLength);
-                if (ep) {
-                    printf("address: 0x%02x, mps: %d, dir: %s", ep->bEndpointAddress, ep->wMaxPacketSize, (ep->bEndpointAddress & 0x80) ? "IN" : "OUT");
-                    if (ep->bmAttributes != USB_TRANSFER_TYPE_INTR) {
-                        // only support INTERRUPT > IN Report in action_transfer() for now
-                        continue;
-                    }
-                    if (ep->bEndpointAddress & 0x80) {
-                        ep_in = ep;
-                        driver_obj->ep_in = (usb_ep_desc_t *)ep_in;
-                        // printf(", ep_in->addr: 0x%02x", driver_obj->ep_in->bEndpointAddress);
-                    } else {
-                        ep_out = ep;
-                        driver_obj->ep_out = (usb_ep_desc_t *)ep_out;
-                        // printf(", ep_out->addr: 0x%02x", driver_obj->ep_out->bEndpointAddress);
-                    }
-                    printf("\n");
+            hid_intf_t *hid_intf = &dev->intfs[dev->num_intfs];
+            memset(hid_intf, 0, sizeof(hid_intf_t));
+            hid_intf->dev = dev;
+            hid_intf->bInterfaceNumber = intf->bInterfaceNumber;
+            hid_intf->bInterfaceSubClass = intf->bInterfaceSubClass;
+            hid_intf->bInterfaceProtocol = intf->bInterfaceProtocol;
+            hid_intf->report_desc_len = intf->report_desc_len;
+            hid_intf->ring = &s_report_rings[d][dev->num_intfs];
+            hid_intf->leases = &s_sink_leases[d][dev->num_intfs];
+            hid_intf->sync = &s_intf_syncs[d][dev->num_intfs];
+            hid_intf->dispatch = &s_report_dispatches[d][dev->num_intfs];
+            hid_intf->worker = &s_report_workers[d % s_num_report_workers];
+            hid_intf->out_queue = &s_output_queues[d][dev->num_intfs];
+
+            for (int i = 0; i < intf->num_eps; i++) {
+                const desc_index_ep_t *ep = &index->eps[intf->first_ep + i];
+                printf("\t > Detected EP num: %d/%d, address: 0x%02x, mps: %d, dir: %s\n", i + 1, intf->num_eps,
+                       ep->bEndpointAddress, ep->wMaxPacketSize, (ep->bEndpointAddress & 0x80) ? "IN" : "OUT");
+                if ((ep->bmAttributes & USB_BM_ATTRIBUTES_XFERTYPE_MASK) != USB_TRANSFER_TYPE_INTR) {
+                    // only support INTERRUPT > IN Report in action_transfer() for now
+                    continue;
+                }
+                const usb_ep_desc_t *ep_desc = (const usb_ep_desc_t *)(config + ep->offset);
+                if (ep->bEndpointAddress & 0x80) {
+                    hid_intf->ep_in = *ep_desc;
+                    hid_intf->has_ep_in = true;
                 } else {
-                    ESP_LOGW("", "error to parse endpoint by index; EP num: %d/%d, len: %d", i + 1, intf->bNumEndpoints, config_desc->wTotalLength);
+                    hid_intf->ep_out = *ep_desc;
+                    hid_intf->has_ep_out = true;
                 }
             }
-            esp_err_t err = usb_host_interface_claim(driver_obj->client_hdl, driver_obj->dev_hdl, n, 0);
+            esp_err_t err = usb_host_interface_claim(driver_obj->client_hdl, dev->dev_hdl, intf->bInterfaceNumber, 0);
             if (err) {
                 ESP_LOGI("", "interface claim status: %d", err);
             } else {
                 printf("Claimed HID intf->bInterfaceNumber: 0x%02x \n", intf->bInterfaceNumber);
                 printf("\n");
-                hidIntfClaimed = true;
+                dev->num_intfs++;
             }
         }
     }
 
+    static_decoders_attach(dev);
+    reserve_transfers(driver_obj, dev);
+
     //Get the HID's descriptors next
-    driver_obj->actions &= ~ACTION_CLAIM_INTF;
-    if (hidIntfClaimed)
-    {
-        driver_obj->actions |= ACTION_TRANSFER_CONTROL;
-        // driver_obj->actions |= ACTION_TRANSFER;
-    }
+    return (dev->num_intfs > 0) ? DEV_STATE_TRANSFER_CONTROL : DEV_STATE_IDLE;
 }
 
-static void transfer_cb(usb_transfer_t *transfer)
+//Setup packet plus whatever data stage went over the bus
+static void capture_ctrl(const hid_device_t *dev, const usb_transfer_t *transfer)
 {
-    //This is function is called from within usb_host_client_handle_events(). Don't block and try to keep it short
-    //struct class_driver_control *class_driver_obj = (struct class_driver_control *)transfer->context;
-    // static int PrintDivider = 0;
-    // if ((PrintDivider++ % 10) == 0) {
-    //     // printf("status %d, actual number of bytes transferred %d\n", transfer->status, transfer->actual_num_bytes);
-    //     // for(int i=0; i < transfer->actual_num_bytes; i++)
-    //     //     printf("%02X ", transfer->data_buffer[i]);
-    //     // printf("\n");
-    //     if (PrintDivider >= 10000) PrintDivider = 0;
-    // }
-    class_driver_t *driver_obj = (class_driver_t *)transfer->context;
-    driver_obj->transfer_status = transfer->status;
-    xSemaphoreGive(driver_obj->transfer_done);
+    size_t len = (transfer->data_buffer[0] & USB_BM_REQUEST_TYPE_DIR_IN) ? transfer->actual_num_bytes : transfer->num_bytes;
+    HID_CAPTURE(HID_CAPTURE_REC_CTRL, dev->dev_addr, 0x00, transfer->status, transfer->data_buffer,
+                (len > USB_SETUP_PACKET_SIZE) ? len : USB_SETUP_PACKET_SIZE, esp_timer_get_time());
 }
 
-static esp_err_t wait_for_transfer_done(usb_transfer_t *transfer)
+static void ctrl_transfer_cb(usb_transfer_t *transfer)
 {
-    class_driver_t *driver_obj = (class_driver_t *)transfer->context;
-    BaseType_t received = xSemaphoreTake(driver_obj->transfer_done, pdMS_TO_TICKS(transfer->timeout_ms));
-    // BaseType_t received = xSemaphoreTake(driver_obj->transfer_done, portMAX_DELAY);
-    if (received != pdTRUE) {
-        xSemaphoreGive(driver_obj->transfer_done);
-        return ESP_ERR_TIMEOUT;
+    //This is function is called from within usb_host_client_handle_events(). Don't block and try to keep it short
+    hid_intf_t *hid_intf = (hid_intf_t *)transfer->context;
+    hid_device_t *dev = hid_intf->dev;
+    int64_t now = esp_timer_get_time();
+    capture_ctrl(dev, transfer);
+    dev->ctrl_pending--;
+    if (transfer->status == USB_TRANSFER_STATUS_COMPLETED) {
+        ep_rtt_update(&dev->ctrl_srtt_us, now - dev->ctrl_submit_us);
+    }
+    //EP0 runs the queue in order, the next request started as this one ended
+    dev->ctrl_submit_us = now;
+    if (dev->ctrl_pending == 0 && dev->state == DEV_STATE_CONTROL_WAIT) {
+        //Last answer is in, let action_control_done() look at all of them
+        event_post(&s_driver_obj, dev, DEV_EVENT_STEP);
     }
-    xSemaphoreGive(driver_obj->transfer_done);
-    return (driver_obj->transfer_status == USB_TRANSFER_STATUS_COMPLETED) ? ESP_OK : ESP_FAIL;
 }
 
-static void action_transfer_control(class_driver_t *driver_obj)
+static dev_state_t action_transfer_control(class_driver_t *driver_obj, hid_device_t *dev)
 {
     #define GET_HID_REPORT_DESC
     // #define GET_REPORT
 
-    assert(driver_obj->dev_hdl != NULL);
-    static uint16_t mps = driver_obj->bMaxPacketSize0;
-    static uint16_t tps = usb_round_up_to_mps(1024, mps);
-    static usb_transfer_t *transfer;
-    if (!transfer) {
-        usb_host_transfer_alloc(tps, 0, &transfer);
-    }
-    static int32_t lastSendTime = 0;
-    if (xTaskGetTickCount() - lastSendTime > 8)
-    {
+    assert(dev->dev_hdl != NULL);
+    //Queue the request for every interface back-to-back, the host library runs them in order on EP0.
+    //Nothing else uses EP0 before streaming, and every other user waits for ctrl_pending to drop to 0
+    dev->ctrl_pending = 0;
+    dev->ctrl_submit_us = esp_timer_get_time();
+    for (int n = 0; n < dev->num_intfs; n++) {
+        hid_intf_t *hid_intf = &dev->intfs[n];
+        usb_transfer_t *transfer = hid_intf->ctrl_transfer;
+        if (transfer == NULL) {
+            continue;
+        }
         usb_setup_packet_t stp;
         #if defined(GET_HID_REPORT_DESC)
             // 0x81,        // bmRequestType: Dir: D2H, Type: Standard, Recipient: Interface
@@ -259,9 +835,8 @@ static void action_transfer_control(class_driver_t *driver_obj)
             stp.bmRequestType = USB_BM_REQUEST_TYPE_DIR_IN | USB_BM_REQUEST_TYPE_TYPE_STANDARD | USB_BM_REQUEST_TYPE_RECIP_INTERFACE;
             stp.bRequest = USB_B_REQUEST_GET_DESCRIPTOR;
             stp.wValue = 0x2200;
-            stp.wIndex = 0;
-            stp.wLength = tps - 8;
-            transfer->num_bytes = tps;
+            stp.wIndex = hid_intf->bInterfaceNumber;
+            stp.wLength = ctrl_data_len(hid_intf);
 
         #elif defined(GET_REPORT)
             // 0xA1,        //   bmRequestType: Dir: D2H, Type: Class, Recipient: Interface
@@ -273,271 +848,1877 @@ static void action_transfer_control(class_driver_t *driver_obj)
             stp.bmRequestType = 0xA1;
             stp.bRequest = 0x01;
             stp.wValue = 0x0100;
-            stp.wIndex = 0x0000;
-            stp.wLength = tps - 8;
-            transfer->num_bytes = tps;
+            stp.wIndex = hid_intf->bInterfaceNumber;
+            stp.wLength = ctrl_data_len(hid_intf);
 
         #endif
+        transfer->num_bytes = USB_SETUP_PACKET_SIZE + stp.wLength;
 
         memcpy(transfer->data_buffer, &stp, USB_SETUP_PACKET_SIZE);
-        for(int i=0; i < 8; i++)
-            printf("%02X ", transfer->data_buffer[i]);
-        printf("\n");
-        printf("transfer->data_buffer_size: %d\n", transfer->data_buffer_size);
-        printf("transfer->num_bytes: %d\n", transfer->num_bytes);
+        HID_LOG(HID_LOG_CAT_CTRL, HID_LOG_EV_SETUP, dev->dev_addr, transfer->num_bytes, 0, transfer->data_buffer, USB_SETUP_PACKET_SIZE);
 
         transfer->bEndpointAddress = 0x00;
-        printf("transfer->bEndpointAddress: 0x%02X \n", transfer->bEndpointAddress);
 
-        transfer->device_handle = driver_obj->dev_hdl;
-        transfer->callback = transfer_cb;
-        transfer->context = (void *)driver_obj;
+        transfer->device_handle = dev->dev_hdl;
+        transfer->callback = ctrl_transfer_cb;
+        transfer->context = (void *)hid_intf;
         transfer->timeout_ms = 1000;
+        transfer->status = USB_TRANSFER_STATUS_ERROR;
 
-        BaseType_t received = xSemaphoreTake(driver_obj->transfer_done, 100);
-        if (received == pdTRUE) {
-            esp_err_t result = usb_host_transfer_submit_control(driver_obj->client_hdl, transfer);
-            if (result != ESP_OK)
-                ESP_LOGW("", "attempting control %s", esp_err_to_name(result));
-            usb_host_client_handle_events(driver_obj->client_hdl, 10); // for raising transfer->callback
-            wait_for_transfer_done(transfer);
-            if (transfer->status != USB_TRANSFER_STATUS_COMPLETED) {
-                printf("Transfer failed - Status %d \n", transfer->status);
-            }
-            // else { printf("Transfer completed - Status %d \n", transfer->status); }
+        esp_err_t result = usb_host_transfer_submit_control(driver_obj->client_hdl, transfer);
+        if (result != ESP_OK) {
+            ESP_LOGW("", "attempting control %s", esp_err_to_name(result));
+            continue;
         }
+        dev->ctrl_pending++;
+    }
 
-        if (transfer->status == USB_TRANSFER_STATUS_COMPLETED) {
-            printf("usb_host_transfer_submit_control - completed \n");
-
-            #if defined(GET_HID_REPORT_DESC)
-                //>>>>> for HID Report Descriptor
-                // Explanation: https://electronics.stackexchange.com/questions/68141/
-                // USB Descriptor and Request Parser: https://eleccelerator.com/usbdescreqparser/#
-                //<<<<<
-                printf("\nstatus %d, actual number of bytes transferred %d\n", transfer->status, transfer->actual_num_bytes);
-                for(int i=0; i < transfer->actual_num_bytes; i++) {
-                    if (i == 8) {
-                        printf("\n\n>>> Goto https://eleccelerator.com/usbdescreqparser/ \n");
-                        printf(">>> Copy & paste below HEX and parser as... USB HID Report Descriptor\n\n");
-                    }
-                    printf("%02X ", transfer->data_buffer[i]);
-                }
-                printf("\n\n");
-                uint8_t *const data = (uint8_t *const)(transfer->data_buffer + USB_SETUP_PACKET_SIZE);
-                size_t len = transfer->actual_num_bytes - 8;
-                printf("HID Report Descriptor\n");
-                printf("> size: %ld bytes\n", len);
-                uint8_t vdrDefUsagePage[] = { 0x06, 0x00, 0xFF, 0x09, 0x01 };
-                uint8_t gamepadUsagePage[] = { 0x05, 0x01, 0x09, 0x05 };
-                int retVd = memcmp(data, vdrDefUsagePage, sizeof(vdrDefUsagePage));
-                int retGp = memcmp(data, gamepadUsagePage, sizeof(gamepadUsagePage));
-                bool isGamepad = retGp == 0;
-                bool isVenDef  = retVd == 0;
-                printf("> Parsed Usage Page: %s\n", isGamepad ? "HID Gamepad" : isVenDef ? "Vendor Defined" : "Unkown");
-                printf("\n\n");
-
-            #elif defined(GET_REPORT)
-                printf("\nstatus %d, actual number of bytes transferred %d\n", transfer->status, transfer->actual_num_bytes);
-                for(int i=0; i < transfer->actual_num_bytes; i++) {
-                    if (i == 8) {
-                        printf("\n\n>>> Goto https://eleccelerator.com/usbdescreqparser/ \n");
-                        printf(">>> Copy & paste below HEX and parser\n\n");
-                    }
-                    printf("%02X ", transfer->data_buffer[i]);
-                }
-                printf("\n\n");
-                // uint8_t *const data = (uint8_t *const)(transfer->data_buffer + USB_SETUP_PACKET_SIZE);
+    //ctrl_transfer_cb() steps the device on once every answer is in
+    return (dev->ctrl_pending > 0) ? DEV_STATE_CONTROL_WAIT : DEV_STATE_IDLE;
+}
 
-            #endif
+static dev_state_t action_control_done(class_driver_t *driver_obj, hid_device_t *dev)
+{
+    if (dev->ctrl_pending > 0) {
+        //Step queued on entering the state, the answers are not all in yet
+        return DEV_STATE_NONE;
+    }
+    bool completed = false;
+    int compiled = 0;
+    for (int n = 0; n < dev->num_intfs; n++) {
+        hid_intf_t *hid_intf = &dev->intfs[n];
+        usb_transfer_t *transfer = hid_intf->ctrl_transfer;
+        if (transfer == NULL) {
+            continue;
         }
-
-        driver_obj->actions &= ~ACTION_TRANSFER_CONTROL;
-        if (transfer->status == USB_TRANSFER_STATUS_COMPLETED) {
-            driver_obj->actions |= ACTION_TRANSFER;
+        if (transfer->status != USB_TRANSFER_STATUS_COMPLETED) {
+            HID_LOG(HID_LOG_CAT_ERROR, HID_LOG_EV_XFER_ERROR, dev->dev_addr, 0x00, transfer->status, NULL, 0);
+            continue;
         }
+        HID_LOG(HID_LOG_CAT_CTRL, HID_LOG_EV_CTRL_DONE, dev->dev_addr, transfer->status, transfer->actual_num_bytes, NULL, 0);
+        completed = true;
+
+        #if defined(GET_HID_REPORT_DESC)
+            //>>>>> for HID Report Descriptor
+            // Explanation: https://electronics.stackexchange.com/questions/68141/
+            // USB Descriptor and Request Parser: https://eleccelerator.com/usbdescreqparser/#
+            //<<<<<
+            printf("\nstatus %d, actual number of bytes transferred %d\n", transfer->status, transfer->actual_num_bytes);
+            for(int i=0; i < transfer->actual_num_bytes; i++) {
+                if (i == 8) {
+                    printf("\n\n>>> Goto https://eleccelerator.com/usbdescreqparser/ \n");
+                    printf(">>> Copy & paste below HEX and parser as... USB HID Report Descriptor\n\n");
+                }
+                printf("%02X ", transfer->data_buffer[i]);
+            }
+            printf("\n\n");
+            uint8_t *const data = (uint8_t *const)(transfer->data_buffer + USB_SETUP_PACKET_SIZE);
+            size_t len = transfer->actual_num_bytes - 8;
+            printf("HID Report Descriptor\n");
+            printf("> size: %ld bytes", len);
+            if (hid_intf->report_desc_len && len != hid_intf->report_desc_len) {
+                printf(", wDescriptorLength %d", hid_intf->report_desc_len);
+            }
+            printf("\n");
+            if (hid_report_layout_compile(data, len, &hid_intf->report_layout)) {
+                compiled++;
+            } else {
+                ESP_LOGW("", "malformed HID Report Descriptor, reports will not be decoded");
+                memset(&hid_intf->report_layout, 0, sizeof(hid_report_layout_t));
+            }
+            memset(&hid_intf->report_values, 0, sizeof(hid_report_values_t));
+            hid_report_layout_print(&hid_intf->report_layout);
+            printf("\n\n");
+
+        #elif defined(GET_REPORT)
+            printf("\nstatus %d, actual number of bytes transferred %d\n", transfer->status, transfer->actual_num_bytes);
+            for(int i=0; i < transfer->actual_num_bytes; i++) {
+                if (i == 8) {
+                    printf("\n\n>>> Goto https://eleccelerator.com/usbdescreqparser/ \n");
+                    printf(">>> Copy & paste below HEX and parser\n\n");
+                }
+                printf("%02X ", transfer->data_buffer[i]);
+            }
+            printf("\n\n");
+            // uint8_t *const data = (uint8_t *const)(transfer->data_buffer + USB_SETUP_PACKET_SIZE);
+
+        #endif
+    }
 
-        vTaskDelay(1); //Short delay to let client task spin up
-        lastSendTime = xTaskGetTickCount();
+    if (compiled == dev->num_intfs) {
+        enum_cache_save(driver_obj, dev);
     }
+    //The control transfers stay reserved for the class requests
+    return completed ? DEV_STATE_CLASS_REQUESTS : DEV_STATE_IDLE;
 }
 
-static void action_transfer(class_driver_t *driver_obj)
+static void class_req_add(hid_device_t *dev, int n, uint8_t bRequest, uint16_t wValue, uint16_t wLength)
 {
-    assert(driver_obj->dev_hdl != NULL);
-    static uint16_t mps = driver_obj->ep_in->wMaxPacketSize;
-    // static uint16_t tps = usb_round_up_to_mps(mps, mps);
-    static usb_transfer_t *transfer;
-    if (!transfer) {
-        usb_host_transfer_alloc(mps, 0, &transfer);
+    if (dev->num_class_reqs >= CLASS_MAX_REQUESTS) {
+        return;
     }
-    static int32_t lastSendTime = 0;
-    if (xTaskGetTickCount() - lastSendTime > 8)
-    {
-        transfer->num_bytes = mps;
-        memset(transfer->data_buffer, 0x00, mps);
-        // printf("transfer->data_buffer_size: %d\n", transfer->data_buffer_size);
-        // printf("transfer->num_bytes: %d\n", transfer->num_bytes);
-
-        transfer->bEndpointAddress = driver_obj->ep_in->bEndpointAddress;
-        // printf("transfer->bEndpointAddress: 0x%02X \n", transfer->bEndpointAddress);
+    class_req_t *req = &dev->class_reqs[dev->num_class_reqs++];
+    req->intf = n;
+    hid_class_setup(req->setup, bRequest, wValue, dev->intfs[n].bInterfaceNumber, wLength);
+    req->status = USB_TRANSFER_STATUS_ERROR;
+    req->value = 0;
+}
 
-        transfer->device_handle = driver_obj->dev_hdl;
-        transfer->callback = transfer_cb;
-        transfer->context = (void *)driver_obj;
-        transfer->timeout_ms = 1000;
+static void class_req_cb(usb_transfer_t *transfer);
 
-        BaseType_t received = xSemaphoreTake(driver_obj->transfer_done, 100);
-        if (received == pdTRUE) {
-            esp_err_t result = usb_host_transfer_submit(transfer);
-            if (result != ESP_OK)
-                ESP_LOGW("", "attempting control %s", esp_err_to_name(result));
-            usb_host_client_handle_events(driver_obj->client_hdl, 10); // for raising transfer->callback
-            wait_for_transfer_done(transfer);
-            if (transfer->status != USB_TRANSFER_STATUS_COMPLETED) {
-                printf("Transfer failed - Status %d \n", transfer->status);
-            }
-            // else { printf("Transfer completed - Status %d \n", transfer->status); }
+/**
+ * Submit the next class request that has a control transfer to run on.
+ * Returns false once there is none left.
+ */
+static bool class_req_submit(class_driver_t *driver_obj, hid_device_t *dev)
+{
+    while (dev->next_class_req < dev->num_class_reqs) {
+        class_req_t *req = &dev->class_reqs[dev->next_class_req];
+        usb_transfer_t *transfer = dev->intfs[req->intf].ctrl_transfer;
+        if (transfer == NULL) {
+            dev->next_class_req++;
+            continue;
         }
-
-        if (transfer->status == USB_TRANSFER_STATUS_COMPLETED) {
-            // printf("usb_host_transfer_submit - completed \n");
-            if (transfer->actual_num_bytes > 0) {
-                unsigned char *const data = (unsigned char *const)(transfer->data_buffer);
-
-                #define DEBUG_EP_IN_GET_REPORT
-                #if defined(DEBUG_EP_IN_GET_REPORT)
-                    //
-                    // check HID Report Descriptor for usage, search GET_HID_REPORT_DESC in this file
-                    // gist: https://gist.github.com/jledet/2857343
-                    //       https://www.microchip.com/forums/m913995.aspx
-                    //
-                    for (int i=0; i<transfer->actual_num_bytes && i<11; i++) {
-                        // printf("%d ", data[i]);
-                        // printf("%02X ", data[i]);
-                        for (int b = 8; b != -1; b--) printf("%d", (data[i] & (1 << b)) >> b );
-                        printf(" ");
-                    }
-                    printf("\n");
-                #endif
-            }
+        memcpy(transfer->data_buffer, req->setup, USB_SETUP_PACKET_SIZE);
+        transfer->num_bytes = USB_SETUP_PACKET_SIZE + (req->setup[6] | (req->setup[7] << 8));
+        HID_LOG(HID_LOG_CAT_CTRL, HID_LOG_EV_SETUP, dev->dev_addr, transfer->num_bytes, 0, transfer->data_buffer, USB_SETUP_PACKET_SIZE);
+        transfer->bEndpointAddress = 0x00;
+        transfer->device_handle = dev->dev_hdl;
+        transfer->callback = class_req_cb;
+        transfer->context = (void *)dev;
+        transfer->status = USB_TRANSFER_STATUS_ERROR;
+        dev->ctrl_submit_us = esp_timer_get_time();
+        esp_err_t err = usb_host_transfer_submit_control(driver_obj->client_hdl, transfer);
+        if (err == ESP_OK) {
+            dev->ctrl_pending++;
+            return true;
         }
+        ESP_LOGW("", "attempting class request %02x: %s", req->setup[1], esp_err_to_name(err));
+        dev->next_class_req++;
+    }
+    return false;
+}
 
-        // driver_obj->actions &= ~ACTION_TRANSFER; // break during development
+static void class_req_cb(usb_transfer_t *transfer)
+{
+    //This is function is called from within usb_host_client_handle_events(). Don't block and try to keep it short
+    hid_device_t *dev = (hid_device_t *)transfer->context;
+    class_req_t *req = &dev->class_reqs[dev->next_class_req++];
+    capture_ctrl(dev, transfer);
+    dev->ctrl_pending--;
+    if (transfer->status == USB_TRANSFER_STATUS_COMPLETED) {
+        ep_rtt_update(&dev->ctrl_srtt_us, esp_timer_get_time() - dev->ctrl_submit_us);
+    }
+    req->status = transfer->status;
+    if (transfer->status == USB_TRANSFER_STATUS_COMPLETED && transfer->actual_num_bytes > USB_SETUP_PACKET_SIZE) {
+        req->value = transfer->data_buffer[USB_SETUP_PACKET_SIZE];
+    }
+    if (dev->state != DEV_STATE_CLASS_WAIT) {
+        //Closing, the rest of the requests are not needed anymore
+        return;
+    }
+    //A STALL flushes EP0, so requests go out one at a time and a refused one only costs itself
+    if (!class_req_submit(&s_driver_obj, dev)) {
+        event_post(&s_driver_obj, dev, DEV_EVENT_STEP);
+    }
+}
 
-        vTaskDelay(1); //Short delay to let client task spin up
-        lastSendTime = xTaskGetTickCount();
+static dev_state_t action_class_done(class_driver_t *driver_obj, hid_device_t *dev)
+{
+    if (dev->ctrl_pending > 0) {
+        return DEV_STATE_NONE;
+    }
+    for (int r = 0; r < dev->num_class_reqs; r++) {
+        const class_req_t *req = &dev->class_reqs[r];
+        hid_intf_t *hid_intf = &dev->intfs[req->intf];
+        if (req->status != USB_TRANSFER_STATUS_COMPLETED) {
+            //Optional for most devices, e.g. SET_IDLE is commonly stalled by joysticks
+            ESP_LOGW(TAG_CLASS, "device %d intf 0x%02x: class request %02x status %d, ignored",
+                     dev->dev_addr, hid_intf->bInterfaceNumber, req->setup[1], req->status);
+            continue;
+        }
+        switch (req->setup[1]) {
+            case HID_REQ_SET_PROTOCOL:
+                hid_intf->boot_protocol = hid_intf->bInterfaceProtocol;
+                ESP_LOGI(TAG_CLASS, "device %d intf 0x%02x: boot %s protocol", dev->dev_addr, hid_intf->bInterfaceNumber,
+                         (hid_intf->boot_protocol == HID_BOOT_PROTOCOL_KEYBOARD) ? "keyboard" : "mouse");
+                break;
+            case HID_REQ_SET_IDLE:
+                ESP_LOGI(TAG_CLASS, "device %d intf 0x%02x: idle rate %d ms", dev->dev_addr, hid_intf->bInterfaceNumber,
+                         req->setup[3] * 4);
+                break;
+            case HID_REQ_GET_PROTOCOL:
+                ESP_LOGI(TAG_CLASS, "device %d intf 0x%02x: reads back %s protocol", dev->dev_addr,
+                         hid_intf->bInterfaceNumber, (req->value == HID_PROTOCOL_BOOT) ? "boot" : "report");
+                break;
+            case HID_REQ_GET_IDLE:
+                ESP_LOGI(TAG_CLASS, "device %d intf 0x%02x: reads back idle rate %d ms", dev->dev_addr,
+                         hid_intf->bInterfaceNumber, req->value * 4);
+                break;
+        }
+    }
+    for (int n = 0; n < dev->num_intfs; n++) {
+        if (dev->intfs[n].ctrl_transfer) {
+            transfer_pool_put(&driver_obj->transfer_pool, dev->intfs[n].ctrl_transfer);
+            dev->intfs[n].ctrl_transfer = NULL;
+        }
     }
+    return DEV_STATE_TRANSFER;
 }
 
-static void aciton_close_dev(class_driver_t *driver_obj)
+/**
+ * Queue the class requests dev->policy asks for: SET_PROTOCOL(boot) on boot
+ * keyboards and mice, SET_IDLE on every interface, optionally followed by
+ * GET_PROTOCOL/GET_IDLE to log what the device settled on.
+ */
+static dev_state_t action_class_requests(class_driver_t *driver_obj, hid_device_t *dev)
 {
-    const usb_config_desc_t *config_desc;
-    ESP_ERROR_CHECK(usb_host_get_active_config_descriptor(driver_obj->dev_hdl, &config_desc));
-    
-    int offset = 0;
-    for (size_t n = 0; n < config_desc->bNumInterfaces; n++)
-    {
-        const usb_intf_desc_t *intf = usb_parse_interface_descriptor(config_desc, n, 0, &offset);
-        printf("\nReleasing intf->bInterfaceNumber: 0x%02x \n", intf->bInterfaceNumber);
-        if (intf->bInterfaceClass == 0x03) // HID - https://www.usb.org/defined-class-codes
-        {
-            printf("\nReleasing HID intf->bInterfaceClass: 0x%02x \n", intf->bInterfaceClass);
-            const usb_ep_desc_t *ep_in = nullptr;
-            const usb_ep_desc_t *ep_out = nullptr;
-            const usb_ep_desc_t *ep = nullptr;
-            for (size_t i = 0; i < intf->bNumEndpoints; i++) {
-                int _offset = 0;
-                ep = usb_parse_endpoint_descriptor_by_index(intf, i, config_desc->wTotalLength, &_offset);
-                if (ep) {
-                    if (ep->bEndpointAddress & 0x80) {
-                        ep_in = ep;
-                    } else {
-                        ep_out = ep;
-                    }
-                    printf("\t > Halting EP num: %d/%d, len: %d, ", i + 1, intf->bNumEndpoints, config_desc->wTotalLength);
-                    printf("address: 0x%02x, EP max size: %d, dir: %s\n", ep->bEndpointAddress, ep->wMaxPacketSize, (ep->bEndpointAddress & 0x80) ? "IN" : "OUT");
-                    ESP_ERROR_CHECK(usb_host_endpoint_halt(driver_obj->dev_hdl, ep->bEndpointAddress));
-                    ESP_ERROR_CHECK(usb_host_endpoint_flush(driver_obj->dev_hdl, ep->bEndpointAddress));
-                }
+    assert(dev->dev_hdl != NULL);
+    const hid_class_policy_t *policy = dev->policy ? dev->policy : &s_hid_class_default_policy;
+    dev->num_class_reqs = 0;
+    dev->next_class_req = 0;
+    for (int n = 0; n < dev->num_intfs; n++) {
+        const hid_intf_t *hid_intf = &dev->intfs[n];
+        bool boot = hid_intf->bInterfaceSubClass == HID_SUBCLASS_BOOT &&
+                    (hid_intf->bInterfaceProtocol == HID_BOOT_PROTOCOL_KEYBOARD ||
+                     hid_intf->bInterfaceProtocol == HID_BOOT_PROTOCOL_MOUSE);
+        if (boot && policy->boot_protocol) {
+            class_req_add(dev, n, HID_REQ_SET_PROTOCOL, HID_PROTOCOL_BOOT, 0);
+        }
+        if (policy->idle_rate != HID_IDLE_UNCHANGED) {
+            class_req_add(dev, n, HID_REQ_SET_IDLE, policy->idle_rate << 8, 0);
+        }
+        if (policy->read_back) {
+            //GET_PROTOCOL is only required of boot interfaces
+            if (boot) {
+                class_req_add(dev, n, HID_REQ_GET_PROTOCOL, 0, 1);
             }
-            ESP_ERROR_CHECK(usb_host_interface_release(driver_obj->client_hdl, driver_obj->dev_hdl, n));
+            class_req_add(dev, n, HID_REQ_GET_IDLE, 0, 1);
         }
     }
+    dev->ctrl_pending = 0;
+    if (class_req_submit(driver_obj, dev)) {
+        return DEV_STATE_CLASS_WAIT;
+    }
+    return action_class_done(driver_obj, dev);
+}
 
-    ESP_ERROR_CHECK(usb_host_device_close(driver_obj->client_hdl, driver_obj->dev_hdl));
-    driver_obj->dev_hdl = NULL;
-    driver_obj->dev_addr = 0;
-    //We need to exit the event handler loop
-    driver_obj->actions &= ~ACTION_CLOSE_DEV;
-    driver_obj->actions &= ~ACTION_TRANSFER;
-    driver_obj->actions |= ACTION_EXIT;
+static void print_in_report(const report_slot_t *slot)
+{
+    //
+    // check HID Report Descriptor for usage, search GET_HID_REPORT_DESC in this file
+    // gist: https://gist.github.com/jledet/2857343
+    //       https://www.microchip.com/forums/m913995.aspx
+    //
+    HID_LOG(HID_LOG_CAT_REPORT, HID_LOG_EV_REPORT, slot->dev_addr, slot->ep_addr, slot->len, slot->data, slot->len);
 }
 
-void usb_class_driver_task(void *arg)
+static void print_report_delta(const hid_intf_t *hid_intf, const report_delta_t *delta)
 {
-    SemaphoreHandle_t signaling_sem = (SemaphoreHandle_t)arg;
-    class_driver_t driver_obj = {0};
+    HID_LOG(HID_LOG_CAT_DECODED, HID_LOG_EV_DELTA,
+            (hid_intf->dev->dev_addr << 8) | hid_intf->ep_in.bEndpointAddress, delta->report_id,
+            (uint32_t)delta->changed_fields, NULL, 0);
+}
 
-    //Wait until daemon task has installed USB Host Library
-    xSemaphoreTake(signaling_sem, portMAX_DELAY);
+static void print_decoded_report(const hid_intf_t *hid_intf)
+{
+    const hid_report_values_t *values = &hid_intf->report_values;
+    HID_LOG(HID_LOG_CAT_DECODED, HID_LOG_EV_DECODED,
+            (hid_intf->dev->dev_addr << 8) | hid_intf->ep_in.bEndpointAddress,
+            (uint32_t)(values->buttons >> 32), (uint32_t)values->buttons, NULL, 0);
+}
 
-    ESP_LOGI(TAG_CLASS, "Registering Client");
-    usb_host_client_config_t client_config = {
-        .is_synchronous = false,    //Synchronous clients currently not supported. Set this to false
-        .max_num_event_msg = CLIENT_NUM_EVENT_MSG,
-        .async = {
-            .client_event_callback = client_event_cb,
-            .callback_arg = (void *)&driver_obj,
-        },
-    };
-    ESP_ERROR_CHECK(usb_host_client_register(&client_config, &driver_obj.client_hdl));
+static uint8_t intf_report_id(const hid_intf_t *hid_intf, const uint8_t *data, size_t len)
+{
+    return (!hid_intf->boot_protocol && hid_intf->report_layout.uses_report_ids && len) ? data[0] : 0;
+}
 
-    driver_obj.transfer_done = xSemaphoreCreateCounting( 1, 1 );
+static void dispatch_build(hid_intf_t *hid_intf)
+{
+    report_dispatch_build(hid_intf->dispatch, &s_report_subs, hid_intf->dev->dev_addr, hid_intf->bInterfaceNumber,
+                          hid_intf->boot_protocol ? NULL : &hid_intf->report_layout);
+}
 
-    while (1) {
-        if (driver_obj.actions == 0) {
-            usb_host_client_handle_events(driver_obj.client_hdl, portMAX_DELAY);
-        } else {
-            if (driver_obj.actions & ACTION_OPEN_DEV) {
-                action_open_dev(&driver_obj);
-            }
-            if (driver_obj.actions & ACTION_GET_DEV_INFO) {
-                action_get_info(&driver_obj);
-            }
-            if (driver_obj.actions & ACTION_GET_DEV_DESC) {
-                action_get_dev_desc(&driver_obj);
-            }
-            if (driver_obj.actions & ACTION_GET_CONFIG_DESC) {
-                action_get_config_desc(&driver_obj);
-            }
-            if (driver_obj.actions & ACTION_GET_STR_DESC) {
-                action_get_str_desc(&driver_obj);
-            }
-            if (driver_obj.actions & ACTION_CLAIM_INTF) {
-                action_claim_interface(&driver_obj);
-            }
-            if (driver_obj.actions & ACTION_TRANSFER_CONTROL) {
-                action_transfer_control(&driver_obj);
-            }
-            if (driver_obj.actions & ACTION_TRANSFER) {
-                action_transfer(&driver_obj);
-            }
-            if (driver_obj.actions & ACTION_CLOSE_DEV) {
-                aciton_close_dev(&driver_obj);
-            }
-            if (driver_obj.actions & ACTION_EXIT) {
-                break;
+//Rebuild the dispatch tables of streaming interfaces after a subscription changed
+static void dispatch_refresh(class_driver_t *driver_obj)
+{
+    for (int d = 0; d < CLASS_MAX_DEVICES; d++) {
+        hid_device_t *dev = &driver_obj->devices[d];
+        for (int n = 0; dev->state == DEV_STATE_STREAMING && n < dev->num_intfs; n++) {
+            if (dev->intfs[n].streaming && report_dispatch_stale(dev->intfs[n].dispatch, &s_report_subs)) {
+                dispatch_build(&dev->intfs[n]);
             }
         }
     }
+}
 
-    vSemaphoreDelete(driver_obj.transfer_done);
-
-    ESP_LOGI(TAG_CLASS, "Deregistering Client");
+static uint32_t stream_interval_us(const class_driver_t *driver_obj, const hid_intf_t *hid_intf)
+{
+    //Full speed interrupt endpoints poll every bInterval frames of 1 ms
+    uint8_t bInterval = hid_intf->ep_in.bInterval;
+    uint32_t interval_us = (bInterval ? bInterval : 1) * 1000;
+    if (driver_obj->poll_policy == POLL_POLICY_CAPPED && driver_obj->poll_cap_hz > 0) {
+        uint32_t cap_us = 1000000 / driver_obj->poll_cap_hz;
+        if (cap_us > interval_us) {
+            interval_us = cap_us;
+        }
+    }
+    return interval_us;
+}
+
+//Index of transfer in in_transfers[], -1 if it is not one of them
+static int transfer_index(const hid_intf_t *hid_intf, const usb_transfer_t *transfer)
+{
+    for (int i = 0; i < TRANSFER_IN_FLIGHT_NUM; i++) {
+        if (hid_intf->in_transfers[i] == transfer) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static esp_err_t stream_submit(hid_intf_t *hid_intf, usb_transfer_t *transfer)
+{
+    stream_stats_t *stats = &hid_intf->stream_stats;
+    if (stats->idle_since_us) {
+        //Every poll slot that passed with nothing queued is a report the device could not deliver
+        stats->missed += (esp_timer_get_time() - stats->idle_since_us) / hid_intf->poll_interval_us;
+        stats->idle_since_us = 0;
+    }
+    int64_t now = esp_timer_get_time();
+    hid_intf->next_submit_us = now + hid_intf->poll_interval_us;
+    int i = transfer_index(hid_intf, transfer);
+    if (i >= 0) {
+        hid_intf->submit_us[i] = now;
+    }
+    transfer->num_bytes = hid_intf->ep_in.wMaxPacketSize;
+    esp_err_t err = usb_host_transfer_submit(transfer);
+    if (err == ESP_OK) {
+        hid_intf->in_flight++;
+    }
+    return err;
+}
+
+/**
+ * Lend the report in transfer's buffer to the sinks. The endpoint keeps
+ * at least one transfer, so a slow sink costs it reports, never the stream.
+ * Returns true if the transfer is lent and must not be resubmitted.
+ */
+static bool sink_lend(hid_intf_t *hid_intf, usb_transfer_t *transfer, int64_t now)
+{
+    int i = transfer_index(hid_intf, transfer);
+    transfer_pool_t *pool = &s_driver_obj.transfer_pool;
+    //The lease may still be out for an orphan of the device that had this slot before
+    if (i < 0 || hid_intf->in_flight + hid_intf->num_parked == 0 ||
+        (pool->num_orphans && (transfer_pool_orphaned(pool, &hid_intf->leases->returned) & (1u << i)))) {
+        hid_intf->stream_stats.unlent++;
+        return false;
+    }
+    report_lease_t *lease = &hid_intf->leases->leases[i];
+    lease->data = transfer->data_buffer;
+    lease->len = transfer->actual_num_bytes;
+    lease->dev_addr = hid_intf->dev->dev_addr;
+    lease->ep_addr = transfer->bEndpointAddress;
+    lease->timestamp_us = now;
+    lease->index = i;
+    lease->returned = &hid_intf->leases->returned;
+    if (!report_sink_lend(&s_report_sinks, lease)) {
+        return false;
+    }
+    hid_intf->lent_mask |= 1u << i;
+    if (s_report_sink_task) {
+        xTaskNotifyGive(s_report_sink_task);
+    }
+    return true;
+}
+
+static void stream_transfer_complete(usb_transfer_t *transfer, int64_t now)
+{
+    hid_intf_t *hid_intf = (hid_intf_t *)transfer->context;
+    stream_stats_t *stats = &hid_intf->stream_stats;
+    bool lent = false;
+    hid_intf->in_flight--;
+    if (transfer->status != USB_TRANSFER_STATUS_COMPLETED || transfer->actual_num_bytes > 0) {
+        HID_CAPTURE(HID_CAPTURE_REC_IN, hid_intf->dev->dev_addr, transfer->bEndpointAddress, transfer->status, transfer->data_buffer,
+                    (transfer->status == USB_TRANSFER_STATUS_COMPLETED) ? transfer->actual_num_bytes : 0, now);
+    }
+
+    if (transfer->status == USB_TRANSFER_STATUS_COMPLETED) {
+        int64_t recover_us = ep_recovery_success(&hid_intf->recovery, now);
+        if (recover_us >= 0) {
+            latency_hist_record(&s_driver_obj.recover, recover_us);
+        }
+        if (transfer->actual_num_bytes > 0) {
+            stats->reports++;
+            s_driver_obj.reports++;
+            stats->bytes += transfer->actual_num_bytes;
+            int i = transfer_index(hid_intf, transfer);
+            if (i >= 0) {
+                latency_hist_record(&hid_intf->latency[LATENCY_SUBMIT_TO_COMPLETE], now - hid_intf->submit_us[i]);
+            }
+            if (hid_intf->last_complete_us) {
+                int64_t jitter_us = (now - hid_intf->last_complete_us) - hid_intf->poll_interval_us;
+                latency_hist_record(&hid_intf->latency[LATENCY_JITTER], (jitter_us < 0) ? -jitter_us : jitter_us);
+            }
+            hid_intf->last_complete_us = now;
+            if (hid_intf->dev->first_report_us == 0) {
+                hid_intf->dev->first_report_us = now;
+            }
+            //Once anything is subscribed, report IDs without a subscriber end here, before the copy
+            if (s_report_subs.active.load(std::memory_order_relaxed) &&
+                !report_dispatch_lookup(hid_intf->dispatch, &s_report_subs,
+                                        intf_report_id(hid_intf, transfer->data_buffer, transfer->actual_num_bytes))) {
+                stats->unsubscribed++;
+            //Hand the report over to usb_report_consumer_task() and get straight back to the endpoint
+            } else if (report_ring_push(hid_intf->ring, hid_intf->dev->dev_addr, transfer->bEndpointAddress,
+                                 transfer->data_buffer, transfer->actual_num_bytes, now) &&
+                hid_intf->worker->task) {
+                xTaskNotifyGive(hid_intf->worker->task);
+            }
+            //Sinks forward every report, straight from the transfer buffer
+            if (REPORT_SINKS_ENABLED && hid_intf->streaming && s_report_sinks.active.load(std::memory_order_relaxed)) {
+                lent = sink_lend(hid_intf, transfer, now);
+            }
+        }
+    } else {
+        stats->errors++;
+        HID_LOG(HID_LOG_CAT_ERROR, HID_LOG_EV_XFER_ERROR, hid_intf->dev->dev_addr, transfer->bEndpointAddress, transfer->status, NULL, 0);
+        if (transfer->status != USB_TRANSFER_STATUS_NO_DEVICE && transfer->status != USB_TRANSFER_STATUS_CANCELED) {
+            //The pipe is halted now, stream_recover() takes over instead of resubmitting into it
+            ep_recovery_error(&hid_intf->recovery, transfer->status, transfer->status == USB_TRANSFER_STATUS_STALL, now);
+        }
+    }
+
+    if (hid_intf->in_flight == 0) {
+        stats->idle_since_us = now;
+    }
+
+    //Put the transfer straight back on the endpoint unless it is lent, the device is going away or the endpoint recovering
+    if (lent || !hid_intf->streaming ||
+        transfer->status == USB_TRANSFER_STATUS_NO_DEVICE ||
+        transfer->status == USB_TRANSFER_STATUS_CANCELED ||
+        ep_recovery_active(&hid_intf->recovery)) {
+        return;
+    }
+    if (hid_intf->capped && now < hid_intf->next_submit_us) {
+        //Too early for the capped rate, stream_submit_parked() submits it once its slot comes up
+        hid_intf->parked[hid_intf->num_parked++] = transfer;
+        return;
+    }
+    esp_err_t err = stream_submit(hid_intf, transfer);
+    if (err != ESP_OK) {
+        ESP_LOGW("", "resubmit IN transfer %s", esp_err_to_name(err));
+    }
+}
+
+static void stream_transfer_cb(usb_transfer_t *transfer)
+{
+    //This is function is called from within usb_host_client_handle_events(). Don't block and try to keep it short
+    int64_t start_us = busy_clock_us();
+    stream_transfer_complete(transfer, esp_timer_get_time());
+    s_driver_obj.busy_us += busy_clock_us() - start_us;
+}
+
+/**
+ * Submit due parked transfers, one per endpoint per round, starting from a
+ * rotating endpoint so no device gets to go first every time.
+ * Returns the time until the earliest parked transfer is due, or -1 if none is parked.
+ */
+static int64_t stream_submit_parked(class_driver_t *driver_obj)
+{
+    const int num_slots = CLASS_MAX_DEVICES * CLASS_MAX_INTERFACES;
+    int64_t wait_us = -1;
+    bool submitted = true;
+    while (submitted) {
+        submitted = false;
+        wait_us = -1;
+        for (int k = 0; k < num_slots; k++) {
+            int slot = (driver_obj->rr_next + k) % num_slots;
+            hid_device_t *dev = &driver_obj->devices[slot / CLASS_MAX_INTERFACES];
+            hid_intf_t *hid_intf = &dev->intfs[slot % CLASS_MAX_INTERFACES];
+            if (dev->dev_addr == 0 || !hid_intf->streaming || hid_intf->num_parked == 0 ||
+                ep_recovery_active(&hid_intf->recovery)) {
+                continue;
+            }
+            int64_t due_us = hid_intf->next_submit_us - esp_timer_get_time();
+            if (due_us > 0) {
+                if (wait_us < 0 || due_us < wait_us) {
+                    wait_us = due_us;
+                }
+                continue;
+            }
+            usb_transfer_t *transfer = hid_intf->parked[--hid_intf->num_parked];
+            esp_err_t err = stream_submit(hid_intf, transfer);
+            if (err != ESP_OK) {
+                ESP_LOGW("", "resubmit IN transfer %s", esp_err_to_name(err));
+            }
+            submitted = true;
+        }
+    }
+    driver_obj->rr_next = (driver_obj->rr_next + 1) % num_slots;
+    return wait_us;
+}
+
+/**
+ * Take back the transfers every sink let go of. Streaming endpoints get
+ * them back like a completion would; a recovering endpoint parks them for
+ * its resubmit.
+ */
+static void sink_reclaim(hid_intf_t *hid_intf)
+{
+    //Only bits of this interface's own leases, those of orphans left by a device that used the slot before stay
+    uint32_t mask = hid_intf->leases->returned.fetch_and(~hid_intf->lent_mask, std::memory_order_acquire) & hid_intf->lent_mask;
+    hid_intf->lent_mask &= ~mask;
+    for (int i = 0; mask && hid_intf->streaming && i < TRANSFER_IN_FLIGHT_NUM; i++) {
+        usb_transfer_t *transfer = hid_intf->in_transfers[i];
+        if (!(mask & (1u << i)) || !transfer) {
+            continue;
+        }
+        if (hid_intf->capped || ep_recovery_active(&hid_intf->recovery)) {
+            hid_intf->parked[hid_intf->num_parked++] = transfer;
+            continue;
+        }
+        esp_err_t err = stream_submit(hid_intf, transfer);
+        if (err != ESP_OK) {
+            ESP_LOGW("", "resubmit IN transfer %s", esp_err_to_name(err));
+        }
+    }
+}
+
+//Put every IN transfer on the endpoint, none may be in flight; lent ones follow once they are back
+static void stream_submit_all(hid_intf_t *hid_intf)
+{
+    hid_intf->num_parked = 0;
+    bool first = true;
+    for (int i = 0; i < TRANSFER_IN_FLIGHT_NUM; i++) {
+        usb_transfer_t *transfer = hid_intf->in_transfers[i];
+        if (!transfer || (hid_intf->lent_mask & (1u << i))) {
+            continue;
+        }
+        if (hid_intf->capped && !first) {
+            //Capped streams are released one slot at a time
+            hid_intf->parked[hid_intf->num_parked++] = transfer;
+            continue;
+        }
+        first = false;
+        esp_err_t err = stream_submit(hid_intf, transfer);
+        if (err != ESP_OK) {
+            ESP_LOGW("", "submit IN transfer %s", esp_err_to_name(err));
+        }
+    }
+}
+
+static void clear_halt_cb(usb_transfer_t *transfer)
+{
+    //This is function is called from within usb_host_client_handle_events(). Don't block and try to keep it short
+    hid_intf_t *hid_intf = (hid_intf_t *)transfer->context;
+    hid_device_t *dev = hid_intf->dev;
+    int64_t now = esp_timer_get_time();
+    capture_ctrl(dev, transfer);
+    dev->ctrl_pending--;
+    if (transfer->status == USB_TRANSFER_STATUS_COMPLETED) {
+        ep_rtt_update(&dev->ctrl_srtt_us, now - dev->ctrl_submit_us);
+    }
+    ep_recovery_step_done(&hid_intf->recovery, transfer->status == USB_TRANSFER_STATUS_COMPLETED, now);
+    transfer_pool_put(&s_driver_obj.transfer_pool, transfer);
+    hid_intf->ctrl_transfer = NULL;
+}
+
+//CLEAR_FEATURE(ENDPOINT_HALT) for a stalled IN endpoint, on a control transfer borrowed from the pool
+static void clear_halt_submit(class_driver_t *driver_obj, hid_device_t *dev, hid_intf_t *hid_intf, int64_t now)
+{
+    size_t size = usb_round_up_to_mps(USB_SETUP_PACKET_SIZE, dev->bMaxPacketSize0);
+    if (hid_intf->ctrl_transfer || transfer_pool_get(&driver_obj->transfer_pool, size, &hid_intf->ctrl_transfer) != ESP_OK) {
+        ep_recovery_step_done(&hid_intf->recovery, false, now);
+        return;
+    }
+    usb_transfer_t *transfer = hid_intf->ctrl_transfer;
+    usb_setup_packet_t *stp = (usb_setup_packet_t *)transfer->data_buffer;
+    stp->bmRequestType = USB_BM_REQUEST_TYPE_DIR_OUT | USB_BM_REQUEST_TYPE_TYPE_STANDARD | USB_BM_REQUEST_TYPE_RECIP_ENDPOINT;
+    stp->bRequest = USB_B_REQUEST_CLEAR_FEATURE;
+    stp->wValue = 0;            //ENDPOINT_HALT
+    stp->wIndex = hid_intf->ep_in.bEndpointAddress;
+    stp->wLength = 0;
+    transfer->num_bytes = USB_SETUP_PACKET_SIZE;
+    transfer->bEndpointAddress = 0x00;
+    transfer->device_handle = dev->dev_hdl;
+    transfer->callback = clear_halt_cb;
+    transfer->context = (void *)hid_intf;
+    dev->ctrl_submit_us = now;
+    esp_err_t err = usb_host_transfer_submit_control(driver_obj->client_hdl, transfer);
+    if (err != ESP_OK) {
+        ESP_LOGW("", "attempting CLEAR_FEATURE %s", esp_err_to_name(err));
+        transfer_pool_put(&driver_obj->transfer_pool, transfer);
+        hid_intf->ctrl_transfer = NULL;
+        ep_recovery_step_done(&hid_intf->recovery, false, now);
+        return;
+    }
+    dev->ctrl_pending++;
+}
+
+/**
+ * Perform the due recovery steps of every endpoint with a failed transfer,
+ * see usb_ep_recovery.hpp. Returns the time until the earliest backoff
+ * ends, or -1 if no step is waiting on the clock.
+ */
+static int64_t stream_recover(class_driver_t *driver_obj)
+{
+    int64_t wait_us = -1;
+    int64_t now = esp_timer_get_time();
+    for (int d = 0; d < CLASS_MAX_DEVICES; d++) {
+        hid_device_t *dev = &driver_obj->devices[d];
+        if (dev->state != DEV_STATE_STREAMING) {
+            continue;
+        }
+        for (int n = 0; n < dev->num_intfs; n++) {
+            hid_intf_t *hid_intf = &dev->intfs[n];
+            ep_recovery_t *rec = &hid_intf->recovery;
+            uint8_t ep_addr = hid_intf->ep_in.bEndpointAddress;
+            if (!hid_intf->streaming || !ep_recovery_active(rec)) {
+                continue;
+            }
+            if (rec->step == EP_RECOVER_CLEAR_FEATURE && !rec->waiting && dev->ctrl_pending > 0) {
+                //EP0 serves one request at a time, the one running wakes the task when it is back
+                continue;
+            }
+            switch (ep_recovery_poll(rec, hid_intf->in_flight, now)) {
+                case EP_RECOVER_HALT_FLUSH:
+                    ESP_LOGW(TAG_CLASS, "%d/%02x: %s, recovering (retry %d)", dev->dev_addr, ep_addr,
+                             rec->stalled ? "stalled" : "transfer failed", rec->retries);
+                    hid_intf->num_parked = 0;
+                    ESP_ERROR_CHECK_WITHOUT_ABORT(usb_host_endpoint_halt(dev->dev_hdl, ep_addr));
+                    ESP_ERROR_CHECK_WITHOUT_ABORT(usb_host_endpoint_flush(dev->dev_hdl, ep_addr));
+                    break;
+                case EP_RECOVER_CLEAR_FEATURE:
+                    clear_halt_submit(driver_obj, dev, hid_intf, now);
+                    break;
+                case EP_RECOVER_RESUBMIT:
+                    ESP_ERROR_CHECK_WITHOUT_ABORT(usb_host_endpoint_clear(dev->dev_hdl, ep_addr));
+                    stream_submit_all(hid_intf);
+                    ep_recovery_resubmitted(rec);
+                    break;
+                case EP_RECOVER_GIVE_UP:
+                    ESP_LOGE(TAG_CLASS, "%d/%02x: still failing after %d recoveries, endpoint given up",
+                             dev->dev_addr, ep_addr, EP_RECOVERY_MAX_RETRIES);
+                    break;
+                default:
+                    break;
+            }
+            //Flushed transfers and CLEAR_FEATURE come back through the event handler, which wakes the task anyway
+            if (rec->health == EP_HEALTH_RECOVERING && rec->step != EP_RECOVER_NONE && !rec->waiting &&
+                !(rec->step == EP_RECOVER_RESUBMIT && hid_intf->in_flight > 0)) {
+                int64_t due_us = (rec->next_us > now) ? rec->next_us - now : 0;
+                if (wait_us < 0 || due_us < wait_us) {
+                    wait_us = due_us;
+                }
+            }
+        }
+    }
+    return wait_us;
+}
+
+//Start or stop the worker's side of an interface, the worker is woken to ack it
+static void intf_sync_bump(hid_intf_t *hid_intf)
+{
+    hid_intf->sync->generation.fetch_add(1, std::memory_order_release);
+    if (hid_intf->worker->task) {
+        xTaskNotifyGive(hid_intf->worker->task);
+    }
+}
+
+//True once the worker acked the last stream_start() or stream_stop() of every interface
+static bool intf_sync_done(const hid_device_t *dev)
+{
+    for (int n = 0; n < dev->num_intfs; n++) {
+        const hid_intf_t *hid_intf = &dev->intfs[n];
+        if (hid_intf->worker->task && hid_intf->sync->acked.load(std::memory_order_acquire) !=
+                                      hid_intf->sync->generation.load(std::memory_order_relaxed)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void filter_init(hid_intf_t *hid_intf)
+{
+    if (hid_intf->bInterfaceProtocol == HID_BOOT_PROTOCOL_MOUSE) {
+        //Mouse reports are motion, whatever the protocol: a repeated one is another move
+        report_filter_init_passthrough(&hid_intf->filter);
+    } else {
+        //Boot reports have a fixed format the layout does not describe, compare them whole
+        report_filter_init(&hid_intf->filter, hid_intf->boot_protocol ? NULL : &hid_intf->report_layout,
+                           REPORT_FILTER_FIELDS, REPORT_FILTER_DEADBAND);
+    }
+}
+
+static void stream_start(class_driver_t *driver_obj, hid_intf_t *hid_intf)
+{
+    uint16_t mps = hid_intf->ep_in.wMaxPacketSize;
+    memset(&hid_intf->stream_stats, 0, sizeof(stream_stats_t));
+    hid_intf->stream_stats.start_us = esp_timer_get_time();
+    hid_intf->stream_stats.idle_since_us = hid_intf->stream_stats.start_us;
+    hid_intf->poll_interval_us = stream_interval_us(driver_obj, hid_intf);
+    hid_intf->stream_stats.configured_hz = 1000000 / hid_intf->poll_interval_us;
+    hid_intf->capped = (driver_obj->poll_policy == POLL_POLICY_CAPPED);
+    hid_intf->next_submit_us = 0;
+    hid_intf->num_parked = 0;
+    hid_intf->last_complete_us = 0;
+    for (int i = 0; i < LATENCY_NUM_STAGES; i++) {
+        latency_hist_reset(&hid_intf->latency[i]);
+    }
+    dispatch_build(hid_intf);
+    ep_recovery_init(&hid_intf->recovery);
+    hid_intf->streaming = true;
+    //Everything the worker reads is set, hand the interface over; it sets up the filter it owns
+    intf_sync_bump(hid_intf);
+
+    for (int i = 0; i < TRANSFER_IN_FLIGHT_NUM; i++) {
+        usb_transfer_t *transfer = hid_intf->in_transfers[i];
+        if (!transfer) {
+            continue;
+        }
+        memset(transfer->data_buffer, 0x00, mps);
+        transfer->bEndpointAddress = hid_intf->ep_in.bEndpointAddress;
+        transfer->device_handle = hid_intf->dev->dev_hdl;
+        transfer->callback = stream_transfer_cb;
+        transfer->context = (void *)hid_intf;
+        transfer->timeout_ms = 1000;
+    }
+    stream_submit_all(hid_intf);
+    ESP_LOGI(TAG_CLASS, "Streaming %d/%02x, bInterval %d, %s policy, %u Hz configured",
+             hid_intf->dev->dev_addr, hid_intf->ep_in.bEndpointAddress, hid_intf->ep_in.bInterval,
+             hid_intf->capped ? "capped" : "device rate",
+             hid_intf->stream_stats.configured_hz);
+}
+
+//Canceled transfers come back through stream_transfer_cb(), action_close_wait() waits for them
+static void stream_stop(hid_intf_t *hid_intf)
+{
+    hid_intf->streaming = false;
+    intf_sync_bump(hid_intf);
+    hid_intf->num_parked = 0;
+}
+
+static output_route_t *output_route(class_driver_t *driver_obj, const hid_device_t *dev, int n)
+{
+    return &s_output_routes[dev - driver_obj->devices][n];
+}
+
+static void output_route_open(class_driver_t *driver_obj, const hid_device_t *dev, int n)
+{
+    output_route(driver_obj, dev, n)->key.store(OUTPUT_ROUTE_KEY(dev->dev_addr, dev->intfs[n].bInterfaceNumber),
+                                                std::memory_order_release);
+}
+
+//True once no writer is inside a route of the device, after output_route_close()
+static bool output_routes_idle(class_driver_t *driver_obj, const hid_device_t *dev)
+{
+    for (int n = 0; n < dev->num_intfs; n++) {
+        if (output_route(driver_obj, dev, n)->writers.load(std::memory_order_seq_cst)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void out_transfer_cb(usb_transfer_t *transfer)
+{
+    //This is function is called from within usb_host_client_handle_events(). Don't block and try to keep it short
+    hid_intf_t *hid_intf = (hid_intf_t *)transfer->context;
+    hid_device_t *dev = hid_intf->dev;
+    hid_intf->out_busy = false;
+    if (hid_intf->has_ep_out) {
+        dev->out_pending--;
+        HID_CAPTURE(HID_CAPTURE_REC_OUT, dev->dev_addr, transfer->bEndpointAddress, transfer->status,
+                    transfer->data_buffer, transfer->num_bytes, esp_timer_get_time());
+    } else {
+        dev->ctrl_pending--;
+        if (transfer->status == USB_TRANSFER_STATUS_COMPLETED) {
+            ep_rtt_update(&dev->ctrl_srtt_us, esp_timer_get_time() - dev->ctrl_submit_us);
+        }
+        capture_ctrl(dev, transfer);
+    }
+    if (transfer->status == USB_TRANSFER_STATUS_COMPLETED) {
+        hid_intf->out_sent++;
+    } else {
+        hid_intf->out_errors++;
+        HID_LOG(HID_LOG_CAT_ERROR, HID_LOG_EV_XFER_ERROR, hid_intf->dev->dev_addr, transfer->bEndpointAddress, transfer->status, NULL, 0);
+    }
+    //output_pump() sends the next report once the event handler returns
+}
+
+/**
+ * Send the next queued output report of one interface: on the interrupt
+ * OUT endpoint when it has one, otherwise as SET_REPORT(Output) on EP0.
+ */
+static void output_submit(class_driver_t *driver_obj, hid_device_t *dev, hid_intf_t *hid_intf, int64_t now)
+{
+    usb_transfer_t *transfer = hid_intf->out_transfer;
+    uint8_t report_id;
+    esp_err_t err;
+    if (hid_intf->has_ep_out) {
+        size_t len = output_queue_take(hid_intf->out_queue, transfer->data_buffer, &report_id);
+        if (len == 0) {
+            return;
+        }
+        transfer->bEndpointAddress = hid_intf->ep_out.bEndpointAddress;
+        transfer->num_bytes = len;
+        hid_intf->next_out_us = now + (hid_intf->ep_out.bInterval ? hid_intf->ep_out.bInterval : 1) * 1000;
+    } else {
+        size_t len = output_queue_take(hid_intf->out_queue, transfer->data_buffer + USB_SETUP_PACKET_SIZE, &report_id);
+        if (len == 0) {
+            return;
+        }
+        hid_class_setup(transfer->data_buffer, HID_REQ_SET_REPORT, (HID_REPORT_TYPE_OUTPUT << 8) | report_id,
+                        hid_intf->bInterfaceNumber, len);
+        transfer->bEndpointAddress = 0x00;
+        transfer->num_bytes = USB_SETUP_PACKET_SIZE + len;
+    }
+    transfer->device_handle = dev->dev_hdl;
+    transfer->callback = out_transfer_cb;
+    transfer->context = (void *)hid_intf;
+    if (hid_intf->has_ep_out) {
+        err = usb_host_transfer_submit(transfer);
+    } else {
+        dev->ctrl_submit_us = now;
+        err = usb_host_transfer_submit_control(driver_obj->client_hdl, transfer);
+    }
+    if (err != ESP_OK) {
+        hid_intf->out_errors++;
+        ESP_LOGW("", "submit output report %s", esp_err_to_name(err));
+        return;
+    }
+    hid_intf->out_busy = true;
+    hid_intf->out_submit_us = now;
+    if (hid_intf->has_ep_out) {
+        dev->out_pending++;
+    } else {
+        dev->ctrl_pending++;
+    }
+}
+
+/**
+ * Time an interrupt OUT transfer may take: the host library ignores
+ * timeout_ms, so a report the device never accepts is taken back by hand.
+ */
+static int64_t output_deadline_us(const hid_device_t *dev, const hid_intf_t *hid_intf)
+{
+    return ((int64_t)ep_timeout_ms(dev->ctrl_srtt_us) + hid_intf->ep_out.bInterval) * 1000;
+}
+
+/**
+ * Send queued output reports, one per interface at a time, interrupt OUT
+ * no faster than its bInterval and SET_REPORT only on an idle EP0. An
+ * interrupt OUT past its deadline is halted and flushed, it comes back
+ * canceled. Returns the time until the earliest held back report may go
+ * out or deadline expires, or -1 if there is none.
+ */
+static int64_t output_pump(class_driver_t *driver_obj)
+{
+    int64_t wait_us = -1;
+    int64_t now = esp_timer_get_time();
+    for (int d = 0; d < CLASS_MAX_DEVICES; d++) {
+        hid_device_t *dev = &driver_obj->devices[d];
+        if (dev->state != DEV_STATE_STREAMING) {
+            continue;
+        }
+        for (int n = 0; n < dev->num_intfs; n++) {
+            hid_intf_t *hid_intf = &dev->intfs[n];
+            uint8_t ep_addr = hid_intf->ep_out.bEndpointAddress;
+            if (!hid_intf->out_transfer) {
+                continue;
+            }
+            if (hid_intf->out_busy) {
+                if (!hid_intf->has_ep_out || hid_intf->out_flushed) {
+                    continue;
+                }
+                int64_t due_us = hid_intf->out_submit_us + output_deadline_us(dev, hid_intf) - now;
+                if (due_us <= 0) {
+                    ESP_LOGW(TAG_CLASS, "%d/%02x: output report not taken in %lld ms, flushed",
+                             dev->dev_addr, ep_addr, (long long)((now - hid_intf->out_submit_us) / 1000));
+                    ESP_ERROR_CHECK_WITHOUT_ABORT(usb_host_endpoint_halt(dev->dev_hdl, ep_addr));
+                    ESP_ERROR_CHECK_WITHOUT_ABORT(usb_host_endpoint_flush(dev->dev_hdl, ep_addr));
+                    hid_intf->out_flushed = true;
+                } else if (wait_us < 0 || due_us < wait_us) {
+                    wait_us = due_us;
+                }
+                continue;
+            }
+            if (hid_intf->out_flushed) {
+                ESP_ERROR_CHECK_WITHOUT_ABORT(usb_host_endpoint_clear(dev->dev_hdl, ep_addr));
+                hid_intf->out_flushed = false;
+            }
+            if (!output_queue_pending(hid_intf->out_queue) || (!hid_intf->has_ep_out && dev->ctrl_pending > 0)) {
+                //A busy EP0 wakes the task when its request is back
+                continue;
+            }
+            int64_t due_us = hid_intf->has_ep_out ? hid_intf->next_out_us - now : 0;
+            if (due_us > 0) {
+                if (wait_us < 0 || due_us < wait_us) {
+                    wait_us = due_us;
+                }
+                continue;
+            }
+            output_submit(driver_obj, dev, hid_intf, now);
+        }
+    }
+    return wait_us;
+}
+
+static void stream_stats_print(const hid_device_t *dev)
+{
+    int64_t now = esp_timer_get_time();
+    uint32_t dev_rate = 0;
+    uint32_t dev_missed = 0;
+    for (int n = 0; n < dev->num_intfs; n++) {
+        const hid_intf_t *hid_intf = &dev->intfs[n];
+        const stream_stats_t *stats = &hid_intf->stream_stats;
+        int64_t elapsed_us = now - stats->start_us;
+        if (!hid_intf->has_ep_in || stats->start_us == 0 || elapsed_us <= 0) {
+            continue;
+        }
+        uint32_t rate = (uint32_t)((int64_t)stats->reports * 1000000 / elapsed_us);
+        dev_rate += rate;
+        dev_missed += stats->missed;
+        ESP_LOGI(TAG_CLASS, "%d/%02x: %u reports, %u/%u reports/s achieved/configured, %u B/s, missed %u, errors %u, in flight %d",
+                 dev->dev_addr, hid_intf->ep_in.bEndpointAddress,
+                 stats->reports,
+                 rate,
+                 stats->configured_hz,
+                 (uint32_t)((int64_t)stats->bytes * 1000000 / elapsed_us),
+                 stats->missed, stats->errors, hid_intf->in_flight);
+        ESP_LOGI(TAG_CLASS, "%d/%02x: report ring depth %u, high water %u/%d, dropped %u, truncated %u, unsubscribed %u",
+                 dev->dev_addr, hid_intf->ep_in.bEndpointAddress,
+                 report_ring_depth(hid_intf->ring), hid_intf->ring->high_water.load(), REPORT_RING_NUM_SLOTS,
+                 hid_intf->ring->dropped.load(), hid_intf->ring->truncated.load(), stats->unsubscribed);
+        if (REPORT_FILTER_ENABLED) {
+            ESP_LOGI(TAG_CLASS, "%d/%02x: forwarded %u, suppressed %u unchanged (%u within deadband)",
+                     dev->dev_addr, hid_intf->ep_in.bEndpointAddress,
+                     hid_intf->filter.forwarded, hid_intf->filter.suppressed, hid_intf->filter.deadbanded);
+        }
+        if (REPORT_SINKS_ENABLED && s_report_sinks.active.load(std::memory_order_relaxed)) {
+            ESP_LOGI(TAG_CLASS, "%d/%02x: %d transfers lent to sinks, %u reports not lent",
+                     dev->dev_addr, hid_intf->ep_in.bEndpointAddress, __builtin_popcount(hid_intf->lent_mask), stats->unlent);
+        }
+        const ep_recovery_t *rec = &hid_intf->recovery;
+        if (rec->recoveries || rec->failures || ep_recovery_active(rec)) {
+            static const char *health_names[] = { "ok", "recovering", "failed" };
+            ESP_LOGI(TAG_CLASS, "%d/%02x: %s, %u recovered, %u given up, errors %u/%u/%u stall/error/timeout",
+                     dev->dev_addr, hid_intf->ep_in.bEndpointAddress, health_names[rec->health],
+                     rec->recoveries, rec->failures, rec->errors[USB_TRANSFER_STATUS_STALL],
+                     rec->errors[USB_TRANSFER_STATUS_ERROR], rec->errors[USB_TRANSFER_STATUS_TIMED_OUT]);
+        }
+    }
+    for (int n = 0; n < dev->num_intfs; n++) {
+        const hid_intf_t *hid_intf = &dev->intfs[n];
+        const output_queue_t *queue = hid_intf->out_queue;
+        if (!hid_intf->out_transfer || queue->writes.load() == 0) {
+            continue;
+        }
+        ESP_LOGI(TAG_CLASS, "%d intf 0x%02x: output %u written, %u sent over %s, %u coalesced, %u rejected, %u errors, max depth %u",
+                 dev->dev_addr, hid_intf->bInterfaceNumber, queue->writes.load(), hid_intf->out_sent,
+                 hid_intf->has_ep_out ? "interrupt OUT" : "SET_REPORT", queue->coalesced, queue->rejected.load(),
+                 hid_intf->out_errors, queue->max_depth);
+    }
+    ESP_LOGI(TAG_CLASS, "device %d: %u reports/s over %d interfaces, missed %u", dev->dev_addr, dev_rate, dev->num_intfs, dev_missed);
+}
+
+static void ttfr_record(class_driver_t *driver_obj, hid_device_t *dev)
+{
+    latency_hist_t *hist = &driver_obj->ttfr[dev->cached ? TTFR_CACHED : TTFR_UNCACHED];
+    int64_t ttfr_us = dev->first_report_us - dev->attach_us;
+    latency_hist_record(hist, ttfr_us);
+    dev->first_report_logged = true;
+    ESP_LOGI(TAG_CLASS, "device %d: first report %u us after attach (%s), mean %u us over %u %s attaches",
+             dev->dev_addr, (uint32_t)ttfr_us, dev->cached ? "cached" : "uncached",
+             (uint32_t)(hist->sum_us / hist->count), hist->count, dev->cached ? "cached" : "uncached");
+
+    //Same identity closed earlier without the client going away: a replug
+    for (int i = 0; i < CLASS_MAX_DEVICES; i++) {
+        recent_gone_t *gone = &driver_obj->recent_gone[i];
+        if (gone->gone_us == 0 || strcmp(gone->cache_key, dev->cache_key) != 0) {
+            continue;
+        }
+        latency_hist_record(&driver_obj->reconnect, ttfr_us);
+        ESP_LOGI(TAG_CLASS, "device %d: reconnected %u ms after removal, attach to first report %u us, mean %u us over %u reconnects",
+                 dev->dev_addr, (uint32_t)((dev->attach_us - gone->gone_us) / 1000), (uint32_t)ttfr_us,
+                 (uint32_t)(driver_obj->reconnect.sum_us / driver_obj->reconnect.count), driver_obj->reconnect.count);
+        gone->gone_us = 0;
+        break;
+    }
+}
+
+static dev_state_t action_transfer(class_driver_t *driver_obj, hid_device_t *dev)
+{
+    assert(dev->dev_hdl != NULL);
+    for (int n = 0; n < dev->num_intfs; n++) {
+        hid_intf_t *hid_intf = &dev->intfs[n];
+        if (hid_intf->out_transfer) {
+            //No writer is inside, the last close of the slot waited for them
+            output_queue_init(hid_intf->out_queue);
+            output_route_open(driver_obj, dev, n);
+        }
+        if (hid_intf->has_ep_in && !hid_intf->streaming) {
+            stream_start(driver_obj, hid_intf);
+        }
+    }
+    return DEV_STATE_STREAMING;
+}
+
+//Share of the last stats period each pipeline stage spent busy
+static void utilization_print(class_driver_t *driver_obj, int64_t now)
+{
+    int64_t period_us = now - driver_obj->print_us;
+    if (period_us <= 0) {
+        return;
+    }
+    char line[96];
+    int len = snprintf(line, sizeof(line), "class driver %u.%u%%",
+                       (uint32_t)(driver_obj->busy_us * 100 / period_us), (uint32_t)(driver_obj->busy_us * 1000 / period_us % 10));
+    for (int w = 0; w < s_num_report_workers && len < (int)sizeof(line); w++) {
+        report_worker_t *worker = &s_report_workers[w];
+        uint32_t busy_us = worker->busy_us.exchange(0, std::memory_order_relaxed);
+        uint32_t reports = worker->reports.exchange(0, std::memory_order_relaxed);
+        len += snprintf(line + len, sizeof(line) - len, ", worker %d %u.%u%% (%u reports)", w,
+                        (uint32_t)(busy_us * 100ll / period_us), (uint32_t)(busy_us * 1000ll / period_us % 10), reports);
+    }
+    ESP_LOGI(TAG_CLASS, "utilization: %s", line);
+}
+
+static void sink_stats_print(void)
+{
+    uint8_t active = s_report_sinks.active.load(std::memory_order_relaxed);
+    for (int i = 0; i < REPORT_SINK_MAX; i++) {
+        const report_sink_slot_t *slot = &s_report_sinks.slots[i];
+        if (!(active & (1u << i))) {
+            continue;
+        }
+        uint32_t lent = slot->lent.load(std::memory_order_relaxed);
+        uint32_t batches = slot->batches.load(std::memory_order_relaxed);
+        ESP_LOGI(TAG_CLASS, "sink %s: %u reports lent in %u writes (%u.%u per write), %u missed on a full queue",
+                 slot->sink.name, lent, batches, batches ? lent / batches : 0, batches ? lent * 10 / batches % 10 : 0,
+                 slot->full.load(std::memory_order_relaxed));
+    }
+}
+
+/**
+ * Run the streaming timers: transfers back from the sinks, parked capped transfers, output reports, first report
+ * bookkeeping and the periodic stats printout. Completed transfers are
+ * resubmitted from stream_transfer_cb(), so nothing else needs polling.
+ * Returns how long the task may sleep before the next timer is due.
+ */
+static TickType_t stream_timers(class_driver_t *driver_obj)
+{
+    for (int d = 0; REPORT_SINKS_ENABLED && d < CLASS_MAX_DEVICES; d++) {
+        hid_device_t *dev = &driver_obj->devices[d];
+        for (int n = 0; n < dev->num_intfs; n++) {
+            if (dev->intfs[n].lent_mask) {
+                sink_reclaim(&dev->intfs[n]);
+            }
+        }
+    }
+    int64_t wait_us = stream_submit_parked(driver_obj);
+    int64_t out_wait_us = output_pump(driver_obj);
+    if (out_wait_us >= 0 && (wait_us < 0 || out_wait_us < wait_us)) {
+        wait_us = out_wait_us;
+    }
+    int64_t recover_wait_us = stream_recover(driver_obj);
+    if (recover_wait_us >= 0 && (wait_us < 0 || recover_wait_us < wait_us)) {
+        wait_us = recover_wait_us;
+    }
+
+    for (int d = 0; d < CLASS_MAX_DEVICES; d++) {
+        hid_device_t *dev = &driver_obj->devices[d];
+        if (dev->first_report_us && !dev->first_report_logged) {
+            ttfr_record(driver_obj, dev);
+        }
+    }
+
+    int64_t now = esp_timer_get_time();
+    if (now - driver_obj->print_us >= STREAM_STATS_PERIOD_MS * 1000) {
+        for (int d = 0; d < CLASS_MAX_DEVICES; d++) {
+            if (driver_obj->devices[d].state == DEV_STATE_STREAMING) {
+                stream_stats_print(&driver_obj->devices[d]);
+            }
+        }
+        if (driver_obj->reports) {
+            ESP_LOGI(TAG_CLASS, "class driver: %u ns busy and %u wakeups per 100 reports, over %u reports",
+                     (uint32_t)(driver_obj->busy_us * 1000 / driver_obj->reports),
+                     driver_obj->wakeups * 100 / driver_obj->reports, driver_obj->reports);
+        }
+        utilization_print(driver_obj, now);
+        sink_stats_print();
+        driver_obj->busy_us = 0;
+        driver_obj->wakeups = 0;
+        driver_obj->reports = 0;
+        driver_obj->print_us = now = esp_timer_get_time();
+    }
+
+    int64_t print_wait_us = driver_obj->print_us + STREAM_STATS_PERIOD_MS * 1000 - now;
+    if (wait_us < 0 || print_wait_us < wait_us) {
+        wait_us = print_wait_us;
+    }
+    return pdMS_TO_TICKS((wait_us + 999) / 1000);
+}
+
+static void latency_print(const hid_device_t *dev)
+{
+    char name[32];
+    for (int n = 0; n < dev->num_intfs; n++) {
+        const hid_intf_t *hid_intf = &dev->intfs[n];
+        if (!hid_intf->has_ep_in) {
+            continue;
+        }
+        for (int i = 0; i < LATENCY_NUM_STAGES; i++) {
+            snprintf(name, sizeof(name), "%d/%02x %s", dev->dev_addr, hid_intf->ep_in.bEndpointAddress, s_latency_stage_names[i]);
+            latency_hist_print(name, &hid_intf->latency[i]);
+        }
+    }
+}
+
+/**
+ * Take every endpoint of the device back. Whatever was in flight comes
+ * back canceled through the client event handler, action_close_wait()
+ * finishes the close once it has.
+ */
+static dev_state_t aciton_close_dev(class_driver_t *driver_obj, hid_device_t *dev)
+{
+    stream_stats_print(dev);
+    latency_print(dev);
+
+    //The device is usually unplugged already, a failed halt must not keep the slot from being freed
+    for (int n = 0; n < dev->num_intfs; n++) {
+        hid_intf_t *hid_intf = &dev->intfs[n];
+        const usb_ep_desc_t *eps[2] = {
+            hid_intf->has_ep_in ? &hid_intf->ep_in : nullptr,
+            hid_intf->has_ep_out ? &hid_intf->ep_out : nullptr,
+        };
+        for (int i = 0; i < 2; i++) {
+            const usb_ep_desc_t *ep = eps[i];
+            if (ep) {
+                printf("\t > Halting EP address: 0x%02x, EP max size: %d, dir: %s\n", ep->bEndpointAddress, ep->wMaxPacketSize, (ep->bEndpointAddress & 0x80) ? "IN" : "OUT");
+                ESP_ERROR_CHECK_WITHOUT_ABORT(usb_host_endpoint_halt(dev->dev_hdl, ep->bEndpointAddress));
+                ESP_ERROR_CHECK_WITHOUT_ABORT(usb_host_endpoint_flush(dev->dev_hdl, ep->bEndpointAddress));
+            }
+        }
+        stream_stop(hid_intf);
+        //Writers that got in before this wake the task once out, action_close_wait() waits for them
+        output_route(driver_obj, dev, n)->key.store(0, std::memory_order_seq_cst);
+    }
+    return DEV_STATE_CLOSE_WAIT;
+}
+
+//True while the host library still holds a transfer of the device, queued control requests and output reports included
+static bool dev_transfers_pending(const hid_device_t *dev)
+{
+    for (int n = 0; n < dev->num_intfs; n++) {
+        if (dev->intfs[n].in_flight > 0) {
+            return true;
+        }
+    }
+    return dev->ctrl_pending > 0 || dev->out_pending > 0;
+}
+
+//Release the interfaces, give the transfers back and close the device, nothing may be in flight
+static void dev_close(class_driver_t *driver_obj, hid_device_t *dev)
+{
+    for (int n = 0; n < dev->num_intfs; n++) {
+        hid_intf_t *hid_intf = &dev->intfs[n];
+        printf("\nReleasing HID intf->bInterfaceNumber: 0x%02x \n", hid_intf->bInterfaceNumber);
+        ESP_ERROR_CHECK_WITHOUT_ABORT(usb_host_interface_release(driver_obj->client_hdl, dev->dev_hdl, hid_intf->bInterfaceNumber));
+    }
+    return_transfers(driver_obj, dev);
+    transfer_pool_print(&driver_obj->transfer_pool);
+
+    ESP_ERROR_CHECK(usb_host_device_close(driver_obj->client_hdl, dev->dev_hdl));
+    dev->dev_hdl = NULL;
+    HID_CAPTURE(HID_CAPTURE_REC_DETACH, dev->dev_addr, 0x00, USB_TRANSFER_STATUS_NO_DEVICE, NULL, 0, esp_timer_get_time());
+
+    //Remembered so a replug of the same device is reported as a reconnect
+    recent_gone_t *gone = &driver_obj->recent_gone[driver_obj->recent_gone_next++ % CLASS_MAX_DEVICES];
+    memcpy(gone->cache_key, dev->cache_key, HID_CACHE_KEY_LEN);
+    gone->gone_us = esp_timer_get_time();
+}
+
+/**
+ * Close the device once every transfer is back, and free the slot once
+ * the worker and output writers are out of its interfaces too; the slot
+ * is memset then. Each completion, worker ack and writer leaving wakes the
+ * task, which steps this again.
+ */
+static dev_state_t action_close_wait(class_driver_t *driver_obj, hid_device_t *dev)
+{
+    if (dev_transfers_pending(dev)) {
+        return DEV_STATE_NONE;
+    }
+    if (dev->dev_hdl) {
+        dev_close(driver_obj, dev);
+    }
+    return (intf_sync_done(dev) && output_routes_idle(driver_obj, dev)) ? DEV_STATE_FREE : DEV_STATE_NONE;
+}
+
+typedef struct {
+    const char *name;
+    dev_state_t (*action)(class_driver_t *driver_obj, hid_device_t *dev);  //Run on DEV_EVENT_STEP
+    dev_state_t on_attach;
+    dev_state_t on_gone;
+} dev_state_desc_t;
+
+//Indexed by dev_state_t
+static const dev_state_desc_t s_dev_states[DEV_STATE_NUM] = {
+    { "free",               NULL,                       DEV_STATE_OPEN, DEV_STATE_NONE },
+    { "open",               action_open_dev,            DEV_STATE_NONE, DEV_STATE_NONE },
+    { "get dev info",       action_get_info,            DEV_STATE_NONE, DEV_STATE_CLOSE },
+    { "get dev desc",       action_get_dev_desc,        DEV_STATE_NONE, DEV_STATE_CLOSE },
+    { "get config desc",    action_get_config_desc,     DEV_STATE_NONE, DEV_STATE_CLOSE },
+    { "get str desc",       action_get_str_desc,        DEV_STATE_NONE, DEV_STATE_CLOSE },
+    { "claim intf",         action_claim_interface,     DEV_STATE_NONE, DEV_STATE_CLOSE },
+    { "transfer control",   action_transfer_control,    DEV_STATE_NONE, DEV_STATE_CLOSE },
+    { "control wait",       action_control_done,        DEV_STATE_NONE, DEV_STATE_CLOSE },
+    { "class requests",     action_class_requests,      DEV_STATE_NONE, DEV_STATE_CLOSE },
+    { "class wait",         action_class_done,          DEV_STATE_NONE, DEV_STATE_CLOSE },
+    { "transfer",           action_transfer,            DEV_STATE_NONE, DEV_STATE_CLOSE },
+    { "streaming",          NULL,                       DEV_STATE_NONE, DEV_STATE_CLOSE },
+    { "idle",               NULL,                       DEV_STATE_NONE, DEV_STATE_CLOSE },
+    { "close",              aciton_close_dev,           DEV_STATE_NONE, DEV_STATE_NONE },
+    { "close wait",         action_close_wait,          DEV_STATE_NONE, DEV_STATE_NONE },
+};
+
+/**
+ * Feed one event to a device. States with an action queue a step for
+ * themselves on entry, so each action runs once per pass over the queue
+ * and a long enumeration cannot hold up another device's events.
+ * Returns true if the device slot was freed.
+ */
+static bool dev_dispatch(class_driver_t *driver_obj, hid_device_t *dev, const dev_event_t *event)
+{
+    const dev_state_desc_t *desc = &s_dev_states[dev->state];
+    dev_state_t next = DEV_STATE_NONE;
+    switch (event->type) {
+        case DEV_EVENT_ATTACH:
+            next = desc->on_attach;
+            break;
+        case DEV_EVENT_GONE:
+            next = desc->on_gone;
+            break;
+        case DEV_EVENT_STEP:
+            if (desc->action && event->state == dev->state) {
+                next = desc->action(driver_obj, dev);
+            }
+            break;
+    }
+    if (next == DEV_STATE_NONE) {
+        return false;
+    }
+    ESP_LOGD(TAG_CLASS, "device %d: %s -> %s", dev->dev_addr, desc->name, s_dev_states[next].name);
+    dev->state = next;
+    if (next == DEV_STATE_FREE) {
+        memset(dev, 0, sizeof(hid_device_t));
+        return true;
+    }
+    if (s_dev_states[next].action) {
+        event_post(driver_obj, dev, DEV_EVENT_STEP);
+    }
+    return false;
+}
+
+void usb_class_driver_task(void *arg)
+{
+    SemaphoreHandle_t signaling_sem = (SemaphoreHandle_t)arg;
+    //Static, the per-device tables are too large for the task stack
+    class_driver_t &driver_obj = s_driver_obj;
+    memset(&driver_obj, 0, sizeof(class_driver_t));
+    for (int d = 0; d < CLASS_MAX_DEVICES; d++) {
+        for (int n = 0; n < CLASS_MAX_INTERFACES; n++) {
+            s_output_routes[d][n].key.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    //Wait until daemon task has installed USB Host Library
+    xSemaphoreTake(signaling_sem, portMAX_DELAY);
+
+    ESP_LOGI(TAG_CLASS, "Registering Client");
+    usb_host_client_config_t client_config = {
+        .is_synchronous = false,    //Synchronous clients currently not supported. Set this to false
+        .max_num_event_msg = CLIENT_NUM_EVENT_MSG,
+        .async = {
+            .client_event_callback = client_event_cb,
+            .callback_arg = (void *)&driver_obj,
+        },
+    };
+    ESP_ERROR_CHECK(usb_host_client_register(&client_config, &driver_obj.client_hdl));
+
+    driver_obj.poll_policy = POLL_POLICY;
+    driver_obj.poll_cap_hz = POLL_CAP_HZ;
+    driver_obj.cache_ready = ENUM_CACHE_ENABLED && hid_cache_init();
+
+    while (1) {
+        //Handle everything queued, then sleep until a USB event or the next stream timer
+        int64_t start_us = busy_clock_us();
+        dev_event_t event;
+        bool freed = false;
+        if (REPORT_SINKS_ENABLED && driver_obj.transfer_pool.num_orphans) {
+            //Transfers of closed devices the sinks have let go of since
+            transfer_pool_reclaim(&driver_obj.transfer_pool);
+        }
+        for (int d = 0; d < CLASS_MAX_DEVICES; d++) {
+            if (driver_obj.devices[d].state == DEV_STATE_CLOSE_WAIT) {
+                //Completions and the worker's ack unblock the client, retry then
+                event_post(&driver_obj, &driver_obj.devices[d], DEV_EVENT_STEP);
+            }
+        }
+        while (event_pop(&driver_obj, &event)) {
+            hid_device_t *dev = &driver_obj.devices[event.dev_index];
+            freed |= dev_dispatch(&driver_obj, dev, &event);
+        }
+        bool streaming = false;
+        bool idle = freed;
+        for (int d = 0; d < CLASS_MAX_DEVICES; d++) {
+            streaming |= (driver_obj.devices[d].state == DEV_STATE_STREAMING);
+            idle &= (driver_obj.devices[d].state == DEV_STATE_FREE);
+        }
+        if (idle && CLASS_EXIT_WHEN_IDLE) {
+            break;
+        }
+        if (idle) {
+            //Stay registered, the next NEW_DEV is enumerated as soon as it arrives
+            ESP_LOGI(TAG_CLASS, "All devices gone, waiting for the next one");
+        }
+        dispatch_refresh(&driver_obj);
+        if (REPORT_SINKS_ENABLED && report_sink_sync(&s_report_sinks) && s_report_sink_task) {
+            //Removed sinks get nothing more, their slots can be freed
+            xTaskNotifyGive(s_report_sink_task);
+        }
+        TickType_t timeout = streaming ? stream_timers(&driver_obj) : portMAX_DELAY;
+        driver_obj.busy_us += busy_clock_us() - start_us;
+        usb_host_client_handle_events(driver_obj.client_hdl, timeout);
+        driver_obj.wakeups++;
+    }
+
+    transfer_pool_deinit(&driver_obj.transfer_pool);
+
+    ESP_LOGI(TAG_CLASS, "Deregistering Client");
     ESP_ERROR_CHECK(usb_host_client_deregister(driver_obj.client_hdl));
 
     //Wait to be deleted
     xSemaphoreGive(signaling_sem);
     vTaskSuspend(NULL);
 }
+
+static void consume_report(const report_slot_t *slot, void *arg)
+{
+    hid_intf_t *hid_intf = (hid_intf_t *)arg;
+    if (slot->dev_addr != hid_intf->dev->dev_addr || slot->timestamp_us < hid_intf->dev->attach_us) {
+        //Left over from a device that used this slot before, possibly at the same address
+        return;
+    }
+    latency_hist_record(&hid_intf->latency[LATENCY_COMPLETE_TO_DEQUEUE], esp_timer_get_time() - slot->timestamp_us);
+    report_delta_t delta;
+    if (REPORT_FILTER_ENABLED && !report_filter_apply(&hid_intf->filter, slot->data, slot->len, &delta)) {
+        //Nothing downstream would see a difference
+        return;
+    }
+    print_in_report(slot);
+    if (REPORT_FILTER_ENABLED) {
+        print_report_delta(hid_intf, &delta);
+    }
+    bool decoded;
+    switch (hid_intf->boot_protocol) {
+        case HID_BOOT_PROTOCOL_KEYBOARD:
+            decoded = hid_boot_keyboard_decode(slot->data, slot->len, &hid_intf->report_values);
+            break;
+        case HID_BOOT_PROTOCOL_MOUSE:
+            decoded = hid_boot_mouse_decode(slot->data, slot->len, &hid_intf->report_values);
+            break;
+        default:
+            //A report the specialized decoder does not expect still gets the generic one
+            decoded = (hid_intf->static_decode && hid_intf->static_decode(slot->data, slot->len, &hid_intf->report_values)) ||
+                      hid_decode_report(&hid_intf->report_layout, slot->data, slot->len, &hid_intf->report_values);
+            break;
+    }
+    if (decoded) {
+        hid_device_t *dev = hid_intf->dev;
+        state_snapshot_publish(&s_state_snapshots[dev - s_driver_obj.devices], dev->dev_addr, dev->attach_us,
+                               dev->num_intfs, hid_intf - dev->intfs, &hid_intf->report_values, slot->timestamp_us);
+        print_decoded_report(hid_intf);
+    }
+
+    uint8_t report_id = intf_report_id(hid_intf, slot->data, slot->len);
+    uint16_t subs = report_dispatch_lookup(hid_intf->dispatch, &s_report_subs, report_id);
+    if (subs) {
+        hid_report_event_t event = {
+            .dev_addr = slot->dev_addr,
+            .bInterfaceNumber = hid_intf->bInterfaceNumber,
+            .report_id = report_id,
+            .len = slot->len,
+            .data = slot->data,
+            .timestamp_us = slot->timestamp_us,
+            .values = decoded ? &hid_intf->report_values : NULL,
+        };
+        for (int i = 0; i < REPORT_SUB_MAX; i++) {
+            if (subs & (1u << i)) {
+                s_report_subs.subs[i].cb(&event, s_report_subs.subs[i].arg);
+            }
+        }
+    }
+}
+
+static hid_intf_t *replay_find_intf(hid_device_t *dev, uint8_t bInterfaceNumber, uint8_t ep_addr)
+{
+    for (int n = 0; dev && n < dev->num_intfs; n++) {
+        hid_intf_t *hid_intf = &dev->intfs[n];
+        if (ep_addr ? (hid_intf->has_ep_in && hid_intf->ep_in.bEndpointAddress == ep_addr) :
+                      (hid_intf->bInterfaceNumber == bInterfaceNumber)) {
+            return hid_intf;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Set a device slot up from its captured configuration descriptor, as
+ * action_claim_interface() does, minus the host library.
+ */
+static void replay_claim(hid_device_t *dev, const uint8_t *config, uint16_t len)
+{
+    int d = dev - s_driver_obj.devices;
+    dev->num_intfs = 0;
+    if (!desc_index_build(config, len, &dev->desc_index)) {
+        return;
+    }
+    const desc_index_t *index = &dev->desc_index;
+    for (int n = 0; n < index->num_intfs && dev->num_intfs < CLASS_MAX_INTERFACES; n++) {
+        const desc_index_intf_t *intf = &index->intfs[n];
+        if (intf->bAlternateSetting != 0 || intf->bInterfaceClass != 0x03) {
+            continue;
+        }
+        hid_intf_t *hid_intf = &dev->intfs[dev->num_intfs];
+        memset(hid_intf, 0, sizeof(hid_intf_t));
+        hid_intf->dev = dev;
+        hid_intf->bInterfaceNumber = intf->bInterfaceNumber;
+        hid_intf->bInterfaceSubClass = intf->bInterfaceSubClass;
+        hid_intf->bInterfaceProtocol = intf->bInterfaceProtocol;
+        hid_intf->report_desc_len = intf->report_desc_len;
+        hid_intf->ring = &s_report_rings[d][dev->num_intfs];
+        hid_intf->leases = &s_sink_leases[d][dev->num_intfs];
+        hid_intf->sync = &s_intf_syncs[d][dev->num_intfs];
+        hid_intf->dispatch = &s_report_dispatches[d][dev->num_intfs];
+        hid_intf->worker = &s_report_workers[d % s_num_report_workers];
+        report_ring_init(hid_intf->ring);
+        for (int i = 0; i < intf->num_eps; i++) {
+            const desc_index_ep_t *ep = &index->eps[intf->first_ep + i];
+            if ((ep->bmAttributes & USB_BM_ATTRIBUTES_XFERTYPE_MASK) != USB_TRANSFER_TYPE_INTR) {
+                continue;
+            }
+            const usb_ep_desc_t *ep_desc = (const usb_ep_desc_t *)(config + ep->offset);
+            if (ep->bEndpointAddress & 0x80) {
+                hid_intf->ep_in = *ep_desc;
+                hid_intf->has_ep_in = true;
+            } else {
+                hid_intf->ep_out = *ep_desc;
+                hid_intf->has_ep_out = true;
+            }
+        }
+        dev->num_intfs++;
+    }
+    static_decoders_attach(dev);
+}
+
+//Report descriptors and SET_PROTOCOL(boot) decide how the reports that follow decode
+static void replay_control(hid_device_t *dev, const hid_capture_rec_t *rec, const uint8_t *data)
+{
+    if (rec->len < USB_SETUP_PACKET_SIZE || rec->status != USB_TRANSFER_STATUS_COMPLETED) {
+        return;
+    }
+    hid_intf_t *hid_intf = replay_find_intf(dev, data[4], 0);
+    if (hid_intf == NULL) {
+        return;
+    }
+    uint16_t wValue = data[2] | (data[3] << 8);
+    if (data[0] == (USB_BM_REQUEST_TYPE_DIR_IN | USB_BM_REQUEST_TYPE_TYPE_STANDARD | USB_BM_REQUEST_TYPE_RECIP_INTERFACE) &&
+        data[1] == USB_B_REQUEST_GET_DESCRIPTOR && (wValue >> 8) == 0x22) {
+        if (!hid_report_layout_compile(data + USB_SETUP_PACKET_SIZE, rec->len - USB_SETUP_PACKET_SIZE, &hid_intf->report_layout)) {
+            memset(&hid_intf->report_layout, 0, sizeof(hid_report_layout_t));
+        }
+    } else if (data[0] == 0x21 && data[1] == HID_REQ_SET_PROTOCOL && wValue == HID_PROTOCOL_BOOT) {
+        hid_intf->boot_protocol = hid_intf->bInterfaceProtocol;
+    }
+}
+
+//Sleep the remainder in whole ticks, rounded up: never early, at most a tick late, and due_us is absolute so it does not add up
+static void replay_wait(int64_t due_us)
+{
+    int64_t wait_us = due_us - esp_timer_get_time();
+    if (wait_us > 0) {
+        int64_t tick_us = portTICK_PERIOD_MS * 1000;
+        vTaskDelay((TickType_t)((wait_us + tick_us - 1) / tick_us));
+    }
+}
+
+/**
+ * Set how many usb_report_consumer_task() workers share the devices. Call
+ * before any worker or the class driver starts.
+ */
+void usb_class_driver_set_report_workers(uint8_t num_workers)
+{
+    s_num_report_workers = (num_workers < 1) ? 1 : (num_workers > REPORT_WORKERS_MAX) ? REPORT_WORKERS_MAX : num_workers;
+}
+
+/**
+ * Drain reports published by the class driver, taking at most
+ * REPORT_DRAIN_BATCH from each endpoint per round so a chatty device cannot
+ * starve the others. arg is the worker index; each worker owns whole
+ * devices, so rings keep a single consumer and state snapshots a single
+ * writer. Runs at a lower priority than usb_class_driver_task(), or on the
+ * other core, so report handling never holds up the USB event path.
+ */
+void usb_report_consumer_task(void *arg)
+{
+    int w = (int)(intptr_t)arg;
+    report_worker_t *worker = &s_report_workers[w];
+    for (int d = w; d < CLASS_MAX_DEVICES; d += s_num_report_workers) {
+        for (int n = 0; n < CLASS_MAX_INTERFACES; n++) {
+            report_ring_init(&s_report_rings[d][n]);
+            s_intf_syncs[d][n].generation.store(0, std::memory_order_relaxed);
+            s_intf_syncs[d][n].acked.store(0, std::memory_order_relaxed);
+        }
+        state_snapshot_init(&s_state_snapshots[d]);
+    }
+    worker->task = xTaskGetCurrentTaskHandle();
+
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(STREAM_STATS_PERIOD_MS));
+        int64_t start_us = busy_clock_us();
+        uint32_t total = 0;
+        size_t drained = 1;
+        while (drained > 0) {
+            drained = 0;
+            for (int d = w; d < CLASS_MAX_DEVICES; d += s_num_report_workers) {
+                //Not dev->num_intfs, the class driver changes it while claiming
+                for (int n = 0; n < CLASS_MAX_INTERFACES; n++) {
+                    hid_intf_t *hid_intf = &s_driver_obj.devices[d].intfs[n];
+                    intf_sync_t *sync = &s_intf_syncs[d][n];
+                    uint32_t generation = sync->generation.load(std::memory_order_acquire);
+                    if (generation != sync->acked.load(std::memory_order_relaxed)) {
+                        if (generation & 1) {
+                            filter_init(hid_intf);
+                        }
+                        sync->acked.store(generation, std::memory_order_release);
+                        if (!(generation & 1) && s_driver_obj.client_hdl) {
+                            //The class driver waits for this to free the device
+                            usb_host_client_unblock(s_driver_obj.client_hdl);
+                        }
+                    }
+                    if (generation & 1) {
+                        drained += report_ring_drain(hid_intf->ring, consume_report, (void *)hid_intf, REPORT_DRAIN_BATCH);
+                    }
+                }
+            }
+            total += drained;
+        }
+        if (total) {
+            worker->busy_us.fetch_add((uint32_t)(busy_clock_us() - start_us), std::memory_order_relaxed);
+            worker->reports.fetch_add(total, std::memory_order_relaxed);
+        }
+    }
+}
+
+/**
+ * Latency histogram of one IN endpoint, or NULL if no such endpoint is streaming.
+ * Safe to read from any task; counts may be a sample apart from each other.
+ */
+const latency_hist_t *usb_class_driver_get_latency(uint8_t dev_addr, uint8_t ep_addr, latency_stage_t stage)
+{
+    for (int d = 0; d < CLASS_MAX_DEVICES; d++) {
+        const hid_device_t *dev = &s_driver_obj.devices[d];
+        for (int n = 0; dev->dev_addr == dev_addr && n < dev->num_intfs; n++) {
+            const hid_intf_t *hid_intf = &dev->intfs[n];
+            if (hid_intf->has_ep_in && hid_intf->ep_in.bEndpointAddress == ep_addr && stage < LATENCY_NUM_STAGES) {
+                return &hid_intf->latency[stage];
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Print the latency histograms of every streaming endpoint, and the time
+ * endpoint error recovery took.
+ */
+void usb_class_driver_dump_latency(void)
+{
+    for (int d = 0; d < CLASS_MAX_DEVICES; d++) {
+        if (s_driver_obj.devices[d].dev_addr != 0) {
+            latency_print(&s_driver_obj.devices[d]);
+        }
+    }
+    if (s_driver_obj.recover.count) {
+        latency_hist_print("recover", &s_driver_obj.recover);
+    }
+}
+
+/**
+ * Copy the latest decoded state of the device at dev_addr into state.
+ * Lock-free and safe from any task at any rate; compare state->seq between
+ * calls to count missed updates. Returns false if the device has decoded
+ * no report since it attached, or the copy kept overlapping a write.
+ */
+bool usb_class_driver_read_state(uint8_t dev_addr, hid_state_t *state)
+{
+    for (int d = 0; d < CLASS_MAX_DEVICES; d++) {
+        const hid_device_t *dev = &s_driver_obj.devices[d];
+        if (dev->dev_addr != dev_addr) {
+            continue;
+        }
+        return state_snapshot_read(&s_state_snapshots[d], state) &&
+               state->seq > 0 && state->dev_addr == dev_addr && state->attach_us == dev->attach_us;
+    }
+    return false;
+}
+
+/**
+ * Queue an output report (rumble, LEDs, ...) for interface bInterfaceNumber
+ * of a streaming device; data excludes the report ID byte, which is added
+ * when report_id is not 0. A report still queued under the same report ID
+ * is replaced, so only the latest value goes out. Safe from any task, only
+ * the output routes are read, never the device slots.
+ */
+esp_err_t usb_class_driver_write_output(uint8_t dev_addr, uint8_t bInterfaceNumber, uint8_t report_id,
+                                        const uint8_t *data, size_t len)
+{
+    size_t report_len = len + (report_id ? 1 : 0);
+    if (report_len == 0 || report_len > OUTPUT_REPORT_MAX_BYTES) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    uint32_t key = OUTPUT_ROUTE_KEY(dev_addr, bInterfaceNumber);
+    for (int d = 0; d < CLASS_MAX_DEVICES; d++) {
+        for (int n = 0; n < CLASS_MAX_INTERFACES; n++) {
+            output_route_t *route = &s_output_routes[d][n];
+            if (route->key.load(std::memory_order_acquire) != key) {
+                continue;
+            }
+            //Counted before the key is checked again, so a close either sees this writer or this writer sees the close
+            route->writers.fetch_add(1, std::memory_order_seq_cst);
+            esp_err_t err = ESP_ERR_NOT_FOUND;
+            if (route->key.load(std::memory_order_seq_cst) == key) {
+                uint8_t report[OUTPUT_REPORT_MAX_BYTES];
+                if (report_id) {
+                    report[0] = report_id;
+                }
+                memcpy(report + (report_id ? 1 : 0), data, len);
+                err = output_queue_write(&s_output_queues[d][n], report_id, report, report_len) ? ESP_OK : ESP_ERR_NO_MEM;
+            }
+            route->writers.fetch_sub(1, std::memory_order_release);
+            //Wake the class driver out of usb_host_client_handle_events() to send it, or to finish a close
+            if (err == ESP_OK || route->key.load(std::memory_order_relaxed) != key) {
+                usb_host_client_unblock(s_driver_obj.client_hdl);
+            }
+            return err;
+        }
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+/**
+ * Call sub->cb on the report worker for every report matching sub. Once
+ * any subscription exists, reports no subscription matches are dropped in
+ * the completion callback, before they are copied, filtered or decoded.
+ * Safe from any task. Returns a handle for usb_class_driver_unsubscribe(),
+ * or -1 if REPORT_SUB_MAX subscriptions exist already.
+ */
+int usb_class_driver_subscribe(const report_sub_t *sub)
+{
+    int handle = report_sub_add(&s_report_subs, sub);
+    if (handle >= 0 && s_driver_obj.client_hdl) {
+        //Let the class driver rebuild the dispatch tables
+        usb_host_client_unblock(s_driver_obj.client_hdl);
+    }
+    return handle;
+}
+
+void usb_class_driver_unsubscribe(int handle)
+{
+    report_sub_remove(&s_report_subs, handle);
+    if (s_driver_obj.client_hdl) {
+        usb_host_client_unblock(s_driver_obj.client_hdl);
+    }
+}
+
+/**
+ * Register a sink for raw IN reports, see usb_report_sink.hpp. Its write
+ * runs on usb_report_sink_task() with batches of reports still in their
+ * transfer buffers. Safe from any task. Returns a handle for
+ * usb_class_driver_remove_sink(), or -1 if REPORT_SINK_MAX sinks exist.
+ */
+int usb_class_driver_add_sink(const report_sink_t *sink)
+{
+    int handle = report_sink_add(&s_report_sinks, sink);
+    if (handle >= 0 && s_driver_obj.client_hdl) {
+        //Lends start once the class driver picked the sink up
+        usb_host_client_unblock(s_driver_obj.client_hdl);
+    }
+    return handle;
+}
+
+/**
+ * Stop lending to a sink. Its queued reports are released unwritten; a
+ * write already running may still finish after this returns.
+ */
+void usb_class_driver_remove_sink(int handle)
+{
+    report_sink_remove(&s_report_sinks, handle);
+    if (s_driver_obj.client_hdl) {
+        //The class driver acks the removal and wakes the sink task to free the slot
+        usb_host_client_unblock(s_driver_obj.client_hdl);
+    }
+}
+
+/**
+ * Hand back a lease a sink kept past its write. Safe from any task.
+ */
+void usb_class_driver_release(report_lease_t *lease)
+{
+    if (report_lease_release(lease) && s_driver_obj.client_hdl) {
+        usb_host_client_unblock(s_driver_obj.client_hdl);
+    }
+}
+
+/**
+ * Run the writes of every sink, each with whatever reports queued up
+ * since its last one. Releasing a lease the class driver is waiting for
+ * wakes it so the transfer goes straight back on its endpoint. Runs at a
+ * lower priority than usb_class_driver_task(); a sink that blocks holds up
+ * the other sinks, and its leases keep transfers off their endpoints.
+ */
+void usb_report_sink_task(void *)
+{
+    s_report_sink_task = xTaskGetCurrentTaskHandle();
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(STREAM_STATS_PERIOD_MS));
+        if (report_sink_service(&s_report_sinks) && s_driver_obj.client_hdl) {
+            usb_host_client_unblock(s_driver_obj.client_hdl);
+        }
+    }
+}
+
+/**
+ * Feed a native capture (usb_hid_capture.hpp) back through the report
+ * path. Device slots are set up from the captured descriptors, report
+ * descriptors or layouts and SET_PROTOCOL requests; every IN report then
+ * goes through the ring, filter, decoder, state snapshot and subscriptions
+ * as if it had just completed. With realtime the captured spacing is kept,
+ * otherwise reports go as fast as they decode. The device slots and
+ * rings are borrowed and drained here, so this refuses to run while the
+ * class driver, a report worker or the sink task exists. Returns false if
+ * it refused or capture is not a native capture.
+ */
+bool usb_class_driver_replay(const uint8_t *capture, size_t len, bool realtime, replay_stats_t *stats)
+{
+    bool running = s_driver_obj.client_hdl || s_report_sink_task;
+    for (int w = 0; w < REPORT_WORKERS_MAX; w++) {
+        running |= (s_report_workers[w].task != NULL);
+    }
+    if (running) {
+        //A second consumer on the rings, or a task reading the slots memset below
+        ESP_LOGW(TAG_CLASS, "replay: the class driver, a report worker or the sink task is running");
+        return false;
+    }
+    size_t off = hid_capture_check(capture, len);
+    if (off == 0) {
+        ESP_LOGW(TAG_CLASS, "replay: not a capture of this build");
+        return false;
+    }
+    memset(stats, 0, sizeof(replay_stats_t));
+    memset(&s_driver_obj, 0, sizeof(class_driver_t));
+
+    hid_capture_rec_t rec;
+    const uint8_t *data;
+    uint32_t last_us = 0;
+    int64_t start_us = esp_timer_get_time();
+    while (hid_capture_next(capture, len, &off, &rec, &data)) {
+        if (stats->records++ == 0) {
+            last_us = rec.timestamp_us;
+        }
+        //Unsigned, so a wrap of the 32-bit timestamps is still a small step
+        stats->captured_us += (uint32_t)(rec.timestamp_us - last_us);
+        last_us = rec.timestamp_us;
+        if (realtime) {
+            replay_wait(start_us + stats->captured_us);
+        }
+
+        hid_device_t *dev = NULL;
+        for (int d = 0; d < CLASS_MAX_DEVICES && dev == NULL; d++) {
+            if (s_driver_obj.devices[d].dev_addr == rec.dev_addr) {
+                dev = &s_driver_obj.devices[d];
+            }
+        }
+        switch (rec.type) {
+            case HID_CAPTURE_REC_ATTACH:
+                for (int d = 0; d < CLASS_MAX_DEVICES && dev == NULL; d++) {
+                    if (s_driver_obj.devices[d].state == DEV_STATE_FREE) {
+                        dev = &s_driver_obj.devices[d];
+                    }
+                }
+                if (dev) {
+                    memset(dev, 0, sizeof(hid_device_t));
+                    dev->dev_addr = rec.dev_addr;
+                    dev->state = DEV_STATE_IDLE;
+                    dev->attach_us = esp_timer_get_time();
+                    if (rec.len >= sizeof(usb_device_desc_t)) {
+                        dev->idVendor = data[8] | (data[9] << 8);
+                        dev->idProduct = data[10] | (data[11] << 8);
+                    }
+                }
+                break;
+            case HID_CAPTURE_REC_CONFIG_DESC:
+                if (dev) {
+                    replay_claim(dev, data, rec.len);
+                }
+                break;
+            case HID_CAPTURE_REC_LAYOUT: {
+                hid_intf_t *hid_intf = replay_find_intf(dev, rec.ep_addr, 0);
+                if (hid_intf && rec.len == sizeof(hid_report_layout_t)) {
+                    memcpy(&hid_intf->report_layout, data, sizeof(hid_report_layout_t));
+                }
+                break;
+            }
+            case HID_CAPTURE_REC_CTRL:
+                if (dev) {
+                    replay_control(dev, &rec, data);
+                }
+                break;
+            case HID_CAPTURE_REC_IN: {
+                hid_intf_t *hid_intf = replay_find_intf(dev, 0, rec.ep_addr);
+                if (hid_intf == NULL || rec.status != USB_TRANSFER_STATUS_COMPLETED || rec.len == 0) {
+                    stats->skipped++;
+                    break;
+                }
+                if (!hid_intf->streaming) {
+                    filter_init(hid_intf);
+                    dispatch_build(hid_intf);
+                    hid_intf->streaming = true;
+                    dev->state = DEV_STATE_STREAMING;
+                }
+                report_ring_push(hid_intf->ring, dev->dev_addr, rec.ep_addr, data, rec.len, esp_timer_get_time());
+                report_ring_drain(hid_intf->ring, consume_report, (void *)hid_intf, REPORT_RING_NUM_SLOTS);
+                stats->reports++;
+                break;
+            }
+            case HID_CAPTURE_REC_DETACH:
+                if (dev) {
+                    memset(dev, 0, sizeof(hid_device_t));
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    stats->elapsed_us = esp_timer_get_time() - start_us;
+
+    //Hand the slots back the way usb_class_driver_task() expects them
+    memset(&s_driver_obj, 0, sizeof(class_driver_t));
+    ESP_LOGI(TAG_CLASS, "replay: %u records, %u reports, %u skipped, %u ms captured, replayed in %u ms",
+             stats->records, stats->reports, stats->skipped,
+             (uint32_t)(stats->captured_us / 1000), (uint32_t)(stats->elapsed_us / 1000));
+    return true;
+}
@@ -0,0 +1,147 @@
+/*
+ * One-pass configuration descriptor index
+ *
+ * Walks a raw configuration descriptor once and records every interface
+ * (including alternate settings), its endpoints and its HID class
+ * descriptor, so later lookups are table reads instead of rescans.
+ * Entries keep their offset into the descriptor, which stays valid for as
+ * long as the descriptor itself. No ESP-IDF dependencies.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define DESC_INDEX_MAX_INTFS        8       //Interfaces, counting each alternate setting
+#define DESC_INDEX_MAX_EPS          16
+
+#define DESC_TYPE_INTERFACE         0x04
+#define DESC_TYPE_ENDPOINT          0x05
+#define DESC_TYPE_HID               0x21
+#define DESC_TYPE_HID_REPORT        0x22
+
+typedef struct {
+    uint16_t offset;            //Of the endpoint descriptor in the config descriptor
+    uint8_t bEndpointAddress;
+    uint8_t bmAttributes;
+    uint16_t wMaxPacketSize;
+    uint8_t bInterval;
+} desc_index_ep_t;
+
+typedef struct {
+    uint16_t offset;            //Of the interface descriptor in the config descriptor
+    uint8_t bInterfaceNumber;
+    uint8_t bAlternateSetting;
+    uint8_t bInterfaceClass;
+    uint8_t bInterfaceSubClass;
+    uint8_t bInterfaceProtocol;
+    uint8_t first_ep;           //Into desc_index_t::eps
+    uint8_t num_eps;
+    bool has_hid;
+    uint16_t bcdHID;
+    uint8_t bCountryCode;
+    uint16_t report_desc_len;   //wDescriptorLength of the report descriptor, 0 if none
+} desc_index_intf_t;
+
+typedef struct {
+    desc_index_intf_t intfs[DESC_INDEX_MAX_INTFS];
+    desc_index_ep_t eps[DESC_INDEX_MAX_EPS];
+    uint8_t num_intfs;
+    uint8_t num_eps;
+    uint8_t bConfigurationValue;
+    bool truncated;             //Some interfaces or endpoints did not fit, or the descriptor was malformed
+} desc_index_t;
+
+static inline uint16_t desc_le16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+/**
+ * Index the configuration descriptor in config (len bytes, normally
+ * wTotalLength). Returns false if it is not a configuration descriptor;
+ * malformed tails are indexed up to the bad descriptor and flagged.
+ */
+static bool desc_index_build(const uint8_t *config, size_t len, desc_index_t *index)
+{
+    memset(index, 0, sizeof(desc_index_t));
+    if (len < 9 || config[0] < 9 || config[1] != 0x02) {
+        return false;
+    }
+    index->bConfigurationValue = config[5];
+
+    desc_index_intf_t *intf = NULL;
+    for (size_t off = config[0]; off < len; off += config[off]) {
+        const uint8_t *p = config + off;
+        uint8_t bLength = p[0];
+        if (bLength < 2 || off + bLength > len) {
+            index->truncated = true;
+            break;
+        }
+        switch (p[1]) {
+            case DESC_TYPE_INTERFACE:
+                if (bLength < 9 || index->num_intfs >= DESC_INDEX_MAX_INTFS) {
+                    index->truncated = true;
+                    intf = NULL;
+                    break;
+                }
+                intf = &index->intfs[index->num_intfs++];
+                intf->offset = (uint16_t)off;
+                intf->bInterfaceNumber = p[2];
+                intf->bAlternateSetting = p[3];
+                intf->bInterfaceClass = p[5];
+                intf->bInterfaceSubClass = p[6];
+                intf->bInterfaceProtocol = p[7];
+                intf->first_ep = index->num_eps;
+                break;
+            case DESC_TYPE_HID:
+                if (intf == NULL || bLength < 6) {
+                    break;
+                }
+                intf->has_hid = true;
+                intf->bcdHID = desc_le16(p + 2);
+                intf->bCountryCode = p[4];
+                //bNumDescriptors (type, length) pairs follow, take the report descriptor's
+                for (int n = 0; n < p[5] && 6 + 3 * n + 3 <= bLength; n++) {
+                    if (p[6 + 3 * n] == DESC_TYPE_HID_REPORT) {
+                        intf->report_desc_len = desc_le16(p + 7 + 3 * n);
+                        break;
+                    }
+                }
+                break;
+            case DESC_TYPE_ENDPOINT: {
+                if (intf == NULL || bLength < 7) {
+                    break;
+                }
+                if (index->num_eps >= DESC_INDEX_MAX_EPS) {
+                    index->truncated = true;
+                    break;
+                }
+                desc_index_ep_t *ep = &index->eps[index->num_eps++];
+                ep->offset = (uint16_t)off;
+                ep->bEndpointAddress = p[2];
+                ep->bmAttributes = p[3];
+                ep->wMaxPacketSize = desc_le16(p + 4);
+                ep->bInterval = p[6];
+                intf->num_eps++;
+                break;
+            }
+            default:
+                break;
+        }
+    }
+    return true;
+}
+
+static const desc_index_intf_t *desc_index_find_intf(const desc_index_t *index, uint8_t bInterfaceNumber, uint8_t bAlternateSetting)
+{
+    for (int i = 0; i < index->num_intfs; i++) {
+        const desc_index_intf_t *intf = &index->intfs[i];
+        if (intf->bInterfaceNumber == bInterfaceNumber && intf->bAlternateSetting == bAlternateSetting) {
+            return intf;
+        }
+    }
+    return NULL;
+}
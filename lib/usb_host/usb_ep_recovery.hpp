@@ -0,0 +1,185 @@
+/*
+ * Interrupt endpoint error recovery
+ *
+ * Any failed transfer halts the host pipe, and a STALL also halts the
+ * endpoint on the device, so a plain resubmit only fails again. This state
+ * machine walks an endpoint from the first error back to its first good
+ * report: halt and flush the pipe, send CLEAR_FEATURE(ENDPOINT_HALT) if the
+ * device stalled, clear the pipe and resubmit. A fault that comes back
+ * starts over after an exponential backoff, at most EP_RECOVERY_MAX_RETRIES
+ * times before the endpoint is given up. The caller performs the steps;
+ * this only decides them, so it runs the same against the host library and
+ * against a simulated one. No ESP-IDF dependencies.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define EP_RECOVERY_MAX_RETRIES     4       //Failed recoveries in a row before the endpoint is given up
+#define EP_RECOVERY_BACKOFF_US      2000    //Wait before the first retry, doubled for every further one
+#define EP_RECOVERY_NUM_STATUS      8       //usb_transfer_status_t values counted separately
+
+#define EP_TIMEOUT_MIN_MS           20      //Shortest adaptive timeout
+#define EP_TIMEOUT_MAX_MS           1000    //Timeout until a round trip was measured, and the longest adaptive one
+#define EP_TIMEOUT_RTT_FACTOR       8       //Timeout in smoothed round trips
+
+typedef enum {
+    EP_HEALTH_OK,
+    EP_HEALTH_RECOVERING,       //Between the first error and the first good report
+    EP_HEALTH_FAILED,           //Given up, left halted until the device goes away
+} ep_health_t;
+
+typedef enum {
+    EP_RECOVER_NONE,            //Nothing to do now, see next_us
+    EP_RECOVER_HALT_FLUSH,      //Halt and flush the pipe, in-flight transfers come back canceled
+    EP_RECOVER_CLEAR_FEATURE,   //Send CLEAR_FEATURE(ENDPOINT_HALT), then call ep_recovery_step_done()
+    EP_RECOVER_RESUBMIT,        //Clear the pipe and resubmit, then call ep_recovery_resubmitted()
+    EP_RECOVER_GIVE_UP,
+} ep_recover_step_t;
+
+typedef struct {
+    uint8_t health;             //ep_health_t
+    uint8_t step;               //ep_recover_step_t to hand out next
+    uint8_t retries;            //Recoveries of the current fault that did not bring a good report
+    bool stalled;               //The device stalled during the current fault
+    bool waiting;               //A step is running outside, e.g. CLEAR_FEATURE on EP0
+    int64_t fault_us;           //First error of the current fault
+    int64_t next_us;            //Earliest time for the next step
+    uint32_t errors[EP_RECOVERY_NUM_STATUS];    //Failed transfers by usb_transfer_status_t
+    uint32_t recoveries;        //Faults that ended in a good report
+    int64_t recover_us;         //First error to first good report of the last fault that ended
+    uint32_t failures;          //Faults given up on
+} ep_recovery_t;
+
+static void ep_recovery_init(ep_recovery_t *rec)
+{
+    memset(rec, 0, sizeof(ep_recovery_t));
+}
+
+/**
+ * A transfer failed with status (anything but COMPLETED, CANCELED and
+ * NO_DEVICE). Returns true once the endpoint is recovering, the transfer
+ * must not be resubmitted then.
+ */
+static bool ep_recovery_error(ep_recovery_t *rec, uint8_t status, bool stall, int64_t now)
+{
+    rec->errors[(status < EP_RECOVERY_NUM_STATUS) ? status : 0]++;
+    if (rec->health == EP_HEALTH_FAILED) {
+        return true;
+    }
+    rec->stalled |= stall;
+    if (rec->health == EP_HEALTH_OK) {
+        rec->health = EP_HEALTH_RECOVERING;
+        rec->retries = 0;
+        rec->fault_us = now;
+        rec->step = EP_RECOVER_HALT_FLUSH;
+        rec->next_us = now;
+    } else if (rec->step == EP_RECOVER_NONE && !rec->waiting) {
+        //Resubmitted and failed again
+        rec->retries++;
+        rec->step = (rec->retries > EP_RECOVERY_MAX_RETRIES) ? EP_RECOVER_GIVE_UP : EP_RECOVER_HALT_FLUSH;
+        rec->next_us = now + ((int64_t)EP_RECOVERY_BACKOFF_US << (rec->retries - 1));
+    }
+    return true;
+}
+
+/**
+ * The step to perform now, if any. in_flight is the number of transfers
+ * still owned by the host library; the pipe is only cleared once the flush
+ * handed them all back.
+ */
+static ep_recover_step_t ep_recovery_poll(ep_recovery_t *rec, int in_flight, int64_t now)
+{
+    if (rec->health != EP_HEALTH_RECOVERING || rec->waiting || rec->step == EP_RECOVER_NONE || now < rec->next_us) {
+        return EP_RECOVER_NONE;
+    }
+    ep_recover_step_t step = (ep_recover_step_t)rec->step;
+    switch (step) {
+        case EP_RECOVER_HALT_FLUSH:
+            rec->step = rec->stalled ? EP_RECOVER_CLEAR_FEATURE : EP_RECOVER_RESUBMIT;
+            break;
+        case EP_RECOVER_CLEAR_FEATURE:
+            rec->waiting = true;
+            break;
+        case EP_RECOVER_RESUBMIT:
+            if (in_flight > 0) {
+                return EP_RECOVER_NONE;
+            }
+            rec->waiting = true;
+            break;
+        case EP_RECOVER_GIVE_UP:
+            rec->health = EP_HEALTH_FAILED;
+            rec->step = EP_RECOVER_NONE;
+            rec->failures++;
+            break;
+        default:
+            break;
+    }
+    return step;
+}
+
+/**
+ * CLEAR_FEATURE answered. A refused one is retried like a failed resubmit.
+ */
+static void ep_recovery_step_done(ep_recovery_t *rec, bool ok, int64_t now)
+{
+    rec->waiting = false;
+    if (ok) {
+        rec->stalled = false;
+        rec->step = EP_RECOVER_RESUBMIT;
+        rec->next_us = now;
+        return;
+    }
+    rec->retries++;
+    rec->step = (rec->retries > EP_RECOVERY_MAX_RETRIES) ? EP_RECOVER_GIVE_UP : EP_RECOVER_CLEAR_FEATURE;
+    rec->next_us = now + ((int64_t)EP_RECOVERY_BACKOFF_US << (rec->retries - 1));
+}
+
+//Transfers are back on the endpoint, the next good report ends the fault
+static void ep_recovery_resubmitted(ep_recovery_t *rec)
+{
+    rec->waiting = false;
+    rec->step = EP_RECOVER_NONE;
+}
+
+/**
+ * A transfer completed. Returns the time to recover, from the first error
+ * to now, if this ended a fault, or -1.
+ */
+static inline int64_t ep_recovery_success(ep_recovery_t *rec, int64_t now)
+{
+    if (rec->health != EP_HEALTH_RECOVERING || rec->step != EP_RECOVER_NONE || rec->waiting) {
+        return -1;
+    }
+    rec->health = EP_HEALTH_OK;
+    rec->recoveries++;
+    rec->recover_us = now - rec->fault_us;
+    return rec->recover_us;
+}
+
+static inline bool ep_recovery_active(const ep_recovery_t *rec)
+{
+    return rec->health != EP_HEALTH_OK;
+}
+
+/**
+ * Fold one round trip into a smoothed estimate (1/8 gain), 0 meaning none yet.
+ */
+static inline void ep_rtt_update(uint32_t *srtt_us, int64_t sample_us)
+{
+    uint32_t sample = (sample_us < 0) ? 0 : (uint32_t)sample_us;
+    *srtt_us = (*srtt_us == 0) ? sample + 1 : *srtt_us - (*srtt_us >> 3) + (sample >> 3);
+}
+
+//Transfer timeout from a smoothed round trip
+static inline uint32_t ep_timeout_ms(uint32_t srtt_us)
+{
+    if (srtt_us == 0) {
+        return EP_TIMEOUT_MAX_MS;
+    }
+    uint32_t ms = srtt_us * EP_TIMEOUT_RTT_FACTOR / 1000;
+    return (ms < EP_TIMEOUT_MIN_MS) ? EP_TIMEOUT_MIN_MS : (ms > EP_TIMEOUT_MAX_MS) ? EP_TIMEOUT_MAX_MS : ms;
+}
@@ -0,0 +1,1025 @@
+/*
+ * Benchmarks, built on target with -DUSB_HID_BENCH and natively by test/test_bench
+ *
+ * Each benchmark drives a module against the simulated devices of
+ * usb_sim_device.hpp on a virtual clock, so bus timing is the scripted
+ * one, while the CPU time is measured for real with esp_timer. The replays
+ * record a simulated bus as a native capture and feed it through the class
+ * driver's report path.
+ *
+ * On the native build, where usb/usb_host.h is the mock host library of
+ * test/mock, the scenarios and the recovery benchmarks plug the simulated
+ * devices into it and run the whole pipeline: enumeration, streaming,
+ * output reports and stream_recover() against injected faults, all on the
+ * virtual clock of mock_rtos.h. They are skipped on target.
+ *
+ * Every result on the virtual clock is also a named metric checked against
+ * s_bench_baseline; one that got worse by more than BENCH_REGRESSION_PCT is
+ * a regression, usb_hid_bench_run() returns how many. Build with
+ * -DBENCH_PRINT_BASELINE=1 to print the table for the current tree.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include "esp_timer.h"
+#include "usb/usb_host.h"
+#include "usb_sim_device.hpp"
+#include "usb_desc_index.hpp"
+#include "usb_output_queue.hpp"
+#include "usb_hid_report_parser.hpp"
+#include "usb_hid_static_decoders.hpp"
+#include "usb_ep_recovery.hpp"
+#include "usb_report_ring.hpp"
+#include "usb_hid_capture.hpp"
+#include "usb_report_sink.hpp"
+#include "usb_class_driver.hpp"
+#include "usb_hid_pipeline.hpp"
+#include "esp_heap_caps.h"
+#ifdef MOCK_USB_HOST
+#include "nvs_flash.h"
+#endif
+
+#define BENCH_DURATION_MS           1000    //Virtual time per scenario
+#define BENCH_SET_REPORT_US         1000    //Assumed EP0 turnaround of one SET_REPORT, one per frame
+#define BENCH_CPU_ROUNDS            10000   //Calls per CPU time measurement, esp_timer only resolves 1 us
+#define BENCH_DECODE_REPORTS        64      //Distinct reports the decode benchmark cycles through
+#define BENCH_OLD_TIMEOUT_MS        1000    //Transfer timeout every error used to wait out
+#define BENCH_ATTACH_US             1000    //Scenario start to the first attach, devices follow 100 us apart
+#define BENCH_SETTLE_US             100000  //Attach to streaming, measurements start after
+#define BENCH_SCENARIO_MS           250     //Virtual time per class driver scenario
+#define BENCH_RECOVERY_MS           200     //Longest a fault may take to be recovered or given up
+#define BENCH_OUTPUT_US             1000    //Output report period of the scenario application, per interface
+#define BENCH_REPLAY_MS             50      //Virtual time recorded per replay, fits BENCH_CAPTURE_BYTES at 4 devices
+#define BENCH_CAPTURE_BYTES         32768
+#define BENCH_FORWARD_OUT_BYTES     4096    //Stands in for the UART FIFO, wraps
+#define BENCH_MAX_METRICS           64
+#define BENCH_REGRESSION_PCT        10      //Worse than the baseline by more than this is a regression
+
+#ifndef BENCH_PRINT_BASELINE
+#define BENCH_PRINT_BASELINE        0
+#endif
+
+typedef struct {
+    const char *name;
+    uint32_t value;
+} bench_baseline_t;
+
+typedef struct {
+    char name[40];
+    uint32_t value;
+} bench_metric_t;
+
+/**
+ * Results of the tree the benchmarks were last reviewed on, printed by a
+ * native -DBENCH_PRINT_BASELINE=1 run. Only the results on the virtual
+ * clock are stored, they are the same on every run and target; CPU times
+ * are printed without a baseline.
+ */
+static const bench_baseline_t s_bench_baseline[] = {
+    { "output.0.250x1.sent", 250 },
+    { "output.0.250x2.sent", 250 },
+    { "set_report.1.250x2.sent", 250 },
+    { "output.0.1000x1.sent", 999 },
+    { "output.0.1000x2.sent", 999 },
+    { "set_report.1.1000x2.sent", 999 },
+    { "output.0.4000x1.sent", 999 },
+    { "output.0.4000x2.sent", 999 },
+    { "set_report.1.4000x2.sent", 999 },
+    { "decode.1.mismatches", 0 },
+    { "forward.1.1.copies", 0 },
+    { "forward.1.1.bytes", 26 },
+    { "forward.1.4.copies", 0 },
+    { "forward.1.4.bytes", 23 },
+    { "replay.1x1.reports", 100 },
+    { "replay.1x1.heap_blocks", 0 },
+    { "replay.1x3.reports", 32 },
+    { "replay.1x3.heap_blocks", 0 },
+    { "replay.4x1.reports", 394 },
+    { "replay.4x1.heap_blocks", 0 },
+    { "replay.4x3.reports", 128 },
+    { "replay.4x3.heap_blocks", 0 },
+    { "recovery.1.stall.us", 3000 },
+    { "recovery.1.error.us", 3000 },
+    { "recovery.1.error x3.us", 12000 },
+    { "scenario.1x1.reports", 500 },
+    { "scenario.1x1.delivered", 500 },
+    { "scenario.1x1.missed", 0 },
+    { "scenario.1x1.p99_us", 1 },
+    { "scenario.1x1.out_sent", 500 },
+    { "scenario.1x1.ep0_max_depth", 1 },
+    { "scenario.1x1.heap_blocks", 0 },
+    { "scenario.1x1.wakeups", 150 },
+    { "scenario.1x3.reports", 166 },
+    { "scenario.1x3.delivered", 166 },
+    { "scenario.1x3.missed", 0 },
+    { "scenario.1x3.p99_us", 1 },
+    { "scenario.1x3.out_sent", 500 },
+    { "scenario.1x3.ep0_max_depth", 1 },
+    { "scenario.1x3.heap_blocks", 0 },
+    { "scenario.1x3.wakeups", 451 },
+    { "scenario.4x1.reports", 2000 },
+    { "scenario.4x1.delivered", 2000 },
+    { "scenario.4x1.missed", 0 },
+    { "scenario.4x1.p99_us", 1 },
+    { "scenario.4x1.out_sent", 2000 },
+    { "scenario.4x1.ep0_max_depth", 1 },
+    { "scenario.4x1.heap_blocks", 0 },
+    { "scenario.4x1.wakeups", 75 },
+    { "scenario.4x3.reports", 664 },
+    { "scenario.4x3.delivered", 664 },
+    { "scenario.4x3.missed", 0 },
+    { "scenario.4x3.p99_us", 1 },
+    { "scenario.4x3.out_sent", 2000 },
+    { "scenario.4x3.ep0_max_depth", 1 },
+    { "scenario.4x3.heap_blocks", 0 },
+    { "scenario.4x3.wakeups", 150 },
+};
+
+typedef struct {
+    uint32_t writes;
+    uint32_t sent;
+    uint32_t coalesced;
+    uint32_t rejected;
+    uint32_t max_depth;
+    uint32_t write_ns;          //CPU time per output_queue_write()
+    uint32_t take_ns;           //CPU time per output_queue_take() that returned a report
+} bench_output_result_t;
+
+typedef struct {
+    uint32_t generic_ns;        //CPU time per hid_decode_report()
+    uint32_t static_ns;         //CPU time per specialized decode
+    uint32_t mismatches;        //Reports the two decoders disagree on
+} bench_decode_result_t;
+
+typedef struct {
+    const char *name;
+    sim_fault_t fault;          //Injected with sim_device_inject()
+    uint32_t slots;             //Report slots that fail, a STALL lasts until CLEAR_FEATURE
+} bench_fault_t;
+
+typedef struct {
+    int64_t recover_us;         //First error to first good report, -1 if given up
+    uint8_t retries;            //Recoveries that failed again before the last one
+    uint32_t flushed;           //Transfers the host library handed back from a flush
+    uint32_t clear_halts;       //CLEAR_FEATURE(ENDPOINT_HALT) the device received
+} bench_recovery_result_t;
+
+typedef struct {
+    uint32_t walk_ns;           //CPU time per desc_index_build() and interface lookup
+    uint32_t compile_ns;        //CPU time per hid_report_layout_compile()
+    uint32_t ring_ns;           //CPU time per report_ring_push() and the drain that takes it
+} bench_micro_result_t;
+
+typedef struct {
+    uint32_t copy_ns;           //CPU time per report forwarded through the ring and a frame buffer
+    uint32_t lend_ns;           //CPU time per report forwarded from the lent buffer
+    uint32_t copy_copies;       //Copies per 100 reports before the writer
+    uint32_t lend_copies;
+    uint32_t copy_bytes;        //Bytes written per report, must match
+    uint32_t lend_bytes;
+} bench_forward_result_t;
+
+typedef struct {
+    uint32_t reports;           //Reports replayed
+    uint32_t offered_hz;        //Reports per second of virtual bus time
+    uint32_t replay_hz;         //Reports per second the report path sustained
+    uint32_t p50_us;            //Ring push to subscriber, bucket bounds
+    uint32_t p99_us;
+    int32_t heap_blocks;        //Heap blocks allocated over the replay, 0 for an allocation-free path
+} bench_replay_result_t;
+
+typedef struct {
+    uint32_t reports;           //IN reports the class driver completed
+    uint32_t delivered;         //Reports that reached the subscriber
+    uint32_t missed;            //Report slots the host had no IN transfer queued for
+    uint32_t p50_us;            //Completion to subscriber, bucket bounds
+    uint32_t p99_us;
+    uint32_t out_written;       //Output reports the application wrote
+    uint32_t out_sent;          //Output reports that went out, the rest were coalesced
+    uint32_t ep0_max_depth;     //Most control transfers queued on EP0 at once, over every device
+    int32_t heap_blocks;        //Heap blocks allocated while streaming, 0 for an allocation-free path
+    uint32_t wakeups;           //Times the class driver task ran, per 100 reports
+    uint32_t cpu_ns;            //CPU time of the class driver task per report, thread time of the native build
+} bench_scenario_result_t;
+
+static bench_metric_t s_bench_metrics[BENCH_MAX_METRICS];
+static int s_bench_num_metrics;
+static uint32_t s_bench_regressions;
+static uint32_t s_bench_compared;
+
+static output_queue_t s_bench_output_queue;
+static hid_report_layout_t s_bench_layout;
+static uint8_t s_bench_reports[BENCH_DECODE_REPORTS][SIM_MAX_REPORT_BYTES];
+static hid_report_values_t s_bench_values[2];
+static report_ring_t s_bench_ring;
+static uint8_t s_bench_capture[BENCH_CAPTURE_BYTES];
+static latency_hist_t s_bench_latency;
+static uint8_t s_bench_forward_out[BENCH_FORWARD_OUT_BYTES];
+static uint32_t s_bench_forward_pos;
+static uint8_t s_bench_frame[2 + REPORT_SINK_BATCH_MAX * (4 + SIM_MAX_REPORT_BYTES) + 1];
+static uint32_t s_bench_frame_len;
+static uint32_t s_bench_copies;
+static report_sink_table_t s_bench_sinks;
+static sink_leases_t s_bench_leases;
+
+/**
+ * Record a result and compare it with its baseline, if there is one.
+ */
+static void bench_check(const char *name, uint32_t value, bool higher_is_better)
+{
+    if (s_bench_num_metrics < BENCH_MAX_METRICS) {
+        bench_metric_t *metric = &s_bench_metrics[s_bench_num_metrics++];
+        snprintf(metric->name, sizeof(metric->name), "%s", name);
+        metric->value = value;
+    }
+    for (size_t i = 0; i < sizeof(s_bench_baseline) / sizeof(s_bench_baseline[0]); i++) {
+        if (strcmp(s_bench_baseline[i].name, name) != 0) {
+            continue;
+        }
+        s_bench_compared++;
+        uint64_t base = s_bench_baseline[i].value;
+        uint64_t margin = base * BENCH_REGRESSION_PCT / 100;
+        bool regressed = higher_is_better ? (uint64_t)value + margin < base : (uint64_t)value > base + margin;
+        if (regressed) {
+            s_bench_regressions++;
+            printf("REGRESSION   %s: %u, baseline %u\n", name, value, s_bench_baseline[i].value);
+        }
+        return;
+    }
+}
+
+/**
+ * The application writes num_report_ids output reports, changing every
+ * time, each write_interval_us; the device takes one per OUT slot of
+ * interface intf (its interrupt OUT bInterval, or BENCH_SET_REPORT_US when
+ * it has no OUT endpoint). Returns the OUT slot period used, 0 if intf is
+ * not in the script.
+ */
+static uint32_t bench_output_queue(const sim_device_script_t *script, uint8_t intf, uint32_t write_interval_us,
+                                   uint8_t num_report_ids, bench_output_result_t *result)
+{
+    desc_index_t index;
+    const uint8_t *config = script->config_desc;
+    if (!desc_index_build(config, desc_le16(config + 2), &index)) {
+        return 0;
+    }
+    const desc_index_intf_t *ix = desc_index_find_intf(&index, intf, 0);
+    if (ix == NULL) {
+        return 0;
+    }
+    uint32_t slot_us = BENCH_SET_REPORT_US;
+    for (int e = ix->first_ep; e < ix->first_ep + ix->num_eps; e++) {
+        if (!(index.eps[e].bEndpointAddress & 0x80)) {
+            slot_us = (index.eps[e].bInterval ? index.eps[e].bInterval : 1) * 1000;
+        }
+    }
+
+    output_queue_t *queue = &s_bench_output_queue;
+    output_queue_init(queue);
+    memset(result, 0, sizeof(bench_output_result_t));
+    uint8_t report[OUTPUT_REPORT_MAX_BYTES];
+    uint8_t report_id;
+    uint64_t next_write_us = 0;
+    uint64_t next_slot_us = slot_us;
+    uint32_t value = 0;
+    while (next_write_us < BENCH_DURATION_MS * 1000ull || next_slot_us < BENCH_DURATION_MS * 1000ull) {
+        if (next_write_us <= next_slot_us) {
+            report_id = 1 + value % num_report_ids;
+            report[0] = report_id;
+            memcpy(report + 1, &value, sizeof(value));
+            value++;
+            output_queue_write(queue, report_id, report, 8);
+            next_write_us += write_interval_us;
+        } else {
+            if (output_queue_take(queue, report, &report_id)) {
+                result->sent++;
+            }
+            next_slot_us += slot_us;
+        }
+    }
+    result->writes = queue->writes.load();
+    result->rejected = queue->rejected.load();
+    result->coalesced = queue->coalesced;
+    result->max_depth = queue->max_depth;
+
+    //CPU cost, outside the scenario: a write alone, then a write and the take it makes pending
+    int64_t start_us = esp_timer_get_time();
+    for (uint32_t i = 0; i < BENCH_CPU_ROUNDS; i++) {
+        report[1] = (uint8_t)i;
+        output_queue_write(queue, 1, report, 8);
+    }
+    int64_t write_us = esp_timer_get_time() - start_us;
+    start_us = esp_timer_get_time();
+    for (uint32_t i = 0; i < BENCH_CPU_ROUNDS; i++) {
+        report[1] = (uint8_t)i;
+        output_queue_write(queue, 1, report, 8);
+        output_queue_take(queue, report, &report_id);
+    }
+    int64_t pair_us = esp_timer_get_time() - start_us;
+    result->write_ns = (uint32_t)(write_us * 1000 / BENCH_CPU_ROUNDS);
+    result->take_ns = (pair_us > write_us) ? (uint32_t)((pair_us - write_us) * 1000 / BENCH_CPU_ROUNDS) : 0;
+    return slot_us;
+}
+
+static void bench_output_print(const char *name, uint8_t intf, uint32_t write_hz, uint8_t num_report_ids)
+{
+    bench_output_result_t result;
+    uint32_t slot_us = bench_output_queue(&s_sim_nb4_script, intf, 1000000 / write_hz, num_report_ids, &result);
+    if (slot_us == 0) {
+        return;
+    }
+    printf("%-12s intf %d, %4u Hz x %u IDs, slot %4u us: %5u written, %4u sent, %5u coalesced, %u rejected, "
+           "depth %u, %u ns/write, %u ns/take\n",
+           name, intf, write_hz, num_report_ids, slot_us, result.writes, result.sent, result.coalesced,
+           result.rejected, result.max_depth, result.write_ns, result.take_ns);
+    char metric[40];
+    snprintf(metric, sizeof(metric), "%s.%u.%ux%u.sent", name, intf, write_hz, num_report_ids);
+    bench_check(metric, result.sent, true);
+}
+
+/**
+ * Decode the same simulated reports of interface intf with
+ * hid_decode_report() and with the interface's specialized decoder, checking
+ * they agree. Returns NULL if the script has no specialized decoder for intf.
+ */
+static const hid_static_decoder_t *bench_decode(const sim_device_script_t *script, uint8_t intf,
+                                                bench_decode_result_t *result)
+{
+    const uint8_t *dev_desc = script->dev_desc;
+    uint16_t vid = dev_desc[8] | (dev_desc[9] << 8);
+    uint16_t pid = dev_desc[10] | (dev_desc[11] << 8);
+    const hid_static_decoder_t *decoder = hid_static_decoder_find(vid, pid, intf, script->report_desc_lens[intf]);
+    if (decoder == NULL ||
+        !hid_report_layout_compile(script->report_descs[intf], script->report_desc_lens[intf], &s_bench_layout)) {
+        return NULL;
+    }
+    uint16_t len = script->report_lens[intf] ? script->report_lens[intf] : SIM_MAX_REPORT_BYTES;
+    sim_report_fill_t fill = script->fill ? script->fill : sim_fill_default;
+    memset(result, 0, sizeof(bench_decode_result_t));
+    memset(s_bench_values, 0, sizeof(s_bench_values));
+    for (int i = 0; i < BENCH_DECODE_REPORTS; i++) {
+        fill(0x80 | intf, i * 7, s_bench_reports[i], len);
+        hid_decode_report(&s_bench_layout, s_bench_reports[i], len, &s_bench_values[0]);
+        decoder->decode(s_bench_reports[i], len, &s_bench_values[1]);
+        if (memcmp(&s_bench_values[0], &s_bench_values[1], sizeof(hid_report_values_t)) != 0) {
+            result->mismatches++;
+        }
+    }
+
+    int64_t start_us = esp_timer_get_time();
+    for (uint32_t i = 0; i < BENCH_CPU_ROUNDS; i++) {
+        hid_decode_report(&s_bench_layout, s_bench_reports[i % BENCH_DECODE_REPORTS], len, &s_bench_values[0]);
+    }
+    int64_t generic_us = esp_timer_get_time() - start_us;
+    start_us = esp_timer_get_time();
+    for (uint32_t i = 0; i < BENCH_CPU_ROUNDS; i++) {
+        decoder->decode(s_bench_reports[i % BENCH_DECODE_REPORTS], len, &s_bench_values[1]);
+    }
+    int64_t static_us = esp_timer_get_time() - start_us;
+    result->generic_ns = (uint32_t)(generic_us * 1000 / BENCH_CPU_ROUNDS);
+    result->static_ns = (uint32_t)(static_us * 1000 / BENCH_CPU_ROUNDS);
+    return decoder;
+}
+
+static void bench_decode_print(uint8_t intf)
+{
+    bench_decode_result_t result;
+    const hid_static_decoder_t *decoder = bench_decode(&s_sim_nb4_script, intf, &result);
+    if (decoder == NULL) {
+        return;
+    }
+    printf("%-12s intf %d, %s: %u ns/report generic, %u ns/report specialized, %u of %d reports differ\n",
+           "decode", intf, decoder->name, result.generic_ns, result.static_ns, result.mismatches, BENCH_DECODE_REPORTS);
+    char metric[40];
+    snprintf(metric, sizeof(metric), "decode.%u.mismatches", intf);
+    bench_check(metric, result.mismatches, false);
+}
+
+#ifdef MOCK_USB_HOST
+static sim_bus_t s_bench_bus;
+static usb_hid_pipeline_t s_bench_pipeline;
+
+static hid_intf_t *bench_driver_intf(uint8_t dev_addr, uint8_t intf)
+{
+    for (int d = 0; d < CLASS_MAX_DEVICES; d++) {
+        hid_device_t *dev = &s_driver_obj.devices[d];
+        for (int n = 0; dev->dev_addr == dev_addr && n < dev->num_intfs; n++) {
+            if (dev->intfs[n].bInterfaceNumber == intf) {
+                return &dev->intfs[n];
+            }
+        }
+    }
+    return NULL;
+}
+
+static uint8_t bench_driver_streaming(void)
+{
+    uint8_t streaming = 0;
+    for (int d = 0; d < CLASS_MAX_DEVICES; d++) {
+        streaming += (s_driver_obj.devices[d].state == DEV_STATE_STREAMING);
+    }
+    return streaming;
+}
+
+/**
+ * Plug num_devices simulated devices into the mock host library, polled
+ * every b_interval frames (0 for their descriptors' bInterval), start the
+ * pipeline on a fresh scheduler and let them enumerate. Returns false if
+ * any is not streaming BENCH_SETTLE_US after its attach.
+ */
+static bool bench_driver_start(const sim_device_script_t *script, uint8_t num_devices, uint8_t b_interval)
+{
+    mock_rtos_reset();
+    mock_nvs_reset();
+    nvs_flash_init();
+    memset(&s_bench_bus, 0, sizeof(sim_bus_t));
+    mock_usb_host_reset(&s_bench_bus);
+    int64_t t0 = mock_rtos_now_us() + BENCH_ATTACH_US;
+    for (uint8_t d = 0; d < num_devices; d++) {
+        //Staggered so the devices do not all report on the same microsecond
+        sim_device_t *dev = sim_bus_add(&s_bench_bus, script, d + 1, t0 + d * 100, 0, 1);
+        for (int e = 0; dev && b_interval && e < dev->num_eps; e++) {
+            dev->eps[e].interval_us = b_interval * 1000;
+        }
+    }
+    usb_hid_pipeline_config_t config = USB_HID_PIPELINE_CONFIG_DEFAULT();
+    usb_hid_pipeline_start(&config, &s_bench_pipeline);
+    mock_rtos_run_until(t0 + BENCH_SETTLE_US);
+    return bench_driver_streaming() == num_devices;
+}
+
+//Drop every task with the scheduler, and forget them as usb_hid_pipeline_wait() would
+static void bench_driver_stop(void)
+{
+    for (int w = 0; w < REPORT_WORKERS_MAX; w++) {
+        s_report_workers[w].task = NULL;
+    }
+    s_report_sink_task = NULL;
+    s_driver_obj.client_hdl = NULL;
+    mock_rtos_reset();
+}
+
+/**
+ * Stream one device, inject fault into the IN endpoint of interface intf
+ * and let the class driver's stream_recover() bring it back, on the mock
+ * host library's halt, flush and EP0 timing. Returns the endpoint's report
+ * slot period, 0 if intf did not stream.
+ */
+static uint32_t bench_recovery(const sim_device_script_t *script, uint8_t intf, const bench_fault_t *fault,
+                               bench_recovery_result_t *result)
+{
+    memset(result, 0, sizeof(bench_recovery_result_t));
+    result->recover_us = -1;
+    uint32_t slot_us = 0;
+    hid_intf_t *hid_intf = bench_driver_start(script, 1, 0) ? bench_driver_intf(1, intf) : NULL;
+    sim_device_t *sim = &s_bench_bus.devices[0];
+    if (hid_intf && hid_intf->has_ep_in && hid_intf->streaming) {
+        uint8_t ep_addr = hid_intf->ep_in.bEndpointAddress;
+        const ep_recovery_t *rec = &hid_intf->recovery;
+        slot_us = sim_device_find_ep(sim, ep_addr)->interval_us;
+        sim_device_inject(sim, ep_addr, fault->fault, fault->slots);
+        int64_t end_us = mock_rtos_now_us() + BENCH_RECOVERY_MS * 1000;
+        while (rec->recoveries == 0 && rec->failures == 0 && mock_rtos_now_us() < end_us) {
+            mock_rtos_run_for(slot_us);
+        }
+        if (rec->recoveries) {
+            result->recover_us = rec->recover_us;
+        }
+        result->retries = rec->retries;
+        result->flushed = mock_usb_sim_stats(sim)->flushed;
+        result->clear_halts = mock_usb_sim_stats(sim)->clear_halts;
+    }
+    bench_driver_stop();
+    return slot_us;
+}
+
+static void bench_recovery_print(uint8_t intf)
+{
+    static const bench_fault_t faults[] = {
+        { "stall", SIM_FAULT_STALL, 1 },
+        { "error", SIM_FAULT_ERROR, 1 },
+        { "error x3", SIM_FAULT_ERROR, 3 },
+        { "error, dead", SIM_FAULT_ERROR, 1000 },
+    };
+    for (size_t i = 0; i < sizeof(faults) / sizeof(faults[0]); i++) {
+        bench_recovery_result_t result;
+        uint32_t slot_us = bench_recovery(&s_sim_nb4_script, intf, &faults[i], &result);
+        if (slot_us == 0) {
+            printf("%-12s intf %d, %-11s did not stream\n", "recovery", intf, faults[i].name);
+            s_bench_regressions++;
+            return;
+        }
+        //Before, a failed transfer went back into the halted pipe: a stall never recovered, an error at best after a timeout
+        if (result.recover_us < 0) {
+            printf("%-12s intf %d, %-11s slot %4u us: given up after %u retries, %u transfers flushed\n",
+                   "recovery", intf, faults[i].name, slot_us, result.retries, result.flushed);
+        } else {
+            char was[16] = "never";
+            if (faults[i].fault != SIM_FAULT_STALL) {
+                snprintf(was, sizeof(was), ">= %u ms", BENCH_OLD_TIMEOUT_MS * faults[i].slots);
+            }
+            printf("%-12s intf %d, %-11s slot %4u us: recovered in %u us, %u transfers flushed, %u CLEAR_FEATURE (was %s)\n",
+                   "recovery", intf, faults[i].name, slot_us, (uint32_t)result.recover_us, result.flushed,
+                   result.clear_halts, was);
+            char metric[40];
+            snprintf(metric, sizeof(metric), "recovery.%u.%s.us", intf, faults[i].name);
+            bench_check(metric, (uint32_t)result.recover_us, false);
+        }
+    }
+}
+#endif
+
+static void bench_ring_noop(const report_slot_t *slot, void *arg)
+{
+    (*(uint32_t *)arg) += slot->len;
+}
+
+/**
+ * CPU time of the per-device and per-report steps that do not need the
+ * bus: walking the configuration descriptor, compiling a report
+ * descriptor, and handing a report through the ring.
+ */
+static bool bench_micro(const sim_device_script_t *script, uint8_t intf, bench_micro_result_t *result)
+{
+    desc_index_t index;
+    const uint8_t *config = script->config_desc;
+    uint16_t config_len = desc_le16(config + 2);
+    if (intf >= SIM_MAX_INTFS || script->report_descs[intf] == NULL) {
+        return false;
+    }
+    memset(result, 0, sizeof(bench_micro_result_t));
+
+    const desc_index_intf_t *ix = NULL;
+    int64_t start_us = esp_timer_get_time();
+    for (uint32_t i = 0; i < BENCH_CPU_ROUNDS; i++) {
+        desc_index_build(config, config_len, &index);
+        ix = desc_index_find_intf(&index, intf, 0);
+    }
+    result->walk_ns = (uint32_t)((esp_timer_get_time() - start_us) * 1000 / BENCH_CPU_ROUNDS);
+    if (ix == NULL) {
+        return false;
+    }
+
+    start_us = esp_timer_get_time();
+    for (uint32_t i = 0; i < BENCH_CPU_ROUNDS; i++) {
+        hid_report_layout_compile(script->report_descs[intf], script->report_desc_lens[intf], &s_bench_layout);
+    }
+    result->compile_ns = (uint32_t)((esp_timer_get_time() - start_us) * 1000 / BENCH_CPU_ROUNDS);
+
+    uint8_t report[SIM_MAX_REPORT_BYTES];
+    uint16_t len = script->report_lens[intf] ? script->report_lens[intf] : SIM_MAX_REPORT_BYTES;
+    uint32_t sink = 0;
+    sim_fill_default(0x80 | intf, 0, report, len);
+    report_ring_init(&s_bench_ring);
+    start_us = esp_timer_get_time();
+    for (uint32_t i = 0; i < BENCH_CPU_ROUNDS; i++) {
+        report_ring_push(&s_bench_ring, 1, 0x80 | intf, report, len, start_us);
+        report_ring_drain(&s_bench_ring, bench_ring_noop, &sink, REPORT_RING_NUM_SLOTS);
+    }
+    result->ring_ns = (uint32_t)((esp_timer_get_time() - start_us) * 1000 / BENCH_CPU_ROUNDS);
+    return true;
+}
+
+static void bench_micro_print(uint8_t intf)
+{
+    bench_micro_result_t result;
+    if (!bench_micro(&s_sim_nb4_script, intf, &result)) {
+        return;
+    }
+    printf("%-12s intf %d: %u ns/config walk, %u ns/report descriptor compile, %u ns/ring handoff\n",
+           "micro", intf, result.walk_ns, result.compile_ns, result.ring_ns);
+}
+
+//Append one native capture record, returns the new length or 0 when it does not fit
+static size_t bench_capture_put(size_t off, uint8_t type, uint8_t dev_addr, uint8_t ep_addr, const uint8_t *data,
+                                uint16_t len, uint64_t timestamp_us)
+{
+    if (off == 0 || off + sizeof(hid_capture_rec_t) + len > BENCH_CAPTURE_BYTES) {
+        return 0;
+    }
+    hid_capture_rec_t rec = { (uint32_t)timestamp_us, type, dev_addr, ep_addr, USB_TRANSFER_STATUS_COMPLETED, len };
+    memcpy(s_bench_capture + off, &rec, sizeof(rec));
+    memcpy(s_bench_capture + off + sizeof(rec), data, len);
+    return off + sizeof(rec) + len;
+}
+
+/**
+ * Record num_devices simulated devices polled every b_interval frames as a
+ * native capture. Returns its length, 0 if BENCH_REPLAY_MS did not fit.
+ */
+static size_t bench_capture_bus(const sim_device_script_t *script, uint8_t num_devices, uint8_t b_interval)
+{
+    static sim_bus_t bus;
+    static sim_event_t event;
+    memset(&bus, 0, sizeof(bus));
+    for (uint8_t d = 0; d < num_devices; d++) {
+        //Staggered so the devices do not all report on the same microsecond
+        sim_device_t *dev = sim_bus_add(&bus, script, d + 1, d * 100, 0, 1);
+        for (int e = 0; dev && e < dev->num_eps; e++) {
+            dev->eps[e].interval_us = b_interval * 1000;
+        }
+    }
+
+    hid_capture_file_t file = { HID_CAPTURE_MAGIC, HID_CAPTURE_VERSION, sizeof(hid_capture_rec_t) };
+    memcpy(s_bench_capture, &file, sizeof(file));
+    size_t off = sizeof(file);
+    uint8_t ctrl[USB_SETUP_PACKET_SIZE + 256];
+    while (sim_bus_next_event(&bus, BENCH_REPLAY_MS * 1000ull, &event)) {
+        size_t next = off;
+        uint8_t dev_addr = event.dev->dev_addr;
+        if (event.type == SIM_EVENT_ATTACH) {
+            const uint8_t *config = script->config_desc;
+            next = bench_capture_put(next, HID_CAPTURE_REC_ATTACH, dev_addr, 0, script->dev_desc, 18, event.time_us);
+            next = bench_capture_put(next, HID_CAPTURE_REC_CONFIG_DESC, dev_addr, 0, config, desc_le16(config + 2), event.time_us);
+            //GET_DESCRIPTOR(report) of every interface, the way the enumeration captured it
+            for (uint8_t n = 0; n < SIM_MAX_INTFS && script->report_descs[n]; n++) {
+                uint16_t len = script->report_desc_lens[n];
+                uint8_t setup[USB_SETUP_PACKET_SIZE] = { 0x81, USB_B_REQUEST_GET_DESCRIPTOR, 0x00, 0x22, n, 0x00,
+                                                         (uint8_t)len, (uint8_t)(len >> 8) };
+                memcpy(ctrl, setup, sizeof(setup));
+                memcpy(ctrl + sizeof(setup), script->report_descs[n], len);
+                next = bench_capture_put(next, HID_CAPTURE_REC_CTRL, dev_addr, 0, ctrl, sizeof(setup) + len, event.time_us);
+            }
+        } else if (event.type == SIM_EVENT_REPORT) {
+            next = bench_capture_put(next, HID_CAPTURE_REC_IN, dev_addr, event.ep_addr, event.data, event.len, event.time_us);
+        }
+        if (next == 0) {
+            return 0;
+        }
+        off = next;
+    }
+    return off;
+}
+
+static void bench_latency_cb(const hid_report_event_t *event, void *arg)
+{
+    latency_hist_record((latency_hist_t *)arg, esp_timer_get_time() - event->timestamp_us);
+}
+
+/**
+ * Record num_devices simulated devices at b_interval, then replay the
+ * capture through usb_class_driver_replay() as fast as it goes: ring,
+ * filter, decoder, state snapshot and a subscriber timing each report.
+ * Must run while usb_class_driver_task() is not. Returns false if the
+ * capture did not fit or the replay was refused.
+ */
+static bool bench_replay(const sim_device_script_t *script, uint8_t num_devices, uint8_t b_interval,
+                         bench_replay_result_t *result)
+{
+    size_t len = bench_capture_bus(script, num_devices, b_interval);
+    memset(result, 0, sizeof(bench_replay_result_t));
+    if (len == 0) {
+        return false;
+    }
+    latency_hist_reset(&s_bench_latency);
+    report_sub_t sub = { REPORT_SUB_ANY_DEVICE, REPORT_SUB_ANY_INTERFACE, REPORT_SUB_ANY_REPORT, 0,
+                         bench_latency_cb, &s_bench_latency };
+    int handle = usb_class_driver_subscribe(&sub);
+
+    multi_heap_info_t before;
+    multi_heap_info_t after;
+    replay_stats_t stats;
+    heap_caps_get_info(&before, MALLOC_CAP_8BIT);
+    bool replayed = usb_class_driver_replay(s_bench_capture, len, false, &stats);
+    heap_caps_get_info(&after, MALLOC_CAP_8BIT);
+    if (handle >= 0) {
+        usb_class_driver_unsubscribe(handle);
+    }
+    if (!replayed || stats.reports == 0) {
+        return false;
+    }
+    result->reports = stats.reports;
+    result->offered_hz = (stats.captured_us > 0) ? (uint32_t)((int64_t)stats.reports * 1000000 / stats.captured_us) : 0;
+    result->replay_hz = (stats.elapsed_us > 0) ? (uint32_t)((int64_t)stats.reports * 1000000 / stats.elapsed_us) : 0;
+    result->p50_us = latency_hist_percentile(&s_bench_latency, 50);
+    result->p99_us = latency_hist_percentile(&s_bench_latency, 99);
+    result->heap_blocks = (int32_t)after.allocated_blocks - (int32_t)before.allocated_blocks;
+    return true;
+}
+
+static void bench_replay_print(uint8_t num_devices, uint8_t b_interval)
+{
+    bench_replay_result_t result;
+    if (!bench_replay(&s_sim_nb4_script, num_devices, b_interval, &result)) {
+        printf("%-12s %u devices, bInterval %2u: not replayed\n", "replay", num_devices, b_interval);
+        s_bench_regressions++;
+        return;
+    }
+    printf("%-12s %u devices, bInterval %2u: %5u reports, %5u reports/s offered, %6u reports/s replayed, "
+           "p50 <%u us, p99 <%u us, %d heap blocks\n",
+           "replay", num_devices, b_interval, result.reports, result.offered_hz, result.replay_hz,
+           result.p50_us, result.p99_us, result.heap_blocks);
+    char metric[40];
+    snprintf(metric, sizeof(metric), "replay.%ux%u.reports", num_devices, b_interval);
+    bench_check(metric, result.reports, true);
+    snprintf(metric, sizeof(metric), "replay.%ux%u.heap_blocks", num_devices, b_interval);
+    bench_check(metric, result.heap_blocks > 0 ? result.heap_blocks : 0, false);
+}
+
+#ifdef MOCK_USB_HOST
+/**
+ * Plug num_devices simulated devices polled every b_interval frames into
+ * the mock host library and run the pipeline for BENCH_SCENARIO_MS once
+ * they stream: the class driver, the report workers and a subscriber
+ * timing each report, with the application writing an output report to
+ * every interface each BENCH_OUTPUT_US. Returns false if a device did not
+ * stream.
+ */
+static bool bench_scenario(const sim_device_script_t *script, uint8_t num_devices, uint8_t b_interval,
+                           bench_scenario_result_t *result)
+{
+    memset(result, 0, sizeof(bench_scenario_result_t));
+    latency_hist_reset(&s_bench_latency);
+    report_sub_t sub = { REPORT_SUB_ANY_DEVICE, REPORT_SUB_ANY_INTERFACE, REPORT_SUB_ANY_REPORT, 0,
+                         bench_latency_cb, &s_bench_latency };
+    int handle = usb_class_driver_subscribe(&sub);
+    bool streaming = bench_driver_start(script, num_devices, b_interval);
+    if (streaming) {
+        uint32_t reports = 0;
+        for (int d = 0; d < CLASS_MAX_DEVICES; d++) {
+            const hid_device_t *dev = &s_driver_obj.devices[d];
+            for (int n = 0; n < dev->num_intfs; n++) {
+                reports += dev->intfs[n].stream_stats.reports;
+            }
+        }
+        for (uint8_t d = 0; d < num_devices; d++) {
+            mock_usb_sim_stats(&s_bench_bus.devices[d])->in_missed = 0;
+            mock_usb_sim_stats(&s_bench_bus.devices[d])->ep0_max_depth = 0;
+        }
+        latency_hist_reset(&s_bench_latency);
+        TaskHandle_t class_driver = s_bench_pipeline.class_driver;
+        uint32_t runs = class_driver->runs;
+        int64_t cpu_ns = class_driver->cpu_ns;
+        multi_heap_info_t before;
+        multi_heap_info_t after;
+        heap_caps_get_info(&before, MALLOC_CAP_8BIT);
+        int64_t end_us = mock_rtos_now_us() + BENCH_SCENARIO_MS * 1000;
+        uint32_t value = 0;
+        while (mock_rtos_now_us() < end_us) {
+            value++;
+            for (uint8_t d = 0; OUTPUT_REPORTS_ENABLED && d < num_devices; d++) {
+                for (uint8_t n = 0; n < SIM_MAX_INTFS && script->report_descs[n]; n++) {
+                    result->out_written++;
+                    usb_class_driver_write_output(d + 1, n, 0, (const uint8_t *)&value, sizeof(value));
+                }
+            }
+            mock_rtos_run_for(BENCH_OUTPUT_US);
+        }
+        heap_caps_get_info(&after, MALLOC_CAP_8BIT);
+        for (int d = 0; d < CLASS_MAX_DEVICES; d++) {
+            const hid_device_t *dev = &s_driver_obj.devices[d];
+            for (int n = 0; n < dev->num_intfs; n++) {
+                result->reports += dev->intfs[n].stream_stats.reports;
+                result->out_sent += dev->intfs[n].out_sent;
+            }
+        }
+        result->reports -= reports;
+        if (result->reports) {
+            result->wakeups = (class_driver->runs - runs) * 100 / result->reports;
+            result->cpu_ns = (uint32_t)((class_driver->cpu_ns - cpu_ns) / result->reports);
+        }
+        for (uint8_t d = 0; d < num_devices; d++) {
+            const mock_usb_stats_t *stats = mock_usb_sim_stats(&s_bench_bus.devices[d]);
+            result->missed += stats->in_missed;
+            if (stats->ep0_max_depth > result->ep0_max_depth) {
+                result->ep0_max_depth = stats->ep0_max_depth;
+            }
+        }
+        result->delivered = s_bench_latency.count;
+        result->p50_us = latency_hist_percentile(&s_bench_latency, 50);
+        result->p99_us = latency_hist_percentile(&s_bench_latency, 99);
+        result->heap_blocks = (int32_t)after.allocated_blocks - (int32_t)before.allocated_blocks;
+    }
+    bench_driver_stop();
+    if (handle >= 0) {
+        usb_class_driver_unsubscribe(handle);
+    }
+    return streaming;
+}
+
+static void bench_scenario_print(uint8_t num_devices, uint8_t b_interval)
+{
+    bench_scenario_result_t result;
+    if (!bench_scenario(&s_sim_nb4_script, num_devices, b_interval, &result)) {
+        printf("%-12s %u devices, bInterval %2u: did not stream\n", "scenario", num_devices, b_interval);
+        s_bench_regressions++;
+        return;
+    }
+    printf("%-12s %u devices, bInterval %2u: %5u reports, %5u delivered, %u missed slots, p50 <%u us, p99 <%u us, "
+           "%u of %u outputs sent, EP0 depth %u, %d heap blocks, class driver %u wakeups per 100 reports, %u ns per report\n",
+           "scenario", num_devices, b_interval, result.reports, result.delivered, result.missed,
+           result.p50_us, result.p99_us, result.out_sent, result.out_written, result.ep0_max_depth, result.heap_blocks,
+           result.wakeups, result.cpu_ns);
+    char metric[40];
+    snprintf(metric, sizeof(metric), "scenario.%ux%u.reports", num_devices, b_interval);
+    bench_check(metric, result.reports, true);
+    snprintf(metric, sizeof(metric), "scenario.%ux%u.delivered", num_devices, b_interval);
+    bench_check(metric, result.delivered, true);
+    snprintf(metric, sizeof(metric), "scenario.%ux%u.missed", num_devices, b_interval);
+    bench_check(metric, result.missed, false);
+    snprintf(metric, sizeof(metric), "scenario.%ux%u.p99_us", num_devices, b_interval);
+    bench_check(metric, result.p99_us, false);
+    snprintf(metric, sizeof(metric), "scenario.%ux%u.out_sent", num_devices, b_interval);
+    bench_check(metric, result.out_sent, true);
+    snprintf(metric, sizeof(metric), "scenario.%ux%u.ep0_max_depth", num_devices, b_interval);
+    bench_check(metric, result.ep0_max_depth, false);
+    snprintf(metric, sizeof(metric), "scenario.%ux%u.heap_blocks", num_devices, b_interval);
+    bench_check(metric, result.heap_blocks > 0 ? result.heap_blocks : 0, false);
+    snprintf(metric, sizeof(metric), "scenario.%ux%u.wakeups", num_devices, b_interval);
+    bench_check(metric, result.wakeups, false);
+}
+#endif
+
+static size_t bench_forward_writer(const report_iov_t *iov, size_t count, void *)
+{
+    size_t bytes = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t len = iov[i].len;
+        for (size_t done = 0; done < len;) {
+            uint32_t off = s_bench_forward_pos % BENCH_FORWARD_OUT_BYTES;
+            size_t n = (len - done < BENCH_FORWARD_OUT_BYTES - off) ? len - done : BENCH_FORWARD_OUT_BYTES - off;
+            memcpy(s_bench_forward_out + off, (const uint8_t *)iov[i].data + done, n);
+            s_bench_forward_pos += n;
+            done += n;
+        }
+        bytes += len;
+    }
+    return bytes;
+}
+
+//The copy-based forwarder: every ring slot is framed into a buffer of its own, then written whole
+static void bench_forward_copy(const report_slot_t *slot, void *arg)
+{
+    uint8_t *frame = s_bench_frame + s_bench_frame_len;
+    frame[0] = slot->dev_addr;
+    frame[1] = slot->ep_addr;
+    frame[2] = (uint8_t)slot->len;
+    frame[3] = (uint8_t)(slot->len >> 8);
+    memcpy(frame + 4, slot->data, slot->len);
+    s_bench_frame_len += 4 + slot->len;
+    s_bench_copies++;
+    (*(uint32_t *)arg)++;
+}
+
+static void bench_forward_copy_flush(uint32_t count)
+{
+    uint8_t check = REPORT_FRAME_SYNC ^ (uint8_t)count;
+    s_bench_frame[0] = REPORT_FRAME_SYNC;
+    s_bench_frame[1] = (uint8_t)count;
+    for (uint32_t b = 2; b < s_bench_frame_len; b++) {
+        check ^= s_bench_frame[b];
+    }
+    s_bench_frame[s_bench_frame_len++] = check;
+    report_iov_t iov = { s_bench_frame, s_bench_frame_len };
+    bench_forward_writer(&iov, 1, NULL);
+}
+
+/**
+ * Forward reports of interface intf in batches of batch, the way a bridge
+ * did before sinks: ring push, then framing each slot into a buffer. Then
+ * through a report_frame_sink_t sink lent the report buffers. Both end in
+ * the same writer, the copies it makes are not counted.
+ */
+static bool bench_forward(const sim_device_script_t *script, uint8_t intf, uint8_t batch, bench_forward_result_t *result)
+{
+    if (intf >= SIM_MAX_INTFS || batch < 1 || batch > REPORT_SINK_BATCH_MAX || batch > TRANSFER_IN_FLIGHT_NUM) {
+        return false;
+    }
+    uint16_t len = script->report_lens[intf] ? script->report_lens[intf] : SIM_MAX_REPORT_BYTES;
+    static uint8_t buffers[TRANSFER_IN_FLIGHT_NUM][SIM_MAX_REPORT_BYTES];
+    for (int i = 0; i < TRANSFER_IN_FLIGHT_NUM; i++) {
+        sim_fill_default(0x80 | intf, i, buffers[i], len);
+    }
+    uint32_t rounds = BENCH_CPU_ROUNDS / batch;
+    uint32_t reports = rounds * batch;
+    memset(result, 0, sizeof(bench_forward_result_t));
+
+    report_ring_init(&s_bench_ring);
+    s_bench_copies = 0;
+    s_bench_forward_pos = 0;
+    int64_t start_us = esp_timer_get_time();
+    for (uint32_t r = 0; r < rounds; r++) {
+        for (uint8_t k = 0; k < batch; k++) {
+            report_ring_push(&s_bench_ring, 1, 0x80 | intf, buffers[k], len, start_us);
+            s_bench_copies++;
+        }
+        uint32_t count = 0;
+        s_bench_frame_len = 2;
+        report_ring_drain(&s_bench_ring, bench_forward_copy, &count, REPORT_SINK_BATCH_MAX);
+        bench_forward_copy_flush(count);
+    }
+    result->copy_ns = (uint32_t)((esp_timer_get_time() - start_us) * 1000 / reports);
+    result->copy_copies = s_bench_copies * 100 / reports;
+    result->copy_bytes = s_bench_forward_pos / reports;
+
+    static report_frame_sink_t frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.writer = bench_forward_writer;
+    report_sink_t sink = { "bench", REPORT_SINK_ANY_DEVICE, report_frame_sink_write, &frame };
+    int handle = report_sink_add(&s_bench_sinks, &sink);
+    report_sink_sync(&s_bench_sinks);
+    s_bench_copies = 0;
+    s_bench_forward_pos = 0;
+    start_us = esp_timer_get_time();
+    for (uint32_t r = 0; r < rounds; r++) {
+        for (uint8_t k = 0; k < batch; k++) {
+            report_lease_t *lease = &s_bench_leases.leases[k];
+            lease->data = buffers[k];
+            lease->len = len;
+            lease->dev_addr = 1;
+            lease->ep_addr = 0x80 | intf;
+            lease->timestamp_us = start_us;
+            lease->index = k;
+            lease->returned = &s_bench_leases.returned;
+            report_sink_lend(&s_bench_sinks, lease);
+        }
+        report_sink_service(&s_bench_sinks);
+        s_bench_leases.returned.exchange(0, std::memory_order_acquire);
+    }
+    result->lend_ns = (uint32_t)((esp_timer_get_time() - start_us) * 1000 / reports);
+    result->lend_copies = s_bench_copies * 100 / reports;
+    result->lend_bytes = s_bench_forward_pos / reports;
+    report_sink_remove(&s_bench_sinks, handle);
+    report_sink_sync(&s_bench_sinks);
+    report_sink_service(&s_bench_sinks);
+    return true;
+}
+
+static void bench_forward_print(uint8_t intf, uint8_t batch)
+{
+    bench_forward_result_t result;
+    if (!bench_forward(&s_sim_nb4_script, intf, batch, &result)) {
+        return;
+    }
+    printf("%-12s intf %d, batch %u: copied %u ns/report, %u.%02u copies, lent %u ns/report, %u.%02u copies, "
+           "%u/%u B written per report\n",
+           "forward", intf, batch, result.copy_ns, result.copy_copies / 100, result.copy_copies % 100,
+           result.lend_ns, result.lend_copies / 100, result.lend_copies % 100, result.copy_bytes, result.lend_bytes);
+    char metric[40];
+    snprintf(metric, sizeof(metric), "forward.%u.%u.copies", intf, batch);
+    bench_check(metric, result.lend_copies, false);
+    snprintf(metric, sizeof(metric), "forward.%u.%u.bytes", intf, batch);
+    bench_check(metric, result.lend_bytes, false);
+}
+
+static void bench_summary_print(void)
+{
+    printf("%d metrics, %u compared against the baseline, %u regressions\n",
+           s_bench_num_metrics, s_bench_compared, s_bench_regressions);
+    if (BENCH_PRINT_BASELINE) {
+        for (int i = 0; i < s_bench_num_metrics; i++) {
+            printf("    { \"%s\", %u },\n", s_bench_metrics[i].name, s_bench_metrics[i].value);
+        }
+    }
+}
+
+/**
+ * Run every benchmark and print the results. Returns the number of
+ * regressions against s_bench_baseline, counting a scenario that could not
+ * run as one.
+ */
+static uint32_t usb_hid_bench_run(void)
+{
+    s_bench_num_metrics = 0;
+    s_bench_regressions = 0;
+    s_bench_compared = 0;
+#ifdef MOCK_USB_HOST
+    //CPU times need the real clock, the scenarios below set the virtual one back
+    mock_rtos_set_realtime(true);
+#endif
+    printf("\nBenchmarks, %u ms of virtual time each\n", BENCH_DURATION_MS);
+    //NB4 interface 0 has an interrupt OUT endpoint at bInterval 1, interface 1 falls back to SET_REPORT
+    static const uint32_t write_hz[] = { 250, 1000, 4000 };
+    for (size_t i = 0; i < sizeof(write_hz) / sizeof(write_hz[0]); i++) {
+        bench_output_print("output", 0, write_hz[i], 1);
+        bench_output_print("output", 0, write_hz[i], 2);
+        bench_output_print("set_report", 1, write_hz[i], 2);
+    }
+    bench_decode_print(1);
+    bench_micro_print(1);
+    bench_forward_print(1, 1);
+    bench_forward_print(1, TRANSFER_IN_FLIGHT_NUM);
+    //Up to CLASS_MAX_DEVICES gamepads at the fastest full-speed poll and at the NB4's own bInterval
+    static const uint8_t num_devices[] = { 1, CLASS_MAX_DEVICES };
+    static const uint8_t b_intervals[] = { 1, 3 };
+    for (size_t i = 0; i < sizeof(num_devices) / sizeof(num_devices[0]); i++) {
+        for (size_t j = 0; j < sizeof(b_intervals) / sizeof(b_intervals[0]); j++) {
+            bench_replay_print(num_devices[i], b_intervals[j]);
+        }
+    }
+#ifdef MOCK_USB_HOST
+    mock_rtos_set_realtime(false);
+    bench_recovery_print(1);
+    for (size_t i = 0; i < sizeof(num_devices) / sizeof(num_devices[0]); i++) {
+        for (size_t j = 0; j < sizeof(b_intervals) / sizeof(b_intervals[0]); j++) {
+            bench_scenario_print(num_devices[i], b_intervals[j]);
+        }
+    }
+#else
+    printf("%-12s need the simulated host library of the native build, skipped\n", "recovery, scenario");
+#endif
+    bench_summary_print();
+    return s_bench_regressions;
+}
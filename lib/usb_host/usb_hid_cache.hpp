@@ -0,0 +1,108 @@
+/*
+ * Persistent enumeration cache in NVS
+ *
+ * Entries are keyed by idVendor/idProduct/bcdDevice and carry a hash of the
+ * config descriptor, so a device that reports the same identity but a
+ * different configuration misses the cache instead of reusing stale data.
+ * The entry body is opaque here; the caller defines a struct that starts
+ * with hid_cache_header_t. Entries written by a build with a different body
+ * layout are rejected by size and version.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "esp_log.h"
+#include "nvs.h"
+#include "nvs_flash.h"
+
+#define HID_CACHE_NAMESPACE         "hid_cache"
+#define HID_CACHE_VERSION           1       //Bump whenever a cached struct changes meaning
+#define HID_CACHE_KEY_LEN           16      //NVS keys are at most 15 characters
+
+typedef struct {
+    uint16_t version;
+    uint16_t size;              //sizeof the whole entry, header included
+    uint32_t config_hash;
+} hid_cache_header_t;
+
+static const char *TAG_CACHE = "CACHE";
+
+//32-bit FNV-1a
+static uint32_t hid_cache_hash(const uint8_t *data, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void hid_cache_key(char key[HID_CACHE_KEY_LEN], uint16_t vid, uint16_t pid, uint16_t bcd_device)
+{
+    snprintf(key, HID_CACHE_KEY_LEN, "%04x%04x%04x", vid, pid, bcd_device);
+}
+
+static bool hid_cache_init(void)
+{
+    esp_err_t err = nvs_flash_init();
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG_CACHE, "nvs init %s, cache disabled", esp_err_to_name(err));
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Read the entry for key into entry (size bytes). Returns false on a miss,
+ * including entries from another build or for another configuration.
+ */
+static bool hid_cache_load(const char *key, uint32_t config_hash, hid_cache_header_t *entry, size_t size)
+{
+    nvs_handle_t nvs;
+    if (nvs_open(HID_CACHE_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+        return false;
+    }
+    size_t len = size;
+    esp_err_t err = nvs_get_blob(nvs, key, entry, &len);
+    nvs_close(nvs);
+    return err == ESP_OK && len == size &&
+           entry->version == HID_CACHE_VERSION && entry->size == size &&
+           entry->config_hash == config_hash;
+}
+
+static bool hid_cache_store(const char *key, uint32_t config_hash, hid_cache_header_t *entry, size_t size)
+{
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open(HID_CACHE_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG_CACHE, "open %s", esp_err_to_name(err));
+        return false;
+    }
+    entry->version = HID_CACHE_VERSION;
+    entry->size = (uint16_t)size;
+    entry->config_hash = config_hash;
+    err = nvs_set_blob(nvs, key, entry, size);
+    if (err == ESP_OK) {
+        err = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG_CACHE, "store %s: %s", key, esp_err_to_name(err));
+        return false;
+    }
+    return true;
+}
+
+static void hid_cache_erase(const char *key)
+{
+    nvs_handle_t nvs;
+    if (nvs_open(HID_CACHE_NAMESPACE, NVS_READWRITE, &nvs) == ESP_OK) {
+        nvs_erase_key(nvs, key);
+        nvs_commit(nvs);
+        nvs_close(nvs);
+    }
+}
@@ -0,0 +1,420 @@
+/*
+ * Binary capture of HID traffic
+ *
+ * The class driver appends the descriptors, every control transfer and
+ * every IN and OUT report, full length and timestamped, to a preallocated
+ * byte ring. usb_hid_capture_task() streams the ring out from a low
+ * priority task, either as native records, which usb_class_driver_replay()
+ * feeds back through the decode path, or as a pcap file with Linux usbmon
+ * headers that Wireshark dissects. A record that does not fit is dropped
+ * whole and counted; the transfer path never waits.
+ *
+ * Compiled out unless HID_CAPTURE_ENABLED is set. The default sink is the
+ * console, so turn the text output off (CORE_DEBUG_LEVEL=0,
+ * HID_LOG_COMPILE_MASK=0) or set another sink with hid_capture_set_sink().
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <atomic>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#ifndef HID_CAPTURE_ENABLED
+#define HID_CAPTURE_ENABLED         0       //Build with -DHID_CAPTURE_ENABLED=1 to record
+#endif
+#define HID_CAPTURE_BUFFER_BYTES    16384   //Must be a power of two
+#define HID_CAPTURE_MAX_RECORD_BYTES 2048   //Header included, longer records are dropped
+#define HID_CAPTURE_FLUSH_MS        20      //How often usb_hid_capture_task() drains the ring
+// #define HID_CAPTURE_OUTPUT_PCAP             //Stream pcap with usbmon headers instead of native records
+
+#define HID_CAPTURE_MAGIC           0x50414348  //"HCAP"
+#define HID_CAPTURE_VERSION         1
+#define HID_CAPTURE_PCAP_BUS        1       //usbmon bus number in exported files
+
+typedef enum {
+    HID_CAPTURE_REC_ATTACH,     //data: device descriptor
+    HID_CAPTURE_REC_CONFIG_DESC,//data: active configuration descriptor, wTotalLength bytes
+    HID_CAPTURE_REC_LAYOUT,     //ep_addr: bInterfaceNumber, data: hid_report_layout_t of this build (cache hits)
+    HID_CAPTURE_REC_CTRL,       //data: setup packet, then the data stage
+    HID_CAPTURE_REC_IN,         //data: report, none if status is not COMPLETED
+    HID_CAPTURE_REC_OUT,        //data: report sent on the interrupt OUT endpoint
+    HID_CAPTURE_REC_DETACH,
+    HID_CAPTURE_REC_MAX,
+} hid_capture_rec_type_t;
+
+//Starts every native capture, records follow back to back
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t rec_bytes;         //sizeof(hid_capture_rec_t)
+} hid_capture_file_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t timestamp_us;      //Low 32 bits of esp_timer, wraps after 71 minutes
+    uint8_t type;               //hid_capture_rec_type_t
+    uint8_t dev_addr;
+    uint8_t ep_addr;
+    uint8_t status;             //usb_transfer_status_t
+    uint16_t len;               //Data bytes following the header
+} hid_capture_rec_t;
+
+typedef size_t (*hid_capture_sink_t)(const void *data, size_t len, void *arg);
+
+//Sink that fills a buffer, e.g. to replay a session without leaving the target
+typedef struct {
+    uint8_t *buf;
+    size_t size;
+    size_t len;
+} hid_capture_mem_t;
+
+//usbmon conversion state, records must be fed in capture order
+typedef struct {
+    uint64_t id;                //URB id, shared by the submit and complete of a transfer
+    uint32_t last_us;
+    uint32_t wraps;
+} hid_capture_pcap_t;
+
+typedef struct {
+    std::atomic<uint32_t> head;                 //Written by the class driver task only
+    std::atomic<uint32_t> tail;
+    std::atomic<uint32_t> dropped;
+    std::atomic<bool> enabled;
+    hid_capture_sink_t sink;                    //NULL for the console
+    void *sink_arg;
+    hid_capture_pcap_t pcap;
+    uint8_t buf[HID_CAPTURE_BUFFER_BYTES];
+    uint8_t scratch[HID_CAPTURE_MAX_RECORD_BYTES];  //usb_hid_capture_task() only
+} hid_capture_t;
+
+static hid_capture_t s_hid_capture;
+
+//Indexed by usb_transfer_status_t, usbmon reports the URB's -errno
+static const int32_t s_hid_capture_usbmon_status[] = {
+    0,          //COMPLETED
+    -71,        //ERROR, -EPROTO
+    -110,       //TIMED_OUT, -ETIMEDOUT
+    -2,         //CANCELED, -ENOENT
+    -32,        //STALL, -EPIPE
+    -75,        //OVERFLOW, -EOVERFLOW
+    -18,        //SKIPPED, -EXDEV
+    -19,        //NO_DEVICE, -ENODEV
+};
+
+static void hid_capture_set_enabled(bool enabled)
+{
+    s_hid_capture.enabled.store(HID_CAPTURE_ENABLED && enabled, std::memory_order_relaxed);
+}
+
+/**
+ * Call before usb_hid_capture_task() starts.
+ */
+static inline void hid_capture_set_sink(hid_capture_sink_t sink, void *arg)
+{
+    s_hid_capture.sink = sink;
+    s_hid_capture.sink_arg = arg;
+}
+
+static inline uint32_t hid_capture_get_dropped(void)
+{
+    return s_hid_capture.dropped.load(std::memory_order_relaxed);
+}
+
+static void hid_capture_copy_in(hid_capture_t *cap, uint32_t pos, const void *src, size_t len)
+{
+    size_t off = pos & (HID_CAPTURE_BUFFER_BYTES - 1);
+    size_t first = (len < HID_CAPTURE_BUFFER_BYTES - off) ? len : HID_CAPTURE_BUFFER_BYTES - off;
+    if (len) {
+        memcpy(cap->buf + off, src, first);
+        memcpy(cap->buf, (const uint8_t *)src + first, len - first);
+    }
+}
+
+static void hid_capture_copy_out(const hid_capture_t *cap, uint32_t pos, void *dst, size_t len)
+{
+    size_t off = pos & (HID_CAPTURE_BUFFER_BYTES - 1);
+    size_t first = (len < HID_CAPTURE_BUFFER_BYTES - off) ? len : HID_CAPTURE_BUFFER_BYTES - off;
+    if (len) {
+        memcpy(dst, cap->buf + off, first);
+        memcpy((uint8_t *)dst + first, cap->buf, len - first);
+    }
+}
+
+/**
+ * Class driver task only. Append one record without blocking; when the
+ * ring has no room for all of it the record is counted as dropped.
+ */
+static bool hid_capture_write(uint8_t type, uint8_t dev_addr, uint8_t ep_addr, uint8_t status,
+                              const uint8_t *data, size_t len, int64_t timestamp_us)
+{
+    hid_capture_t *cap = &s_hid_capture;
+    size_t total = sizeof(hid_capture_rec_t) + len;
+    uint32_t head = cap->head.load(std::memory_order_relaxed);
+    uint32_t used = head - cap->tail.load(std::memory_order_acquire);
+    if (total > HID_CAPTURE_MAX_RECORD_BYTES || HID_CAPTURE_BUFFER_BYTES - used < total) {
+        cap->dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    hid_capture_rec_t rec = { (uint32_t)timestamp_us, type, dev_addr, ep_addr, status, (uint16_t)len };
+    hid_capture_copy_in(cap, head, &rec, sizeof(rec));
+    hid_capture_copy_in(cap, head + sizeof(rec), data, len);
+    cap->head.store(head + total, std::memory_order_release);
+    return true;
+}
+
+//Compiles to nothing unless HID_CAPTURE_ENABLED is set
+#define HID_CAPTURE(type, dev_addr, ep_addr, status, data, len, timestamp_us)                          \
+    do {                                                                                                \
+        if (HID_CAPTURE_ENABLED && s_hid_capture.enabled.load(std::memory_order_relaxed)) {             \
+            hid_capture_write((type), (dev_addr), (ep_addr), (uint8_t)(status),                         \
+                              (const uint8_t *)(data), (len), (timestamp_us));                          \
+        }                                                                                               \
+    } while (0)
+
+/**
+ * Step over one record of a native capture. *off starts right after the
+ * hid_capture_file_t. Returns false at the end or on a truncated record.
+ */
+static bool hid_capture_next(const uint8_t *capture, size_t len, size_t *off, hid_capture_rec_t *rec,
+                             const uint8_t **data)
+{
+    if (*off + sizeof(hid_capture_rec_t) > len) {
+        return false;
+    }
+    memcpy(rec, capture + *off, sizeof(hid_capture_rec_t));
+    if (*off + sizeof(hid_capture_rec_t) + rec->len > len) {
+        return false;
+    }
+    *data = capture + *off + sizeof(hid_capture_rec_t);
+    *off += sizeof(hid_capture_rec_t) + rec->len;
+    return true;
+}
+
+/**
+ * Returns the offset of the first record, or 0 if capture is not a native
+ * capture this build can read.
+ */
+static size_t hid_capture_check(const uint8_t *capture, size_t len)
+{
+    hid_capture_file_t file;
+    if (len < sizeof(file)) {
+        return 0;
+    }
+    memcpy(&file, capture, sizeof(file));
+    if (file.magic != HID_CAPTURE_MAGIC || file.version != HID_CAPTURE_VERSION ||
+        file.rec_bytes != sizeof(hid_capture_rec_t)) {
+        return 0;
+    }
+    return sizeof(file);
+}
+
+static void hid_capture_pcap_header(hid_capture_pcap_t *pcap, hid_capture_sink_t sink, void *arg)
+{
+    //pcap 2.4, microsecond timestamps, LINKTYPE_USB_LINUX
+    static const uint32_t header[6] = { 0xA1B2C3D4, 0x00040002, 0, 0, 65535, 189 };
+    memset(pcap, 0, sizeof(hid_capture_pcap_t));
+    sink(header, sizeof(header), arg);
+}
+
+//One usbmon event: 'S'ubmit or 'C'omplete
+static void hid_capture_usbmon(hid_capture_pcap_t *pcap, uint64_t ts_us, char type, uint8_t xfer_type, uint8_t ep_addr,
+                               uint8_t dev_addr, int32_t status, const uint8_t *setup, const uint8_t *data,
+                               uint32_t len, uint32_t urb_len, hid_capture_sink_t sink, void *arg)
+{
+    struct __attribute__((packed)) {
+        uint32_t ts_sec;
+        uint32_t ts_usec;
+        uint32_t incl_len;
+        uint32_t orig_len;
+        uint64_t id;
+        uint8_t type;
+        uint8_t xfer_type;      //0 isochronous, 1 interrupt, 2 control, 3 bulk
+        uint8_t epnum;
+        uint8_t devnum;
+        uint16_t busnum;
+        int8_t flag_setup;      //0 when setup is valid
+        int8_t flag_data;       //0 when data follows
+        int64_t sec;
+        int32_t usec;
+        int32_t status;
+        uint32_t length;
+        uint32_t len_cap;
+        uint8_t setup[8];
+    } hdr;
+    hdr.ts_sec = (uint32_t)(ts_us / 1000000);
+    hdr.ts_usec = (uint32_t)(ts_us % 1000000);
+    hdr.incl_len = hdr.orig_len = 48 + len;
+    hdr.id = pcap->id;
+    hdr.type = (uint8_t)type;
+    hdr.xfer_type = xfer_type;
+    hdr.epnum = ep_addr;
+    hdr.devnum = dev_addr;
+    hdr.busnum = HID_CAPTURE_PCAP_BUS;
+    hdr.flag_setup = setup ? 0 : '-';
+    hdr.flag_data = len ? 0 : ((ep_addr & 0x80) ? '<' : '>');
+    hdr.sec = hdr.ts_sec;
+    hdr.usec = hdr.ts_usec;
+    hdr.status = status;
+    hdr.length = urb_len;
+    hdr.len_cap = len;
+    if (setup) {
+        memcpy(hdr.setup, setup, 8);
+    } else {
+        memset(hdr.setup, 0, 8);
+    }
+    sink(&hdr, sizeof(hdr), arg);
+    if (len) {
+        sink(data, len, arg);
+    }
+}
+
+/**
+ * Convert one native record to usbmon events. Descriptors the host library
+ * read during enumeration come out as GET_DESCRIPTOR transfers; layout and
+ * detach records have no usbmon counterpart and are skipped.
+ */
+static void hid_capture_pcap_record(hid_capture_pcap_t *pcap, const hid_capture_rec_t *rec, const uint8_t *data,
+                                    hid_capture_sink_t sink, void *arg)
+{
+    if (rec->timestamp_us < pcap->last_us) {
+        pcap->wraps++;
+    }
+    pcap->last_us = rec->timestamp_us;
+    uint64_t ts_us = ((uint64_t)pcap->wraps << 32) | rec->timestamp_us;
+    int32_t status = (rec->status < sizeof(s_hid_capture_usbmon_status) / sizeof(s_hid_capture_usbmon_status[0])) ?
+                     s_hid_capture_usbmon_status[rec->status] : -71;
+    pcap->id++;
+
+    switch (rec->type) {
+        case HID_CAPTURE_REC_ATTACH:
+        case HID_CAPTURE_REC_CONFIG_DESC: {
+            uint8_t setup[8] = { 0x80, 0x06, 0x00, (uint8_t)((rec->type == HID_CAPTURE_REC_ATTACH) ? 0x01 : 0x02),
+                                 0x00, 0x00, (uint8_t)rec->len, (uint8_t)(rec->len >> 8) };
+            hid_capture_usbmon(pcap, ts_us, 'S', 2, 0x80, rec->dev_addr, -115, setup, NULL, 0, rec->len, sink, arg);
+            hid_capture_usbmon(pcap, ts_us, 'C', 2, 0x80, rec->dev_addr, 0, NULL, data, rec->len, rec->len, sink, arg);
+            break;
+        }
+        case HID_CAPTURE_REC_CTRL: {
+            if (rec->len < 8) {
+                break;
+            }
+            bool in = data[0] & 0x80;
+            uint32_t stage_len = rec->len - 8;
+            uint16_t wLength = (uint16_t)(data[6] | (data[7] << 8));
+            hid_capture_usbmon(pcap, ts_us, 'S', 2, in ? 0x80 : 0x00, rec->dev_addr, -115, data,
+                               data + 8, in ? 0 : stage_len, wLength, sink, arg);
+            hid_capture_usbmon(pcap, ts_us, 'C', 2, in ? 0x80 : 0x00, rec->dev_addr, status, NULL,
+                               data + 8, in ? stage_len : 0, stage_len, sink, arg);
+            break;
+        }
+        case HID_CAPTURE_REC_IN:
+            hid_capture_usbmon(pcap, ts_us, 'C', 1, rec->ep_addr, rec->dev_addr, status, NULL, data, rec->len, rec->len,
+                               sink, arg);
+            break;
+        case HID_CAPTURE_REC_OUT:
+            hid_capture_usbmon(pcap, ts_us, 'S', 1, rec->ep_addr, rec->dev_addr, -115, NULL, data, rec->len, rec->len,
+                               sink, arg);
+            hid_capture_usbmon(pcap, ts_us, 'C', 1, rec->ep_addr, rec->dev_addr, status, NULL, NULL, 0, rec->len,
+                               sink, arg);
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * Convert a whole native capture to pcap. Returns the number of records
+ * read, or -1 if capture is not a native capture.
+ */
+static inline int hid_capture_to_pcap(const uint8_t *capture, size_t len, hid_capture_sink_t sink, void *arg)
+{
+    size_t off = hid_capture_check(capture, len);
+    if (off == 0) {
+        return -1;
+    }
+    hid_capture_pcap_t pcap;
+    hid_capture_pcap_header(&pcap, sink, arg);
+    hid_capture_rec_t rec;
+    const uint8_t *data;
+    int n = 0;
+    while (hid_capture_next(capture, len, &off, &rec, &data)) {
+        hid_capture_pcap_record(&pcap, &rec, data, sink, arg);
+        n++;
+    }
+    return n;
+}
+
+static inline size_t hid_capture_mem_sink(const void *data, size_t len, void *arg)
+{
+    hid_capture_mem_t *mem = (hid_capture_mem_t *)arg;
+    if (len > mem->size - mem->len) {
+        len = mem->size - mem->len;
+    }
+    memcpy(mem->buf + mem->len, data, len);
+    mem->len += len;
+    return len;
+}
+
+static size_t hid_capture_console_sink(const void *data, size_t len, void *)
+{
+    return fwrite(data, 1, len, stdout);
+}
+
+/**
+ * Stream every complete record to the sink, releasing ring space record by
+ * record. Returns the number of records written.
+ */
+static size_t hid_capture_flush(void)
+{
+    hid_capture_t *cap = &s_hid_capture;
+    hid_capture_sink_t sink = cap->sink ? cap->sink : hid_capture_console_sink;
+    size_t n = 0;
+    uint32_t tail = cap->tail.load(std::memory_order_relaxed);
+    uint32_t head = cap->head.load(std::memory_order_acquire);
+    while (tail != head) {
+        hid_capture_rec_t rec;
+        hid_capture_copy_out(cap, tail, &rec, sizeof(rec));
+        hid_capture_copy_out(cap, tail + sizeof(rec), cap->scratch, rec.len);
+        #if defined(HID_CAPTURE_OUTPUT_PCAP)
+            hid_capture_pcap_record(&cap->pcap, &rec, cap->scratch, sink, cap->sink_arg);
+        #else
+            sink(&rec, sizeof(rec), cap->sink_arg);
+            sink(cap->scratch, rec.len, cap->sink_arg);
+        #endif
+        tail += sizeof(rec) + rec.len;
+        cap->tail.store(tail, std::memory_order_release);
+        n++;
+    }
+    if (n && sink == hid_capture_console_sink) {
+        fflush(stdout);
+    }
+    return n;
+}
+
+void usb_hid_capture_task(void *)
+{
+    hid_capture_t *cap = &s_hid_capture;
+    hid_capture_sink_t sink = cap->sink ? cap->sink : hid_capture_console_sink;
+    #if defined(HID_CAPTURE_OUTPUT_PCAP)
+        hid_capture_pcap_header(&cap->pcap, sink, cap->sink_arg);
+    #else
+        hid_capture_file_t file = { HID_CAPTURE_MAGIC, HID_CAPTURE_VERSION, sizeof(hid_capture_rec_t) };
+        sink(&file, sizeof(file), cap->sink_arg);
+    #endif
+    while (1) {
+        vTaskDelay(pdMS_TO_TICKS(HID_CAPTURE_FLUSH_MS));
+        hid_capture_flush();
+    }
+}
+
+static void hid_capture_init(void)
+{
+    s_hid_capture.head.store(0, std::memory_order_relaxed);
+    s_hid_capture.tail.store(0, std::memory_order_relaxed);
+    s_hid_capture.dropped.store(0, std::memory_order_relaxed);
+    hid_capture_set_enabled(true);
+}
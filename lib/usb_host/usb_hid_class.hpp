@@ -0,0 +1,112 @@
+/*
+ * HID class requests and boot protocol decoders
+ *
+ * Setup packets for GET/SET_IDLE and GET/SET_PROTOCOL (HID 1.11, 7.2), the
+ * per-device policy that decides which of them the driver sends, and fixed
+ * decoders for the boot keyboard (8 byte) and boot mouse (3+ byte) reports,
+ * which need no report descriptor. No ESP-IDF dependencies.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "usb_hid_report_parser.hpp"
+
+#define HID_REQ_GET_REPORT          0x01
+#define HID_REQ_GET_IDLE            0x02
+#define HID_REQ_GET_PROTOCOL        0x03
+#define HID_REQ_SET_REPORT          0x09
+#define HID_REQ_SET_IDLE            0x0A
+#define HID_REQ_SET_PROTOCOL        0x0B
+
+#define HID_REPORT_TYPE_INPUT       0x01    //High byte of wValue in GET_REPORT/SET_REPORT
+#define HID_REPORT_TYPE_OUTPUT      0x02
+#define HID_REPORT_TYPE_FEATURE     0x03
+
+#define HID_PROTOCOL_BOOT           0
+#define HID_PROTOCOL_REPORT         1
+
+#define HID_SUBCLASS_BOOT           0x01
+#define HID_BOOT_PROTOCOL_KEYBOARD  0x01    //bInterfaceProtocol of boot interfaces
+#define HID_BOOT_PROTOCOL_MOUSE     0x02
+
+#define HID_IDLE_ONLY_ON_CHANGE     0       //SET_IDLE duration: report only when something changed
+#define HID_IDLE_UNCHANGED          0xFF    //Policy value: leave the device's idle rate alone
+
+typedef struct {
+    bool boot_protocol;         //Switch boot keyboards and mice to the boot protocol
+    uint8_t idle_rate;          //SET_IDLE duration in 4 ms units, or HID_IDLE_UNCHANGED
+    bool read_back;             //Follow the SET requests with GET_PROTOCOL and GET_IDLE
+} hid_class_policy_t;
+
+typedef struct {
+    uint16_t idVendor;
+    uint16_t idProduct;
+    hid_class_policy_t policy;
+} hid_class_policy_entry_t;
+
+//Devices that need something other than the default
+static const hid_class_policy_entry_t s_hid_class_policies[] = {
+    { 0x284e, 0x8d00, { false, HID_IDLE_UNCHANGED, false } },  //Flysky NB4, no boot interfaces, keep its own idle rate
+};
+
+static const hid_class_policy_t *hid_class_policy_find(uint16_t vid, uint16_t pid, const hid_class_policy_t *fallback)
+{
+    for (size_t i = 0; i < sizeof(s_hid_class_policies) / sizeof(s_hid_class_policies[0]); i++) {
+        if (s_hid_class_policies[i].idVendor == vid && s_hid_class_policies[i].idProduct == pid) {
+            return &s_hid_class_policies[i].policy;
+        }
+    }
+    return fallback;
+}
+
+/**
+ * Build a class request addressed to an interface. Requests with a data
+ * stage are device-to-host (GET_*), all others have none.
+ */
+static void hid_class_setup(uint8_t setup[8], uint8_t bRequest, uint16_t wValue, uint8_t bInterfaceNumber, uint16_t wLength)
+{
+    bool in = (bRequest == HID_REQ_GET_REPORT || bRequest == HID_REQ_GET_IDLE || bRequest == HID_REQ_GET_PROTOCOL);
+    setup[0] = (in ? 0x80 : 0x00) | 0x21;     //Class, interface
+    setup[1] = bRequest;
+    setup[2] = (uint8_t)wValue;
+    setup[3] = (uint8_t)(wValue >> 8);
+    setup[4] = bInterfaceNumber;
+    setup[5] = 0;
+    setup[6] = (uint8_t)wLength;
+    setup[7] = (uint8_t)(wLength >> 8);
+}
+
+/**
+ * Boot keyboard: modifiers into buttons 0-7, up to six key codes into axes 0-5.
+ */
+static inline bool hid_boot_keyboard_decode(const uint8_t *data, size_t len, hid_report_values_t *values)
+{
+    if (len < 8) {
+        return false;
+    }
+    values->report_id = 0;
+    values->buttons = data[0];
+    for (int k = 0; k < 6; k++) {
+        values->axes[k] = data[2 + k];
+    }
+    return true;
+}
+
+/**
+ * Boot mouse: buttons 0-2, relative X, Y and (if present) wheel into axes 0-2.
+ */
+static inline bool hid_boot_mouse_decode(const uint8_t *data, size_t len, hid_report_values_t *values)
+{
+    if (len < 3) {
+        return false;
+    }
+    values->report_id = 0;
+    values->buttons = data[0] & 0x07;
+    values->axes[0] = (int8_t)data[1];
+    values->axes[1] = (int8_t)data[2];
+    values->axes[2] = (len > 3) ? (int8_t)data[3] : 0;
+    return true;
+}
@@ -0,0 +1,217 @@
+/*
+ * Deferred binary logging
+ *
+ * Hot paths only copy a small fixed-size record into a preallocated ring;
+ * usb_hid_log_task() formats records (or streams them raw) from a low
+ * priority task. Categories can be compiled out with HID_LOG_COMPILE_MASK
+ * and switched at runtime with hid_log_set_mask(). Records that do not fit
+ * are dropped and counted, never waited for.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <atomic>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+
+#define HID_LOG_CAT_CTRL            0x01    //Control transfers
+#define HID_LOG_CAT_REPORT          0x02    //Raw IN reports
+#define HID_LOG_CAT_DECODED         0x04    //Decoded IN reports
+#define HID_LOG_CAT_ERROR           0x08    //Transfer errors
+#define HID_LOG_CAT_ALL             0xFF
+
+#ifndef HID_LOG_COMPILE_MASK
+#define HID_LOG_COMPILE_MASK        HID_LOG_CAT_ALL
+#endif
+#ifndef HID_LOG_DEFAULT_MASK
+//Raw reports arrive at up to 1 kHz per endpoint, more than the console keeps up with; enable them for debugging only
+#define HID_LOG_DEFAULT_MASK        (HID_LOG_CAT_CTRL | HID_LOG_CAT_ERROR)
+#endif
+
+#define HID_LOG_NUM_RECORDS         64      //Must be a power of two
+#define HID_LOG_DATA_BYTES          16
+#define HID_LOG_FLUSH_MS            20      //How often usb_hid_log_task() drains the ring
+// #define HID_LOG_OUTPUT_RAW                  //Stream records as binary frames instead of text
+
+typedef enum {
+    HID_LOG_EV_SETUP,           //data: setup packet, args: dev_addr, num_bytes
+    HID_LOG_EV_CTRL_DONE,       //args: dev_addr, status, actual_num_bytes
+    HID_LOG_EV_REPORT,          //data: first report bytes, args: dev_addr, ep_addr, len
+    HID_LOG_EV_DECODED,         //args: dev_addr << 8 | ep_addr, buttons high, buttons low
+    HID_LOG_EV_DELTA,           //args: dev_addr << 8 | ep_addr, report_id, changed fields 0-31
+    HID_LOG_EV_XFER_ERROR,      //args: dev_addr, ep_addr, status
+    HID_LOG_EV_MAX,
+} hid_log_event_t;
+
+typedef enum {
+    HID_LOG_DATA_NONE,
+    HID_LOG_DATA_HEX,
+    HID_LOG_DATA_BIN,
+} hid_log_data_fmt_t;
+
+typedef struct {
+    const char *fmt;            //printf format for args[0..2]
+    uint8_t data_fmt;           //hid_log_data_fmt_t
+} hid_log_event_desc_t;
+
+//Indexed by hid_log_event_t
+static const hid_log_event_desc_t s_hid_log_events[HID_LOG_EV_MAX] = {
+    { "%u: setup, num_bytes %u:", HID_LOG_DATA_HEX },
+    { "%u: control status %u, actual number of bytes transferred %u", HID_LOG_DATA_NONE },
+    { "%u/%02x: %u bytes:", HID_LOG_DATA_BIN },
+    { "%04x: buttons %08x%08x", HID_LOG_DATA_NONE },
+    { "%04x: report %u changed fields %08x", HID_LOG_DATA_NONE },
+    { "%u/%02x: Transfer failed - Status %u", HID_LOG_DATA_NONE },
+};
+
+typedef struct {
+    std::atomic<uint32_t> seq;  //Position + 1 once the record is complete
+    uint32_t timestamp_us;
+    uint8_t category;
+    uint8_t event;
+    uint8_t len;
+    uint32_t args[3];
+    uint8_t data[HID_LOG_DATA_BYTES];
+} hid_log_record_t;
+
+typedef struct {
+    std::atomic<uint32_t> head;
+    std::atomic<uint32_t> tail;
+    std::atomic<uint32_t> mask;
+    std::atomic<uint32_t> dropped;
+    hid_log_record_t records[HID_LOG_NUM_RECORDS];
+} hid_log_t;
+
+static hid_log_t s_hid_log;
+
+static void hid_log_set_mask(uint32_t mask)
+{
+    s_hid_log.mask.store(mask & HID_LOG_COMPILE_MASK, std::memory_order_relaxed);
+}
+
+static uint32_t hid_log_get_dropped(void)
+{
+    return s_hid_log.dropped.load(std::memory_order_relaxed);
+}
+
+/**
+ * Append a record without blocking. Safe to call from several tasks at once;
+ * when the ring is full the record is counted as dropped.
+ */
+static void hid_log_write(uint8_t category, uint8_t event, uint32_t a0, uint32_t a1, uint32_t a2,
+                          const uint8_t *data, size_t len)
+{
+    hid_log_t *log = &s_hid_log;
+    uint32_t pos = log->head.load(std::memory_order_relaxed);
+    do {
+        if (pos - log->tail.load(std::memory_order_acquire) >= HID_LOG_NUM_RECORDS) {
+            log->dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+    } while (!log->head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed));
+
+    hid_log_record_t *rec = &log->records[pos & (HID_LOG_NUM_RECORDS - 1)];
+    rec->timestamp_us = (uint32_t)esp_timer_get_time();
+    rec->category = category;
+    rec->event = event;
+    rec->args[0] = a0;
+    rec->args[1] = a1;
+    rec->args[2] = a2;
+    if (len > HID_LOG_DATA_BYTES) {
+        len = HID_LOG_DATA_BYTES;
+    }
+    if (len) {
+        memcpy(rec->data, data, len);
+    }
+    rec->len = (uint8_t)len;
+    rec->seq.store(pos + 1, std::memory_order_release);
+}
+
+//Compiles to nothing for categories outside HID_LOG_COMPILE_MASK
+#define HID_LOG(cat, ev, a0, a1, a2, data, len)                                             \
+    do {                                                                                    \
+        if ((HID_LOG_COMPILE_MASK & (cat)) &&                                               \
+            (s_hid_log.mask.load(std::memory_order_relaxed) & (cat))) {                     \
+            hid_log_write((cat), (ev), (uint32_t)(a0), (uint32_t)(a1), (uint32_t)(a2),      \
+                          (const uint8_t *)(data), (len));                                  \
+        }                                                                                   \
+    } while (0)
+
+static void hid_log_format(const hid_log_record_t *rec)
+{
+    #if defined(HID_LOG_OUTPUT_RAW)
+        //Frame: 0xA5, then the record from timestamp_us on, parsed host side
+        static const uint8_t sync = 0xA5;
+        fwrite(&sync, 1, 1, stdout);
+        fwrite(&rec->timestamp_us, 1, sizeof(hid_log_record_t) - offsetof(hid_log_record_t, timestamp_us), stdout);
+    #else
+        if (rec->event >= HID_LOG_EV_MAX) {
+            return;
+        }
+        const hid_log_event_desc_t *desc = &s_hid_log_events[rec->event];
+        printf("[%u] ", rec->timestamp_us);
+        printf(desc->fmt, rec->args[0], rec->args[1], rec->args[2]);
+        for (int i = 0; i < rec->len; i++) {
+            if (desc->data_fmt == HID_LOG_DATA_HEX) {
+                printf(" %02X", rec->data[i]);
+            } else if (desc->data_fmt == HID_LOG_DATA_BIN) {
+                printf(" ");
+                for (int b = 7; b != -1; b--) printf("%d", (rec->data[i] >> b) & 1);
+            }
+        }
+        printf("\n");
+    #endif
+}
+
+/**
+ * Format every complete record. Returns the number of records consumed.
+ */
+static size_t hid_log_flush(void)
+{
+    hid_log_t *log = &s_hid_log;
+    size_t n = 0;
+    uint32_t tail = log->tail.load(std::memory_order_relaxed);
+    while (true) {
+        hid_log_record_t *rec = &log->records[tail & (HID_LOG_NUM_RECORDS - 1)];
+        if (rec->seq.load(std::memory_order_acquire) != tail + 1) {
+            break;
+        }
+        hid_log_format(rec);
+        tail++;
+        log->tail.store(tail, std::memory_order_release);
+        n++;
+    }
+    return n;
+}
+
+void usb_hid_log_task(void *)
+{
+    uint32_t reported_dropped = 0;
+    while (1) {
+        vTaskDelay(pdMS_TO_TICKS(HID_LOG_FLUSH_MS));
+        hid_log_flush();
+        #if !defined(HID_LOG_OUTPUT_RAW)
+            uint32_t dropped = hid_log_get_dropped();
+            if (dropped != reported_dropped) {
+                printf("log: %u records dropped\n", dropped - reported_dropped);
+                reported_dropped = dropped;
+            }
+        #endif
+    }
+}
+
+static void hid_log_init(void)
+{
+    s_hid_log.head.store(0, std::memory_order_relaxed);
+    s_hid_log.tail.store(0, std::memory_order_relaxed);
+    s_hid_log.dropped.store(0, std::memory_order_relaxed);
+    for (int i = 0; i < HID_LOG_NUM_RECORDS; i++) {
+        s_hid_log.records[i].seq.store(0, std::memory_order_relaxed);
+    }
+    hid_log_set_mask(HID_LOG_DEFAULT_MASK);
+}
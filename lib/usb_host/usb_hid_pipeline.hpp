@@ -0,0 +1,139 @@
+/*
+ * USB HID task pipeline
+ *
+ * Creates every task of the host stack from one config struct: the host
+ * library daemon and the class driver, which only move raw reports, the
+ * report workers, which decode and dispatch them, and the deferred log
+ * task, plus the report sink task when REPORT_SINKS_ENABLED is set and the
+ * capture task when HID_CAPTURE_ENABLED is set. Each stage gets its own
+ * stack size, priority and core, so a dual core part can keep USB events
+ * on one core and decoding on the other.
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "usb_host_lib_daemon.hpp"
+#include "usb_class_driver.hpp"
+
+typedef struct {
+    uint32_t stack_size;
+    UBaseType_t priority;
+    BaseType_t core_id;                         //Or tskNO_AFFINITY
+} usb_task_config_t;
+
+typedef struct {
+    usb_task_config_t daemon;
+    usb_task_config_t class_driver;
+    usb_task_config_t report_worker;            //Shared by every report worker
+    usb_task_config_t log;
+    usb_task_config_t capture;                  //Only started when HID_CAPTURE_ENABLED is set
+    usb_task_config_t report_sink;              //Only started when REPORT_SINKS_ENABLED is set
+    uint8_t num_report_workers;                 //1 to REPORT_WORKERS_MAX
+} usb_hid_pipeline_config_t;
+
+//Decoding goes to the second core when there is one
+#define USB_HID_PIPELINE_WORKER_CORE    ((portNUM_PROCESSORS > 1) ? 1 : 0)
+
+#define USB_HID_PIPELINE_CONFIG_DEFAULT() {                             \
+    .daemon = { 4096, 2, 0 },                                           \
+    .class_driver = { 4096, 3, 0 },                                     \
+    .report_worker = { 4096, 1, USB_HID_PIPELINE_WORKER_CORE },         \
+    .log = { 4096, 1, 0 },                                              \
+    .capture = { 4096, 1, 0 },                                          \
+    .report_sink = { 4096, 2, USB_HID_PIPELINE_WORKER_CORE },           \
+    .num_report_workers = 1,                                            \
+}
+
+typedef struct {
+    SemaphoreHandle_t signaling_sem;
+    TaskHandle_t daemon;
+    TaskHandle_t class_driver;
+    TaskHandle_t log;
+    TaskHandle_t capture;
+    TaskHandle_t report_sink;
+    TaskHandle_t report_workers[REPORT_WORKERS_MAX];
+    uint8_t num_report_workers;
+} usb_hid_pipeline_t;
+
+static const char *TAG_PIPELINE = "PIPELINE";
+
+static TaskHandle_t usb_hid_pipeline_task(TaskFunction_t fn, const char *name, const usb_task_config_t *task, void *arg)
+{
+    TaskHandle_t hdl = NULL;
+    if (xTaskCreatePinnedToCore(fn, name, task->stack_size, arg, task->priority, &hdl, task->core_id) != pdPASS) {
+        ESP_LOGE(TAG_PIPELINE, "could not create %s", name);
+        return NULL;
+    }
+    ESP_LOGI(TAG_PIPELINE, "%s: priority %u, core %d, %u byte stack", name, task->priority, task->core_id, task->stack_size);
+    return hdl;
+}
+
+/**
+ * Create the tasks in dependency order: the log task first, then the
+ * report workers so their rings are ready, then the daemon and the class
+ * driver.
+ */
+static void usb_hid_pipeline_start(const usb_hid_pipeline_config_t *config, usb_hid_pipeline_t *pipeline)
+{
+    memset(pipeline, 0, sizeof(usb_hid_pipeline_t));
+    pipeline->signaling_sem = xSemaphoreCreateBinary();
+
+    //Deferred log task, hot paths only queue binary records for it
+    hid_log_init();
+    pipeline->log = usb_hid_pipeline_task(usb_hid_log_task, "usb_hid_log", &config->log, NULL);
+    if (HID_CAPTURE_ENABLED) {
+        //Before the class driver, so the capture starts with the first attach
+        hid_capture_init();
+        pipeline->capture = usb_hid_pipeline_task(usb_hid_capture_task, "usb_hid_capture", &config->capture, NULL);
+    }
+
+    if (REPORT_SINKS_ENABLED) {
+        pipeline->report_sink = usb_hid_pipeline_task(usb_report_sink_task, "usb_report_sink", &config->report_sink, NULL);
+    }
+
+    usb_class_driver_set_report_workers(config->num_report_workers);
+    pipeline->num_report_workers = s_num_report_workers;
+    for (int w = 0; w < pipeline->num_report_workers; w++) {
+        char name[16];
+        snprintf(name, sizeof(name), "usb_report%d", w);
+        pipeline->report_workers[w] = usb_hid_pipeline_task(usb_report_consumer_task, name, &config->report_worker,
+                                                            (void *)(intptr_t)w);
+    }
+
+    pipeline->daemon = usb_hid_pipeline_task(usb_host_lib_daemon_task, "usb_host_daemon", &config->daemon,
+                                             (void *)pipeline->signaling_sem);
+    pipeline->class_driver = usb_hid_pipeline_task(usb_class_driver_task, "usb_class_driver", &config->class_driver,
+                                                   (void *)pipeline->signaling_sem);
+}
+
+/**
+ * Block until the daemon and the class driver are done, then delete every task.
+ */
+static inline void usb_hid_pipeline_wait(usb_hid_pipeline_t *pipeline)
+{
+    for (int i = 0; i < 2; i++) {
+        xSemaphoreTake(pipeline->signaling_sem, portMAX_DELAY);
+    }
+
+    //A NULL handle would delete the caller
+    TaskHandle_t tasks[REPORT_WORKERS_MAX + 5] = { pipeline->log, pipeline->capture, pipeline->report_sink,
+                                                   pipeline->class_driver, pipeline->daemon };
+    for (int w = 0; w < pipeline->num_report_workers; w++) {
+        tasks[5 + w] = pipeline->report_workers[w];
+    }
+    for (int i = 0; i < REPORT_WORKERS_MAX + 5; i++) {
+        if (tasks[i]) {
+            vTaskDelete(tasks[i]);
+        }
+    }
+    //Nothing drains the rings any more, usb_class_driver_replay() may borrow them
+    for (int w = 0; w < REPORT_WORKERS_MAX; w++) {
+        s_report_workers[w].task = NULL;
+    }
+    s_report_sink_task = NULL;
+    s_driver_obj.client_hdl = NULL;
+}
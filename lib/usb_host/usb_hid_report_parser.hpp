@@ -0,0 +1,439 @@
+/*
+ * HID report descriptor parser
+ *
+ * Compiles a report descriptor once, at enumeration, into a flat table of
+ * input fields sorted by report ID. hid_decode_report() then walks only the
+ * fields of the incoming report ID and extracts typed axis and button values
+ * without allocating. No ESP-IDF dependencies, so it builds on any host.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+
+#define HID_REPORT_MAX_FIELDS       48
+#define HID_REPORT_MAX_REPORTS      8
+#define HID_REPORT_MAX_AXES         24
+#define HID_REPORT_MAX_BUTTONS      64
+#define HID_PARSER_MAX_USAGES       16
+#define HID_PARSER_STACK_DEPTH      4
+
+#define HID_USAGE_PAGE_GENERIC_DESKTOP  0x01
+#define HID_USAGE_PAGE_BUTTON           0x09
+#define HID_USAGE_PAGE_VENDOR_MIN       0xFF00
+
+typedef enum {
+    HID_FIELD_KIND_AXIS,        //Variable value, decoded into axes[]
+    HID_FIELD_KIND_BUTTON,      //Variable 1-bit value, decoded into the buttons mask
+    HID_FIELD_KIND_ARRAY,       //Array of usage indexes (e.g. key codes), decoded into axes[]
+    HID_FIELD_KIND_OPAQUE,      //Vendor defined payload, left for the consumer to read raw
+} hid_field_kind_t;
+
+#define HID_FIELD_FLAG_SIGNED       0x01
+#define HID_FIELD_FLAG_RELATIVE     0x02
+
+typedef struct {
+    //Read for every report by hid_decode_report()
+    uint16_t bit_offset;        //First bit of the field, counted from data[0] (report ID byte included)
+    uint8_t bit_size;           //Bits per element, 1..32
+    uint8_t kind;               //hid_field_kind_t
+    uint8_t flags;              //HID_FIELD_FLAG_*
+    uint8_t slot;               //First axes[] index or buttons bit the field decodes into
+    uint16_t count;             //Consecutive elements of bit_size bits
+    //Read only by consumers interpreting the values
+    uint8_t report_id;
+    uint16_t usage_page;
+    uint16_t usage;             //Usage of the first element, following elements count up from it
+    int32_t logical_min;
+    int32_t logical_max;
+} hid_field_t;
+
+typedef struct {
+    uint8_t report_id;
+    uint8_t first_field;        //Index into hid_report_layout_t.fields
+    uint8_t num_fields;
+    uint16_t size_bytes;        //Input report length, report ID byte included
+    uint16_t output_size_bytes; //Output report length, report ID byte included; 0 when there is none
+} hid_report_info_t;
+
+typedef struct {
+    hid_field_t fields[HID_REPORT_MAX_FIELDS];
+    hid_report_info_t reports[HID_REPORT_MAX_REPORTS];
+    uint8_t num_fields;
+    uint8_t num_reports;
+    uint8_t num_axes;
+    uint8_t num_buttons;
+    bool uses_report_ids;
+    bool truncated;             //Descriptor declared more than the layout can hold
+    uint16_t app_usage_page;    //Usage of the first application collection
+    uint16_t app_usage;
+} hid_report_layout_t;
+
+typedef struct {
+    uint8_t report_id;          //Report ID of the last decoded report
+    uint64_t buttons;           //Bit n is button slot n
+    int32_t axes[HID_REPORT_MAX_AXES];
+} hid_report_values_t;
+
+typedef struct {
+    uint16_t usage_page;
+    int32_t logical_min;
+    int32_t logical_max;
+    uint8_t logical_max_size;   //Item size logical_max was read from, to undo a wrong sign extension
+    uint8_t report_size;
+    uint8_t report_id;
+    uint16_t report_count;
+} hid_parser_globals_t;
+
+static hid_report_info_t *hid_report_layout_find(const hid_report_layout_t *layout, uint8_t report_id)
+{
+    for (int i = 0; i < layout->num_reports; i++) {
+        if (layout->reports[i].report_id == report_id) {
+            return (hid_report_info_t *)&layout->reports[i];
+        }
+    }
+    return NULL;
+}
+
+static hid_report_info_t *hid_report_layout_add(hid_report_layout_t *layout, uint8_t report_id)
+{
+    hid_report_info_t *info = hid_report_layout_find(layout, report_id);
+    if (info == NULL && layout->num_reports < HID_REPORT_MAX_REPORTS) {
+        info = &layout->reports[layout->num_reports++];
+        memset(info, 0, sizeof(hid_report_info_t));
+        info->report_id = report_id;
+    }
+    return info;
+}
+
+static void hid_report_layout_add_field(hid_report_layout_t *layout, const hid_parser_globals_t *g,
+                                        uint8_t kind, uint8_t flags, uint32_t bit_offset,
+                                        uint16_t count, uint16_t usage_page, uint16_t usage)
+{
+    uint32_t slots = (kind == HID_FIELD_KIND_OPAQUE) ? 0 : count;
+    uint32_t slot = (kind == HID_FIELD_KIND_BUTTON) ? layout->num_buttons : layout->num_axes;
+    uint32_t max_slots = (kind == HID_FIELD_KIND_BUTTON) ? HID_REPORT_MAX_BUTTONS : HID_REPORT_MAX_AXES;
+    if (layout->num_fields >= HID_REPORT_MAX_FIELDS || slot + slots > max_slots ||
+        bit_offset > 0xFFFF || g->report_size == 0 || g->report_size > 32) {
+        layout->truncated = true;
+        return;
+    }
+
+    hid_field_t *f = &layout->fields[layout->num_fields++];
+    f->bit_offset = (uint16_t)bit_offset;
+    f->bit_size = g->report_size;
+    f->kind = kind;
+    f->flags = flags;
+    f->slot = (uint8_t)slot;
+    f->count = count;
+    f->report_id = g->report_id;
+    f->usage_page = usage_page;
+    f->usage = usage;
+    f->logical_min = g->logical_min;
+    f->logical_max = g->logical_max;
+
+    if (kind == HID_FIELD_KIND_BUTTON) {
+        layout->num_buttons += slots;
+    } else {
+        layout->num_axes += slots;
+    }
+}
+
+/**
+ * Compile a HID report descriptor into layout.
+ *
+ * Returns false if the descriptor is malformed. Fields that do not fit the
+ * fixed capacity are dropped and flagged with layout->truncated.
+ */
+static bool hid_report_layout_compile(const uint8_t *desc, size_t len, hid_report_layout_t *layout)
+{
+    memset(layout, 0, sizeof(hid_report_layout_t));
+
+    hid_parser_globals_t g;
+    memset(&g, 0, sizeof(g));
+    hid_parser_globals_t stack[HID_PARSER_STACK_DEPTH];
+    int sp = 0;
+
+    uint32_t usages[HID_PARSER_MAX_USAGES];
+    int num_usages = 0;
+    uint32_t usage_min = 0;
+    uint32_t usage_max = 0;
+    bool has_range = false;
+
+    //Bits declared so far per report, in the same order as layout->reports
+    uint32_t input_bits[HID_REPORT_MAX_REPORTS] = {0};
+    uint32_t output_bits[HID_REPORT_MAX_REPORTS] = {0};
+
+    size_t i = 0;
+    while (i < len) {
+        uint8_t prefix = desc[i++];
+        if (prefix == 0xFE) {
+            //Long item, nothing in it we use
+            if (i + 2 > len) {
+                return false;
+            }
+            i += 2 + desc[i];
+            continue;
+        }
+        size_t size = prefix & 0x03;
+        if (size == 3) {
+            size = 4;
+        }
+        if (i + size > len) {
+            return false;
+        }
+        uint32_t udata = 0;
+        for (size_t b = 0; b < size; b++) {
+            udata |= (uint32_t)desc[i + b] << (8 * b);
+        }
+        int32_t sdata = (size == 1) ? (int8_t)udata : (size == 2) ? (int16_t)udata : (int32_t)udata;
+        i += size;
+
+        switch (prefix & 0xFC) {
+            //Global items
+            case 0x04: g.usage_page = (uint16_t)udata; break;
+            case 0x14: g.logical_min = sdata; break;
+            case 0x24:
+                g.logical_max = sdata;
+                g.logical_max_size = (uint8_t)size;
+                break;
+            case 0x74: g.report_size = (uint8_t)udata; break;
+            case 0x94: g.report_count = (uint16_t)udata; break;
+            case 0x84:
+                g.report_id = (uint8_t)udata;
+                layout->uses_report_ids = true;
+                break;
+            case 0xA4:
+                if (sp < HID_PARSER_STACK_DEPTH) {
+                    stack[sp++] = g;
+                }
+                break;
+            case 0xB4:
+                if (sp > 0) {
+                    g = stack[--sp];
+                }
+                break;
+
+            //Local items, 4-byte usages carry their own usage page in the upper half
+            case 0x08:
+                if (num_usages < HID_PARSER_MAX_USAGES) {
+                    usages[num_usages++] = (size == 4) ? udata : ((uint32_t)g.usage_page << 16) | udata;
+                }
+                break;
+            case 0x18:
+                usage_min = (size == 4) ? udata : ((uint32_t)g.usage_page << 16) | udata;
+                has_range = true;
+                break;
+            case 0x28:
+                usage_max = (size == 4) ? udata : ((uint32_t)g.usage_page << 16) | udata;
+                has_range = true;
+                break;
+
+            //Main items
+            case 0xA0:
+                if (udata == 0x01 && layout->app_usage_page == 0) {
+                    uint32_t usage = num_usages ? usages[0] : usage_min;
+                    layout->app_usage_page = (uint16_t)(usage >> 16);
+                    layout->app_usage = (uint16_t)usage;
+                }
+                break;
+            case 0x80: {
+                hid_report_info_t *info = hid_report_layout_add(layout, g.report_id);
+                if (info == NULL) {
+                    layout->truncated = true;
+                    break;
+                }
+                uint32_t *bits = &input_bits[info - layout->reports];
+                uint32_t offset = *bits;
+                *bits += (uint32_t)g.report_size * g.report_count;
+                if ((udata & 0x01) || g.report_count == 0) {
+                    //Constant padding
+                    break;
+                }
+
+                //A logical max that only looks negative because it was sign-extended is unsigned
+                hid_parser_globals_t fg = g;
+                if (fg.logical_min >= 0 && fg.logical_max < 0 && fg.logical_max_size < 4) {
+                    fg.logical_max = (int32_t)(fg.logical_max & ((1u << (8 * fg.logical_max_size)) - 1));
+                }
+                uint8_t flags = (fg.logical_min < 0 ? HID_FIELD_FLAG_SIGNED : 0) | ((udata & 0x04) ? HID_FIELD_FLAG_RELATIVE : 0);
+                uint32_t first = has_range ? usage_min : (num_usages ? usages[0] : ((uint32_t)g.usage_page << 16));
+                uint16_t page = (uint16_t)(first >> 16);
+
+                if (!(udata & 0x02)) {
+                    hid_report_layout_add_field(layout, &fg, HID_FIELD_KIND_ARRAY, flags, offset, g.report_count, page, (uint16_t)first);
+                } else if (page >= HID_USAGE_PAGE_VENDOR_MIN) {
+                    hid_report_layout_add_field(layout, &fg, HID_FIELD_KIND_OPAQUE, flags, offset, g.report_count, page, (uint16_t)first);
+                } else if (has_range || num_usages <= 1) {
+                    uint8_t kind = (page == HID_USAGE_PAGE_BUTTON || g.report_size == 1) ? HID_FIELD_KIND_BUTTON : HID_FIELD_KIND_AXIS;
+                    hid_report_layout_add_field(layout, &fg, kind, flags, offset, g.report_count, page, (uint16_t)first);
+                } else {
+                    //Explicit usage list, merge runs of consecutive usages into one field
+                    uint8_t kind = (g.report_size == 1) ? HID_FIELD_KIND_BUTTON : HID_FIELD_KIND_AXIS;
+                    uint16_t run = 0;
+                    for (uint16_t k = 0; k < g.report_count; k++) {
+                        uint32_t usage = usages[(k < num_usages) ? k : num_usages - 1];
+                        uint32_t next = usages[(k + 1 < num_usages) ? k + 1 : num_usages - 1];
+                        run++;
+                        if (k + 1 == g.report_count || next != usage + 1) {
+                            uint32_t start = usage - (run - 1);
+                            hid_report_layout_add_field(layout, &fg, kind, flags, offset + (uint32_t)(k + 1 - run) * g.report_size,
+                                                        run, (uint16_t)(start >> 16), (uint16_t)start);
+                            run = 0;
+                        }
+                    }
+                }
+                break;
+            }
+            case 0x90: {
+                hid_report_info_t *info = hid_report_layout_add(layout, g.report_id);
+                if (info) {
+                    output_bits[info - layout->reports] += (uint32_t)g.report_size * g.report_count;
+                }
+                break;
+            }
+            default:
+                break;
+        }
+
+        //Local items only apply to the next main item
+        if ((prefix & 0x0C) == 0x00) {
+            num_usages = 0;
+            usage_min = usage_max = 0;
+            has_range = false;
+        }
+    }
+    (void)usage_max;
+
+    //Sort fields by report ID (stable) so each report owns one contiguous range
+    for (int a = 1; a < layout->num_fields; a++) {
+        hid_field_t f = layout->fields[a];
+        int b = a - 1;
+        while (b >= 0 && layout->fields[b].report_id > f.report_id) {
+            layout->fields[b + 1] = layout->fields[b];
+            b--;
+        }
+        layout->fields[b + 1] = f;
+    }
+
+    uint8_t id_bytes = layout->uses_report_ids ? 1 : 0;
+    for (int a = 0; a < layout->num_fields; a++) {
+        layout->fields[a].bit_offset += id_bytes * 8;
+    }
+    for (int r = 0; r < layout->num_reports; r++) {
+        hid_report_info_t *info = &layout->reports[r];
+        info->size_bytes = input_bits[r] ? (uint16_t)((input_bits[r] + 7) / 8 + id_bytes) : 0;
+        info->output_size_bytes = output_bits[r] ? (uint16_t)((output_bits[r] + 7) / 8 + id_bytes) : 0;
+        info->first_field = 0;
+        info->num_fields = 0;
+        for (int a = 0; a < layout->num_fields; a++) {
+            if (layout->fields[a].report_id == info->report_id) {
+                if (info->num_fields == 0) {
+                    info->first_field = a;
+                }
+                info->num_fields++;
+            }
+        }
+    }
+    return true;
+}
+
+static inline uint32_t hid_extract_bits(const uint8_t *data, size_t len, uint32_t bit_offset, uint8_t bit_size)
+{
+    uint32_t byte = bit_offset >> 3;
+    uint64_t window = 0;
+    if (byte + sizeof(window) <= len) {
+        memcpy(&window, data + byte, sizeof(window));
+    } else {
+        for (uint32_t b = 0; b < 5 && byte + b < len; b++) {
+            window |= (uint64_t)data[byte + b] << (8 * b);
+        }
+    }
+    return (uint32_t)(window >> (bit_offset & 7)) & (uint32_t)((1ull << bit_size) - 1);
+}
+
+/**
+ * Decode one input report into values, updating only the axes and buttons
+ * owned by its report ID. Returns the report's info, or NULL if the report
+ * ID is not part of the layout.
+ */
+static inline const hid_report_info_t *hid_decode_report(const hid_report_layout_t *layout, const uint8_t *data, size_t len,
+                                                         hid_report_values_t *values)
+{
+    if (len == 0) {
+        return NULL;
+    }
+    uint8_t report_id = layout->uses_report_ids ? data[0] : 0;
+    const hid_report_info_t *info = hid_report_layout_find(layout, report_id);
+    if (info == NULL) {
+        return NULL;
+    }
+    values->report_id = report_id;
+
+    const hid_field_t *f = &layout->fields[info->first_field];
+    const hid_field_t *end = f + info->num_fields;
+    for (; f < end; f++) {
+        if (f->kind == HID_FIELD_KIND_BUTTON && f->bit_size == 1 && f->count <= 32) {
+            //All buttons of the field in one extraction
+            uint64_t mask = ((1ull << f->count) - 1) << f->slot;
+            uint64_t bits = (uint64_t)hid_extract_bits(data, len, f->bit_offset, (uint8_t)f->count) << f->slot;
+            values->buttons = (values->buttons & ~mask) | bits;
+            continue;
+        }
+        if (f->kind == HID_FIELD_KIND_OPAQUE) {
+            continue;
+        }
+        uint32_t shift = 32 - f->bit_size;
+        for (uint32_t k = 0; k < f->count; k++) {
+            uint32_t raw = hid_extract_bits(data, len, f->bit_offset + k * f->bit_size, f->bit_size);
+            int32_t sext = (int32_t)(raw << shift) >> shift;
+            int32_t v = (f->flags & HID_FIELD_FLAG_SIGNED) ? sext : (int32_t)raw;
+            if (f->kind == HID_FIELD_KIND_BUTTON) {
+                uint64_t bit = 1ull << (f->slot + k);
+                values->buttons = (values->buttons & ~bit) | (v ? bit : 0);
+            } else {
+                values->axes[f->slot + k] = v;
+            }
+        }
+    }
+    return info;
+}
+
+static const char *hid_report_layout_type_name(const hid_report_layout_t *layout)
+{
+    if (layout->app_usage_page == HID_USAGE_PAGE_GENERIC_DESKTOP) {
+        switch (layout->app_usage) {
+            case 0x02: return "HID Mouse";
+            case 0x04: return "HID Joystick";
+            case 0x05: return "HID Gamepad";
+            case 0x06: return "HID Keyboard";
+            default: break;
+        }
+    }
+    if (layout->app_usage_page >= HID_USAGE_PAGE_VENDOR_MIN) {
+        return "Vendor Defined";
+    }
+    return "Unkown";
+}
+
+static inline void hid_report_layout_print(const hid_report_layout_t *layout)
+{
+    static const char *kind_names[] = { "axis", "button", "array", "opaque" };
+    printf("> Parsed Usage Page: %s (0x%04x/0x%04x)\n", hid_report_layout_type_name(layout), layout->app_usage_page, layout->app_usage);
+    printf("> %d reports, %d fields, %d axes, %d buttons%s\n", layout->num_reports, layout->num_fields,
+           layout->num_axes, layout->num_buttons, layout->truncated ? ", truncated" : "");
+    for (int r = 0; r < layout->num_reports; r++) {
+        const hid_report_info_t *info = &layout->reports[r];
+        printf(">  report %d: in %d bytes, out %d bytes\n", info->report_id, info->size_bytes, info->output_size_bytes);
+        for (int n = info->first_field; n < info->first_field + info->num_fields; n++) {
+            const hid_field_t *f = &layout->fields[n];
+            printf(">    bit %d, %dx%d bits, %s, usage 0x%04x/0x%04x, logical %d..%d, slot %d\n",
+                   f->bit_offset, f->count, f->bit_size, kind_names[f->kind], f->usage_page, f->usage,
+                   (int)f->logical_min, (int)f->logical_max, f->slot);
+        }
+    }
+}
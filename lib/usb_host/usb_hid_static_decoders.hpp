@@ -0,0 +1,147 @@
+/*
+ * Compile-time specialized report decoders for known devices
+ *
+ * A decoder is a type listing its reports and their fields, with every bit
+ * offset, size and slot a template argument, so each extraction compiles
+ * to a fixed load and shift. Its output is exactly what hid_decode_report()
+ * produces from the device's report descriptor. s_hid_static_decoders maps
+ * VID/PID and interface to them; every other interface keeps the generic
+ * decoder. No ESP-IDF dependencies.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "usb_hid_report_parser.hpp"
+
+typedef bool (*hid_static_decode_t)(const uint8_t *data, size_t len, hid_report_values_t *values);
+
+//Little-endian bits [BIT_OFFSET, BIT_OFFSET + BIT_SIZE) of data, counted from data[0] like hid_field_t
+template <uint32_t BIT_OFFSET, uint8_t BIT_SIZE, bool SIGNED>
+static inline int32_t hid_static_extract(const uint8_t *data)
+{
+    static_assert(BIT_SIZE >= 1 && BIT_SIZE <= 32, "1 to 32 bits per element");
+    uint64_t window = 0;
+    memcpy(&window, data + (BIT_OFFSET >> 3), ((BIT_OFFSET & 7) + BIT_SIZE + 7) >> 3);
+    uint32_t raw = (uint32_t)(window >> (BIT_OFFSET & 7)) & (uint32_t)((1ull << BIT_SIZE) - 1);
+    return SIGNED ? (int32_t)(raw << (32 - BIT_SIZE)) >> (32 - BIT_SIZE) : (int32_t)raw;
+}
+
+//COUNT elements of BIT_SIZE bits into axes[SLOT..]
+template <uint32_t BIT_OFFSET, uint8_t BIT_SIZE, uint8_t COUNT, uint8_t SLOT, bool SIGNED = false>
+struct hid_static_axes {
+    static_assert(SLOT + COUNT <= HID_REPORT_MAX_AXES, "axis slot out of range");
+    static constexpr uint32_t end_bit = BIT_OFFSET + BIT_SIZE * COUNT;
+    static inline void decode(const uint8_t *data, hid_report_values_t *values)
+    {
+        hid_static_axes<BIT_OFFSET, BIT_SIZE, COUNT - 1, SLOT, SIGNED>::decode(data, values);
+        values->axes[SLOT + COUNT - 1] = hid_static_extract<BIT_OFFSET + (COUNT - 1) * BIT_SIZE, BIT_SIZE, SIGNED>(data);
+    }
+};
+
+template <uint32_t BIT_OFFSET, uint8_t BIT_SIZE, uint8_t SLOT, bool SIGNED>
+struct hid_static_axes<BIT_OFFSET, BIT_SIZE, 0, SLOT, SIGNED> {
+    static constexpr uint32_t end_bit = BIT_OFFSET;
+    static inline void decode(const uint8_t *, hid_report_values_t *) {}
+};
+
+//COUNT 1-bit buttons into buttons bits SLOT.., in one extraction
+template <uint32_t BIT_OFFSET, uint8_t COUNT, uint8_t SLOT>
+struct hid_static_buttons {
+    static_assert(COUNT >= 1 && COUNT <= 32 && SLOT + COUNT <= HID_REPORT_MAX_BUTTONS, "button slots out of range");
+    static constexpr uint32_t end_bit = BIT_OFFSET + COUNT;
+    static inline void decode(const uint8_t *data, hid_report_values_t *values)
+    {
+        uint64_t mask = ((1ull << COUNT) - 1) << SLOT;
+        uint64_t bits = (uint64_t)(uint32_t)hid_static_extract<BIT_OFFSET, COUNT, false>(data) << SLOT;
+        values->buttons = (values->buttons & ~mask) | bits;
+    }
+};
+
+template <uint32_t... V>
+struct hid_static_max;
+
+template <uint32_t A>
+struct hid_static_max<A> {
+    static constexpr uint32_t value = A;
+};
+
+template <uint32_t A, uint32_t... REST>
+struct hid_static_max<A, REST...> {
+    static constexpr uint32_t value = (A > hid_static_max<REST...>::value) ? A : hid_static_max<REST...>::value;
+};
+
+//One input report; REPORT_ID 0 for devices without report IDs
+template <uint8_t REPORT_ID, typename... FIELDS>
+struct hid_static_report {
+    //Shortest report every field fits in
+    static constexpr size_t min_bytes = (hid_static_max<FIELDS::end_bit...>::value + 7) / 8;
+    static inline bool decode(const uint8_t *data, size_t len, hid_report_values_t *values)
+    {
+        if (len < min_bytes || (REPORT_ID && data[0] != REPORT_ID)) {
+            return false;
+        }
+        values->report_id = REPORT_ID;
+        int expand[] = { 0, (FIELDS::decode(data, values), 0)... };
+        (void)expand;
+        return true;
+    }
+};
+
+//Every report of one interface, tried in order
+template <typename... REPORTS>
+struct hid_static_intf;
+
+template <typename REPORT>
+struct hid_static_intf<REPORT> {
+    static bool decode(const uint8_t *data, size_t len, hid_report_values_t *values)
+    {
+        return REPORT::decode(data, len, values);
+    }
+};
+
+template <typename REPORT, typename... REST>
+struct hid_static_intf<REPORT, REST...> {
+    static bool decode(const uint8_t *data, size_t len, hid_report_values_t *values)
+    {
+        return REPORT::decode(data, len, values) || hid_static_intf<REST...>::decode(data, len, values);
+    }
+};
+
+//Flysky Noble NB4 (0x284e:0x8d00) interface 1: 24 buttons, then 8 axes of 16 bits, no report IDs
+typedef hid_static_intf<
+    hid_static_report<0,
+        hid_static_buttons<0, 24, 0>,
+        hid_static_axes<24, 16, 8, 0>>
+> hid_static_nb4_gamepad_t;
+
+typedef struct {
+    uint16_t idVendor;
+    uint16_t idProduct;
+    uint8_t bInterfaceNumber;
+    uint16_t report_desc_len;   //wDescriptorLength the decoder was written against, any other descriptor misses
+    const char *name;
+    hid_static_decode_t decode;
+} hid_static_decoder_t;
+
+static const hid_static_decoder_t s_hid_static_decoders[] = {
+    { 0x284e, 0x8d00, 1, 56, "NB4 gamepad", hid_static_nb4_gamepad_t::decode },
+};
+
+/**
+ * The specialized decoder of one interface, or NULL to use hid_decode_report().
+ */
+static const hid_static_decoder_t *hid_static_decoder_find(uint16_t idVendor, uint16_t idProduct, uint8_t bInterfaceNumber,
+                                                           uint16_t report_desc_len)
+{
+    for (size_t i = 0; i < sizeof(s_hid_static_decoders) / sizeof(s_hid_static_decoders[0]); i++) {
+        const hid_static_decoder_t *decoder = &s_hid_static_decoders[i];
+        if (decoder->idVendor == idVendor && decoder->idProduct == idProduct &&
+            decoder->bInterfaceNumber == bInterfaceNumber && decoder->report_desc_len == report_desc_len) {
+            return decoder;
+        }
+    }
+    return NULL;
+}
@@ -35,8 +35,12 @@ static void usb_host_lib_daemon_task(void *arg)
         ESP_ERROR_CHECK(usb_host_lib_handle_events(portMAX_DELAY, &event_flags));
         if (event_flags & USB_HOST_LIB_EVENT_FLAGS_NO_CLIENTS) {
             has_clients = false;
+            //Free what is still connected, ALL_FREE follows unless nothing was
+            has_devices = (usb_host_device_free_all() == ESP_ERR_NOT_FINISHED);
         }
-        if (event_flags & USB_HOST_LIB_EVENT_FLAGS_ALL_FREE) {
+        if ((event_flags & USB_HOST_LIB_EVENT_FLAGS_ALL_FREE) && !has_clients) {
+            //Also raised whenever the last device is unplugged, which only ends the loop once the class driver is gone
+            ESP_LOGI(TAG_DAEMON, "All devices freed");
             has_devices = false;
         }
     }
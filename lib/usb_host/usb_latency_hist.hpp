@@ -0,0 +1,75 @@
+/*
+ * Fixed-bucket latency histograms
+ *
+ * Bucket n counts samples in [2^(n-1), 2^n) microseconds, bucket 0 counts
+ * samples under 1 us. Recording is a count-leading-zeros and two adds, cheap
+ * enough to stay enabled in production. Each histogram has a single writer;
+ * readers may see a sample in count before it shows up in sum_us, which is
+ * harmless for reporting. No ESP-IDF dependencies.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define LATENCY_HIST_NUM_BUCKETS    18      //Last bucket collects everything from 2^16 us (65 ms) up
+
+typedef struct {
+    uint32_t buckets[LATENCY_HIST_NUM_BUCKETS];
+    uint32_t count;
+    uint32_t max_us;
+    uint64_t sum_us;
+} latency_hist_t;
+
+static inline void latency_hist_record(latency_hist_t *hist, int64_t us)
+{
+    uint32_t v = (us < 0) ? 0 : (us > 0xFFFFFFFF) ? 0xFFFFFFFF : (uint32_t)us;
+    uint32_t bucket = v ? 32 - __builtin_clz(v) : 0;
+    if (bucket >= LATENCY_HIST_NUM_BUCKETS) {
+        bucket = LATENCY_HIST_NUM_BUCKETS - 1;
+    }
+    hist->buckets[bucket]++;
+    hist->count++;
+    hist->sum_us += v;
+    if (v > hist->max_us) {
+        hist->max_us = v;
+    }
+}
+
+static void latency_hist_reset(latency_hist_t *hist)
+{
+    memset(hist, 0, sizeof(latency_hist_t));
+}
+
+/**
+ * Upper bound, in microseconds, of the bucket holding the given percentile (0-100).
+ */
+static uint32_t latency_hist_percentile(const latency_hist_t *hist, uint32_t percentile)
+{
+    if (hist->count == 0) {
+        return 0;
+    }
+    uint64_t target = ((uint64_t)hist->count * percentile + 99) / 100;
+    uint64_t seen = 0;
+    for (int n = 0; n < LATENCY_HIST_NUM_BUCKETS; n++) {
+        seen += hist->buckets[n];
+        if (seen >= target && seen > 0) {
+            return (n == LATENCY_HIST_NUM_BUCKETS - 1) ? hist->max_us : (1u << n);
+        }
+    }
+    return hist->max_us;
+}
+
+static void latency_hist_print(const char *name, const latency_hist_t *hist)
+{
+    uint32_t mean = hist->count ? (uint32_t)(hist->sum_us / hist->count) : 0;
+    printf("%s: n %u, mean %u us, p50 <%u us, p99 <%u us, max %u us\n", name, hist->count, mean,
+           latency_hist_percentile(hist, 50), latency_hist_percentile(hist, 99), hist->max_us);
+    printf("%s:", name);
+    for (int n = 0; n < LATENCY_HIST_NUM_BUCKETS; n++) {
+        printf(" %u", hist->buckets[n]);
+    }
+    printf("\n");
+}
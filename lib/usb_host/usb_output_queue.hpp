@@ -0,0 +1,158 @@
+/*
+ * Coalescing queue of output reports
+ *
+ * One slot per report ID holds the latest report written for it. Writes
+ * that arrive before the previous one went out replace it, so the device
+ * only ever receives the newest rumble or LED state, however fast the
+ * application writes. Each slot is a small seqlock: writers on any task
+ * never wait on the class driver, and the class driver, the only reader,
+ * skips a slot that is being written instead of spinning.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <atomic>
+
+#define OUTPUT_QUEUE_MAX_REPORTS    4       //Report IDs with an output report, per interface
+#define OUTPUT_REPORT_MAX_BYTES     64      //Report ID byte included
+#define OUTPUT_QUEUE_WRITE_TRIES    8       //Attempts to get past a concurrent writer of the same report ID
+#define OUTPUT_SLOT_FREE            (-1)
+
+typedef struct {
+    std::atomic<int16_t> report_id;             //OUTPUT_SLOT_FREE until the first write claims the slot
+    std::atomic<uint32_t> lock;                 //Odd while a writer is inside, +2 per write
+    std::atomic<uint16_t> len;
+    std::atomic<uint32_t> words[OUTPUT_REPORT_MAX_BYTES / 4];
+    uint32_t taken_lock;                        //Reader only, lock of the last write taken
+} output_slot_t;
+
+typedef struct {
+    output_slot_t slots[OUTPUT_QUEUE_MAX_REPORTS];
+    std::atomic<uint32_t> writes;
+    std::atomic<uint32_t> rejected;             //No free slot, too long, or a writer kept racing
+    //Reader only
+    uint8_t rr_next;
+    uint32_t taken;
+    uint32_t coalesced;                         //Writes replaced before they went out
+    uint32_t max_depth;                         //Most slots pending at one take
+} output_queue_t;
+
+static void output_queue_init(output_queue_t *queue)
+{
+    for (int i = 0; i < OUTPUT_QUEUE_MAX_REPORTS; i++) {
+        output_slot_t *slot = &queue->slots[i];
+        slot->report_id.store(OUTPUT_SLOT_FREE, std::memory_order_relaxed);
+        slot->lock.store(0, std::memory_order_relaxed);
+        slot->len.store(0, std::memory_order_relaxed);
+        slot->taken_lock = 0;
+    }
+    queue->writes.store(0, std::memory_order_relaxed);
+    queue->rejected.store(0, std::memory_order_relaxed);
+    queue->rr_next = 0;
+    queue->taken = 0;
+    queue->coalesced = 0;
+    queue->max_depth = 0;
+}
+
+static output_slot_t *output_queue_slot(output_queue_t *queue, uint8_t report_id)
+{
+    for (int i = 0; i < OUTPUT_QUEUE_MAX_REPORTS; i++) {
+        output_slot_t *slot = &queue->slots[i];
+        int16_t id = slot->report_id.load(std::memory_order_acquire);
+        if (id == report_id) {
+            return slot;
+        }
+        if (id == OUTPUT_SLOT_FREE) {
+            int16_t expected = OUTPUT_SLOT_FREE;
+            if (slot->report_id.compare_exchange_strong(expected, report_id, std::memory_order_acq_rel) ||
+                expected == report_id) {
+                return slot;
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Any task. Queue report (len bytes, report ID byte first when report_id
+ * is not 0), replacing a report with the same ID that has not gone out yet.
+ * Returns false, and counts it, if the report cannot be queued.
+ */
+static bool output_queue_write(output_queue_t *queue, uint8_t report_id, const uint8_t *report, size_t len)
+{
+    output_slot_t *slot = (len > 0 && len <= OUTPUT_REPORT_MAX_BYTES) ? output_queue_slot(queue, report_id) : NULL;
+    for (int tries = 0; slot && tries < OUTPUT_QUEUE_WRITE_TRIES; tries++) {
+        uint32_t lock = slot->lock.load(std::memory_order_relaxed);
+        if ((lock & 1) || !slot->lock.compare_exchange_weak(lock, lock + 1, std::memory_order_acquire)) {
+            continue;
+        }
+        std::atomic_thread_fence(std::memory_order_release);
+        uint32_t words[OUTPUT_REPORT_MAX_BYTES / 4] = { 0 };
+        memcpy(words, report, len);
+        for (size_t i = 0; i < (len + 3) / 4; i++) {
+            slot->words[i].store(words[i], std::memory_order_relaxed);
+        }
+        slot->len.store((uint16_t)len, std::memory_order_relaxed);
+        slot->lock.store(lock + 2, std::memory_order_release);
+        queue->writes.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+    queue->rejected.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+//Reader only
+static bool output_queue_pending(const output_queue_t *queue)
+{
+    for (int i = 0; i < OUTPUT_QUEUE_MAX_REPORTS; i++) {
+        if (queue->slots[i].lock.load(std::memory_order_relaxed) != queue->slots[i].taken_lock) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Reader only. Copy the next pending report, taking report IDs in turn so
+ * a constantly rewritten one cannot starve the others. Returns its length,
+ * or 0 if nothing is pending or every pending slot is mid-write.
+ */
+static size_t output_queue_take(output_queue_t *queue, uint8_t *report, uint8_t *report_id)
+{
+    uint32_t depth = 0;
+    size_t len = 0;
+    for (int k = 0; k < OUTPUT_QUEUE_MAX_REPORTS; k++) {
+        output_slot_t *slot = &queue->slots[(queue->rr_next + k) % OUTPUT_QUEUE_MAX_REPORTS];
+        uint32_t lock = slot->lock.load(std::memory_order_acquire);
+        if (lock == slot->taken_lock) {
+            continue;
+        }
+        depth++;
+        if (len || (lock & 1)) {
+            continue;
+        }
+        uint32_t words[OUTPUT_REPORT_MAX_BYTES / 4];
+        size_t n = slot->len.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < (n + 3) / 4 && i < OUTPUT_REPORT_MAX_BYTES / 4; i++) {
+            words[i] = slot->words[i].load(std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot->lock.load(std::memory_order_relaxed) != lock || n > OUTPUT_REPORT_MAX_BYTES) {
+            continue;
+        }
+        memcpy(report, words, n);
+        *report_id = (uint8_t)slot->report_id.load(std::memory_order_relaxed);
+        queue->coalesced += (lock - slot->taken_lock) / 2 - 1;
+        slot->taken_lock = lock;
+        queue->rr_next = (uint8_t)((queue->rr_next + k + 1) % OUTPUT_QUEUE_MAX_REPORTS);
+        queue->taken++;
+        len = n;
+    }
+    if (depth > queue->max_depth) {
+        queue->max_depth = depth;
+    }
+    return len;
+}
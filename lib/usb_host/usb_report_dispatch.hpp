@@ -0,0 +1,187 @@
+/*
+ * Report subscriptions and per-interface dispatch tables
+ *
+ * Consumers subscribe to (device, interface, report ID) or to reports that
+ * carry a given usage page. For each interface the subscriptions are
+ * matched against its compiled layout once, into a 256-entry table of
+ * subscriber masks indexed by report ID, so the receive path resolves
+ * subscribers with one load and can drop unsubscribed reports before they
+ * are copied or decoded. Subscribing and unsubscribing are lock-free and
+ * safe from any task; tables are rebuilt by their owner when the
+ * generation moves, into the buffer readers are not using, and published
+ * with one store. Every entry carries the generations of the slots it was
+ * matched against, so a slot reused since the build is not dispatched to
+ * with the previous subscription's filter. No ESP-IDF dependencies.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <atomic>
+#include "usb_hid_report_parser.hpp"
+
+#define REPORT_SUB_MAX              16      //Subscriptions at once, bits of a uint16_t mask
+#define REPORT_SUB_ANY_DEVICE       0
+#define REPORT_SUB_ANY_INTERFACE    0xFF
+#define REPORT_SUB_ANY_REPORT       (-1)
+
+typedef struct {
+    uint8_t dev_addr;
+    uint8_t bInterfaceNumber;
+    uint8_t report_id;
+    uint16_t len;
+    const uint8_t *data;                        //Raw report, report ID byte included; valid during the callback only
+    int64_t timestamp_us;                       //Completion time of the IN transfer
+    const hid_report_values_t *values;          //Decoded report, NULL if it could not be decoded
+} hid_report_event_t;
+
+typedef void (*report_sub_cb_t)(const hid_report_event_t *event, void *arg);
+
+typedef struct {
+    uint8_t dev_addr;                           //REPORT_SUB_ANY_DEVICE for every device
+    uint8_t bInterfaceNumber;                   //REPORT_SUB_ANY_INTERFACE for every interface
+    int16_t report_id;                          //REPORT_SUB_ANY_REPORT for every report ID
+    uint16_t usage_page;                        //0, or only reports with a field on this usage page
+    report_sub_cb_t cb;
+    void *arg;
+} report_sub_t;
+
+typedef struct {
+    report_sub_t subs[REPORT_SUB_MAX];
+    std::atomic<uint16_t> claimed;              //Slots taken, subs[] may still be being filled in
+    std::atomic<uint16_t> active;               //Slots filled in and dispatched to
+    std::atomic<uint32_t> generation;           //Bumped on every change, tables older than this are stale
+    std::atomic<uint32_t> slot_generations[REPORT_SUB_MAX]; //Bumped each time the slot is filled in
+} report_sub_table_t;                           //Zero-initialized is empty
+
+typedef struct {
+    uint16_t masks[256];                        //Subscribers by report ID
+    uint32_t slot_generations[REPORT_SUB_MAX];  //Of the subscriptions the masks were matched against
+} report_dispatch_masks_t;
+
+//One reader and one builder, outside anything that gets memset while a reader may use it
+typedef struct {
+    report_dispatch_masks_t buffers[2];
+    std::atomic<uint8_t> current;               //Buffer readers use, the builder fills the other one
+    uint32_t generation;                        //Of the table the masks were built from, 0 before the first build; builder only
+} report_dispatch_t;
+
+/**
+ * Any task. Returns the subscription's handle, or -1 if every slot is taken.
+ */
+static int report_sub_add(report_sub_table_t *table, const report_sub_t *sub)
+{
+    uint16_t claimed = table->claimed.load(std::memory_order_relaxed);
+    while (true) {
+        int i = 0;
+        while (i < REPORT_SUB_MAX && (claimed & (1u << i))) {
+            i++;
+        }
+        if (i == REPORT_SUB_MAX) {
+            return -1;
+        }
+        if (table->claimed.compare_exchange_weak(claimed, claimed | (1u << i), std::memory_order_acquire)) {
+            table->subs[i] = *sub;
+            table->slot_generations[i].fetch_add(1, std::memory_order_release);
+            table->active.fetch_or(1u << i, std::memory_order_release);
+            table->generation.fetch_add(1, std::memory_order_release);
+            return i;
+        }
+    }
+}
+
+/**
+ * Any task. A callback already running for this subscription may still
+ * finish after this returns.
+ */
+static void report_sub_remove(report_sub_table_t *table, int handle)
+{
+    if (handle < 0 || handle >= REPORT_SUB_MAX) {
+        return;
+    }
+    table->active.fetch_and(~(1u << handle), std::memory_order_acq_rel);
+    table->generation.fetch_add(1, std::memory_order_release);
+    table->claimed.fetch_and(~(1u << handle), std::memory_order_release);
+}
+
+static bool report_sub_has_page(const hid_report_layout_t *layout, uint8_t report_id, uint16_t usage_page)
+{
+    const hid_report_info_t *info = layout ? hid_report_layout_find(layout, report_id) : NULL;
+    for (int a = 0; info && a < info->num_fields; a++) {
+        if (layout->fields[info->first_field + a].usage_page == usage_page) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Match every active subscription against one interface and publish the
+ * result. layout may be NULL (e.g. boot protocol), then usage page
+ * subscriptions never match. Only one task may build a given dispatch.
+ */
+static void report_dispatch_build(report_dispatch_t *dispatch, report_sub_table_t *table, uint8_t dev_addr,
+                                  uint8_t bInterfaceNumber, const hid_report_layout_t *layout)
+{
+    uint32_t generation = table->generation.load(std::memory_order_acquire);
+    uint16_t active = table->active.load(std::memory_order_acquire);
+    uint8_t next = dispatch->current.load(std::memory_order_relaxed) ^ 1;
+    report_dispatch_masks_t *masks = &dispatch->buffers[next];
+    //A reader that loaded current before the previous publish may still be in here, every entry is stored once
+    uint16_t matched = 0;
+    int first[REPORT_SUB_MAX];
+    int last[REPORT_SUB_MAX];
+    for (int i = 0; i < REPORT_SUB_MAX; i++) {
+        //Generation before the contents, a slot refilled meanwhile then looks stale to the lookup
+        masks->slot_generations[i] = table->slot_generations[i].load(std::memory_order_acquire);
+        const report_sub_t *sub = &table->subs[i];
+        if (!(active & (1u << i)) ||
+            (sub->dev_addr != REPORT_SUB_ANY_DEVICE && sub->dev_addr != dev_addr) ||
+            (sub->bInterfaceNumber != REPORT_SUB_ANY_INTERFACE && sub->bInterfaceNumber != bInterfaceNumber)) {
+            continue;
+        }
+        matched |= 1u << i;
+        first[i] = (sub->report_id == REPORT_SUB_ANY_REPORT) ? 0 : sub->report_id;
+        last[i] = (sub->report_id == REPORT_SUB_ANY_REPORT) ? 255 : sub->report_id;
+    }
+    for (int id = 0; id < 256; id++) {
+        uint16_t mask = 0;
+        for (int i = 0; matched && i < REPORT_SUB_MAX; i++) {
+            const report_sub_t *sub = &table->subs[i];
+            if ((matched & (1u << i)) && id >= first[i] && id <= last[i] &&
+                (sub->usage_page == 0 || report_sub_has_page(layout, (uint8_t)id, sub->usage_page))) {
+                mask |= 1u << i;
+            }
+        }
+        masks->masks[id] = mask;
+    }
+    dispatch->current.store(next, std::memory_order_release);
+    dispatch->generation = generation;
+}
+
+//Builder only
+static inline bool report_dispatch_stale(const report_dispatch_t *dispatch, const report_sub_table_t *table)
+{
+    return dispatch->generation != table->generation.load(std::memory_order_acquire);
+}
+
+/**
+ * Subscribers of one report, a single table read. Slots removed since the
+ * last build are masked out with the live active mask, slots refilled
+ * since then by their generation.
+ */
+static inline uint16_t report_dispatch_lookup(const report_dispatch_t *dispatch, const report_sub_table_t *table,
+                                              uint8_t report_id)
+{
+    const report_dispatch_masks_t *masks = &dispatch->buffers[dispatch->current.load(std::memory_order_acquire)];
+    uint16_t subs = masks->masks[report_id] & table->active.load(std::memory_order_acquire);
+    for (uint16_t pending = subs; pending; pending &= pending - 1) {
+        int i = __builtin_ctz(pending);
+        if (masks->slot_generations[i] != table->slot_generations[i].load(std::memory_order_relaxed)) {
+            subs &= ~(1u << i);
+        }
+    }
+    return subs;
+}
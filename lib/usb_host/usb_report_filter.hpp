@@ -0,0 +1,207 @@
+/*
+ * Input report change suppression
+ *
+ * Keeps the last forwarded report per report ID and drops reports that do
+ * not differ from it. The compare is a word-wise XOR against a mask built
+ * from the compiled layout, so only the selected fields count; axes may be
+ * given a deadband instead of an exact compare. Relative fields (mouse
+ * motion, wheels) are never compared: a report with any of them non-zero is
+ * forwarded, as two identical moves are still two moves. Reports longer
+ * than REPORT_FILTER_MAX_BYTES are forwarded unfiltered. Forwarded reports
+ * come with a bitmap of the fields that changed. Single threaded, no
+ * ESP-IDF dependencies.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "usb_hid_report_parser.hpp"
+
+#define REPORT_FILTER_MAX_BYTES     64      //Longest report compared, longer ones are always forwarded
+#define REPORT_FILTER_WORDS         (REPORT_FILTER_MAX_BYTES / 4)
+#define REPORT_FILTER_ALL_FIELDS    (~0ull)
+
+static_assert(HID_REPORT_MAX_FIELDS <= 64, "field selections are 64-bit masks");
+
+typedef struct {
+    uint32_t last[REPORT_FILTER_WORDS];     //Last forwarded report
+    uint32_t mask[REPORT_FILTER_WORDS];     //Bits compared exactly
+    uint32_t rel_mask[REPORT_FILTER_WORDS]; //Bits of relative fields, any set one forwards the report
+    uint16_t len;                           //Length of last, 0 before the first report
+    uint8_t report_id;
+} report_filter_entry_t;
+
+typedef struct {
+    const hid_report_layout_t *layout;      //NULL to compare whole reports
+    bool passthrough;                       //Forward every report, see report_filter_init_passthrough()
+    uint64_t fields;                        //Bit n selects layout->fields[n]
+    uint32_t deadband;                      //Axis change, in logical units, that still counts as unchanged
+    report_filter_entry_t entries[HID_REPORT_MAX_REPORTS];
+    uint8_t num_entries;
+    uint32_t forwarded;
+    uint32_t suppressed;
+    uint32_t deadbanded;                    //Suppressed although an axis moved within its deadband
+} report_filter_t;
+
+typedef struct {
+    uint8_t report_id;
+    uint64_t changed_fields;                //Bit n set if layout->fields[n] differs from the last forwarded report
+} report_delta_t;
+
+static void report_filter_mask_bits(uint32_t *mask, uint32_t first_bit, uint32_t num_bits)
+{
+    uint32_t end = first_bit + num_bits;
+    if (end > REPORT_FILTER_MAX_BYTES * 8) {
+        end = REPORT_FILTER_MAX_BYTES * 8;
+    }
+    for (uint32_t bit = first_bit; bit < end; bit++) {
+        mask[bit >> 5] |= 1u << (bit & 31);
+    }
+}
+
+//Absolute axes get the deadband, everything else is compared bit for bit
+static inline bool report_filter_is_deadbanded(const report_filter_t *filter, const hid_field_t *f)
+{
+    return filter->deadband > 0 && f->kind == HID_FIELD_KIND_AXIS && f->bit_size > 1 &&
+           !(f->flags & HID_FIELD_FLAG_RELATIVE);
+}
+
+/**
+ * Set up a filter for one endpoint. Masks are built once here, so
+ * report_filter_apply() never walks fields for unchanged reports.
+ */
+static void report_filter_init(report_filter_t *filter, const hid_report_layout_t *layout, uint64_t fields, uint32_t deadband)
+{
+    memset(filter, 0, sizeof(report_filter_t));
+    filter->layout = (layout && layout->num_reports > 0) ? layout : NULL;
+    filter->fields = fields;
+    filter->deadband = deadband;
+
+    if (filter->layout == NULL) {
+        filter->num_entries = 1;
+        memset(filter->entries[0].mask, 0xFF, sizeof(filter->entries[0].mask));
+        return;
+    }
+    for (int r = 0; r < layout->num_reports; r++) {
+        const hid_report_info_t *info = &layout->reports[r];
+        report_filter_entry_t *entry = &filter->entries[filter->num_entries++];
+        entry->report_id = info->report_id;
+        for (int a = info->first_field; a < info->first_field + info->num_fields; a++) {
+            const hid_field_t *f = &layout->fields[a];
+            if (f->flags & HID_FIELD_FLAG_RELATIVE) {
+                report_filter_mask_bits(entry->rel_mask, f->bit_offset, (uint32_t)f->bit_size * f->count);
+            } else if (((fields >> a) & 1) && !report_filter_is_deadbanded(filter, f)) {
+                report_filter_mask_bits(entry->mask, f->bit_offset, (uint32_t)f->bit_size * f->count);
+            }
+        }
+    }
+}
+
+/**
+ * Set up a filter that forwards every report, for reports the layout does
+ * not describe and that are all motion, such as boot mouse reports.
+ */
+static void report_filter_init_passthrough(report_filter_t *filter)
+{
+    memset(filter, 0, sizeof(report_filter_t));
+    filter->passthrough = true;
+}
+
+static bool report_filter_field_changed(const hid_field_t *f, const uint8_t *a, const uint8_t *b, size_t len,
+                                        uint32_t deadband)
+{
+    uint32_t shift = 32 - f->bit_size;
+    for (uint32_t k = 0; k < f->count; k++) {
+        uint32_t bit = f->bit_offset + k * f->bit_size;
+        if (bit + f->bit_size > len * 8) {
+            break;
+        }
+        uint32_t raw_a = hid_extract_bits(a, len, bit, f->bit_size);
+        uint32_t raw_b = hid_extract_bits(b, len, bit, f->bit_size);
+        if (raw_a == raw_b) {
+            continue;
+        }
+        if (deadband == 0) {
+            return true;
+        }
+        int64_t va = (f->flags & HID_FIELD_FLAG_SIGNED) ? (int32_t)(raw_a << shift) >> shift : (int64_t)raw_a;
+        int64_t vb = (f->flags & HID_FIELD_FLAG_SIGNED) ? (int32_t)(raw_b << shift) >> shift : (int64_t)raw_b;
+        if (va - vb > (int64_t)deadband || vb - va > (int64_t)deadband) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Compare one input report with the last one forwarded for its report ID.
+ * Returns true, with delta filled in, if it should be forwarded; false if
+ * it is suppressed. Report IDs the layout does not know and reports longer
+ * than REPORT_FILTER_MAX_BYTES are always forwarded.
+ */
+static bool report_filter_apply(report_filter_t *filter, const uint8_t *data, size_t len, report_delta_t *delta)
+{
+    const hid_report_layout_t *layout = filter->layout;
+    uint8_t report_id = (layout && layout->uses_report_ids && len) ? data[0] : 0;
+    report_filter_entry_t *entry = NULL;
+    for (int i = 0; i < filter->num_entries && entry == NULL; i++) {
+        if (filter->entries[i].report_id == report_id) {
+            entry = &filter->entries[i];
+        }
+    }
+    delta->report_id = report_id;
+    delta->changed_fields = REPORT_FILTER_ALL_FIELDS;
+    if (entry == NULL || filter->passthrough || len > REPORT_FILTER_MAX_BYTES) {
+        filter->forwarded++;
+        return true;
+    }
+
+    static const uint32_t zero[REPORT_FILTER_WORDS] = { 0 };
+    uint32_t cur[REPORT_FILTER_WORDS] = { 0 };
+    memcpy(cur, data, len);
+    uint32_t diff = 0;
+    uint32_t motion = 0;
+    for (int w = 0; w < REPORT_FILTER_WORDS; w++) {
+        diff |= (cur[w] ^ entry->last[w]) & entry->mask[w];
+        motion |= cur[w] & entry->rel_mask[w];
+    }
+    bool first = (entry->len != len);
+    const hid_report_info_t *info = layout ? hid_report_layout_find(layout, report_id) : NULL;
+
+    bool changed = first || diff != 0 || motion != 0;
+    bool moved = false;
+    if (!changed && info && filter->deadband) {
+        for (int a = info->first_field; a < info->first_field + info->num_fields && !changed; a++) {
+            const hid_field_t *f = &layout->fields[a];
+            if (((filter->fields >> a) & 1) && report_filter_is_deadbanded(filter, f)) {
+                changed = report_filter_field_changed(f, (const uint8_t *)cur, (const uint8_t *)entry->last,
+                                                      len, filter->deadband);
+                moved |= report_filter_field_changed(f, (const uint8_t *)cur, (const uint8_t *)entry->last,
+                                                     len, 0);
+            }
+        }
+    }
+    if (!changed) {
+        filter->suppressed++;
+        filter->deadbanded += moved ? 1 : 0;
+        return false;
+    }
+
+    if (info && !first) {
+        delta->changed_fields = 0;
+        for (int a = info->first_field; a < info->first_field + info->num_fields; a++) {
+            //A relative field changed whenever it moved, whatever it was last time
+            const hid_field_t *f = &layout->fields[a];
+            const uint32_t *ref = (f->flags & HID_FIELD_FLAG_RELATIVE) ? zero : entry->last;
+            if (report_filter_field_changed(f, (const uint8_t *)cur, (const uint8_t *)ref, len, 0)) {
+                delta->changed_fields |= 1ull << a;
+            }
+        }
+    }
+    memcpy(entry->last, cur, sizeof(cur));
+    entry->len = (uint16_t)len;
+    filter->forwarded++;
+    return true;
+}
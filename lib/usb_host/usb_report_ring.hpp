@@ -0,0 +1,109 @@
+/*
+ * Lock-free single-producer/single-consumer ring of IN report slots
+ *
+ * The producer is the transfer completion callback, which must never block:
+ * when the ring is full the report is dropped and counted. The consumer
+ * drains slots in batches and releases the whole batch with one store.
+ * Only std::atomic is used, so the ring can be exercised with host threads.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <atomic>
+
+#define REPORT_RING_NUM_SLOTS       32      //Must be a power of two
+#define REPORT_RING_SLOT_BYTES      64      //Reports longer than this are truncated and counted
+#define REPORT_RING_CACHE_LINE      32
+
+typedef struct {
+    int64_t timestamp_us;       //Time the completion callback published the report
+    uint8_t ep_addr;
+    uint8_t dev_addr;
+    uint16_t len;
+    uint8_t data[REPORT_RING_SLOT_BYTES];
+} report_slot_t;
+
+typedef struct {
+    //Producer side
+    alignas(REPORT_RING_CACHE_LINE) std::atomic<uint32_t> head;
+    std::atomic<uint32_t> dropped;      //Reports lost because the ring was full
+    std::atomic<uint32_t> truncated;    //Reports longer than REPORT_RING_SLOT_BYTES
+    std::atomic<uint32_t> high_water;   //Deepest the ring has been
+    //Consumer side
+    alignas(REPORT_RING_CACHE_LINE) std::atomic<uint32_t> tail;
+    std::atomic<uint32_t> consumed;
+    alignas(REPORT_RING_CACHE_LINE) report_slot_t slots[REPORT_RING_NUM_SLOTS];
+} report_ring_t;
+
+typedef void (*report_ring_consumer_cb_t)(const report_slot_t *slot, void *arg);
+
+static void report_ring_init(report_ring_t *ring)
+{
+    ring->head.store(0, std::memory_order_relaxed);
+    ring->tail.store(0, std::memory_order_relaxed);
+    ring->dropped.store(0, std::memory_order_relaxed);
+    ring->truncated.store(0, std::memory_order_relaxed);
+    ring->high_water.store(0, std::memory_order_relaxed);
+    ring->consumed.store(0, std::memory_order_relaxed);
+}
+
+static inline uint32_t report_ring_depth(const report_ring_t *ring)
+{
+    return ring->head.load(std::memory_order_acquire) - ring->tail.load(std::memory_order_acquire);
+}
+
+/**
+ * Producer only. Copy one report into the ring without blocking.
+ * Returns false, and counts a drop, if the ring is full.
+ */
+static bool report_ring_push(report_ring_t *ring, uint8_t dev_addr, uint8_t ep_addr,
+                             const uint8_t *data, size_t len, int64_t timestamp_us)
+{
+    uint32_t head = ring->head.load(std::memory_order_relaxed);
+    uint32_t depth = head - ring->tail.load(std::memory_order_acquire);
+    if (depth >= REPORT_RING_NUM_SLOTS) {
+        ring->dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    report_slot_t *slot = &ring->slots[head & (REPORT_RING_NUM_SLOTS - 1)];
+    if (len > REPORT_RING_SLOT_BYTES) {
+        ring->truncated.fetch_add(1, std::memory_order_relaxed);
+        len = REPORT_RING_SLOT_BYTES;
+    }
+    memcpy(slot->data, data, len);
+    slot->len = (uint16_t)len;
+    slot->ep_addr = ep_addr;
+    slot->dev_addr = dev_addr;
+    slot->timestamp_us = timestamp_us;
+    ring->head.store(head + 1, std::memory_order_release);
+
+    if (depth + 1 > ring->high_water.load(std::memory_order_relaxed)) {
+        ring->high_water.store(depth + 1, std::memory_order_relaxed);
+    }
+    return true;
+}
+
+/**
+ * Consumer only. Hand up to max_slots published reports to cb, in order,
+ * then release them all at once. Returns the number of reports consumed.
+ */
+static size_t report_ring_drain(report_ring_t *ring, report_ring_consumer_cb_t cb, void *arg, size_t max_slots)
+{
+    uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+    uint32_t avail = ring->head.load(std::memory_order_acquire) - tail;
+    if (avail > max_slots) {
+        avail = (uint32_t)max_slots;
+    }
+    for (uint32_t i = 0; i < avail; i++) {
+        cb(&ring->slots[(tail + i) & (REPORT_RING_NUM_SLOTS - 1)], arg);
+    }
+    if (avail) {
+        ring->tail.store(tail + avail, std::memory_order_release);
+        ring->consumed.fetch_add(avail, std::memory_order_relaxed);
+    }
+    return avail;
+}
@@ -0,0 +1,324 @@
+/*
+ * Zero-copy report forwarding to sinks
+ *
+ * Instead of copying a report, the class driver lends the buffer of the
+ * completed IN transfer to every registered sink. A lease points at the
+ * transfer's data and holds one reference per sink it was queued to. The
+ * transfer stays off the endpoint until the last sink releases the lease,
+ * then goes back to its owner through an atomic mask. Each sink has its
+ * own lease queue, drained in batches of up to REPORT_SINK_BATCH_MAX so
+ * one write can carry several small reports. No ESP-IDF dependencies.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+
+#define REPORT_SINK_MAX             4
+#define REPORT_SINK_QUEUE_LEN       16      //Leases queued per sink, must be a power of two
+#define REPORT_SINK_BATCH_MAX       8       //Leases handed to one write
+#define REPORT_SINK_ANY_DEVICE      0
+
+#define REPORT_FRAME_SYNC           0xA5
+
+//One report lent out of a transfer buffer, owned by the class driver
+typedef struct {
+    const uint8_t *data;                        //The transfer's buffer, must not be written while lent
+    uint16_t len;
+    uint8_t dev_addr;
+    uint8_t ep_addr;
+    int64_t timestamp_us;                       //Completion time of the IN transfer
+    std::atomic<uint8_t> refs;                  //Sinks still holding the lease
+    uint8_t index;                              //Bit set in *returned once the last sink let go
+    std::atomic<uint32_t> *returned;
+} report_lease_t;
+
+/**
+ * Forward a batch of leases. Returns how many leases, from the front, the
+ * sink is done with; the caller releases those. A sink that keeps the rest
+ * (e.g. until a DMA transfer finishes) must release each of them later.
+ */
+typedef size_t (*report_sink_write_t)(report_lease_t *const *leases, size_t count, void *arg);
+
+typedef struct {
+    const char *name;
+    uint8_t dev_addr;                           //REPORT_SINK_ANY_DEVICE for every device
+    report_sink_write_t write;
+    void *arg;
+} report_sink_t;
+
+//Lease queue of one sink, filled by the class driver task and drained by the sink task
+typedef struct {
+    report_sink_t sink;
+    std::atomic<uint32_t> head;
+    std::atomic<uint32_t> tail;
+    report_lease_t *queue[REPORT_SINK_QUEUE_LEN];
+    std::atomic<uint32_t> lent;                 //Leases queued to this sink, written by the lender only
+    std::atomic<uint32_t> full;                 //Reports the sink missed, its queue was full; lender only
+    std::atomic<uint32_t> batches;              //Writes, lent / batches is the mean batch size; sink task only
+} report_sink_slot_t;
+
+typedef struct {
+    report_sink_slot_t slots[REPORT_SINK_MAX];
+    std::atomic<uint8_t> claimed;               //Slots taken, sink may still be being filled in
+    std::atomic<uint8_t> active;                //Slots filled in and lent to
+    std::atomic<uint8_t> seen;                  //active as of the lender's last report_sink_sync(), lender only
+} report_sink_table_t;                          //Zero-initialized is empty
+
+//One piece of a gathered write
+typedef struct {
+    const void *data;
+    size_t len;
+} report_iov_t;
+
+//Writes count pieces back to back, e.g. into a UART FIFO or as a linked DMA descriptor list; returns the bytes taken
+typedef size_t (*report_frame_writer_t)(const report_iov_t *iov, size_t count, void *arg);
+
+/**
+ * Batching stream over a gather writer. One frame per batch: sync byte and
+ * report count, then dev_addr, ep_addr and le16 length ahead of each
+ * report, then an XOR of every byte before it.
+ */
+typedef struct {
+    report_frame_writer_t writer;
+    void *writer_arg;
+    uint32_t frames;
+    uint32_t bytes;
+    uint8_t head[2];
+    uint8_t headers[REPORT_SINK_BATCH_MAX][4];
+    uint8_t check;
+    report_iov_t iov[2 * REPORT_SINK_BATCH_MAX + 2];
+} report_frame_sink_t;
+
+/**
+ * Any task. Returns a handle for report_sink_remove(), or -1 if
+ * REPORT_SINK_MAX sinks exist already.
+ */
+static int report_sink_add(report_sink_table_t *table, const report_sink_t *sink)
+{
+    uint8_t claimed = table->claimed.load(std::memory_order_relaxed);
+    while (true) {
+        int i = 0;
+        while (i < REPORT_SINK_MAX && (claimed & (1u << i))) {
+            i++;
+        }
+        if (i == REPORT_SINK_MAX) {
+            return -1;
+        }
+        if (table->claimed.compare_exchange_weak(claimed, claimed | (1u << i), std::memory_order_acquire)) {
+            report_sink_slot_t *slot = &table->slots[i];
+            slot->sink = *sink;
+            slot->lent.store(0, std::memory_order_relaxed);
+            slot->full.store(0, std::memory_order_relaxed);
+            slot->batches.store(0, std::memory_order_relaxed);
+            table->active.fetch_or(1u << i, std::memory_order_release);
+            return i;
+        }
+    }
+}
+
+/**
+ * Any task. Nothing is lent to the sink once the lender's next
+ * report_sink_sync() saw this; leases still queued then are released
+ * unwritten by the next report_sink_service(), which also frees the slot.
+ */
+static void report_sink_remove(report_sink_table_t *table, int handle)
+{
+    if (handle >= 0 && handle < REPORT_SINK_MAX) {
+        table->active.fetch_and(~(1u << handle), std::memory_order_acq_rel);
+    }
+}
+
+//Drop one reference, true if it was the last
+static inline bool report_lease_drop(report_lease_t *lease)
+{
+    //References only go down, so a single one left is ours and needs no read-modify-write
+    if (lease->refs.load(std::memory_order_acquire) == 1) {
+        lease->refs.store(0, std::memory_order_relaxed);
+        return true;
+    }
+    return lease->refs.fetch_sub(1, std::memory_order_acq_rel) == 1;
+}
+
+/**
+ * Drop one reference. Returns true if it was the last one; the lease's
+ * bit is set in *returned then and the owner should be woken.
+ */
+static inline bool report_lease_release(report_lease_t *lease)
+{
+    if (!report_lease_drop(lease)) {
+        return false;
+    }
+    lease->returned->fetch_or(1u << lease->index, std::memory_order_release);
+    return true;
+}
+
+/**
+ * Lender only, between lends. Picks up added and removed sinks; lends only
+ * go to sinks seen here, and a removed sink's slot is only freed once this
+ * acked the removal, so no lease is queued to it after its last drain.
+ * Returns true if a removal was acked, the sink task should be woken then.
+ */
+static bool report_sink_sync(report_sink_table_t *table)
+{
+    uint8_t active = table->active.load(std::memory_order_acquire);
+    uint8_t seen = table->seen.load(std::memory_order_relaxed);
+    if (seen == active) {
+        return false;
+    }
+    table->seen.store(active, std::memory_order_release);
+    return seen & ~active;
+}
+
+/**
+ * Lender only. Queue lease to every active sink that takes reports of
+ * its device. Returns true if the lease is out and comes back through
+ * *returned, false if no sink took it.
+ */
+static bool report_sink_lend(report_sink_table_t *table, report_lease_t *lease)
+{
+    uint8_t active = table->seen.load(std::memory_order_relaxed) & table->active.load(std::memory_order_acquire);
+    //Queues only ever gain room while the lender is away, so the sinks picked here can all be queued to
+    uint8_t take = 0;
+    uint8_t refs = 0;
+    for (int i = 0; active && i < REPORT_SINK_MAX; i++) {
+        report_sink_slot_t *slot = &table->slots[i];
+        if (!(active & (1u << i)) ||
+            (slot->sink.dev_addr != REPORT_SINK_ANY_DEVICE && slot->sink.dev_addr != lease->dev_addr)) {
+            continue;
+        }
+        if (slot->head.load(std::memory_order_relaxed) - slot->tail.load(std::memory_order_acquire) >= REPORT_SINK_QUEUE_LEN) {
+            slot->full.store(slot->full.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            continue;
+        }
+        take |= 1u << i;
+        refs++;
+    }
+    if (refs == 0) {
+        return false;
+    }
+    //Set before the first push publishes the lease, no RMW needed on the way out
+    lease->refs.store(refs, std::memory_order_relaxed);
+    for (int i = 0; take && i < REPORT_SINK_MAX; i++) {
+        if (!(take & (1u << i))) {
+            continue;
+        }
+        report_sink_slot_t *slot = &table->slots[i];
+        uint32_t head = slot->head.load(std::memory_order_relaxed);
+        slot->queue[head & (REPORT_SINK_QUEUE_LEN - 1)] = lease;
+        slot->head.store(head + 1, std::memory_order_release);
+        slot->lent.store(slot->lent.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+    return true;
+}
+
+/**
+ * Sink task only. Hand every queued lease to its sink in batches and
+ * release what the sinks are done with. A removed sink's leases are
+ * released unwritten, its slot freed once report_sink_sync() acked it. Returns the number of leases that
+ * went back to their owner, so the caller knows whether to wake it.
+ */
+static size_t report_sink_service(report_sink_table_t *table)
+{
+    size_t returned = 0;
+    report_lease_t *batch[REPORT_SINK_BATCH_MAX];
+    uint8_t claimed = table->claimed.load(std::memory_order_acquire);
+    for (int i = 0; i < REPORT_SINK_MAX; i++) {
+        if (!(claimed & (1u << i))) {
+            continue;
+        }
+        report_sink_slot_t *slot = &table->slots[i];
+        bool active = table->active.load(std::memory_order_acquire) & (1u << i);
+        //After active, before draining: once the lender acked a removal nothing is pushed after the drain
+        bool acked = !(table->seen.load(std::memory_order_acquire) & (1u << i));
+        while (true) {
+            uint32_t tail = slot->tail.load(std::memory_order_relaxed);
+            size_t count = slot->head.load(std::memory_order_acquire) - tail;
+            if (count == 0) {
+                break;
+            }
+            count = (count > REPORT_SINK_BATCH_MAX) ? REPORT_SINK_BATCH_MAX : count;
+            for (size_t k = 0; k < count; k++) {
+                batch[k] = slot->queue[(tail + k) & (REPORT_SINK_QUEUE_LEN - 1)];
+            }
+            slot->tail.store(tail + count, std::memory_order_release);
+            size_t done = count;
+            if (active) {
+                done = slot->sink.write(batch, count, slot->sink.arg);
+                slot->batches.store(slot->batches.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            }
+            //Leases of one owner usually come in runs, hand each run back with one fetch_or
+            std::atomic<uint32_t> *owner = NULL;
+            uint32_t mask = 0;
+            for (size_t k = 0; k < done && k < count; k++) {
+                if (!report_lease_drop(batch[k])) {
+                    continue;
+                }
+                if (owner != batch[k]->returned && mask) {
+                    owner->fetch_or(mask, std::memory_order_release);
+                    mask = 0;
+                }
+                owner = batch[k]->returned;
+                mask |= 1u << batch[k]->index;
+                returned++;
+            }
+            if (mask) {
+                owner->fetch_or(mask, std::memory_order_release);
+            }
+        }
+        if (!active && acked) {
+            //Removed, acked by the lender and drained, the slot can be claimed again
+            table->claimed.fetch_and(~(1u << i), std::memory_order_release);
+        }
+    }
+    return returned;
+}
+
+/**
+ * report_sink_write_t for a report_frame_sink_t arg. The report data goes
+ * to the writer straight from the lent buffers, in one gathered write per
+ * batch; the sink is done with every lease once it returns.
+ */
+static inline size_t report_frame_sink_write(report_lease_t *const *leases, size_t count, void *arg)
+{
+    report_frame_sink_t *frame = (report_frame_sink_t *)arg;
+    count = (count > REPORT_SINK_BATCH_MAX) ? REPORT_SINK_BATCH_MAX : count;
+    frame->head[0] = REPORT_FRAME_SYNC;
+    frame->head[1] = (uint8_t)count;
+    uint8_t check = frame->head[0] ^ frame->head[1];
+    size_t n = 0;
+    frame->iov[n++] = { frame->head, sizeof(frame->head) };
+    for (size_t k = 0; k < count; k++) {
+        const report_lease_t *lease = leases[k];
+        uint8_t *header = frame->headers[k];
+        header[0] = lease->dev_addr;
+        header[1] = lease->ep_addr;
+        header[2] = (uint8_t)lease->len;
+        header[3] = (uint8_t)(lease->len >> 8);
+        check ^= header[0] ^ header[1] ^ header[2] ^ header[3];
+        for (uint16_t b = 0; b < lease->len; b++) {
+            check ^= lease->data[b];
+        }
+        frame->iov[n++] = { header, 4 };
+        frame->iov[n++] = { lease->data, lease->len };
+    }
+    frame->check = check;
+    frame->iov[n++] = { &frame->check, 1 };
+    frame->bytes += frame->writer(frame->iov, n, frame->writer_arg);
+    frame->frames++;
+    return count;
+}
+
+//Writer for the console UART
+static inline size_t report_frame_stdout_writer(const report_iov_t *iov, size_t count, void *)
+{
+    size_t bytes = 0;
+    for (size_t i = 0; i < count; i++) {
+        bytes += fwrite(iov[i].data, 1, iov[i].len, stdout);
+    }
+    return bytes;
+}
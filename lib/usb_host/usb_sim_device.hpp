@@ -0,0 +1,320 @@
+/*
+ * Scripted simulated HID devices
+ *
+ * A discrete-event model of devices on a bus: each device is scripted from
+ * its raw descriptors (as captured in log.txt), attaches and detaches at
+ * given times and delivers an IN report on every endpoint's bInterval slot.
+ * Time is virtual, so scenarios run deterministically and as fast as the
+ * consumer can take events. Faults can be injected per endpoint: error slots,
+ * or a STALL that lasts until CLEAR_FEATURE(ENDPOINT_HALT). No ESP-IDF
+ * dependencies; the same scenarios feed the decode and ring paths on target
+ * and the mock host library of the native build (test/mock).
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#define SIM_MAX_DEVICES             8
+#define SIM_MAX_INTFS               4
+#define SIM_MAX_EPS                 4       //IN endpoints per simulated device
+#define SIM_MAX_REPORT_BYTES        64
+
+typedef enum {
+    SIM_FAULT_NONE,
+    SIM_FAULT_ERROR,            //The slot fails, e.g. a CRC or PID error
+    SIM_FAULT_STALL,            //The endpoint halts and stalls every slot until sim_device_clear_halt()
+} sim_fault_t;
+
+typedef void (*sim_report_fill_t)(uint8_t ep_addr, uint32_t seq, uint8_t *buf, uint16_t len);
+
+typedef struct {
+    const char *name;
+    const uint8_t *dev_desc;            //18 bytes
+    const uint8_t *config_desc;         //wTotalLength bytes
+    const uint8_t *report_descs[SIM_MAX_INTFS]; //Per interface, in bInterfaceNumber order
+    uint16_t report_desc_lens[SIM_MAX_INTFS];
+    uint16_t report_lens[SIM_MAX_INTFS]; //IN report length per interface, 0 for wMaxPacketSize
+    sim_report_fill_t fill;             //NULL for the built-in pattern
+} sim_device_script_t;
+
+typedef struct {
+    uint8_t ep_addr;
+    uint8_t intf;
+    uint16_t len;
+    uint32_t interval_us;
+    uint64_t next_us;
+    uint32_t seq;
+    uint8_t fault;                      //sim_fault_t of the next fault_slots slots
+    uint32_t fault_slots;
+    bool halted;                        //Stalled until sim_device_clear_halt()
+} sim_ep_t;
+
+typedef struct {
+    const sim_device_script_t *script;
+    uint8_t dev_addr;
+    uint64_t attach_us;
+    uint64_t detach_us;                 //0 to stay attached
+    uint32_t hold;                      //Reports repeated unchanged this many times, 1 for always changing
+    uint32_t ep0_stall_mask;            //Bit n set: class requests with bRequest n are answered with a STALL
+    bool out_nak;                       //OUT endpoints NAK every transfer, the host never gets one through
+    bool attached;
+    bool gone;
+    sim_ep_t eps[SIM_MAX_EPS];
+    uint8_t num_eps;
+} sim_device_t;
+
+typedef enum {
+    SIM_EVENT_NONE,
+    SIM_EVENT_ATTACH,
+    SIM_EVENT_REPORT,
+    SIM_EVENT_DETACH,
+} sim_event_type_t;
+
+typedef struct {
+    sim_event_type_t type;
+    uint64_t time_us;
+    sim_device_t *dev;
+    uint8_t ep_addr;
+    uint32_t seq;
+    uint8_t fault;                      //sim_fault_t of a report slot, SIM_FAULT_NONE when data is valid
+    uint16_t len;
+    uint8_t data[SIM_MAX_REPORT_BYTES];
+} sim_event_t;
+
+typedef struct {
+    sim_device_t devices[SIM_MAX_DEVICES];
+    uint8_t num_devices;
+    uint64_t now_us;
+} sim_bus_t;
+
+//Flysky Noble NB4 (0x284e:0x8d00), descriptors from log.txt
+static const uint8_t s_sim_nb4_dev_desc[18] = {
+    0x12, 0x01, 0x00, 0x02, 0x00, 0x00, 0x00, 0x40, 0x4E, 0x28, 0x00, 0x8D, 0x00, 0x01, 0x01, 0x02, 0x03, 0x01,
+};
+static const uint8_t s_sim_nb4_config_desc[66] = {
+    0x09, 0x02, 0x42, 0x00, 0x02, 0x01, 0x00, 0x80, 0xFA,
+    0x09, 0x04, 0x00, 0x00, 0x02, 0x03, 0x00, 0x00, 0x00,
+    0x09, 0x21, 0x11, 0x01, 0x00, 0x01, 0x22, 0x19, 0x00,
+    0x07, 0x05, 0x81, 0x03, 0x40, 0x00, 0x01,
+    0x07, 0x05, 0x01, 0x03, 0x40, 0x00, 0x01,
+    0x09, 0x04, 0x01, 0x00, 0x01, 0x03, 0x00, 0x00, 0x00,
+    0x09, 0x21, 0x11, 0x01, 0x00, 0x01, 0x22, 0x38, 0x00,
+    0x07, 0x05, 0x82, 0x03, 0x40, 0x00, 0x03,
+};
+static const uint8_t s_sim_nb4_vendor_report_desc[25] = {
+    0x06, 0x00, 0xFF, 0x09, 0x01, 0xA1, 0x01, 0x15, 0x81, 0x25, 0x7F, 0x75, 0x08, 0x96, 0x18, 0x01,
+    0x09, 0x01, 0x81, 0x02, 0x09, 0x01, 0x91, 0x02, 0xC0,
+};
+static const uint8_t s_sim_nb4_gamepad_report_desc[56] = {
+    0x05, 0x01, 0x09, 0x05, 0xA1, 0x01, 0xA1, 0x00, 0x05, 0x09, 0x19, 0x01, 0x29, 0x18, 0x15, 0x00,
+    0x25, 0x01, 0x95, 0x18, 0x75, 0x01, 0x81, 0x02, 0x05, 0x01, 0x09, 0x30, 0x09, 0x31, 0x09, 0x32,
+    0x09, 0x33, 0x09, 0x34, 0x09, 0x35, 0x09, 0x36, 0x09, 0x36, 0x16, 0x00, 0x00, 0x26, 0xFF, 0x07,
+    0x75, 0x10, 0x95, 0x08, 0x81, 0x02, 0xC0, 0xC0,
+};
+
+static const sim_device_script_t s_sim_nb4_script = {
+    "Flysky Noble NB4",
+    s_sim_nb4_dev_desc,
+    s_sim_nb4_config_desc,
+    { s_sim_nb4_vendor_report_desc, s_sim_nb4_gamepad_report_desc },
+    { sizeof(s_sim_nb4_vendor_report_desc), sizeof(s_sim_nb4_gamepad_report_desc) },
+    { 0, 19 },
+    NULL,
+};
+
+//Buttons walk one bit per report, 16-bit axes sweep their 11-bit range
+static void sim_fill_default(uint8_t ep_addr, uint32_t seq, uint8_t *buf, uint16_t len)
+{
+    for (uint16_t i = 0; i < len; i++) {
+        buf[i] = 0;
+    }
+    if (len >= 3) {
+        uint32_t buttons = 1u << (seq % 24);
+        buf[0] = (uint8_t)buttons;
+        buf[1] = (uint8_t)(buttons >> 8);
+        buf[2] = (uint8_t)(buttons >> 16);
+    }
+    for (uint16_t i = 3; i + 1 < len; i += 2) {
+        uint16_t axis = (uint16_t)((seq * 16 + i * 97) & 0x07FF);
+        buf[i] = (uint8_t)axis;
+        buf[i + 1] = (uint8_t)(axis >> 8);
+    }
+    (void)ep_addr;
+}
+
+/**
+ * Add a device to the bus. IN endpoints and their bInterval come from the
+ * script's config descriptor. Returns NULL when the bus is full.
+ */
+static inline sim_device_t *sim_bus_add(sim_bus_t *bus, const sim_device_script_t *script, uint8_t dev_addr,
+                                        uint64_t attach_us, uint64_t detach_us, uint32_t hold)
+{
+    if (bus->num_devices >= SIM_MAX_DEVICES) {
+        return NULL;
+    }
+    sim_device_t *dev = &bus->devices[bus->num_devices++];
+    memset(dev, 0, sizeof(sim_device_t));
+    dev->script = script;
+    dev->dev_addr = dev_addr;
+    dev->attach_us = attach_us;
+    dev->detach_us = detach_us;
+    dev->hold = hold ? hold : 1;
+
+    const uint8_t *p = script->config_desc;
+    uint16_t total = (uint16_t)(p[2] | (p[3] << 8));
+    uint8_t intf = 0;
+    for (uint16_t off = 0; off + 2 <= total && p[off] >= 2; off += p[off]) {
+        if (p[off + 1] == 0x04) {
+            intf = p[off + 2];
+        } else if (p[off + 1] == 0x05 && (p[off + 2] & 0x80) && dev->num_eps < SIM_MAX_EPS) {
+            sim_ep_t *ep = &dev->eps[dev->num_eps++];
+            uint16_t mps = (uint16_t)(p[off + 4] | (p[off + 5] << 8));
+            uint16_t len = (intf < SIM_MAX_INTFS && script->report_lens[intf]) ? script->report_lens[intf] : mps;
+            ep->ep_addr = p[off + 2];
+            ep->intf = intf;
+            ep->len = (len > SIM_MAX_REPORT_BYTES) ? SIM_MAX_REPORT_BYTES : len;
+            ep->interval_us = (p[off + 6] ? p[off + 6] : 1) * 1000;
+        }
+    }
+    return dev;
+}
+
+static sim_ep_t *sim_device_find_ep(sim_device_t *dev, uint8_t ep_addr)
+{
+    for (int e = 0; e < dev->num_eps; e++) {
+        if (dev->eps[e].ep_addr == ep_addr) {
+            return &dev->eps[e];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Fail the next slots of an IN endpoint. SIM_FAULT_STALL halts the endpoint
+ * from its next slot on, whatever slots is. Returns false for an unknown endpoint.
+ */
+static inline bool sim_device_inject(sim_device_t *dev, uint8_t ep_addr, sim_fault_t fault, uint32_t slots)
+{
+    sim_ep_t *ep = sim_device_find_ep(dev, ep_addr);
+    if (ep == NULL) {
+        return false;
+    }
+    ep->fault = fault;
+    ep->fault_slots = (fault == SIM_FAULT_STALL) ? 1 : slots;
+    return true;
+}
+
+//CLEAR_FEATURE(ENDPOINT_HALT) reached the device
+static inline bool sim_device_clear_halt(sim_device_t *dev, uint8_t ep_addr)
+{
+    sim_ep_t *ep = sim_device_find_ep(dev, ep_addr);
+    if (ep == NULL) {
+        return false;
+    }
+    ep->halted = false;
+    return true;
+}
+
+//Earliest pending event, UINT64_MAX if there is none
+static uint64_t sim_bus_peek(const sim_bus_t *bus, int *dev_index, int *ep_index, sim_event_type_t *type)
+{
+    uint64_t best_us = UINT64_MAX;
+    *dev_index = -1;
+    *ep_index = -1;
+    *type = SIM_EVENT_NONE;
+    for (int d = 0; d < bus->num_devices; d++) {
+        const sim_device_t *dev = &bus->devices[d];
+        if (dev->gone) {
+            continue;
+        }
+        if (!dev->attached) {
+            if (dev->attach_us < best_us) {
+                best_us = dev->attach_us;
+                *dev_index = d;
+                *ep_index = -1;
+                *type = SIM_EVENT_ATTACH;
+            }
+            continue;
+        }
+        if (dev->detach_us && dev->detach_us < best_us) {
+            best_us = dev->detach_us;
+            *dev_index = d;
+            *ep_index = -1;
+            *type = SIM_EVENT_DETACH;
+        }
+        for (int e = 0; e < dev->num_eps; e++) {
+            if (dev->eps[e].next_us < best_us) {
+                best_us = dev->eps[e].next_us;
+                *dev_index = d;
+                *ep_index = e;
+                *type = SIM_EVENT_REPORT;
+            }
+        }
+    }
+    return best_us;
+}
+
+//Time of the next event, UINT64_MAX if there is none
+static inline uint64_t sim_bus_next_us(const sim_bus_t *bus)
+{
+    int dev_index;
+    int ep_index;
+    sim_event_type_t type;
+    return sim_bus_peek(bus, &dev_index, &ep_index, &type);
+}
+
+/**
+ * Pop the earliest event at or before until_us. Returns false when there is none.
+ */
+static inline bool sim_bus_next_event(sim_bus_t *bus, uint64_t until_us, sim_event_t *event)
+{
+    int dev_index;
+    int ep_index;
+    sim_event_type_t best_type;
+    uint64_t best_us = sim_bus_peek(bus, &dev_index, &ep_index, &best_type);
+    if (dev_index < 0 || best_us > until_us) {
+        return false;
+    }
+    sim_device_t *best_dev = &bus->devices[dev_index];
+    sim_ep_t *best_ep = (ep_index >= 0) ? &best_dev->eps[ep_index] : NULL;
+
+    bus->now_us = best_us;
+    event->type = best_type;
+    event->time_us = best_us;
+    event->dev = best_dev;
+    event->ep_addr = 0;
+    event->seq = 0;
+    event->fault = SIM_FAULT_NONE;
+    event->len = 0;
+    if (best_type == SIM_EVENT_ATTACH) {
+        best_dev->attached = true;
+        for (int e = 0; e < best_dev->num_eps; e++) {
+            best_dev->eps[e].next_us = best_us + best_dev->eps[e].interval_us;
+            best_dev->eps[e].seq = 0;
+        }
+    } else if (best_type == SIM_EVENT_DETACH) {
+        best_dev->attached = false;
+        best_dev->gone = true;
+    } else {
+        sim_report_fill_t fill = best_dev->script->fill ? best_dev->script->fill : sim_fill_default;
+        if (best_ep->fault_slots) {
+            best_ep->fault_slots--;
+            best_ep->halted |= (best_ep->fault == SIM_FAULT_STALL);
+            event->fault = best_ep->fault;
+        }
+        if (best_ep->halted) {
+            event->fault = SIM_FAULT_STALL;
+        }
+        event->ep_addr = best_ep->ep_addr;
+        event->seq = best_ep->seq;
+        event->len = best_ep->len;
+        fill(best_ep->ep_addr, best_ep->seq / best_dev->hold, event->data, best_ep->len);
+        best_ep->seq++;
+        best_ep->next_us += best_ep->interval_us;
+    }
+    return true;
+}
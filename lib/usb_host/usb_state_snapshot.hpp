@@ -0,0 +1,128 @@
+/*
+ * Latest decoded state per device, published through a seqlock
+ *
+ * One writer (the report consumer task) updates the snapshot after every
+ * decoded report without ever waiting; readers on any task copy it out
+ * without a lock and retry if a write overlapped the copy. The state is
+ * kept as std::atomic words so the racing copy is well defined. The
+ * sequence number counts publications since attach, so a reader that sees
+ * it jump by more than one knows it missed updates.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <atomic>
+#include "usb_hid_report_parser.hpp"
+
+#define HID_STATE_MAX_INTFS         3       //Interfaces per device kept in a snapshot
+#define STATE_SNAPSHOT_READ_TRIES   4       //Copies attempted before a read gives up
+
+typedef struct {
+    uint32_t seq;               //Publications since attach, 0 before the first report
+    uint8_t dev_addr;
+    uint8_t num_intfs;
+    uint8_t intf;               //Interface the latest publication updated
+    int64_t timestamp_us;       //Completion time of the report behind the latest publication
+    int64_t attach_us;          //Tells a reattached device at the same address from the previous one
+    hid_report_values_t intfs[HID_STATE_MAX_INTFS];
+} hid_state_t;
+
+#define HID_STATE_WORDS             (sizeof(hid_state_t) / 4)
+
+static_assert(sizeof(hid_state_t) % 4 == 0 && offsetof(hid_state_t, intfs) % 4 == 0,
+              "snapshot is copied in 32-bit words");
+
+typedef struct {
+    std::atomic<uint32_t> lock;                 //Odd while the writer is inside
+    std::atomic<uint32_t> words[HID_STATE_WORDS];
+    //Writer only
+    uint32_t seq;
+    int64_t attach_us;
+} state_snapshot_t;
+
+static void state_snapshot_init(state_snapshot_t *snap)
+{
+    snap->lock.store(0, std::memory_order_relaxed);
+    for (size_t i = 0; i < HID_STATE_WORDS; i++) {
+        snap->words[i].store(0, std::memory_order_relaxed);
+    }
+    snap->seq = 0;
+    snap->attach_us = 0;
+}
+
+static inline void state_snapshot_store(state_snapshot_t *snap, size_t offset, const void *src, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)src;
+    for (size_t i = 0; i < len / 4; i++) {
+        uint32_t word;
+        memcpy(&word, p + i * 4, 4);
+        snap->words[offset / 4 + i].store(word, std::memory_order_relaxed);
+    }
+}
+
+/**
+ * Writer only. Publish the decoded values of one interface together with
+ * the device header. A new attach_us starts the snapshot over, so nothing
+ * of a previous device in the same slot survives its first report.
+ */
+static void state_snapshot_publish(state_snapshot_t *snap, uint8_t dev_addr, int64_t attach_us, uint8_t num_intfs,
+                                   uint8_t intf, const hid_report_values_t *values, int64_t timestamp_us)
+{
+    if (intf >= HID_STATE_MAX_INTFS) {
+        return;
+    }
+    bool fresh = (snap->attach_us != attach_us);
+    if (fresh) {
+        snap->seq = 0;
+        snap->attach_us = attach_us;
+    }
+    hid_state_t head;
+    memset(&head, 0, offsetof(hid_state_t, intfs));
+    head.seq = ++snap->seq;
+    head.dev_addr = dev_addr;
+    head.num_intfs = num_intfs;
+    head.intf = intf;
+    head.timestamp_us = timestamp_us;
+    head.attach_us = attach_us;
+
+    uint32_t lock = snap->lock.load(std::memory_order_relaxed);
+    snap->lock.store(lock + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    if (fresh) {
+        for (size_t i = offsetof(hid_state_t, intfs) / 4; i < HID_STATE_WORDS; i++) {
+            snap->words[i].store(0, std::memory_order_relaxed);
+        }
+    }
+    state_snapshot_store(snap, 0, &head, offsetof(hid_state_t, intfs));
+    state_snapshot_store(snap, offsetof(hid_state_t, intfs) + intf * sizeof(hid_report_values_t),
+                         values, sizeof(hid_report_values_t));
+    snap->lock.store(lock + 2, std::memory_order_release);
+}
+
+/**
+ * Any task. Copy the snapshot into state. Returns false if every attempt
+ * overlapped a write, which only happens when the reader preempted the
+ * writer mid-publication; try again later rather than spinning.
+ */
+static bool state_snapshot_read(const state_snapshot_t *snap, hid_state_t *state)
+{
+    uint8_t *dst = (uint8_t *)state;
+    for (int tries = 0; tries < STATE_SNAPSHOT_READ_TRIES; tries++) {
+        uint32_t before = snap->lock.load(std::memory_order_acquire);
+        if (before & 1) {
+            continue;
+        }
+        for (size_t i = 0; i < HID_STATE_WORDS; i++) {
+            uint32_t word = snap->words[i].load(std::memory_order_relaxed);
+            memcpy(dst + i * 4, &word, 4);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (snap->lock.load(std::memory_order_relaxed) == before) {
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,184 @@
+/*
+ * Fixed-capacity pool of USB transfers
+ *
+ * Transfers are allocated from the heap only when the pool has no free
+ * entry large enough, which happens while the first devices are claimed.
+ * Closing a device puts its transfers back, so reconnects and steady-state
+ * streaming run without touching the heap. A transfer whose buffer is
+ * still borrowed when its device closes is parked as an orphan and comes
+ * back once the borrower sets its bit. Owned by the class driver task; not
+ * safe to share between tasks, except the borrowers' bits.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <atomic>
+#include "esp_log.h"
+#include "usb/usb_host.h"
+
+#define TRANSFER_POOL_MAX_ENTRIES   72      //4 devices x 3 interfaces x (4 IN transfers + 1 control + 1 output)
+#define TRANSFER_POOL_MAX_ORPHANS   16      //Borrowed transfers of closed devices waiting to come back
+
+typedef struct {
+    usb_transfer_t *transfer;
+    bool in_use;
+} transfer_pool_entry_t;
+
+//In use by a device that is gone, the borrower sets bit in *done when it lets go of the buffer
+typedef struct {
+    usb_transfer_t *transfer;
+    std::atomic<uint32_t> *done;
+    uint32_t bit;
+} transfer_pool_orphan_t;
+
+typedef struct {
+    transfer_pool_entry_t entries[TRANSFER_POOL_MAX_ENTRIES];
+    int num_entries;
+    transfer_pool_orphan_t orphans[TRANSFER_POOL_MAX_ORPHANS];
+    int num_orphans;
+    uint32_t in_use;
+    uint32_t peak;              //Most entries ever in use at once
+    uint32_t exhausted;         //Requests that could not be served
+    uint32_t allocs;            //Heap allocations, flat once every size has been seen
+} transfer_pool_t;
+
+static const char *TAG_POOL = "POOL";
+
+/**
+ * Take a transfer with a data buffer of at least size bytes. Prefers the
+ * smallest free entry that fits, then a new entry, then regrowing the
+ * smallest free entry. Returns ESP_ERR_NO_MEM, and counts it, when every
+ * entry is in use or the heap is out.
+ */
+static esp_err_t transfer_pool_get(transfer_pool_t *pool, size_t size, usb_transfer_t **transfer_out)
+{
+    transfer_pool_entry_t *best = NULL;
+    transfer_pool_entry_t *smallest = NULL;
+    for (int i = 0; i < pool->num_entries; i++) {
+        transfer_pool_entry_t *entry = &pool->entries[i];
+        if (entry->in_use) {
+            continue;
+        }
+        size_t entry_size = entry->transfer->data_buffer_size;
+        if (entry_size >= size && (best == NULL || entry_size < best->transfer->data_buffer_size)) {
+            best = entry;
+        }
+        if (smallest == NULL || entry_size < smallest->transfer->data_buffer_size) {
+            smallest = entry;
+        }
+    }
+
+    if (best == NULL) {
+        best = (pool->num_entries < TRANSFER_POOL_MAX_ENTRIES) ? &pool->entries[pool->num_entries] : smallest;
+        if (best == NULL) {
+            pool->exhausted++;
+            return ESP_ERR_NO_MEM;
+        }
+        usb_transfer_t *transfer;
+        esp_err_t err = usb_host_transfer_alloc(size, 0, &transfer);
+        if (err != ESP_OK) {
+            pool->exhausted++;
+            return err;
+        }
+        if (best == &pool->entries[pool->num_entries]) {
+            pool->num_entries++;
+        } else {
+            usb_host_transfer_free(best->transfer);
+        }
+        best->transfer = transfer;
+        pool->allocs++;
+    }
+
+    best->in_use = true;
+    pool->in_use++;
+    if (pool->in_use > pool->peak) {
+        pool->peak = pool->in_use;
+    }
+    *transfer_out = best->transfer;
+    return ESP_OK;
+}
+
+static void transfer_pool_put(transfer_pool_t *pool, usb_transfer_t *transfer)
+{
+    for (int i = 0; i < pool->num_entries; i++) {
+        transfer_pool_entry_t *entry = &pool->entries[i];
+        if (entry->transfer == transfer && entry->in_use) {
+            entry->in_use = false;
+            pool->in_use--;
+            return;
+        }
+    }
+    ESP_LOGW(TAG_POOL, "transfer %p is not from this pool", transfer);
+}
+
+/**
+ * Park a transfer whose buffer is still borrowed, its owner is going away.
+ * transfer_pool_reclaim() puts it back once bit is set in *done, which it
+ * then clears. Returns false, leaking the transfer, if the list is full.
+ */
+static bool transfer_pool_orphan(transfer_pool_t *pool, usb_transfer_t *transfer, std::atomic<uint32_t> *done, uint32_t bit)
+{
+    if (pool->num_orphans >= TRANSFER_POOL_MAX_ORPHANS) {
+        ESP_LOGW(TAG_POOL, "transfer %p: no room for another orphan, leaked", transfer);
+        return false;
+    }
+    transfer_pool_orphan_t *orphan = &pool->orphans[pool->num_orphans++];
+    orphan->transfer = transfer;
+    orphan->done = done;
+    orphan->bit = bit;
+    return true;
+}
+
+//Put back every orphan its borrower let go of, returns how many
+static int transfer_pool_reclaim(transfer_pool_t *pool)
+{
+    int reclaimed = 0;
+    for (int i = 0; i < pool->num_orphans;) {
+        transfer_pool_orphan_t *orphan = &pool->orphans[i];
+        if (!(orphan->done->load(std::memory_order_acquire) & orphan->bit)) {
+            i++;
+            continue;
+        }
+        orphan->done->fetch_and(~orphan->bit, std::memory_order_relaxed);
+        transfer_pool_put(pool, orphan->transfer);
+        *orphan = pool->orphans[--pool->num_orphans];
+        reclaimed++;
+    }
+    return reclaimed;
+}
+
+//Bits of done that orphans still wait for, they must not be lent again meanwhile
+static uint32_t transfer_pool_orphaned(const transfer_pool_t *pool, const std::atomic<uint32_t> *done)
+{
+    uint32_t bits = 0;
+    for (int i = 0; i < pool->num_orphans; i++) {
+        if (pool->orphans[i].done == done) {
+            bits |= pool->orphans[i].bit;
+        }
+    }
+    return bits;
+}
+
+/**
+ * Free every entry. Transfers still in use, orphans included, are leaked
+ * rather than freed under the host library or a borrower.
+ */
+static void transfer_pool_deinit(transfer_pool_t *pool)
+{
+    for (int i = 0; i < pool->num_entries; i++) {
+        if (!pool->entries[i].in_use) {
+            usb_host_transfer_free(pool->entries[i].transfer);
+        }
+    }
+    memset(pool, 0, sizeof(transfer_pool_t));
+}
+
+static void transfer_pool_print(const transfer_pool_t *pool)
+{
+    ESP_LOGI(TAG_POOL, "%u in use (%d orphaned), peak %u of %d/%d entries, %u allocs, exhausted %u",
+             pool->in_use, pool->num_orphans, pool->peak, pool->num_entries, TRANSFER_POOL_MAX_ENTRIES,
+             pool->allocs, pool->exhausted);
+}
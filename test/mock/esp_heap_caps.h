@@ -0,0 +1,66 @@
+/*
+ * esp_heap_caps.h for the native build. Only allocations made through
+ * mock_heap_alloc(), i.e. by the mock host library, are counted.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#define MALLOC_CAP_8BIT             (1 << 2)
+#define MALLOC_CAP_DEFAULT          (1 << 12)
+
+typedef struct {
+    size_t total_free_bytes;
+    size_t total_allocated_bytes;
+    size_t largest_free_block;
+    size_t minimum_free_bytes;
+    size_t allocated_blocks;
+    size_t free_blocks;
+    size_t total_blocks;
+} multi_heap_info_t;
+
+typedef struct {
+    size_t blocks;
+    size_t bytes;
+} mock_heap_t;
+
+static mock_heap_t s_mock_heap;
+
+typedef struct {
+    size_t size;
+    max_align_t align;
+} mock_heap_block_t;
+
+static inline void *mock_heap_alloc(size_t size)
+{
+    mock_heap_block_t *block = (mock_heap_block_t *)calloc(1, sizeof(mock_heap_block_t) + size);
+    if (block == NULL) {
+        return NULL;
+    }
+    block->size = size;
+    s_mock_heap.blocks++;
+    s_mock_heap.bytes += size;
+    return block + 1;
+}
+
+static inline void mock_heap_free(void *ptr)
+{
+    if (ptr == NULL) {
+        return;
+    }
+    mock_heap_block_t *block = (mock_heap_block_t *)ptr - 1;
+    s_mock_heap.blocks--;
+    s_mock_heap.bytes -= block->size;
+    free(block);
+}
+
+static inline void heap_caps_get_info(multi_heap_info_t *info, uint32_t caps)
+{
+    (void)caps;
+    *info = multi_heap_info_t();
+    info->allocated_blocks = s_mock_heap.blocks;
+    info->total_allocated_bytes = s_mock_heap.bytes;
+}
@@ -0,0 +1,7 @@
+/*
+ * esp_intr_alloc.h for the native build
+ */
+
+#pragma once
+
+#define ESP_INTR_FLAG_LEVEL1        (1 << 1)
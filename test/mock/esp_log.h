@@ -0,0 +1,37 @@
+/*
+ * esp_log.h for the native build, printf with the ESP-IDF line format
+ * and the mock_rtos.h clock
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "esp_timer.h"
+
+typedef enum {
+    ESP_LOG_NONE,
+    ESP_LOG_ERROR,
+    ESP_LOG_WARN,
+    ESP_LOG_INFO,
+    ESP_LOG_DEBUG,
+    ESP_LOG_VERBOSE,
+} esp_log_level_t;
+
+#ifndef LOG_LOCAL_LEVEL
+#define LOG_LOCAL_LEVEL             ESP_LOG_INFO
+#endif
+
+#define ESP_LOG_LEVEL_MOCK(level, letter, tag, format, ...) do {                            \
+        if ((level) <= LOG_LOCAL_LEVEL) {                                                   \
+            printf(letter " (%u) %s: " format "\n", (unsigned)(esp_timer_get_time() / 1000),\
+                   tag, ##__VA_ARGS__);                                                     \
+        }                                                                                   \
+    } while (0)
+
+#define ESP_LOGE(tag, format, ...)  ESP_LOG_LEVEL_MOCK(ESP_LOG_ERROR, "E", tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...)  ESP_LOG_LEVEL_MOCK(ESP_LOG_WARN, "W", tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...)  ESP_LOG_LEVEL_MOCK(ESP_LOG_INFO, "I", tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...)  ESP_LOG_LEVEL_MOCK(ESP_LOG_DEBUG, "D", tag, format, ##__VA_ARGS__)
+#define ESP_LOGV(tag, format, ...)  ESP_LOG_LEVEL_MOCK(ESP_LOG_VERBOSE, "V", tag, format, ##__VA_ARGS__)
@@ -0,0 +1,13 @@
+/*
+ * esp_timer.h for the native build: the clock of mock_rtos.h
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+
+static inline int64_t esp_timer_get_time(void)
+{
+    return mock_rtos_now_us();
+}
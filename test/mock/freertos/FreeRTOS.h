@@ -0,0 +1,34 @@
+/*
+ * FreeRTOS for the native build
+ *
+ * Types and macros of the ESP-IDF FreeRTOS port the libraries use. Tasks,
+ * semaphores and notifications run on the cooperative scheduler in
+ * mock_rtos.h, one tick per millisecond of its virtual clock.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+
+#define pdTRUE                      1
+#define pdFALSE                     0
+#define pdPASS                      pdTRUE
+#define pdFAIL                      pdFALSE
+#define portMAX_DELAY               ((TickType_t)0xffffffffu)
+#define configTICK_RATE_HZ          1000
+#define portTICK_PERIOD_MS          (1000 / configTICK_RATE_HZ)
+#define pdMS_TO_TICKS(ms)           ((TickType_t)((uint64_t)(ms) * configTICK_RATE_HZ / 1000))
+#define portNUM_PROCESSORS          1
+#define tskNO_AFFINITY              0x7FFFFFFF
+#define IRAM_ATTR
+
+#include "mock_rtos.h"
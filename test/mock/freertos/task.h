@@ -0,0 +1,7 @@
+/*
+ * Task API of the native build, see mock_rtos.h
+ */
+
+#pragma once
+
+#include "freertos/FreeRTOS.h"
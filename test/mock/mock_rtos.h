@@ -0,0 +1,494 @@
+/*
+ * Cooperative FreeRTOS scheduler for the native build
+ *
+ * Every task runs on its own ucontext stack until it blocks; the highest
+ * priority ready task goes next, round robin among equals. Giving a
+ * semaphore or notification to a higher priority task switches to it right
+ * away, as the real scheduler would. Time is virtual: whenever every task is
+ * blocked, the clock jumps to the earliest timeout or event source (the
+ * simulated bus of mock_usb_host.h), so a scenario of seconds runs in
+ * milliseconds and the same way every time. With realtime set, time spent
+ * running also advances the clock, for CPU time measurements. Either way
+ * every task counts the times it ran and the thread CPU time it used.
+ *
+ * The test itself is a task too: blocking calls made outside any task run
+ * the scheduler until they return, and mock_rtos_run_for() lets the tasks
+ * run for a stretch of virtual time.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <ucontext.h>
+#include "freertos/FreeRTOS.h"
+
+#define MOCK_RTOS_MAX_TASKS         16
+#define MOCK_RTOS_STACK_BYTES       (256 * 1024)    //Per task, whatever the task asked for
+#define MOCK_RTOS_MAX_SOURCES       4
+#define MOCK_RTOS_NEVER             INT64_MAX
+
+typedef void (*TaskFunction_t)(void *arg);
+
+typedef enum {
+    MOCK_TASK_FREE,
+    MOCK_TASK_READY,
+    MOCK_TASK_BLOCKED,
+    MOCK_TASK_SUSPENDED,
+    MOCK_TASK_DELETED,
+} mock_task_state_t;
+
+typedef struct mock_task_s {
+    mock_task_state_t state;
+    char name[16];
+    UBaseType_t priority;
+    TaskFunction_t fn;
+    void *arg;
+    ucontext_t ctx;
+    void *stack;
+    const void *wait_obj;       //What a blocked task waits for, NULL for a plain delay
+    int64_t wake_us;            //Timeout of a blocked task, MOCK_RTOS_NEVER for none
+    bool timed_out;
+    uint32_t notify;            //Task notification value
+    uint64_t last_run;          //Round robin among equal priorities
+    uint32_t runs;              //Times the task was switched in, each a wakeup on target
+    int64_t cpu_ns;             //Thread CPU time spent running
+} mock_task_t;
+
+typedef mock_task_t *TaskHandle_t;
+
+typedef struct {
+    int64_t (*next_us)(void);   //Time of the source's next event, MOCK_RTOS_NEVER for none
+    void (*run)(int64_t now_us);//Handle every event due at or before now_us
+} mock_rtos_source_t;
+
+typedef struct {
+    mock_task_t tasks[MOCK_RTOS_MAX_TASKS];
+    mock_task_t main_task;      //The test, blocks by running the scheduler
+    mock_task_t *current;       //NULL while the scheduler or the test runs
+    ucontext_t sched_ctx;
+    int64_t now_us;
+    bool realtime;
+    int64_t real_mark_us;
+    uint64_t runs;
+    mock_rtos_source_t sources[MOCK_RTOS_MAX_SOURCES];
+    int num_sources;
+} mock_rtos_t;
+
+static mock_rtos_t s_mock_rtos;
+
+static inline int64_t mock_rtos_real_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+//CPU time of the process' thread, which runs every task and the scheduler
+static inline int64_t mock_rtos_cpu_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline int64_t mock_rtos_now_us(void)
+{
+    if (s_mock_rtos.realtime) {
+        int64_t real_us = mock_rtos_real_us();
+        s_mock_rtos.now_us += real_us - s_mock_rtos.real_mark_us;
+        s_mock_rtos.real_mark_us = real_us;
+    }
+    return s_mock_rtos.now_us;
+}
+
+static inline void mock_rtos_set_realtime(bool realtime)
+{
+    mock_rtos_now_us();
+    s_mock_rtos.realtime = realtime;
+    s_mock_rtos.real_mark_us = mock_rtos_real_us();
+}
+
+static inline void mock_rtos_add_source(int64_t (*next_us)(void), void (*run)(int64_t now_us))
+{
+    assert(s_mock_rtos.num_sources < MOCK_RTOS_MAX_SOURCES);
+    mock_rtos_source_t *source = &s_mock_rtos.sources[s_mock_rtos.num_sources++];
+    source->next_us = next_us;
+    source->run = run;
+}
+
+/**
+ * Delete every task and event source. The clock keeps running, so
+ * timestamps stay unique across tests. Call from the test only.
+ */
+static inline void mock_rtos_reset(void)
+{
+    assert(s_mock_rtos.current == NULL);
+    for (int i = 0; i < MOCK_RTOS_MAX_TASKS; i++) {
+        free(s_mock_rtos.tasks[i].stack);
+    }
+    memset(s_mock_rtos.tasks, 0, sizeof(s_mock_rtos.tasks));
+    memset(&s_mock_rtos.main_task, 0, sizeof(mock_task_t));
+    strcpy(s_mock_rtos.main_task.name, "main");
+    s_mock_rtos.main_task.state = MOCK_TASK_READY;
+    s_mock_rtos.num_sources = 0;
+}
+
+static inline mock_task_t *mock_rtos_self(void)
+{
+    return s_mock_rtos.current ? s_mock_rtos.current : &s_mock_rtos.main_task;
+}
+
+static inline void mock_rtos_switch_out(mock_task_t *task)
+{
+    s_mock_rtos.current = NULL;
+    swapcontext(&task->ctx, &s_mock_rtos.sched_ctx);
+}
+
+//Hand the tasks waiting on obj, the highest priority one or all, back to the scheduler
+static inline void mock_rtos_wake(const void *obj, bool all)
+{
+    mock_task_t *woken = NULL;
+    for (int i = -1; i < MOCK_RTOS_MAX_TASKS; i++) {
+        mock_task_t *task = (i < 0) ? &s_mock_rtos.main_task : &s_mock_rtos.tasks[i];
+        if (task->state != MOCK_TASK_BLOCKED || task->wait_obj != obj || obj == NULL) {
+            continue;
+        }
+        if (all) {
+            task->state = MOCK_TASK_READY;
+        } else if (woken == NULL || task->priority > woken->priority) {
+            woken = task;
+        }
+    }
+    if (woken) {
+        woken->state = MOCK_TASK_READY;
+    }
+    //Preempt a running task for a higher priority one, the test itself is never preempted
+    mock_task_t *self = s_mock_rtos.current;
+    for (int i = 0; self && i < MOCK_RTOS_MAX_TASKS; i++) {
+        mock_task_t *task = &s_mock_rtos.tasks[i];
+        if (task->state == MOCK_TASK_READY && task != self && task->priority > self->priority) {
+            mock_rtos_switch_out(self);
+            break;
+        }
+    }
+}
+
+//Run due event sources and time out blocked tasks
+static inline void mock_rtos_poll(void)
+{
+    int64_t now = mock_rtos_now_us();
+    for (int s = 0; s < s_mock_rtos.num_sources; s++) {
+        if (s_mock_rtos.sources[s].next_us() <= now) {
+            s_mock_rtos.sources[s].run(now);
+        }
+    }
+    for (int i = -1; i < MOCK_RTOS_MAX_TASKS; i++) {
+        mock_task_t *task = (i < 0) ? &s_mock_rtos.main_task : &s_mock_rtos.tasks[i];
+        if (task->state == MOCK_TASK_BLOCKED && task->wake_us <= now) {
+            task->state = MOCK_TASK_READY;
+            task->timed_out = true;
+        }
+    }
+}
+
+static inline int64_t mock_rtos_next_us(void)
+{
+    int64_t next_us = MOCK_RTOS_NEVER;
+    for (int s = 0; s < s_mock_rtos.num_sources; s++) {
+        int64_t us = s_mock_rtos.sources[s].next_us();
+        if (us < next_us) {
+            next_us = us;
+        }
+    }
+    for (int i = -1; i < MOCK_RTOS_MAX_TASKS; i++) {
+        mock_task_t *task = (i < 0) ? &s_mock_rtos.main_task : &s_mock_rtos.tasks[i];
+        if (task->state == MOCK_TASK_BLOCKED && task->wake_us < next_us) {
+            next_us = task->wake_us;
+        }
+    }
+    return next_us;
+}
+
+static inline mock_task_t *mock_rtos_pick(void)
+{
+    mock_task_t *best = NULL;
+    for (int i = 0; i < MOCK_RTOS_MAX_TASKS; i++) {
+        mock_task_t *task = &s_mock_rtos.tasks[i];
+        if (task->state == MOCK_TASK_DELETED && task != s_mock_rtos.current) {
+            free(task->stack);
+            task->stack = NULL;
+            task->state = MOCK_TASK_FREE;
+        }
+        if (task->state != MOCK_TASK_READY) {
+            continue;
+        }
+        if (best == NULL || task->priority > best->priority ||
+            (task->priority == best->priority && task->last_run < best->last_run)) {
+            best = task;
+        }
+    }
+    return best;
+}
+
+/**
+ * Run the next ready task until it blocks, or move the clock to the next
+ * timeout or event if none is ready. Returns false, with the clock at
+ * until_us, once nothing is ready and nothing is due by then.
+ */
+static inline bool mock_rtos_step(int64_t until_us)
+{
+    mock_rtos_poll();
+    mock_task_t *task = mock_rtos_pick();
+    if (task) {
+        task->last_run = ++s_mock_rtos.runs;
+        task->runs++;
+        s_mock_rtos.current = task;
+        int64_t start_ns = mock_rtos_cpu_ns();
+        swapcontext(&s_mock_rtos.sched_ctx, &task->ctx);
+        task->cpu_ns += mock_rtos_cpu_ns() - start_ns;
+        s_mock_rtos.current = NULL;
+        return true;
+    }
+    int64_t next_us = mock_rtos_next_us();
+    int64_t now = mock_rtos_now_us();
+    if (next_us > until_us || next_us == MOCK_RTOS_NEVER) {
+        if (until_us != MOCK_RTOS_NEVER && until_us > now) {
+            s_mock_rtos.now_us = until_us;
+        }
+        return false;
+    }
+    if (next_us > now) {
+        s_mock_rtos.now_us = next_us;
+    }
+    return true;
+}
+
+//Let the tasks run until the clock reaches until_us
+static inline void mock_rtos_run_until(int64_t until_us)
+{
+    assert(s_mock_rtos.current == NULL);
+    while (mock_rtos_step(until_us)) {
+    }
+}
+
+static inline void mock_rtos_run_for(int64_t duration_us)
+{
+    mock_rtos_run_until(mock_rtos_now_us() + duration_us);
+}
+
+static inline int64_t mock_rtos_deadline(TickType_t ticks)
+{
+    return (ticks == portMAX_DELAY) ? MOCK_RTOS_NEVER : mock_rtos_now_us() + (int64_t)ticks * portTICK_PERIOD_MS * 1000;
+}
+
+/**
+ * Block the caller on obj until mock_rtos_wake(obj) or wake_us. Returns
+ * false on the timeout.
+ */
+static inline bool mock_rtos_block(const void *obj, int64_t wake_us)
+{
+    mock_task_t *self = mock_rtos_self();
+    self->state = MOCK_TASK_BLOCKED;
+    self->wait_obj = obj;
+    self->wake_us = wake_us;
+    self->timed_out = false;
+    if (self == &s_mock_rtos.main_task) {
+        while (self->state == MOCK_TASK_BLOCKED && mock_rtos_step(wake_us)) {
+        }
+        if (self->state == MOCK_TASK_BLOCKED) {
+            if (wake_us == MOCK_RTOS_NEVER) {
+                fprintf(stderr, "mock_rtos: the test blocks forever, every task is blocked too\n");
+                abort();
+            }
+            self->timed_out = true;
+        }
+        self->state = MOCK_TASK_READY;
+    } else {
+        mock_rtos_switch_out(self);
+    }
+    self->wait_obj = NULL;
+    return !self->timed_out;
+}
+
+static void mock_rtos_task_entry(int index)
+{
+    mock_task_t *task = &s_mock_rtos.tasks[index];
+    task->fn(task->arg);
+    //FreeRTOS tasks must not return, treat it as vTaskDelete(NULL)
+    task->state = MOCK_TASK_DELETED;
+    mock_rtos_switch_out(task);
+}
+
+/* FreeRTOS API */
+
+static inline BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack_depth, void *arg,
+                                                 UBaseType_t priority, TaskHandle_t *handle, BaseType_t core_id)
+{
+    (void)stack_depth;
+    (void)core_id;
+    mock_task_t *task = NULL;
+    for (int i = 0; i < MOCK_RTOS_MAX_TASKS && task == NULL; i++) {
+        if (s_mock_rtos.tasks[i].state == MOCK_TASK_FREE ||
+            (s_mock_rtos.tasks[i].state == MOCK_TASK_DELETED && &s_mock_rtos.tasks[i] != s_mock_rtos.current)) {
+            task = &s_mock_rtos.tasks[i];
+        }
+    }
+    if (task == NULL) {
+        return pdFAIL;
+    }
+    free(task->stack);
+    memset(task, 0, sizeof(mock_task_t));
+    snprintf(task->name, sizeof(task->name), "%s", name);
+    task->priority = priority;
+    task->fn = fn;
+    task->arg = arg;
+    task->stack = malloc(MOCK_RTOS_STACK_BYTES);
+    getcontext(&task->ctx);
+    task->ctx.uc_stack.ss_sp = task->stack;
+    task->ctx.uc_stack.ss_size = MOCK_RTOS_STACK_BYTES;
+    task->ctx.uc_link = NULL;
+    makecontext(&task->ctx, (void (*)(void))mock_rtos_task_entry, 1, (int)(task - s_mock_rtos.tasks));
+    task->state = MOCK_TASK_READY;
+    if (handle) {
+        *handle = task;
+    }
+    return pdPASS;
+}
+
+static inline BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack_depth, void *arg,
+                                     UBaseType_t priority, TaskHandle_t *handle)
+{
+    return xTaskCreatePinnedToCore(fn, name, stack_depth, arg, priority, handle, tskNO_AFFINITY);
+}
+
+static inline void vTaskDelete(TaskHandle_t handle)
+{
+    mock_task_t *task = handle ? handle : s_mock_rtos.current;
+    if (task == NULL) {
+        return;
+    }
+    task->state = MOCK_TASK_DELETED;
+    if (task == s_mock_rtos.current) {
+        mock_rtos_switch_out(task);
+    }
+}
+
+static inline void vTaskSuspend(TaskHandle_t handle)
+{
+    mock_task_t *task = handle ? handle : s_mock_rtos.current;
+    if (task == NULL) {
+        return;
+    }
+    task->state = MOCK_TASK_SUSPENDED;
+    if (task == s_mock_rtos.current) {
+        mock_rtos_switch_out(task);
+    }
+}
+
+//A call the task was blocked in when suspended returns as timed out
+static inline void vTaskResume(TaskHandle_t handle)
+{
+    if (handle->state == MOCK_TASK_SUSPENDED) {
+        handle->state = MOCK_TASK_READY;
+        handle->timed_out = true;
+        mock_rtos_wake(NULL, false);
+    }
+}
+
+static inline void vTaskDelay(TickType_t ticks)
+{
+    mock_task_t *self = mock_rtos_self();
+    if (ticks == 0 && self != &s_mock_rtos.main_task) {
+        //Yield to equal priorities
+        self->state = MOCK_TASK_READY;
+        mock_rtos_switch_out(self);
+        return;
+    }
+    mock_rtos_block(NULL, mock_rtos_deadline(ticks));
+}
+
+static inline TickType_t xTaskGetTickCount(void)
+{
+    return (TickType_t)(mock_rtos_now_us() / 1000 / portTICK_PERIOD_MS);
+}
+
+static inline TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    return mock_rtos_self();
+}
+
+static inline BaseType_t xPortGetCoreID(void)
+{
+    return 0;
+}
+
+static inline BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+    task->notify++;
+    mock_rtos_wake(&task->notify, false);
+    return pdPASS;
+}
+
+static inline uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t ticks)
+{
+    mock_task_t *self = mock_rtos_self();
+    int64_t wake_us = mock_rtos_deadline(ticks);
+    while (self->notify == 0 && ticks != 0 && mock_rtos_block(&self->notify, wake_us)) {
+    }
+    uint32_t value = self->notify;
+    if (value) {
+        self->notify = clear_on_exit ? 0 : value - 1;
+    }
+    return value;
+}
+
+typedef struct {
+    UBaseType_t count;
+    UBaseType_t max_count;
+} mock_semaphore_t;
+
+typedef mock_semaphore_t *SemaphoreHandle_t;
+
+static inline SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max_count, UBaseType_t initial_count)
+{
+    mock_semaphore_t *sem = (mock_semaphore_t *)calloc(1, sizeof(mock_semaphore_t));
+    sem->max_count = max_count;
+    sem->count = initial_count;
+    return sem;
+}
+
+static inline SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+    return xSemaphoreCreateCounting(1, 0);
+}
+
+static inline void vSemaphoreDelete(SemaphoreHandle_t sem)
+{
+    free(sem);
+}
+
+static inline BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+    if (sem->count >= sem->max_count) {
+        return pdFALSE;
+    }
+    sem->count++;
+    mock_rtos_wake(sem, false);
+    return pdTRUE;
+}
+
+static inline BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks)
+{
+    int64_t wake_us = mock_rtos_deadline(ticks);
+    while (sem->count == 0) {
+        if (ticks == 0 || !mock_rtos_block(sem, wake_us)) {
+            return pdFALSE;
+        }
+    }
+    sem->count--;
+    return pdTRUE;
+}
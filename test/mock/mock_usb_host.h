@@ -0,0 +1,921 @@
+/*
+ * USB Host Library of the native build, on a simulated bus
+ *
+ * Implements the usb/usb_host.h calls the class driver makes against the
+ * devices of a sim_bus_t (usb_sim_device.hpp), with the semantics of
+ * ESP-IDF 4.4 that the driver depends on:
+ *  - NEW_DEV goes to every registered client MOCK_USB_ENUM_US after the
+ *    attach, DEV_GONE to the clients that opened the device; transfers
+ *    still queued then complete with NO_DEVICE
+ *  - transfer callbacks and client events only run inside
+ *    usb_host_client_handle_events() of the owning client
+ *  - interrupt IN transfers complete on the endpoint's bInterval slots with
+ *    the simulated report; an injected fault halts the pipe, and queued
+ *    transfers stay queued until usb_host_endpoint_flush() cancels them
+ *  - a halted pipe refuses submits until usb_host_endpoint_clear()
+ *  - interrupt OUT transfers complete on the endpoint's bInterval slots,
+ *    or never while sim_device_t::out_nak is set
+ *  - EP0 runs one control transfer per MOCK_USB_CTRL_US, in submit order;
+ *    a STALL cancels the control transfers queued behind it
+ *  - timeout_ms is ignored, as in ESP-IDF 4.4
+ * The simulated device answers GET_DESCRIPTOR (device, configuration and
+ * HID report), CLEAR_FEATURE(ENDPOINT_HALT) and the HID class requests;
+ * class requests in sim_device_t::ep0_stall_mask are stalled.
+ *
+ * The bus is an event source of mock_rtos.h, so simulated time only moves
+ * while every task waits. Call mock_usb_host_reset() after
+ * mock_rtos_reset() to plug a bus in.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_err.h"
+#include "esp_heap_caps.h"
+#include "usb_sim_device.hpp"
+
+#define MOCK_USB_HOST               1       //usb/usb_host.h is this mock, usb_hid_bench.hpp plugs devices into it
+#define MOCK_USB_MAX_CLIENTS        2
+#define MOCK_USB_MAX_PIPES          6       //Endpoints other than EP0 per device
+#define MOCK_USB_PIPE_DEPTH         8       //Transfers queued per endpoint
+#define MOCK_USB_MAX_EVENTS         8       //Client events queued, max_num_event_msg is capped to this
+#define MOCK_USB_MAX_DONE           64      //Completed transfers waiting for their client's event handler
+#define MOCK_USB_ENUM_US            20000   //Attach to NEW_DEV: debounce, reset and enumeration
+#define MOCK_USB_CTRL_US            1000    //EP0 turnaround, one control transfer per frame
+
+//What the host saw of one simulated device, kept until it attaches again
+typedef struct {
+    uint32_t ctrl_transfers;                //Control transfers completed on EP0
+    uint32_t ctrl_stalls;
+    uint32_t ctrl_canceled;                 //Queued behind a STALL
+    uint32_t ep0_max_depth;                 //Most control transfers queued on EP0 at once
+    uint32_t clear_halts;                   //CLEAR_FEATURE(ENDPOINT_HALT) requests
+    uint32_t set_reports;                   //SET_REPORT requests
+    uint32_t in_completed;                  //Interrupt IN transfers completed with a report
+    uint32_t in_failed;                     //Interrupt IN transfers failed by an injected fault
+    uint32_t in_missed;                     //Report slots with no IN transfer queued
+    uint32_t out_completed;                 //Interrupt OUT transfers completed
+    uint32_t flushed;                       //Transfers canceled by usb_host_endpoint_flush()
+} mock_usb_stats_t;
+
+typedef struct {
+    bool in_flight;
+    struct usb_host_client_handle_s *client;   //Whose event handler calls the callback
+    usb_transfer_t transfer;                //Last, usb_transfer_t ends in a flexible array
+} mock_transfer_t;
+
+typedef struct {
+    uint8_t ep_addr;                        //0 for EP0
+    uint8_t bInterfaceNumber;
+    uint8_t type;                           //usb_transfer_type_t
+    uint16_t mps;
+    uint8_t bInterval;
+    bool halted;
+    struct usb_host_client_handle_s *client;   //Claimed the interface
+    usb_transfer_t *queue[MOCK_USB_PIPE_DEPTH];
+    int head;
+    int count;
+    int64_t due_us;                         //EP0 and OUT: completion time of the transfer at head
+} mock_pipe_t;
+
+struct usb_device_handle_s {
+    sim_device_t *sim;                      //NULL while the slot is free
+    bool enumerated;                        //NEW_DEV went out
+    bool gone;
+    int64_t enum_us;                        //Time NEW_DEV goes out
+    uint8_t open_mask;                      //Bit per client that opened the device
+    uint32_t claimed;                       //Bit per claimed bInterfaceNumber
+    uint8_t protocol[SIM_MAX_INTFS];        //HID protocol set by SET_PROTOCOL, report by default
+    uint8_t idle[SIM_MAX_INTFS];            //SET_IDLE duration
+    mock_pipe_t ep0;
+    mock_pipe_t pipes[MOCK_USB_MAX_PIPES];
+    int num_pipes;
+};
+
+struct usb_host_client_handle_s {
+    bool registered;
+    usb_host_client_config_t config;
+    usb_host_client_event_msg_t events[MOCK_USB_MAX_EVENTS];
+    int events_head;
+    int num_events;
+    usb_transfer_t *done[MOCK_USB_MAX_DONE];
+    int done_head;
+    int num_done;
+    bool unblocked;
+    uint32_t events_dropped;
+};
+
+typedef struct {
+    bool installed;
+    sim_bus_t *bus;
+    struct usb_device_handle_s devices[SIM_MAX_DEVICES];    //By index into bus->devices
+    mock_usb_stats_t stats[SIM_MAX_DEVICES];
+    struct usb_host_client_handle_s clients[MOCK_USB_MAX_CLIENTS];
+    uint32_t lib_flags;
+    bool free_all;                          //usb_host_device_free_all() is waiting for devices to close
+} mock_usb_host_t;
+
+static mock_usb_host_t s_mock_usb;
+
+static inline mock_transfer_t *mock_usb_transfer(usb_transfer_t *transfer)
+{
+    return (mock_transfer_t *)((uint8_t *)transfer - offsetof(mock_transfer_t, transfer));
+}
+
+static inline mock_usb_stats_t *mock_usb_dev_stats(const struct usb_device_handle_s *dev)
+{
+    return &s_mock_usb.stats[dev - s_mock_usb.devices];
+}
+
+//Host side counters of a simulated device
+static inline mock_usb_stats_t *mock_usb_sim_stats(const sim_device_t *sim)
+{
+    return &s_mock_usb.stats[sim - s_mock_usb.bus->devices];
+}
+
+static inline int mock_usb_client_index(const struct usb_host_client_handle_s *client)
+{
+    return (int)(client - s_mock_usb.clients);
+}
+
+static inline bool mock_usb_dev_valid(const struct usb_device_handle_s *dev)
+{
+    return dev >= s_mock_usb.devices && dev < s_mock_usb.devices + SIM_MAX_DEVICES && dev->sim && dev->enumerated;
+}
+
+static inline void mock_usb_client_event(struct usb_host_client_handle_s *client, const usb_host_client_event_msg_t *msg)
+{
+    int depth = client->config.max_num_event_msg;
+    if (depth <= 0 || depth > MOCK_USB_MAX_EVENTS) {
+        depth = MOCK_USB_MAX_EVENTS;
+    }
+    if (client->num_events >= depth) {
+        client->events_dropped++;
+        return;
+    }
+    client->events[(client->events_head + client->num_events++) % MOCK_USB_MAX_EVENTS] = *msg;
+    mock_rtos_wake(client, true);
+}
+
+//Hand a transfer back to its client, the callback runs in its event handler
+static inline void mock_usb_complete(usb_transfer_t *transfer, usb_transfer_status_t status, int actual_num_bytes)
+{
+    mock_transfer_t *mt = mock_usb_transfer(transfer);
+    struct usb_host_client_handle_s *client = mt->client;
+    transfer->status = status;
+    transfer->actual_num_bytes = actual_num_bytes;
+    assert(client->num_done < MOCK_USB_MAX_DONE);
+    client->done[(client->done_head + client->num_done++) % MOCK_USB_MAX_DONE] = transfer;
+    mock_rtos_wake(client, true);
+}
+
+static inline usb_transfer_t *mock_usb_pipe_pop(mock_pipe_t *pipe)
+{
+    usb_transfer_t *transfer = pipe->queue[pipe->head];
+    pipe->head = (pipe->head + 1) % MOCK_USB_PIPE_DEPTH;
+    pipe->count--;
+    return transfer;
+}
+
+static inline void mock_usb_pipe_cancel(mock_pipe_t *pipe, usb_transfer_status_t status)
+{
+    while (pipe->count) {
+        mock_usb_complete(mock_usb_pipe_pop(pipe), status, 0);
+    }
+}
+
+static inline mock_pipe_t *mock_usb_find_pipe(struct usb_device_handle_s *dev, uint8_t ep_addr)
+{
+    if ((ep_addr & USB_B_ENDPOINT_ADDRESS_EP_NUM_MASK) == 0) {
+        return &dev->ep0;
+    }
+    for (int i = 0; i < dev->num_pipes; i++) {
+        if (dev->pipes[i].ep_addr == ep_addr) {
+            return &dev->pipes[i];
+        }
+    }
+    return NULL;
+}
+
+//Next interrupt OUT slot after now
+static inline int64_t mock_usb_out_slot(const mock_pipe_t *pipe, int64_t now)
+{
+    int64_t interval_us = (pipe->bInterval ? pipe->bInterval : 1) * 1000;
+    return (now / interval_us + 1) * interval_us;
+}
+
+static inline void mock_usb_free_dev(struct usb_device_handle_s *dev)
+{
+    memset(dev, 0, sizeof(struct usb_device_handle_s));
+    for (int d = 0; d < SIM_MAX_DEVICES; d++) {
+        if (s_mock_usb.devices[d].sim) {
+            return;
+        }
+    }
+    s_mock_usb.free_all = false;
+    s_mock_usb.lib_flags |= USB_HOST_LIB_EVENT_FLAGS_ALL_FREE;
+    mock_rtos_wake(&s_mock_usb, true);
+}
+
+static inline const uint8_t *mock_usb_report_desc(const sim_device_t *sim, uint8_t bInterfaceNumber, uint16_t *len)
+{
+    if (bInterfaceNumber >= SIM_MAX_INTFS || sim->script->report_descs[bInterfaceNumber] == NULL) {
+        return NULL;
+    }
+    *len = sim->script->report_desc_lens[bInterfaceNumber];
+    return sim->script->report_descs[bInterfaceNumber];
+}
+
+/**
+ * The simulated device's answer to the control transfer at the head of
+ * EP0. Returns the status, with the data stage length in data_len.
+ */
+static inline usb_transfer_status_t mock_usb_device_request(struct usb_device_handle_s *dev, usb_transfer_t *transfer,
+                                                            int *data_len)
+{
+    const usb_setup_packet_t *setup = (const usb_setup_packet_t *)transfer->data_buffer;
+    const sim_device_script_t *script = dev->sim->script;
+    mock_usb_stats_t *stats = mock_usb_dev_stats(dev);
+    uint8_t *data = transfer->data_buffer + USB_SETUP_PACKET_SIZE;
+    int space = transfer->num_bytes - USB_SETUP_PACKET_SIZE;
+    if (space > setup->wLength) {
+        space = setup->wLength;
+    }
+    uint8_t intf = (uint8_t)setup->wIndex;
+    const uint8_t *answer = NULL;
+    uint16_t answer_len = 0;
+    *data_len = 0;
+
+    if ((setup->bmRequestType & USB_BM_REQUEST_TYPE_TYPE_MASK) == USB_BM_REQUEST_TYPE_TYPE_CLASS) {
+        if (setup->bRequest < 32 && (dev->sim->ep0_stall_mask & (1u << setup->bRequest))) {
+            return USB_TRANSFER_STATUS_STALL;
+        }
+        switch (setup->bRequest) {
+            case 0x09:  //SET_REPORT
+                stats->set_reports++;
+                *data_len = space;
+                return USB_TRANSFER_STATUS_COMPLETED;
+            case 0x0A:  //SET_IDLE
+                if (intf < SIM_MAX_INTFS) {
+                    dev->idle[intf] = (uint8_t)(setup->wValue >> 8);
+                }
+                return USB_TRANSFER_STATUS_COMPLETED;
+            case 0x0B:  //SET_PROTOCOL
+                if (intf < SIM_MAX_INTFS) {
+                    dev->protocol[intf] = (uint8_t)setup->wValue;
+                }
+                return USB_TRANSFER_STATUS_COMPLETED;
+            case 0x02:  //GET_IDLE
+            case 0x03:  //GET_PROTOCOL
+                if (intf >= SIM_MAX_INTFS || space < 1) {
+                    return USB_TRANSFER_STATUS_STALL;
+                }
+                data[0] = (setup->bRequest == 0x02) ? dev->idle[intf] : dev->protocol[intf];
+                *data_len = 1;
+                return USB_TRANSFER_STATUS_COMPLETED;
+            default:
+                return USB_TRANSFER_STATUS_STALL;
+        }
+    }
+    switch (setup->bRequest) {
+        case USB_B_REQUEST_GET_DESCRIPTOR:
+            switch (setup->wValue >> 8) {
+                case USB_B_DESCRIPTOR_TYPE_DEVICE:
+                    answer = script->dev_desc;
+                    answer_len = 18;
+                    break;
+                case USB_B_DESCRIPTOR_TYPE_CONFIGURATION:
+                    answer = script->config_desc;
+                    answer_len = (uint16_t)(answer[2] | (answer[3] << 8));
+                    break;
+                case 0x22:  //HID report descriptor
+                    answer = mock_usb_report_desc(dev->sim, intf, &answer_len);
+                    break;
+            }
+            if (answer == NULL) {
+                return USB_TRANSFER_STATUS_STALL;
+            }
+            *data_len = (answer_len < space) ? answer_len : space;
+            memcpy(data, answer, *data_len);
+            return USB_TRANSFER_STATUS_COMPLETED;
+        case USB_B_REQUEST_CLEAR_FEATURE:
+            if ((setup->bmRequestType & USB_BM_REQUEST_TYPE_RECIP_MASK) != USB_BM_REQUEST_TYPE_RECIP_ENDPOINT ||
+                setup->wValue != 0) {
+                return USB_TRANSFER_STATUS_STALL;
+            }
+            stats->clear_halts++;
+            return sim_device_clear_halt(dev->sim, (uint8_t)setup->wIndex) ? USB_TRANSFER_STATUS_COMPLETED :
+                   USB_TRANSFER_STATUS_STALL;
+        case USB_B_REQUEST_SET_CONFIGURATION:
+        case USB_B_REQUEST_SET_INTERFACE:
+            return USB_TRANSFER_STATUS_COMPLETED;
+        default:
+            return USB_TRANSFER_STATUS_STALL;
+    }
+}
+
+static inline void mock_usb_ep0_complete(struct usb_device_handle_s *dev, int64_t now)
+{
+    mock_pipe_t *ep0 = &dev->ep0;
+    mock_usb_stats_t *stats = mock_usb_dev_stats(dev);
+    usb_transfer_t *transfer = mock_usb_pipe_pop(ep0);
+    int data_len;
+    usb_transfer_status_t status = mock_usb_device_request(dev, transfer, &data_len);
+    bool in = transfer->data_buffer[0] & USB_BM_REQUEST_TYPE_DIR_IN;
+    stats->ctrl_transfers++;
+    if (status == USB_TRANSFER_STATUS_STALL) {
+        //The host library halts and flushes EP0 to recover from a STALL
+        stats->ctrl_stalls++;
+        stats->ctrl_canceled += ep0->count;
+        mock_usb_complete(transfer, status, 0);
+        mock_usb_pipe_cancel(ep0, USB_TRANSFER_STATUS_CANCELED);
+        return;
+    }
+    mock_usb_complete(transfer, status, in ? USB_SETUP_PACKET_SIZE + data_len : transfer->num_bytes);
+    ep0->due_us = now + MOCK_USB_CTRL_US;
+}
+
+//A report slot of a simulated IN endpoint came up
+static inline void mock_usb_report(struct usb_device_handle_s *dev, const sim_event_t *event)
+{
+    mock_pipe_t *pipe = mock_usb_find_pipe(dev, event->ep_addr);
+    mock_usb_stats_t *stats = mock_usb_dev_stats(dev);
+    if (pipe == NULL || pipe->halted || pipe->count == 0) {
+        stats->in_missed++;
+        return;
+    }
+    usb_transfer_t *transfer = mock_usb_pipe_pop(pipe);
+    if (event->fault != SIM_FAULT_NONE) {
+        //The pipe halts on any error, queued transfers wait for a flush
+        stats->in_failed++;
+        pipe->halted = true;
+        mock_usb_complete(transfer, (event->fault == SIM_FAULT_STALL) ? USB_TRANSFER_STATUS_STALL : USB_TRANSFER_STATUS_ERROR, 0);
+        return;
+    }
+    int len = (event->len < transfer->num_bytes) ? event->len : transfer->num_bytes;
+    memcpy(transfer->data_buffer, event->data, len);
+    stats->in_completed++;
+    mock_usb_complete(transfer, USB_TRANSFER_STATUS_COMPLETED, len);
+}
+
+static inline void mock_usb_detach(struct usb_device_handle_s *dev)
+{
+    if (!dev->enumerated) {
+        memset(dev, 0, sizeof(struct usb_device_handle_s));
+        return;
+    }
+    dev->gone = true;
+    mock_usb_pipe_cancel(&dev->ep0, USB_TRANSFER_STATUS_NO_DEVICE);
+    for (int i = 0; i < dev->num_pipes; i++) {
+        mock_usb_pipe_cancel(&dev->pipes[i], USB_TRANSFER_STATUS_NO_DEVICE);
+    }
+    if (dev->open_mask == 0) {
+        mock_usb_free_dev(dev);
+        return;
+    }
+    usb_host_client_event_msg_t msg;
+    msg.event = USB_HOST_CLIENT_EVENT_DEV_GONE;
+    msg.dev_gone.dev_hdl = dev;
+    for (int c = 0; c < MOCK_USB_MAX_CLIENTS; c++) {
+        if (dev->open_mask & (1u << c)) {
+            mock_usb_client_event(&s_mock_usb.clients[c], &msg);
+        }
+    }
+}
+
+static inline int64_t mock_usb_next_us(void)
+{
+    if (!s_mock_usb.installed || s_mock_usb.bus == NULL) {
+        return MOCK_RTOS_NEVER;
+    }
+    uint64_t bus_us = sim_bus_next_us(s_mock_usb.bus);
+    int64_t next_us = (bus_us == UINT64_MAX) ? MOCK_RTOS_NEVER : (int64_t)bus_us;
+    for (int d = 0; d < SIM_MAX_DEVICES; d++) {
+        struct usb_device_handle_s *dev = &s_mock_usb.devices[d];
+        if (dev->sim && !dev->enumerated && dev->enum_us < next_us) {
+            next_us = dev->enum_us;
+        }
+        if (dev->sim && dev->ep0.count && dev->ep0.due_us < next_us) {
+            next_us = dev->ep0.due_us;
+        }
+        for (int i = 0; dev->sim && i < dev->num_pipes; i++) {
+            const mock_pipe_t *pipe = &dev->pipes[i];
+            if (!(pipe->ep_addr & USB_B_ENDPOINT_ADDRESS_EP_DIR_MASK) && pipe->count && !pipe->halted &&
+                !dev->sim->out_nak && pipe->due_us < next_us) {
+                next_us = pipe->due_us;
+            }
+        }
+    }
+    return next_us;
+}
+
+static inline void mock_usb_run(int64_t now)
+{
+    sim_bus_t *bus = s_mock_usb.bus;
+    sim_event_t event;
+    while (sim_bus_next_event(bus, (uint64_t)now, &event)) {
+        struct usb_device_handle_s *dev = &s_mock_usb.devices[event.dev - bus->devices];
+        switch (event.type) {
+            case SIM_EVENT_ATTACH:
+                memset(dev, 0, sizeof(struct usb_device_handle_s));
+                memset(mock_usb_dev_stats(dev), 0, sizeof(mock_usb_stats_t));
+                dev->sim = event.dev;
+                dev->enum_us = event.time_us + MOCK_USB_ENUM_US;
+                memset(dev->protocol, 1, sizeof(dev->protocol));
+                break;
+            case SIM_EVENT_DETACH:
+                if (dev->sim) {
+                    mock_usb_detach(dev);
+                }
+                break;
+            case SIM_EVENT_REPORT:
+                if (dev->sim && dev->enumerated && !dev->gone) {
+                    mock_usb_report(dev, &event);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    for (int d = 0; d < SIM_MAX_DEVICES; d++) {
+        struct usb_device_handle_s *dev = &s_mock_usb.devices[d];
+        if (dev->sim && !dev->enumerated && dev->enum_us <= now) {
+            dev->enumerated = true;
+            usb_host_client_event_msg_t msg;
+            msg.event = USB_HOST_CLIENT_EVENT_NEW_DEV;
+            msg.new_dev.address = dev->sim->dev_addr;
+            for (int c = 0; c < MOCK_USB_MAX_CLIENTS; c++) {
+                if (s_mock_usb.clients[c].registered) {
+                    mock_usb_client_event(&s_mock_usb.clients[c], &msg);
+                }
+            }
+        }
+        while (dev->sim && dev->ep0.count && dev->ep0.due_us <= now) {
+            mock_usb_ep0_complete(dev, now);
+        }
+        for (int i = 0; dev->sim && i < dev->num_pipes; i++) {
+            mock_pipe_t *pipe = &dev->pipes[i];
+            while (!(pipe->ep_addr & USB_B_ENDPOINT_ADDRESS_EP_DIR_MASK) && pipe->count && !pipe->halted &&
+                   !dev->sim->out_nak && pipe->due_us <= now) {
+                usb_transfer_t *transfer = mock_usb_pipe_pop(pipe);
+                mock_usb_dev_stats(dev)->out_completed++;
+                mock_usb_complete(transfer, USB_TRANSFER_STATUS_COMPLETED, transfer->num_bytes);
+                pipe->due_us = mock_usb_out_slot(pipe, now);
+            }
+        }
+    }
+}
+
+/**
+ * Plug bus into the mock host library, with no clients and nothing
+ * installed. Call after mock_rtos_reset(); bus must outlive the test.
+ */
+static inline void mock_usb_host_reset(sim_bus_t *bus)
+{
+    memset(&s_mock_usb, 0, sizeof(mock_usb_host_t));
+    s_mock_usb.bus = bus;
+    mock_rtos_add_source(mock_usb_next_us, mock_usb_run);
+}
+
+/* Host library */
+
+static inline esp_err_t usb_host_install(const usb_host_config_t *config)
+{
+    (void)config;
+    if (s_mock_usb.installed) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    s_mock_usb.installed = true;
+    return ESP_OK;
+}
+
+static inline esp_err_t usb_host_uninstall(void)
+{
+    for (int c = 0; c < MOCK_USB_MAX_CLIENTS; c++) {
+        if (s_mock_usb.clients[c].registered) {
+            return ESP_ERR_INVALID_STATE;
+        }
+    }
+    for (int d = 0; d < SIM_MAX_DEVICES; d++) {
+        if (s_mock_usb.devices[d].sim && s_mock_usb.devices[d].enumerated) {
+            return ESP_ERR_INVALID_STATE;
+        }
+    }
+    s_mock_usb.installed = false;
+    return ESP_OK;
+}
+
+static inline esp_err_t usb_host_lib_handle_events(TickType_t timeout_ticks, uint32_t *event_flags_ret)
+{
+    int64_t wake_us = mock_rtos_deadline(timeout_ticks);
+    while (s_mock_usb.lib_flags == 0) {
+        if (timeout_ticks == 0 || !mock_rtos_block(&s_mock_usb, wake_us)) {
+            break;
+        }
+    }
+    if (event_flags_ret) {
+        *event_flags_ret = s_mock_usb.lib_flags;
+    }
+    esp_err_t err = s_mock_usb.lib_flags ? ESP_OK : ESP_ERR_TIMEOUT;
+    s_mock_usb.lib_flags = 0;
+    return err;
+}
+
+static inline esp_err_t usb_host_lib_unblock(void)
+{
+    mock_rtos_wake(&s_mock_usb, true);
+    return ESP_OK;
+}
+
+/**
+ * Free every device no client holds open; the rest are freed as their
+ * clients close them. Returns ESP_OK if there were none, otherwise
+ * ESP_ERR_NOT_FINISHED with USB_HOST_LIB_EVENT_FLAGS_ALL_FREE to follow.
+ */
+static inline esp_err_t usb_host_device_free_all(void)
+{
+    bool any = false;
+    for (int d = 0; d < SIM_MAX_DEVICES; d++) {
+        any |= (s_mock_usb.devices[d].sim != NULL);
+    }
+    if (!any) {
+        return ESP_OK;
+    }
+    s_mock_usb.free_all = true;
+    for (int d = 0; d < SIM_MAX_DEVICES; d++) {
+        struct usb_device_handle_s *dev = &s_mock_usb.devices[d];
+        if (dev->sim && dev->open_mask == 0) {
+            //Its port is powered down, a later replug would have to be a new sim_bus_add()
+            dev->sim->gone = true;
+            mock_usb_free_dev(dev);
+        }
+    }
+    return ESP_ERR_NOT_FINISHED;
+}
+
+/* Clients */
+
+static inline esp_err_t usb_host_client_register(const usb_host_client_config_t *client_config,
+                                                 usb_host_client_handle_t *client_hdl_ret)
+{
+    if (!s_mock_usb.installed) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (client_config->is_synchronous) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    for (int c = 0; c < MOCK_USB_MAX_CLIENTS; c++) {
+        struct usb_host_client_handle_s *client = &s_mock_usb.clients[c];
+        if (!client->registered) {
+            memset(client, 0, sizeof(struct usb_host_client_handle_s));
+            client->registered = true;
+            client->config = *client_config;
+            *client_hdl_ret = client;
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_NO_MEM;
+}
+
+static inline esp_err_t usb_host_client_deregister(usb_host_client_handle_t client_hdl)
+{
+    int c = mock_usb_client_index(client_hdl);
+    for (int d = 0; d < SIM_MAX_DEVICES; d++) {
+        if (s_mock_usb.devices[d].open_mask & (1u << c)) {
+            return ESP_ERR_INVALID_STATE;
+        }
+    }
+    client_hdl->registered = false;
+    for (int i = 0; i < MOCK_USB_MAX_CLIENTS; i++) {
+        if (s_mock_usb.clients[i].registered) {
+            return ESP_OK;
+        }
+    }
+    s_mock_usb.lib_flags |= USB_HOST_LIB_EVENT_FLAGS_NO_CLIENTS;
+    mock_rtos_wake(&s_mock_usb, true);
+    return ESP_OK;
+}
+
+/**
+ * Wait up to timeout_ticks for an event, then run the callbacks of every
+ * queued client event and completed transfer, including any completed by
+ * those callbacks.
+ */
+static inline esp_err_t usb_host_client_handle_events(usb_host_client_handle_t client_hdl, TickType_t timeout_ticks)
+{
+    struct usb_host_client_handle_s *client = client_hdl;
+    int64_t wake_us = mock_rtos_deadline(timeout_ticks);
+    while (client->num_events == 0 && client->num_done == 0 && !client->unblocked) {
+        if (timeout_ticks == 0 || !mock_rtos_block(client, wake_us)) {
+            break;
+        }
+    }
+    bool handled = client->unblocked;
+    client->unblocked = false;
+    while (client->num_events || client->num_done) {
+        handled = true;
+        if (client->num_events) {
+            usb_host_client_event_msg_t msg = client->events[client->events_head];
+            client->events_head = (client->events_head + 1) % MOCK_USB_MAX_EVENTS;
+            client->num_events--;
+            client->config.async.client_event_callback(&msg, client->config.async.callback_arg);
+            continue;
+        }
+        usb_transfer_t *transfer = client->done[client->done_head];
+        client->done_head = (client->done_head + 1) % MOCK_USB_MAX_DONE;
+        client->num_done--;
+        mock_usb_transfer(transfer)->in_flight = false;
+        transfer->callback(transfer);
+    }
+    return handled ? ESP_OK : ESP_ERR_TIMEOUT;
+}
+
+static inline esp_err_t usb_host_client_unblock(usb_host_client_handle_t client_hdl)
+{
+    client_hdl->unblocked = true;
+    mock_rtos_wake(client_hdl, true);
+    return ESP_OK;
+}
+
+/* Devices */
+
+static inline esp_err_t usb_host_device_open(usb_host_client_handle_t client_hdl, uint8_t dev_addr,
+                                             usb_device_handle_t *dev_hdl_ret)
+{
+    for (int d = 0; d < SIM_MAX_DEVICES; d++) {
+        struct usb_device_handle_s *dev = &s_mock_usb.devices[d];
+        if (dev->sim && dev->enumerated && !dev->gone && dev->sim->dev_addr == dev_addr) {
+            dev->open_mask |= 1u << mock_usb_client_index(client_hdl);
+            *dev_hdl_ret = dev;
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+static inline esp_err_t usb_host_device_close(usb_host_client_handle_t client_hdl, usb_device_handle_t dev_hdl)
+{
+    uint8_t bit = 1u << mock_usb_client_index(client_hdl);
+    if (!mock_usb_dev_valid(dev_hdl) || !(dev_hdl->open_mask & bit)) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    for (int i = 0; i < dev_hdl->num_pipes; i++) {
+        if (dev_hdl->pipes[i].client == client_hdl) {
+            //Interfaces must be released first
+            return ESP_ERR_INVALID_STATE;
+        }
+    }
+    dev_hdl->open_mask &= ~bit;
+    if (dev_hdl->open_mask == 0 && (dev_hdl->gone || s_mock_usb.free_all)) {
+        mock_usb_free_dev(dev_hdl);
+    }
+    return ESP_OK;
+}
+
+static inline esp_err_t usb_host_device_info(usb_device_handle_t dev_hdl, usb_device_info_t *dev_info)
+{
+    if (!mock_usb_dev_valid(dev_hdl)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    const sim_device_script_t *script = dev_hdl->sim->script;
+    memset(dev_info, 0, sizeof(usb_device_info_t));
+    dev_info->speed = USB_SPEED_FULL;
+    dev_info->dev_addr = dev_hdl->sim->dev_addr;
+    dev_info->bMaxPacketSize0 = script->dev_desc[7];
+    dev_info->bConfigurationValue = script->config_desc[5];
+    return ESP_OK;
+}
+
+static inline esp_err_t usb_host_get_device_descriptor(usb_device_handle_t dev_hdl, const usb_device_desc_t **device_desc)
+{
+    if (!mock_usb_dev_valid(dev_hdl)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    *device_desc = (const usb_device_desc_t *)dev_hdl->sim->script->dev_desc;
+    return ESP_OK;
+}
+
+static inline esp_err_t usb_host_get_active_config_descriptor(usb_device_handle_t dev_hdl, const usb_config_desc_t **config_desc)
+{
+    if (!mock_usb_dev_valid(dev_hdl)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    *config_desc = (const usb_config_desc_t *)dev_hdl->sim->script->config_desc;
+    return ESP_OK;
+}
+
+/* Interfaces and endpoints */
+
+static inline esp_err_t usb_host_interface_claim(usb_host_client_handle_t client_hdl, usb_device_handle_t dev_hdl,
+                                                 uint8_t bInterfaceNumber, uint8_t bAlternateSetting)
+{
+    if (!mock_usb_dev_valid(dev_hdl) || !(dev_hdl->open_mask & (1u << mock_usb_client_index(client_hdl))) ||
+        bInterfaceNumber >= 32 || (dev_hdl->claimed & (1u << bInterfaceNumber))) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    const uint8_t *p = dev_hdl->sim->script->config_desc;
+    uint16_t total = (uint16_t)(p[2] | (p[3] << 8));
+    bool found = false;
+    bool in_intf = false;
+    int num_pipes = dev_hdl->num_pipes;
+    for (uint16_t off = 0; off + 2 <= total && p[off] >= 2; off += p[off]) {
+        if (p[off + 1] == USB_B_DESCRIPTOR_TYPE_INTERFACE) {
+            in_intf = (p[off + 2] == bInterfaceNumber && p[off + 3] == bAlternateSetting);
+            found |= in_intf;
+        } else if (p[off + 1] == USB_B_DESCRIPTOR_TYPE_ENDPOINT && in_intf) {
+            if (num_pipes >= MOCK_USB_MAX_PIPES) {
+                return ESP_ERR_NO_MEM;
+            }
+            mock_pipe_t *pipe = &dev_hdl->pipes[num_pipes++];
+            memset(pipe, 0, sizeof(mock_pipe_t));
+            pipe->ep_addr = p[off + 2];
+            pipe->type = p[off + 3] & USB_BM_ATTRIBUTES_XFERTYPE_MASK;
+            pipe->mps = (uint16_t)(p[off + 4] | (p[off + 5] << 8));
+            pipe->bInterval = p[off + 6];
+            pipe->bInterfaceNumber = bInterfaceNumber;
+            pipe->client = client_hdl;
+        }
+    }
+    if (!found) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    dev_hdl->num_pipes = num_pipes;
+    dev_hdl->claimed |= 1u << bInterfaceNumber;
+    return ESP_OK;
+}
+
+static inline esp_err_t usb_host_interface_release(usb_host_client_handle_t client_hdl, usb_device_handle_t dev_hdl,
+                                                   uint8_t bInterfaceNumber)
+{
+    if (!mock_usb_dev_valid(dev_hdl) || bInterfaceNumber >= 32 || !(dev_hdl->claimed & (1u << bInterfaceNumber))) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    for (int i = 0; i < dev_hdl->num_pipes; i++) {
+        const mock_pipe_t *pipe = &dev_hdl->pipes[i];
+        if (pipe->bInterfaceNumber == bInterfaceNumber && (pipe->client != client_hdl || pipe->count)) {
+            //Transfers must be flushed and handed back first
+            return ESP_ERR_INVALID_STATE;
+        }
+    }
+    int kept = 0;
+    for (int i = 0; i < dev_hdl->num_pipes; i++) {
+        if (dev_hdl->pipes[i].bInterfaceNumber != bInterfaceNumber) {
+            dev_hdl->pipes[kept++] = dev_hdl->pipes[i];
+        }
+    }
+    dev_hdl->num_pipes = kept;
+    dev_hdl->claimed &= ~(1u << bInterfaceNumber);
+    return ESP_OK;
+}
+
+static inline esp_err_t usb_host_endpoint_halt(usb_device_handle_t dev_hdl, uint8_t bEndpointAddress)
+{
+    mock_pipe_t *pipe = (dev_hdl && dev_hdl->sim) ? mock_usb_find_pipe(dev_hdl, bEndpointAddress) : NULL;
+    if (pipe == NULL || pipe == &dev_hdl->ep0) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    pipe->halted = true;
+    return ESP_OK;
+}
+
+static inline esp_err_t usb_host_endpoint_flush(usb_device_handle_t dev_hdl, uint8_t bEndpointAddress)
+{
+    mock_pipe_t *pipe = (dev_hdl && dev_hdl->sim) ? mock_usb_find_pipe(dev_hdl, bEndpointAddress) : NULL;
+    if (pipe == NULL || pipe == &dev_hdl->ep0) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (!pipe->halted) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    mock_usb_dev_stats(dev_hdl)->flushed += pipe->count;
+    mock_usb_pipe_cancel(pipe, USB_TRANSFER_STATUS_CANCELED);
+    return ESP_OK;
+}
+
+static inline esp_err_t usb_host_endpoint_clear(usb_device_handle_t dev_hdl, uint8_t bEndpointAddress)
+{
+    mock_pipe_t *pipe = (dev_hdl && dev_hdl->sim) ? mock_usb_find_pipe(dev_hdl, bEndpointAddress) : NULL;
+    if (pipe == NULL || pipe == &dev_hdl->ep0) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (!pipe->halted) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    pipe->halted = false;
+    pipe->due_us = mock_usb_out_slot(pipe, mock_rtos_now_us());
+    return ESP_OK;
+}
+
+/* Transfers */
+
+static inline esp_err_t usb_host_transfer_alloc(size_t data_buffer_size, int num_isoc_packets, usb_transfer_t **transfer)
+{
+    uint8_t *data_buffer = (uint8_t *)mock_heap_alloc(data_buffer_size ? data_buffer_size : 1);
+    mock_transfer_t *mt = (mock_transfer_t *)mock_heap_alloc(sizeof(mock_transfer_t) +
+                                                             num_isoc_packets * sizeof(usb_isoc_packet_desc_t));
+    if (data_buffer == NULL || mt == NULL) {
+        mock_heap_free(data_buffer);
+        mock_heap_free(mt);
+        return ESP_ERR_NO_MEM;
+    }
+    //The const members are only ever set here, as in the host library
+    usb_transfer_t *t = &mt->transfer;
+    memset((void *)t, 0, sizeof(usb_transfer_t));
+    *(uint8_t **)&t->data_buffer = data_buffer;
+    *(size_t *)&t->data_buffer_size = data_buffer_size;
+    *(int *)&t->num_isoc_packets = num_isoc_packets;
+    mt->in_flight = false;
+    mt->client = NULL;
+    *transfer = &mt->transfer;
+    return ESP_OK;
+}
+
+static inline esp_err_t usb_host_transfer_free(usb_transfer_t *transfer)
+{
+    if (transfer == NULL) {
+        return ESP_OK;
+    }
+    mock_transfer_t *mt = mock_usb_transfer(transfer);
+    if (mt->in_flight) {
+        return ESP_ERR_NOT_FINISHED;
+    }
+    mock_heap_free(transfer->data_buffer);
+    mock_heap_free(mt);
+    return ESP_OK;
+}
+
+static inline esp_err_t mock_usb_enqueue(mock_pipe_t *pipe, usb_transfer_t *transfer, struct usb_host_client_handle_s *client)
+{
+    mock_transfer_t *mt = mock_usb_transfer(transfer);
+    if (mt->in_flight) {
+        return ESP_ERR_NOT_FINISHED;
+    }
+    if (transfer->num_bytes < 0 || (size_t)transfer->num_bytes > transfer->data_buffer_size) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (pipe->halted) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (pipe->count >= MOCK_USB_PIPE_DEPTH) {
+        return ESP_ERR_NO_MEM;
+    }
+    mt->in_flight = true;
+    mt->client = client;
+    transfer->status = USB_TRANSFER_STATUS_ERROR;
+    transfer->actual_num_bytes = 0;
+    pipe->queue[(pipe->head + pipe->count++) % MOCK_USB_PIPE_DEPTH] = transfer;
+    return ESP_OK;
+}
+
+static inline esp_err_t usb_host_transfer_submit(usb_transfer_t *transfer)
+{
+    usb_device_handle_t dev = transfer->device_handle;
+    if (!mock_usb_dev_valid(dev) || dev->gone) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if ((transfer->bEndpointAddress & USB_B_ENDPOINT_ADDRESS_EP_NUM_MASK) == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    mock_pipe_t *pipe = mock_usb_find_pipe(dev, transfer->bEndpointAddress);
+    if (pipe == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    bool in = transfer->bEndpointAddress & USB_B_ENDPOINT_ADDRESS_EP_DIR_MASK;
+    if (in && (transfer->num_bytes == 0 || transfer->num_bytes % pipe->mps != 0)) {
+        //IN transfers must be whole packets
+        return ESP_ERR_INVALID_ARG;
+    }
+    bool idle = (pipe->count == 0);
+    esp_err_t err = mock_usb_enqueue(pipe, transfer, pipe->client);
+    if (err == ESP_OK && !in && idle) {
+        pipe->due_us = mock_usb_out_slot(pipe, mock_rtos_now_us());
+    }
+    return err;
+}
+
+static inline esp_err_t usb_host_transfer_submit_control(usb_host_client_handle_t client_hdl, usb_transfer_t *transfer)
+{
+    usb_device_handle_t dev = transfer->device_handle;
+    if (!mock_usb_dev_valid(dev) || dev->gone || !(dev->open_mask & (1u << mock_usb_client_index(client_hdl)))) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (transfer->bEndpointAddress != 0 || transfer->num_bytes < USB_SETUP_PACKET_SIZE) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    bool idle = (dev->ep0.count == 0);
+    esp_err_t err = mock_usb_enqueue(&dev->ep0, transfer, client_hdl);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (idle) {
+        dev->ep0.due_us = mock_rtos_now_us() + MOCK_USB_CTRL_US;
+    }
+    mock_usb_stats_t *stats = mock_usb_dev_stats(dev);
+    if ((uint32_t)dev->ep0.count > stats->ep0_max_depth) {
+        stats->ep0_max_depth = dev->ep0.count;
+    }
+    return ESP_OK;
+}
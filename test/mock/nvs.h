@@ -0,0 +1,139 @@
+/*
+ * nvs.h for the native build: blobs kept in memory until mock_nvs_reset()
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_err.h"
+
+#define MOCK_NVS_MAX_ENTRIES        16
+#define MOCK_NVS_KEY_LEN            16      //NVS_KEY_NAME_MAX_SIZE, terminator included
+
+typedef uint32_t nvs_handle_t;
+
+typedef enum {
+    NVS_READONLY,
+    NVS_READWRITE,
+} nvs_open_mode_t;
+
+typedef struct {
+    char ns[MOCK_NVS_KEY_LEN];
+    char key[MOCK_NVS_KEY_LEN];
+    void *data;
+    size_t len;
+} mock_nvs_entry_t;
+
+typedef struct {
+    mock_nvs_entry_t entries[MOCK_NVS_MAX_ENTRIES];
+    char open_ns[MOCK_NVS_KEY_LEN];         //One handle open at a time is all the libraries need
+    bool initialized;
+    uint32_t commits;
+} mock_nvs_t;
+
+static mock_nvs_t s_mock_nvs;
+
+static inline void mock_nvs_reset(void)
+{
+    for (int i = 0; i < MOCK_NVS_MAX_ENTRIES; i++) {
+        free(s_mock_nvs.entries[i].data);
+    }
+    memset(&s_mock_nvs, 0, sizeof(mock_nvs_t));
+}
+
+static inline mock_nvs_entry_t *mock_nvs_find(const char *key, bool create)
+{
+    mock_nvs_entry_t *free_entry = NULL;
+    for (int i = 0; i < MOCK_NVS_MAX_ENTRIES; i++) {
+        mock_nvs_entry_t *entry = &s_mock_nvs.entries[i];
+        if (entry->data == NULL) {
+            free_entry = free_entry ? free_entry : entry;
+        } else if (strcmp(entry->ns, s_mock_nvs.open_ns) == 0 && strcmp(entry->key, key) == 0) {
+            return entry;
+        }
+    }
+    if (create && free_entry) {
+        snprintf(free_entry->ns, MOCK_NVS_KEY_LEN, "%s", s_mock_nvs.open_ns);
+        snprintf(free_entry->key, MOCK_NVS_KEY_LEN, "%s", key);
+        return free_entry;
+    }
+    return NULL;
+}
+
+static inline esp_err_t nvs_open(const char *name, nvs_open_mode_t open_mode, nvs_handle_t *out_handle)
+{
+    if (!s_mock_nvs.initialized) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (strlen(name) >= MOCK_NVS_KEY_LEN) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    (void)open_mode;
+    snprintf(s_mock_nvs.open_ns, MOCK_NVS_KEY_LEN, "%s", name);
+    *out_handle = 1;
+    return ESP_OK;
+}
+
+static inline void nvs_close(nvs_handle_t handle)
+{
+    (void)handle;
+}
+
+static inline esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out_value, size_t *length)
+{
+    (void)handle;
+    mock_nvs_entry_t *entry = mock_nvs_find(key, false);
+    if (entry == NULL) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    if (out_value == NULL) {
+        *length = entry->len;
+        return ESP_OK;
+    }
+    if (*length < entry->len) {
+        *length = entry->len;
+        return ESP_ERR_INVALID_SIZE;
+    }
+    memcpy(out_value, entry->data, entry->len);
+    *length = entry->len;
+    return ESP_OK;
+}
+
+static inline esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t length)
+{
+    (void)handle;
+    if (strlen(key) >= MOCK_NVS_KEY_LEN) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    mock_nvs_entry_t *entry = mock_nvs_find(key, true);
+    if (entry == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    free(entry->data);
+    entry->data = malloc(length ? length : 1);
+    memcpy(entry->data, value, length);
+    entry->len = length;
+    return ESP_OK;
+}
+
+static inline esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key)
+{
+    (void)handle;
+    mock_nvs_entry_t *entry = mock_nvs_find(key, false);
+    if (entry == NULL) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    free(entry->data);
+    memset(entry, 0, sizeof(mock_nvs_entry_t));
+    return ESP_OK;
+}
+
+static inline esp_err_t nvs_commit(nvs_handle_t handle)
+{
+    (void)handle;
+    s_mock_nvs.commits++;
+    return ESP_OK;
+}
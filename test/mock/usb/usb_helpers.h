@@ -0,0 +1,59 @@
+/*
+ * Descriptor helpers of ESP-IDF 4.4, for the native build
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include "usb/usb_types_ch9.h"
+
+typedef void (*print_class_descriptor_cb)(const usb_standard_desc_t *desc);
+
+static inline int usb_round_up_to_mps(int num_bytes, int mps)
+{
+    if (num_bytes < 0 || mps < 0) {
+        return 0;
+    }
+    return ((num_bytes + mps - 1) / mps) * mps;
+}
+
+static inline void usb_print_device_descriptor(const usb_device_desc_t *devc_desc)
+{
+    if (devc_desc == NULL) {
+        return;
+    }
+    printf("*** Device descriptor ***\n");
+    printf("bcdUSB %d.%d0\n", (devc_desc->bcdUSB >> 8) & 0xF, (devc_desc->bcdUSB >> 4) & 0xF);
+    printf("bMaxPacketSize0 %d\n", devc_desc->bMaxPacketSize0);
+    printf("idVendor 0x%x\n", devc_desc->idVendor);
+    printf("idProduct 0x%x\n", devc_desc->idProduct);
+    printf("bNumConfigurations %d\n", devc_desc->bNumConfigurations);
+}
+
+static inline void usb_print_config_descriptor(const usb_config_desc_t *cfg_desc, print_class_descriptor_cb class_specific_cb)
+{
+    if (cfg_desc == NULL) {
+        return;
+    }
+    const uint8_t *p = (const uint8_t *)cfg_desc;
+    printf("*** Configuration descriptor ***\n");
+    for (int off = 0; off + 2 <= cfg_desc->wTotalLength && p[off] >= 2; off += p[off]) {
+        const usb_standard_desc_t *desc = (const usb_standard_desc_t *)(p + off);
+        printf("bLength %d, bDescriptorType 0x%02x\n", desc->bLength, desc->bDescriptorType);
+        if (class_specific_cb && desc->bDescriptorType > USB_B_DESCRIPTOR_TYPE_ENDPOINT) {
+            class_specific_cb(desc);
+        }
+    }
+}
+
+static inline void usb_print_string_descriptor(const usb_str_desc_t *str_desc)
+{
+    if (str_desc == NULL) {
+        return;
+    }
+    const uint8_t *p = (const uint8_t *)str_desc;
+    for (int i = 2; i + 1 < str_desc->bLength; i += 2) {
+        printf("%c", (char)p[i]);
+    }
+    printf("\n");
+}
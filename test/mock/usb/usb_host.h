@@ -0,0 +1,69 @@
+/*
+ * USB Host Library API of ESP-IDF 4.4, for the native build
+ *
+ * Same types and calls as the real usb/usb_host.h; mock_usb_host.h
+ * implements them on a simulated bus (usb_sim_device.hpp).
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_err.h"
+#include "esp_intr_alloc.h"
+#include "usb/usb_helpers.h"
+#include "usb/usb_types_ch9.h"
+#include "usb/usb_types_stack.h"
+
+typedef struct usb_host_client_handle_s *usb_host_client_handle_t;
+
+#define USB_HOST_LIB_EVENT_FLAGS_NO_CLIENTS     0x01    //All clients have been deregistered
+#define USB_HOST_LIB_EVENT_FLAGS_ALL_FREE       0x02    //All devices have been freed
+
+typedef enum {
+    USB_HOST_CLIENT_EVENT_NEW_DEV,
+    USB_HOST_CLIENT_EVENT_DEV_GONE,
+} usb_host_client_event_t;
+
+typedef struct {
+    usb_host_client_event_t event;
+    union {
+        struct {
+            uint8_t address;
+        } new_dev;
+        struct {
+            usb_device_handle_t dev_hdl;
+        } dev_gone;
+    };
+} usb_host_client_event_msg_t;
+
+typedef void (*usb_host_client_event_cb_t)(const usb_host_client_event_msg_t *event_msg, void *arg);
+
+typedef struct {
+    bool skip_phy_setup;
+    int intr_flags;
+} usb_host_config_t;
+
+typedef struct {
+    bool is_synchronous;
+    int max_num_event_msg;
+    union {
+        struct {
+            usb_host_client_event_cb_t client_event_callback;
+            void *callback_arg;
+        } async;
+    };
+} usb_host_client_config_t;
+
+typedef struct {
+    usb_speed_t speed;
+    uint8_t dev_addr;
+    uint8_t bMaxPacketSize0;
+    uint8_t bConfigurationValue;
+    const usb_str_desc_t *str_desc_manufacturer;
+    const usb_str_desc_t *str_desc_product;
+    const usb_str_desc_t *str_desc_serial_num;
+} usb_device_info_t;
+
+#include "mock_usb_host.h"
@@ -0,0 +1,134 @@
+/*
+ * USB 2.0 chapter 9 types of ESP-IDF 4.4, for the native build
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#define USB_SETUP_PACKET_SIZE                   8
+
+typedef union {
+    struct {
+        uint8_t bmRequestType;
+        uint8_t bRequest;
+        uint16_t wValue;
+        uint16_t wIndex;
+        uint16_t wLength;
+    } __attribute__((packed));
+    uint8_t val[USB_SETUP_PACKET_SIZE];
+} usb_setup_packet_t;
+
+#define USB_BM_REQUEST_TYPE_DIR_OUT             (0X00 << 7)
+#define USB_BM_REQUEST_TYPE_DIR_IN              (0x01 << 7)
+#define USB_BM_REQUEST_TYPE_TYPE_STANDARD       (0x00 << 5)
+#define USB_BM_REQUEST_TYPE_TYPE_CLASS          (0x01 << 5)
+#define USB_BM_REQUEST_TYPE_TYPE_VENDOR         (0x02 << 5)
+#define USB_BM_REQUEST_TYPE_TYPE_MASK           (0x03 << 5)
+#define USB_BM_REQUEST_TYPE_RECIP_DEVICE        (0x00 << 0)
+#define USB_BM_REQUEST_TYPE_RECIP_INTERFACE     (0x01 << 0)
+#define USB_BM_REQUEST_TYPE_RECIP_ENDPOINT      (0x02 << 0)
+#define USB_BM_REQUEST_TYPE_RECIP_MASK          (0x1f << 0)
+
+#define USB_B_REQUEST_GET_STATUS                0x00
+#define USB_B_REQUEST_CLEAR_FEATURE             0x01
+#define USB_B_REQUEST_SET_FEATURE               0x03
+#define USB_B_REQUEST_SET_ADDRESS               0x05
+#define USB_B_REQUEST_GET_DESCRIPTOR            0x06
+#define USB_B_REQUEST_SET_DESCRIPTOR            0x07
+#define USB_B_REQUEST_GET_CONFIGURATION         0x08
+#define USB_B_REQUEST_SET_CONFIGURATION         0x09
+#define USB_B_REQUEST_GET_INTERFACE             0x0A
+#define USB_B_REQUEST_SET_INTERFACE             0x0B
+
+#define USB_W_VALUE_DT_DEVICE                   0x01
+#define USB_W_VALUE_DT_CONFIG                   0x02
+#define USB_W_VALUE_DT_STRING                   0x03
+
+#define USB_B_DESCRIPTOR_TYPE_DEVICE            0x01
+#define USB_B_DESCRIPTOR_TYPE_CONFIGURATION     0x02
+#define USB_B_DESCRIPTOR_TYPE_STRING            0x03
+#define USB_B_DESCRIPTOR_TYPE_INTERFACE         0x04
+#define USB_B_DESCRIPTOR_TYPE_ENDPOINT          0x05
+
+#define USB_BM_ATTRIBUTES_XFERTYPE_MASK         0x03
+#define USB_B_ENDPOINT_ADDRESS_EP_NUM_MASK      0x0f
+#define USB_B_ENDPOINT_ADDRESS_EP_DIR_MASK      0x80
+
+typedef union {
+    struct {
+        uint8_t bLength;
+        uint8_t bDescriptorType;
+    } __attribute__((packed));
+    uint8_t val[2];
+} usb_standard_desc_t;
+
+typedef union {
+    struct {
+        uint8_t bLength;
+        uint8_t bDescriptorType;
+        uint16_t bcdUSB;
+        uint8_t bDeviceClass;
+        uint8_t bDeviceSubClass;
+        uint8_t bDeviceProtocol;
+        uint8_t bMaxPacketSize0;
+        uint16_t idVendor;
+        uint16_t idProduct;
+        uint16_t bcdDevice;
+        uint8_t iManufacturer;
+        uint8_t iProduct;
+        uint8_t iSerialNumber;
+        uint8_t bNumConfigurations;
+    } __attribute__((packed));
+    uint8_t val[18];
+} usb_device_desc_t;
+
+typedef union {
+    struct {
+        uint8_t bLength;
+        uint8_t bDescriptorType;
+        uint16_t wTotalLength;
+        uint8_t bNumInterfaces;
+        uint8_t bConfigurationValue;
+        uint8_t iConfiguration;
+        uint8_t bmAttributes;
+        uint8_t bMaxPower;
+    } __attribute__((packed));
+    uint8_t val[9];
+} usb_config_desc_t;
+
+typedef union {
+    struct {
+        uint8_t bLength;
+        uint8_t bDescriptorType;
+        uint8_t bInterfaceNumber;
+        uint8_t bAlternateSetting;
+        uint8_t bNumEndpoints;
+        uint8_t bInterfaceClass;
+        uint8_t bInterfaceSubClass;
+        uint8_t bInterfaceProtocol;
+        uint8_t iInterface;
+    } __attribute__((packed));
+    uint8_t val[9];
+} usb_intf_desc_t;
+
+typedef union {
+    struct {
+        uint8_t bLength;
+        uint8_t bDescriptorType;
+        uint8_t bEndpointAddress;
+        uint8_t bmAttributes;
+        uint16_t wMaxPacketSize;
+        uint8_t bInterval;
+    } __attribute__((packed));
+    uint8_t val[7];
+} usb_ep_desc_t;
+
+typedef union {
+    struct {
+        uint8_t bLength;
+        uint8_t bDescriptorType;
+        uint16_t wData[1];
+    } __attribute__((packed));
+    uint8_t val[4];
+} usb_str_desc_t;
@@ -0,0 +1,33 @@
+/*
+ * Benchmarks on the native build
+ *
+ * Runs usb_hid_bench_run(): the module benchmarks, and the scenarios and
+ * recoveries on the real pipeline against the mock host library. Fails on
+ * any regression against s_bench_baseline, so `pio test -e native` exits
+ * non-zero.
+ */
+
+#include <unity.h>
+#include "usb_hid_bench.hpp"
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+static void test_no_regressions(void)
+{
+    TEST_ASSERT_EQUAL(0, usb_hid_bench_run());
+    //Every stored result was measured again, none was skipped
+    TEST_ASSERT_EQUAL(sizeof(s_bench_baseline) / sizeof(s_bench_baseline[0]), s_bench_compared);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_no_regressions);
+    return UNITY_END();
+}
@@ -0,0 +1,398 @@
+/*
+ * Class driver on the native build
+ *
+ * Runs the real pipeline (daemon, class driver, report workers, sink task)
+ * against the mock host library of test/mock, with the NB4 controller of
+ * usb_sim_device.hpp plugged into the simulated bus.
+ */
+
+#include <unity.h>
+#include "nvs_flash.h"
+#include "usb_hid_pipeline.hpp"
+
+#define TEST_ATTACH_US              30000
+
+static sim_bus_t s_bus;
+static usb_hid_pipeline_t s_pipeline;
+
+typedef struct {
+    uint32_t reports;
+    uint32_t decoded;
+} test_sub_count_t;
+
+static void test_count_cb(const hid_report_event_t *event, void *arg)
+{
+    test_sub_count_t *count = (test_sub_count_t *)arg;
+    count->reports++;
+    count->decoded += (event->values != NULL);
+}
+
+static void test_start(void)
+{
+    usb_hid_pipeline_config_t config = USB_HID_PIPELINE_CONFIG_DEFAULT();
+    usb_hid_pipeline_start(&config, &s_pipeline);
+}
+
+static hid_device_t *test_find_dev(uint8_t dev_addr)
+{
+    for (int d = 0; d < CLASS_MAX_DEVICES; d++) {
+        if (s_driver_obj.devices[d].dev_addr == dev_addr) {
+            return &s_driver_obj.devices[d];
+        }
+    }
+    return NULL;
+}
+
+void setUp(void)
+{
+    mock_rtos_reset();
+    mock_nvs_reset();
+    nvs_flash_init();
+    memset(&s_bus, 0, sizeof(sim_bus_t));
+    mock_usb_host_reset(&s_bus);
+}
+
+void tearDown(void)
+{
+    //The tasks go with the next mock_rtos_reset(), forget them as usb_hid_pipeline_wait() would
+    for (int w = 0; w < REPORT_WORKERS_MAX; w++) {
+        s_report_workers[w].task = NULL;
+    }
+    s_report_sink_task = NULL;
+    s_driver_obj.client_hdl = NULL;
+}
+
+//A device that stays plugged in enumerates, streams and reaches subscribers and readers
+static void test_enumerate_and_stream(void)
+{
+    sim_bus_add(&s_bus, &s_sim_nb4_script, 1, mock_rtos_now_us() + TEST_ATTACH_US, 0, 1);
+    test_sub_count_t count = {};
+    report_sub_t sub = { REPORT_SUB_ANY_DEVICE, REPORT_SUB_ANY_INTERFACE, REPORT_SUB_ANY_REPORT, 0, test_count_cb, &count };
+    int handle = usb_class_driver_subscribe(&sub);
+    TEST_ASSERT_TRUE(handle >= 0);
+    test_start();
+
+    mock_rtos_run_for(1000000);
+    hid_device_t *dev = test_find_dev(1);
+    TEST_ASSERT_NOT_NULL(dev);
+    TEST_ASSERT_EQUAL(DEV_STATE_STREAMING, dev->state);
+    uint32_t reports = 0;
+    for (int n = 0; n < dev->num_intfs; n++) {
+        reports += dev->intfs[n].stream_stats.reports;
+        TEST_ASSERT_EQUAL(0, dev->intfs[n].stream_stats.errors);
+    }
+    TEST_ASSERT_GREATER_THAN(100, reports);
+    TEST_ASSERT_GREATER_THAN(0, count.reports);
+    TEST_ASSERT_GREATER_THAN(0, count.decoded);
+    hid_state_t state;
+    TEST_ASSERT_TRUE(usb_class_driver_read_state(1, &state));
+    TEST_ASSERT_EQUAL(1, state.dev_addr);
+    usb_class_driver_unsubscribe(handle);
+}
+
+//Removal closes the device, gives every transfer back and frees the slot in the host library
+static void test_detach_frees_device(void)
+{
+    int64_t t0 = mock_rtos_now_us();
+    sim_device_t *sim = sim_bus_add(&s_bus, &s_sim_nb4_script, 1, t0 + TEST_ATTACH_US, t0 + 500000, 1);
+    test_start();
+
+    mock_rtos_run_until(t0 + 400000);
+    TEST_ASSERT_EQUAL(DEV_STATE_STREAMING, test_find_dev(1)->state);
+    TEST_ASSERT_GREATER_THAN(0, s_driver_obj.transfer_pool.in_use);
+    mock_rtos_run_until(t0 + 700000);
+    TEST_ASSERT_NULL(test_find_dev(1));
+    TEST_ASSERT_EQUAL(0, s_driver_obj.transfer_pool.in_use);
+    TEST_ASSERT_NULL(s_mock_usb.devices[sim - s_bus.devices].sim);
+    TEST_ASSERT_GREATER_THAN(0, mock_usb_sim_stats(sim)->in_completed);
+}
+
+static report_lease_t *s_kept_leases[32];
+static size_t s_num_kept;
+
+//Holds on to every lease, as a sink waiting for a DMA transfer would
+static size_t test_keep_write(report_lease_t *const *leases, size_t count, void *)
+{
+    if (s_num_kept + count > sizeof(s_kept_leases) / sizeof(s_kept_leases[0])) {
+        return count;
+    }
+    for (size_t i = 0; i < count; i++) {
+        s_kept_leases[s_num_kept++] = leases[i];
+    }
+    return 0;
+}
+
+//Transfers a sink still holds at removal do not hold up the close and come back once released
+static void test_detach_with_kept_leases(void)
+{
+    int64_t t0 = mock_rtos_now_us();
+    sim_bus_add(&s_bus, &s_sim_nb4_script, 1, t0 + TEST_ATTACH_US, t0 + 300000, 1);
+    s_num_kept = 0;
+    report_sink_t sink = { "keep", REPORT_SINK_ANY_DEVICE, test_keep_write, NULL };
+    int handle = usb_class_driver_add_sink(&sink);
+    TEST_ASSERT_TRUE(handle >= 0);
+    test_start();
+
+    mock_rtos_run_until(t0 + 200000);
+    TEST_ASSERT_EQUAL(DEV_STATE_STREAMING, test_find_dev(1)->state);
+    TEST_ASSERT_GREATER_THAN(0, s_num_kept);
+    mock_rtos_run_until(t0 + 310000);
+    TEST_ASSERT_NULL(test_find_dev(1));
+    TEST_ASSERT_EQUAL(s_num_kept, s_driver_obj.transfer_pool.in_use);
+    TEST_ASSERT_EQUAL(s_num_kept, s_driver_obj.transfer_pool.num_orphans);
+    for (size_t i = 0; i < s_num_kept; i++) {
+        usb_class_driver_release(s_kept_leases[i]);
+    }
+    mock_rtos_run_for(10000);
+    TEST_ASSERT_EQUAL(0, s_driver_obj.transfer_pool.num_orphans);
+    TEST_ASSERT_EQUAL(0, s_driver_obj.transfer_pool.in_use);
+    usb_class_driver_remove_sink(handle);
+}
+
+//The slot is not freed, and so not reused, while the report worker may still be inside an interface
+static void test_close_waits_for_worker(void)
+{
+    int64_t t0 = mock_rtos_now_us();
+    sim_bus_add(&s_bus, &s_sim_nb4_script, 1, t0 + TEST_ATTACH_US, t0 + 300000, 1);
+    test_start();
+
+    mock_rtos_run_until(t0 + 200000);
+    TEST_ASSERT_EQUAL(DEV_STATE_STREAMING, test_find_dev(1)->state);
+    vTaskSuspend(s_pipeline.report_workers[0]);
+    mock_rtos_run_until(t0 + 400000);
+    hid_device_t *dev = test_find_dev(1);
+    TEST_ASSERT_NOT_NULL(dev);
+    TEST_ASSERT_EQUAL(DEV_STATE_CLOSE_WAIT, dev->state);
+    TEST_ASSERT_EQUAL(0, s_driver_obj.transfer_pool.in_use);
+    vTaskResume(s_pipeline.report_workers[0]);
+    mock_rtos_run_for(10000);
+    TEST_ASSERT_NULL(test_find_dev(1));
+}
+
+//A replug of the same device claims from the enumeration cache and streams again
+static void test_replug_uses_cache(void)
+{
+    int64_t t0 = mock_rtos_now_us();
+    sim_bus_add(&s_bus, &s_sim_nb4_script, 1, t0 + TEST_ATTACH_US, t0 + 400000, 1);
+    sim_device_t *replug = sim_bus_add(&s_bus, &s_sim_nb4_script, 2, t0 + 600000, 0, 1);
+    test_start();
+
+    mock_rtos_run_until(t0 + 1000000);
+    hid_device_t *dev = test_find_dev(2);
+    TEST_ASSERT_NOT_NULL(dev);
+    TEST_ASSERT_EQUAL(DEV_STATE_STREAMING, dev->state);
+    TEST_ASSERT_TRUE(dev->cached);
+    TEST_ASSERT_EQUAL(1, s_driver_obj.ttfr[TTFR_CACHED].count);
+    TEST_ASSERT_GREATER_THAN(0, mock_usb_sim_stats(replug)->in_completed);
+}
+
+//CLEAR_FEATURE for a stalled endpoint waits for a SET_REPORT on EP0 instead of queuing behind it
+static void test_ep0_one_request_at_a_time(void)
+{
+    int64_t t0 = mock_rtos_now_us();
+    sim_device_t *sim = sim_bus_add(&s_bus, &s_sim_nb4_script, 1, t0 + TEST_ATTACH_US, 0, 1);
+    test_start();
+
+    mock_rtos_run_until(t0 + 200000);
+    hid_device_t *dev = test_find_dev(1);
+    TEST_ASSERT_NOT_NULL(dev);
+    TEST_ASSERT_EQUAL(DEV_STATE_STREAMING, dev->state);
+    mock_usb_sim_stats(sim)->ep0_max_depth = 0;
+    TEST_ASSERT_TRUE(sim_device_inject(sim, 0x82, SIM_FAULT_STALL, 1));
+    uint8_t rumble = 0;
+    while (mock_rtos_now_us() < t0 + 250000) {
+        rumble++;
+        TEST_ASSERT_EQUAL(ESP_OK, usb_class_driver_write_output(1, 1, 0, &rumble, 1));
+        mock_rtos_run_for(700);
+    }
+    mock_rtos_run_for(50000);
+    const mock_usb_stats_t *stats = mock_usb_sim_stats(sim);
+    TEST_ASSERT_EQUAL(1, stats->ep0_max_depth);
+    TEST_ASSERT_EQUAL(1, stats->clear_halts);
+    TEST_ASSERT_GREATER_THAN(10, stats->set_reports);
+    TEST_ASSERT_EQUAL(0, stats->ctrl_canceled);
+    TEST_ASSERT_EQUAL(0, dev->intfs[1].out_errors);
+    TEST_ASSERT_EQUAL(1, dev->intfs[1].recovery.recoveries);
+    TEST_ASSERT_EQUAL(EP_HEALTH_OK, dev->intfs[1].recovery.health);
+}
+
+//An interrupt OUT report the device never takes is flushed past its deadline, and the pipe works again after
+static void test_output_deadline(void)
+{
+    int64_t t0 = mock_rtos_now_us();
+    sim_device_t *sim = sim_bus_add(&s_bus, &s_sim_nb4_script, 1, t0 + TEST_ATTACH_US, 0, 1);
+    test_start();
+
+    mock_rtos_run_until(t0 + 200000);
+    hid_device_t *dev = test_find_dev(1);
+    TEST_ASSERT_NOT_NULL(dev);
+    TEST_ASSERT_TRUE(dev->intfs[0].has_ep_out);
+    sim->out_nak = true;
+    uint8_t report = 1;
+    TEST_ASSERT_EQUAL(ESP_OK, usb_class_driver_write_output(1, 0, 0, &report, 1));
+    mock_rtos_run_for(100000);
+    TEST_ASSERT_EQUAL(1, dev->intfs[0].out_errors);
+    TEST_ASSERT_EQUAL(0, dev->intfs[0].out_sent);
+    TEST_ASSERT_EQUAL(0, dev->out_pending);
+    TEST_ASSERT_EQUAL(1, mock_usb_sim_stats(sim)->flushed);
+
+    sim->out_nak = false;
+    report = 2;
+    TEST_ASSERT_EQUAL(ESP_OK, usb_class_driver_write_output(1, 0, 0, &report, 1));
+    mock_rtos_run_for(20000);
+    TEST_ASSERT_EQUAL(1, dev->intfs[0].out_sent);
+    TEST_ASSERT_EQUAL(1, mock_usb_sim_stats(sim)->out_completed);
+}
+
+//A removal with an output report still on the bus closes once it comes back, and every transfer returns to the pool
+static void test_detach_with_output_in_flight(void)
+{
+    int64_t t0 = mock_rtos_now_us();
+    sim_device_t *sim = sim_bus_add(&s_bus, &s_sim_nb4_script, 1, t0 + TEST_ATTACH_US, t0 + 210000, 1);
+    test_start();
+
+    mock_rtos_run_until(t0 + 200000);
+    hid_device_t *dev = test_find_dev(1);
+    TEST_ASSERT_NOT_NULL(dev);
+    sim->out_nak = true;
+    uint8_t report = 1;
+    TEST_ASSERT_EQUAL(ESP_OK, usb_class_driver_write_output(1, 0, 0, &report, 1));
+    mock_rtos_run_until(t0 + 205000);
+    TEST_ASSERT_EQUAL(1, dev->out_pending);
+    mock_rtos_run_until(t0 + 250000);
+    TEST_ASSERT_NULL(test_find_dev(1));
+    TEST_ASSERT_EQUAL(0, s_driver_obj.transfer_pool.in_use);
+    TEST_ASSERT_EQUAL(0, s_driver_obj.transfer_pool.num_orphans);
+}
+
+//A writer still inside an interface's output route keeps the slot, and its queue, from being reused
+static void test_close_waits_for_output_writer(void)
+{
+    int64_t t0 = mock_rtos_now_us();
+    sim_bus_add(&s_bus, &s_sim_nb4_script, 1, t0 + TEST_ATTACH_US, t0 + 210000, 1);
+    test_start();
+
+    mock_rtos_run_until(t0 + 200000);
+    hid_device_t *dev = test_find_dev(1);
+    TEST_ASSERT_NOT_NULL(dev);
+    output_route_t *route = &s_output_routes[dev - s_driver_obj.devices][0];
+    TEST_ASSERT_EQUAL(OUTPUT_ROUTE_KEY(1, 0), route->key.load());
+    //As a usb_class_driver_write_output() preempted between its two key checks would
+    route->writers.fetch_add(1);
+    mock_rtos_run_until(t0 + 250000);
+    TEST_ASSERT_EQUAL(DEV_STATE_CLOSE_WAIT, dev->state);
+    TEST_ASSERT_EQUAL(0, route->key.load());
+    uint8_t report = 1;
+    TEST_ASSERT_EQUAL(ESP_ERR_NOT_FOUND, usb_class_driver_write_output(1, 0, 0, &report, 1));
+    route->writers.fetch_sub(1);
+    usb_host_client_unblock(s_driver_obj.client_hdl);
+    mock_rtos_run_for(10000);
+    TEST_ASSERT_NULL(test_find_dev(1));
+}
+
+//A slot refilled since the last build is not dispatched to with the previous subscription's filter
+static void test_dispatch_slot_reuse(void)
+{
+    static report_sub_table_t table;
+    static report_dispatch_t dispatch;
+    report_sub_t sub = { REPORT_SUB_ANY_DEVICE, REPORT_SUB_ANY_INTERFACE, 1, 0, test_count_cb, NULL };
+    int first = report_sub_add(&table, &sub);
+    report_dispatch_build(&dispatch, &table, 1, 0, NULL);
+    TEST_ASSERT_EQUAL(1u << first, report_dispatch_lookup(&dispatch, &table, 1));
+
+    report_sub_remove(&table, first);
+    sub.report_id = 2;
+    TEST_ASSERT_EQUAL(first, report_sub_add(&table, &sub));
+    TEST_ASSERT_TRUE(report_dispatch_stale(&dispatch, &table));
+    TEST_ASSERT_EQUAL(0, report_dispatch_lookup(&dispatch, &table, 1));
+    TEST_ASSERT_EQUAL(0, report_dispatch_lookup(&dispatch, &table, 2));
+    report_dispatch_build(&dispatch, &table, 1, 0, NULL);
+    TEST_ASSERT_EQUAL(0, report_dispatch_lookup(&dispatch, &table, 1));
+    TEST_ASSERT_EQUAL(1u << first, report_dispatch_lookup(&dispatch, &table, 2));
+}
+
+//A removed sink's slot is not reused before the lender acked the removal, a lend already under way may still queue to it
+static void test_sink_slot_reuse(void)
+{
+    static report_sink_table_t table;
+    static report_lease_t lease;
+    std::atomic<uint32_t> returned(0);
+    lease.dev_addr = 1;
+    lease.returned = &returned;
+    report_sink_t sink = { "keep", REPORT_SINK_ANY_DEVICE, test_keep_write, NULL };
+    s_num_kept = 0;
+    int first = report_sink_add(&table, &sink);
+    TEST_ASSERT_FALSE(report_sink_lend(&table, &lease));
+    report_sink_sync(&table);
+
+    report_sink_remove(&table, first);
+    report_sink_service(&table);
+    TEST_ASSERT_TRUE(report_sink_add(&table, &sink) != first);
+    //As a lend that read the sinks before the removal would
+    table.active.fetch_or(1u << first);
+    TEST_ASSERT_TRUE(report_sink_lend(&table, &lease));
+    table.active.fetch_and(~(1u << first));
+    TEST_ASSERT_TRUE(report_sink_sync(&table));
+    report_sink_service(&table);
+    TEST_ASSERT_EQUAL(1u << lease.index, returned.load());
+    TEST_ASSERT_EQUAL(0, s_num_kept);
+    TEST_ASSERT_EQUAL(first, report_sink_add(&table, &sink));
+}
+
+static void test_client_event_cb(const usb_host_client_event_msg_t *event_msg, void *arg)
+{
+    *(int *)arg += (event_msg->event == USB_HOST_CLIENT_EVENT_NEW_DEV);
+}
+
+//An unplug while a client is registered does not end the daemon, the last client leaving does, with devices still plugged in
+static void test_daemon_exits_after_last_client(void)
+{
+    int64_t t0 = mock_rtos_now_us();
+    sim_bus_add(&s_bus, &s_sim_nb4_script, 1, t0 + 10000, t0 + 100000, 1);
+    sim_bus_add(&s_bus, &s_sim_nb4_script, 2, t0 + 150000, 0, 1);
+    SemaphoreHandle_t sem = xSemaphoreCreateBinary();
+    TaskHandle_t daemon;
+    xTaskCreatePinnedToCore(usb_host_lib_daemon_task, "usb_host_daemon", 4096, (void *)sem, 2, &daemon, 0);
+    TEST_ASSERT_TRUE(xSemaphoreTake(sem, portMAX_DELAY));
+
+    int new_devs = 0;
+    usb_host_client_config_t client_config = {
+        .is_synchronous = false,
+        .max_num_event_msg = 4,
+        .async = {
+            .client_event_callback = test_client_event_cb,
+            .callback_arg = &new_devs,
+        },
+    };
+    usb_host_client_handle_t client;
+    TEST_ASSERT_EQUAL(ESP_OK, usb_host_client_register(&client_config, &client));
+    while (mock_rtos_now_us() < t0 + 300000) {
+        usb_host_client_handle_events(client, pdMS_TO_TICKS(10));
+    }
+    TEST_ASSERT_EQUAL(2, new_devs);
+    TEST_ASSERT_FALSE(xSemaphoreTake(sem, 0));
+
+    TEST_ASSERT_EQUAL(ESP_OK, usb_host_client_deregister(client));
+    TEST_ASSERT_TRUE(xSemaphoreTake(sem, pdMS_TO_TICKS(100)));
+    TEST_ASSERT_FALSE(s_mock_usb.installed);
+    vTaskDelete(daemon);
+    vSemaphoreDelete(sem);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_enumerate_and_stream);
+    RUN_TEST(test_detach_frees_device);
+    RUN_TEST(test_detach_with_kept_leases);
+    RUN_TEST(test_close_waits_for_worker);
+    RUN_TEST(test_replug_uses_cache);
+    RUN_TEST(test_ep0_one_request_at_a_time);
+    RUN_TEST(test_output_deadline);
+    RUN_TEST(test_detach_with_output_in_flight);
+    RUN_TEST(test_close_waits_for_output_writer);
+    RUN_TEST(test_dispatch_slot_reuse);
+    RUN_TEST(test_sink_slot_reuse);
+    RUN_TEST(test_daemon_exits_after_last_client);
+    return UNITY_END();
+}
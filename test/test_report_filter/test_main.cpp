@@ -0,0 +1,80 @@
+/*
+ * Report filter on the native build
+ */
+
+#include <unity.h>
+#include "usb_report_filter.hpp"
+
+//Report protocol mouse: 3 buttons, relative X, Y and wheel
+static const uint8_t s_mouse_report_desc[] = {
+    0x05, 0x01, 0x09, 0x02, 0xA1, 0x01, 0x09, 0x01, 0xA1, 0x00,
+    0x05, 0x09, 0x19, 0x01, 0x29, 0x03, 0x15, 0x00, 0x25, 0x01, 0x95, 0x03, 0x75, 0x01, 0x81, 0x02,
+    0x95, 0x01, 0x75, 0x05, 0x81, 0x03,
+    0x05, 0x01, 0x09, 0x30, 0x09, 0x31, 0x09, 0x38, 0x15, 0x81, 0x25, 0x7F, 0x75, 0x08, 0x95, 0x03, 0x81, 0x06,
+    0xC0, 0xC0,
+};
+
+static hid_report_layout_t s_layout;
+
+void setUp(void)
+{
+    memset(&s_layout, 0, sizeof(s_layout));
+    TEST_ASSERT_TRUE(hid_report_layout_compile(s_mouse_report_desc, sizeof(s_mouse_report_desc), &s_layout));
+}
+
+void tearDown(void)
+{
+}
+
+//Two identical moves are two moves, a report without motion or button change is dropped
+static void test_relative_motion_is_forwarded(void)
+{
+    report_filter_t filter;
+    report_delta_t delta;
+    report_filter_init(&filter, &s_layout, REPORT_FILTER_ALL_FIELDS, 0);
+    const uint8_t move[4] = { 0x00, 0x01, 0x00, 0x00 };
+    const uint8_t rest[4] = { 0x00, 0x00, 0x00, 0x00 };
+    const uint8_t click[4] = { 0x01, 0x00, 0x00, 0x00 };
+    TEST_ASSERT_TRUE(report_filter_apply(&filter, move, sizeof(move), &delta));
+    TEST_ASSERT_TRUE(report_filter_apply(&filter, move, sizeof(move), &delta));
+    TEST_ASSERT_TRUE(delta.changed_fields != 0);
+    TEST_ASSERT_FALSE(report_filter_apply(&filter, rest, sizeof(rest), &delta));
+    TEST_ASSERT_TRUE(report_filter_apply(&filter, click, sizeof(click), &delta));
+    TEST_ASSERT_FALSE(report_filter_apply(&filter, click, sizeof(click), &delta));
+    TEST_ASSERT_EQUAL(3, filter.forwarded);
+    TEST_ASSERT_EQUAL(2, filter.suppressed);
+}
+
+static void test_passthrough_forwards_repeats(void)
+{
+    report_filter_t filter;
+    report_delta_t delta;
+    report_filter_init_passthrough(&filter);
+    const uint8_t boot[3] = { 0x01, 0x00, 0x00 };
+    TEST_ASSERT_TRUE(report_filter_apply(&filter, boot, sizeof(boot), &delta));
+    TEST_ASSERT_TRUE(report_filter_apply(&filter, boot, sizeof(boot), &delta));
+    TEST_ASSERT_EQUAL(0, filter.suppressed);
+}
+
+//Only the first REPORT_FILTER_MAX_BYTES fit the compare, longer reports must not be judged by them
+static void test_long_reports_are_forwarded(void)
+{
+    report_filter_t filter;
+    report_delta_t delta;
+    report_filter_init(&filter, NULL, REPORT_FILTER_ALL_FIELDS, 0);
+    uint8_t report[REPORT_FILTER_MAX_BYTES + 8] = { 0 };
+    TEST_ASSERT_TRUE(report_filter_apply(&filter, report, sizeof(report), &delta));
+    report[REPORT_FILTER_MAX_BYTES + 4] = 0x55;
+    TEST_ASSERT_TRUE(report_filter_apply(&filter, report, sizeof(report), &delta));
+    TEST_ASSERT_TRUE(report_filter_apply(&filter, report, REPORT_FILTER_MAX_BYTES, &delta));
+    TEST_ASSERT_FALSE(report_filter_apply(&filter, report, REPORT_FILTER_MAX_BYTES, &delta));
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_relative_motion_is_forwarded);
+    RUN_TEST(test_passthrough_forwards_repeats);
+    RUN_TEST(test_long_reports_are_forwarded);
+    return UNITY_END();
+}
@@ -0,0 +1,142 @@
+/*
+ * Report descriptor parser on the native build
+ *
+ * Compiles the two report descriptors of the simulated NB4 controller
+ * (usb_sim_device.hpp) and decodes the reports the simulation sends.
+ */
+
+#include <unity.h>
+#include "usb_hid_report_parser.hpp"
+#include "usb_sim_device.hpp"
+
+static hid_report_layout_t s_layout;
+
+static void test_assert_field(const hid_field_t *f, uint16_t bit_offset, uint8_t bit_size, uint16_t count, uint8_t kind,
+                              uint16_t usage_page, uint16_t usage, int32_t logical_min, int32_t logical_max, uint8_t slot)
+{
+    TEST_ASSERT_EQUAL(bit_offset, f->bit_offset);
+    TEST_ASSERT_EQUAL(bit_size, f->bit_size);
+    TEST_ASSERT_EQUAL(count, f->count);
+    TEST_ASSERT_EQUAL(kind, f->kind);
+    TEST_ASSERT_EQUAL_HEX(usage_page, f->usage_page);
+    TEST_ASSERT_EQUAL_HEX(usage, f->usage);
+    TEST_ASSERT_EQUAL(logical_min, f->logical_min);
+    TEST_ASSERT_EQUAL(logical_max, f->logical_max);
+    TEST_ASSERT_EQUAL(slot, f->slot);
+}
+
+void setUp(void)
+{
+    memset(&s_layout, 0xA5, sizeof(s_layout));
+}
+
+void tearDown(void)
+{
+}
+
+//24 buttons and 8 16-bit axes of 11-bit range, the repeated Slider usage splits the axes in two fields
+static void test_gamepad_layout(void)
+{
+    TEST_ASSERT_TRUE(hid_report_layout_compile(s_sim_nb4_gamepad_report_desc, sizeof(s_sim_nb4_gamepad_report_desc), &s_layout));
+    TEST_ASSERT_FALSE(s_layout.truncated);
+    TEST_ASSERT_FALSE(s_layout.uses_report_ids);
+    TEST_ASSERT_EQUAL_HEX(HID_USAGE_PAGE_GENERIC_DESKTOP, s_layout.app_usage_page);
+    TEST_ASSERT_EQUAL_HEX(0x05, s_layout.app_usage);
+    TEST_ASSERT_EQUAL_STRING("HID Gamepad", hid_report_layout_type_name(&s_layout));
+    TEST_ASSERT_EQUAL(1, s_layout.num_reports);
+    TEST_ASSERT_EQUAL(0, s_layout.reports[0].report_id);
+    TEST_ASSERT_EQUAL(19, s_layout.reports[0].size_bytes);
+    TEST_ASSERT_EQUAL(0, s_layout.reports[0].output_size_bytes);
+    TEST_ASSERT_EQUAL(0, s_layout.reports[0].first_field);
+    TEST_ASSERT_EQUAL(3, s_layout.reports[0].num_fields);
+    TEST_ASSERT_EQUAL(3, s_layout.num_fields);
+    TEST_ASSERT_EQUAL(24, s_layout.num_buttons);
+    TEST_ASSERT_EQUAL(8, s_layout.num_axes);
+
+    test_assert_field(&s_layout.fields[0], 0, 1, 24, HID_FIELD_KIND_BUTTON, HID_USAGE_PAGE_BUTTON, 0x01, 0, 1, 0);
+    test_assert_field(&s_layout.fields[1], 24, 16, 7, HID_FIELD_KIND_AXIS, HID_USAGE_PAGE_GENERIC_DESKTOP, 0x30, 0, 0x07FF, 0);
+    test_assert_field(&s_layout.fields[2], 136, 16, 1, HID_FIELD_KIND_AXIS, HID_USAGE_PAGE_GENERIC_DESKTOP, 0x36, 0, 0x07FF, 7);
+    for (int n = 0; n < s_layout.num_fields; n++) {
+        TEST_ASSERT_EQUAL(0, s_layout.fields[n].flags);
+        TEST_ASSERT_EQUAL(0, s_layout.fields[n].report_id);
+    }
+}
+
+//280 signed vendor bytes each way, kept opaque
+static void test_vendor_layout(void)
+{
+    TEST_ASSERT_TRUE(hid_report_layout_compile(s_sim_nb4_vendor_report_desc, sizeof(s_sim_nb4_vendor_report_desc), &s_layout));
+    TEST_ASSERT_FALSE(s_layout.truncated);
+    TEST_ASSERT_FALSE(s_layout.uses_report_ids);
+    TEST_ASSERT_EQUAL_HEX(0xFF00, s_layout.app_usage_page);
+    TEST_ASSERT_EQUAL_HEX(0x01, s_layout.app_usage);
+    TEST_ASSERT_EQUAL_STRING("Vendor Defined", hid_report_layout_type_name(&s_layout));
+    TEST_ASSERT_EQUAL(1, s_layout.num_reports);
+    TEST_ASSERT_EQUAL(280, s_layout.reports[0].size_bytes);
+    TEST_ASSERT_EQUAL(280, s_layout.reports[0].output_size_bytes);
+    TEST_ASSERT_EQUAL(1, s_layout.num_fields);
+    TEST_ASSERT_EQUAL(0, s_layout.num_axes);
+    TEST_ASSERT_EQUAL(0, s_layout.num_buttons);
+
+    test_assert_field(&s_layout.fields[0], 0, 8, 280, HID_FIELD_KIND_OPAQUE, 0xFF00, 0x01, -127, 127, 0);
+    TEST_ASSERT_EQUAL(HID_FIELD_FLAG_SIGNED, s_layout.fields[0].flags);
+}
+
+//The reports the simulation sends decode to the buttons and axes it put in
+static void test_gamepad_decode(void)
+{
+    TEST_ASSERT_TRUE(hid_report_layout_compile(s_sim_nb4_gamepad_report_desc, sizeof(s_sim_nb4_gamepad_report_desc), &s_layout));
+    hid_report_values_t values;
+    memset(&values, 0, sizeof(values));
+    uint8_t report[19];
+    for (uint32_t seq = 0; seq < 100; seq++) {
+        sim_fill_default(0x81, seq, report, sizeof(report));
+        TEST_ASSERT_EQUAL_PTR(&s_layout.reports[0], hid_decode_report(&s_layout, report, sizeof(report), &values));
+        TEST_ASSERT_EQUAL(0, values.report_id);
+        TEST_ASSERT_EQUAL_HEX32(1u << (seq % 24), (uint32_t)values.buttons);
+        TEST_ASSERT_EQUAL_HEX32(0, (uint32_t)(values.buttons >> 32));
+        for (int a = 0; a < 8; a++) {
+            int32_t axis = (int32_t)((seq * 16 + (3 + a * 2) * 97) & 0x07FF);
+            TEST_ASSERT_EQUAL(axis, values.axes[a]);
+            TEST_ASSERT_TRUE(values.axes[a] >= s_layout.fields[1].logical_min && values.axes[a] <= s_layout.fields[1].logical_max);
+        }
+    }
+
+    //Full scale on every axis, every button down
+    memset(report, 0, sizeof(report));
+    report[0] = report[1] = report[2] = 0xFF;
+    for (int i = 3; i < 19; i += 2) {
+        report[i] = 0xFF;
+        report[i + 1] = 0x07;
+    }
+    TEST_ASSERT_NOT_NULL(hid_decode_report(&s_layout, report, sizeof(report), &values));
+    TEST_ASSERT_EQUAL_HEX32(0x00FFFFFF, (uint32_t)values.buttons);
+    for (int a = 0; a < 8; a++) {
+        TEST_ASSERT_EQUAL(0x07FF, values.axes[a]);
+    }
+}
+
+//Vendor reports go through undecoded, the values stay as they were
+static void test_vendor_decode(void)
+{
+    TEST_ASSERT_TRUE(hid_report_layout_compile(s_sim_nb4_vendor_report_desc, sizeof(s_sim_nb4_vendor_report_desc), &s_layout));
+    hid_report_values_t values;
+    memset(&values, 0, sizeof(values));
+    values.axes[0] = 42;
+    uint8_t report[280];
+    sim_fill_default(0x82, 5, report, sizeof(report));
+    TEST_ASSERT_EQUAL_PTR(&s_layout.reports[0], hid_decode_report(&s_layout, report, sizeof(report), &values));
+    TEST_ASSERT_EQUAL(0, values.buttons);
+    TEST_ASSERT_EQUAL(42, values.axes[0]);
+    TEST_ASSERT_NULL(hid_decode_report(&s_layout, report, 0, &values));
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_gamepad_layout);
+    RUN_TEST(test_vendor_layout);
+    RUN_TEST(test_gamepad_decode);
+    RUN_TEST(test_vendor_decode);
+    return UNITY_END();
+}
@@ -0,0 +1,156 @@
+/*
+ * Report ring on the native build
+ *
+ * The producer and the consumer run on two host threads, as the completion
+ * callback and the report worker do on the two cores of the target.
+ */
+
+#include <unity.h>
+#include <thread>
+#include <chrono>
+#include <vector>
+#include "usb_report_ring.hpp"
+
+#define TEST_REPORTS                200000
+#define TEST_REPORT_LEN             16
+
+static report_ring_t s_ring;
+
+typedef struct {
+    uint32_t next_seq;          //Lowest sequence number the next report may carry
+    uint32_t consumed;
+    uint32_t out_of_order;
+    uint32_t corrupt;
+    uint32_t max_depth;         //Deepest the consumer found the ring
+    std::vector<bool> seen;
+} test_consumer_t;
+
+//Every byte of a report is derived from its sequence number, so a torn copy shows
+static void test_fill(uint8_t *data, uint32_t seq)
+{
+    for (int i = 0; i < TEST_REPORT_LEN; i++) {
+        data[i] = (uint8_t)(seq >> ((i % 4) * 8)) ^ (uint8_t)i;
+    }
+}
+
+static void test_consume(const report_slot_t *slot, void *arg)
+{
+    test_consumer_t *consumer = (test_consumer_t *)arg;
+    uint32_t seq = (uint32_t)slot->timestamp_us;
+    uint8_t expected[TEST_REPORT_LEN];
+    test_fill(expected, seq);
+    if (slot->len != TEST_REPORT_LEN || slot->dev_addr != 1 || slot->ep_addr != 0x81 ||
+        memcmp(slot->data, expected, TEST_REPORT_LEN) != 0 || seq >= TEST_REPORTS) {
+        consumer->corrupt++;
+        return;
+    }
+    if (seq < consumer->next_seq) {
+        consumer->out_of_order++;
+    }
+    consumer->next_seq = seq + 1;
+    consumer->seen[seq] = true;
+    consumer->consumed++;
+}
+
+void setUp(void)
+{
+    report_ring_init(&s_ring);
+}
+
+void tearDown(void)
+{
+}
+
+//Reports come out in the order they went in, each either consumed once or counted as dropped
+static void test_threads_keep_order_and_count_drops(void)
+{
+    std::vector<bool> pushed(TEST_REPORTS, false);
+    uint32_t failed = 0;
+    std::atomic<bool> done(false);
+    test_consumer_t consumer = {};
+    consumer.seen.assign(TEST_REPORTS, false);
+
+    std::thread producer([&]() {
+        uint8_t data[TEST_REPORT_LEN];
+        for (uint32_t seq = 0; seq < TEST_REPORTS; seq++) {
+            test_fill(data, seq);
+            if (report_ring_push(&s_ring, 1, 0x81, data, sizeof(data), seq)) {
+                pushed[seq] = true;
+            } else {
+                failed++;
+            }
+        }
+        done.store(true, std::memory_order_release);
+    });
+    std::thread worker([&]() {
+        for (uint32_t pass = 0; ; pass++) {
+            bool last = done.load(std::memory_order_acquire);
+            uint32_t depth = report_ring_depth(&s_ring);
+            if (depth > consumer.max_depth) {
+                consumer.max_depth = depth;
+            }
+            //Small batches and the odd nap, so the ring both runs dry and fills up
+            report_ring_drain(&s_ring, test_consume, &consumer, 1 + pass % 8);
+            if (pass % 512 == 0) {
+                std::this_thread::sleep_for(std::chrono::microseconds(200));
+            }
+            if (last && report_ring_depth(&s_ring) == 0) {
+                break;
+            }
+        }
+    });
+    producer.join();
+    worker.join();
+
+    TEST_ASSERT_EQUAL(0, consumer.corrupt);
+    TEST_ASSERT_EQUAL(0, consumer.out_of_order);
+    TEST_ASSERT_TRUE(pushed == consumer.seen);
+    TEST_ASSERT_EQUAL(failed, s_ring.dropped.load());
+    TEST_ASSERT_EQUAL(TEST_REPORTS - failed, consumer.consumed);
+    TEST_ASSERT_EQUAL(consumer.consumed, s_ring.consumed.load());
+    TEST_ASSERT_GREATER_THAN(0, failed);
+    TEST_ASSERT_EQUAL(0, s_ring.truncated.load());
+    TEST_ASSERT_TRUE(s_ring.high_water.load() >= consumer.max_depth);
+    TEST_ASSERT_EQUAL(REPORT_RING_NUM_SLOTS, s_ring.high_water.load());
+}
+
+//With the consumer held off the ring fills exactly once, the rest is dropped, and the consumer gets the first ones
+static void test_full_ring_drops_the_newest(void)
+{
+    std::atomic<bool> pushed(false);
+    test_consumer_t consumer = {};
+    consumer.seen.assign(TEST_REPORTS, false);
+
+    std::thread producer([&]() {
+        uint8_t data[TEST_REPORT_LEN];
+        for (uint32_t seq = 0; seq < REPORT_RING_NUM_SLOTS + 8; seq++) {
+            test_fill(data, seq);
+            report_ring_push(&s_ring, 1, 0x81, data, sizeof(data), seq);
+        }
+        pushed.store(true, std::memory_order_release);
+    });
+    std::thread worker([&]() {
+        while (!pushed.load(std::memory_order_acquire)) {
+            std::this_thread::yield();
+        }
+        report_ring_drain(&s_ring, test_consume, &consumer, REPORT_RING_NUM_SLOTS);
+    });
+    producer.join();
+    worker.join();
+
+    TEST_ASSERT_EQUAL(8, s_ring.dropped.load());
+    TEST_ASSERT_EQUAL(REPORT_RING_NUM_SLOTS, s_ring.high_water.load());
+    TEST_ASSERT_EQUAL(REPORT_RING_NUM_SLOTS, consumer.consumed);
+    TEST_ASSERT_EQUAL(REPORT_RING_NUM_SLOTS, consumer.next_seq);
+    TEST_ASSERT_EQUAL(0, consumer.out_of_order);
+    TEST_ASSERT_EQUAL(0, consumer.corrupt);
+    TEST_ASSERT_EQUAL(0, report_ring_depth(&s_ring));
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_threads_keep_order_and_count_drops);
+    RUN_TEST(test_full_ring_drops_the_newest);
+    return UNITY_END();
+}